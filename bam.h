@@ -75,12 +75,13 @@ typedef gzFile bamFile;
   @field target_len  lengths of the referene sequences
   @field dict        header dictionary
   @field hash        hash table for fast name lookup
+  @field n_hashed    number of target names entered into hash so far
   @field rg2lib      hash table for @RG-ID -> LB lookup
   @field l_text      length of the plain text in the header
   @field text        plain text
 
   @discussion Field hash points to null by default. It is a private
-  member.
+  member, filled lazily by bam_get_tid() in header order.
  */
 typedef struct
 {
@@ -89,6 +90,7 @@ typedef struct
 	unsigned int *target_len;
 	void *dict;
 	void *hash;
+	int n_hashed;
 	void *rg2lib;
 	unsigned int l_text;
 	unsigned int n_text;
@@ -440,6 +442,7 @@ int bam_validate1(const bam_header_t *header, const bam1_t *b);
   @field  indel  indel length; 0 for no indel, positive for ins and negative for del
   @field  is_del 1 iff the base on the padded read is a deletion
   @field  level  the level of the read in the "viewer" mode
+  @field  aux    caller value given to bam_plp_push_aux(); 0 otherwise
 
   @discussion See also bam_plbuf_push() and bam_lplbuf_push(). The
   difference between the two functions is that the former does not
@@ -461,6 +464,10 @@ typedef struct __bam_plp_t *bam_plp_t;
 
 bam_plp_t bam_plp_init(bam_plp_auto_f func, void *data);
 int bam_plp_push(bam_plp_t iter, const bam1_t *b);
+
+/*! @abstract  bam_plp_push() that tags the alignment with a caller value
+  returned in bam_pileup1_t::aux at every column the alignment covers. */
+int bam_plp_push_aux(bam_plp_t iter, const bam1_t *b, int aux);
 const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_plp);
 void bam_plp_destroy(bam_plp_t iter);
 
@@ -488,6 +495,9 @@ bam_plbuf_t *bam_plbuf_init(bam_pileup_f func, void *data);
 void bam_plbuf_destroy(bam_plbuf_t *buf);
 int bam_plbuf_push(const bam1_t *b, bam_plbuf_t *buf);
 
+/*! @abstract  bam_plbuf_push() equivalent with bam_pileup1_t::aux set. */
+int bam_plbuf_push_aux(const bam1_t *b, bam_plbuf_t *buf, int aux);
+
 struct __bam_lplbuf_t;
 typedef struct __bam_lplbuf_t bam_lplbuf_t;
 
@@ -512,10 +522,56 @@ typedef struct __bam_index_t bam_index_t;
   @abstract   Build index for a BAM file.
   @discussion Index file "fn.bai" will be created.
   @param  fn  name of the BAM file
-  @return     always 0 currently
+  @return     0 on success; negative if the file is unsorted or unwritable
  */
 int bam_index_build(const char *fn);
 
+/*!
+  @abstract   Write an index in the BAI format.
+  @param  idx pointer to the index structure
+  @param  fp  file to write to
+ */
+void bam_index_save(const bam_index_t *idx, FILE *fp);
+
+/*!
+  @abstract   Write an index in the tabix format, for a BGZF-compressed text file.
+  @param  idx    pointer to the index structure
+  @param  fp     BGZF stream to write to
+  @param  conf   format, sequence, begin and end columns, meta character and skipped lines
+  @param  names  NUL-terminated names of the reference sequences, concatenated
+  @param  l_nm   total length of names
+  @return        0 on success; -1 on a write error
+ */
+int bam_index_save_tabix(const bam_index_t *idx, BGZF *fp, const int *conf, const char *names, int l_nm);
+
+struct __bam_index_builder_t;
+typedef struct __bam_index_builder_t bam_index_builder_t;
+
+/*!
+  @abstract   Start an index built from alignments fed one at a time.
+  @param  n_targets  number of reference sequences in the header
+  @param  off        virtual file offset of the first alignment
+  @return     pointer to the index builder
+ */
+bam_index_builder_t *bam_index_builder_init(int n_targets, unsigned long long off);
+
+/*!
+  @abstract   Add the next alignment of the file to the index.
+  @param  bi   pointer to the index builder
+  @param  b    the alignment, in file order
+  @param  off  virtual file offset just past the alignment
+  @return      0 on success; -1 if the alignments are not sorted
+ */
+int bam_index_builder_push(bam_index_builder_t *bi, const bam1_t *b, unsigned long long off);
+
+/*!
+  @abstract   Finish an index after the last alignment and free the builder.
+  @param  bi   pointer to the index builder
+  @param  off  virtual file offset of the end of the file
+  @return      pointer to the index structure; 0 if the input was not sorted
+ */
+bam_index_t *bam_index_builder_finish(bam_index_builder_t *bi, unsigned long long off);
+
 /*!
   @abstract   Load index from file "fn.bai".
   @param  fn  name of the BAM file (NOT the index file)
@@ -552,6 +608,20 @@ typedef int (*bam_fetch_f)(const bam1_t *b, void *data);
 int bam_fetch(bamFile fp, const bam_index_t *idx, int tid, int beg, int end, void *data, bam_fetch_f func);
 
 bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end);
+
+/*!
+  @abstract Iterate over the alignments overlapping any of several
+  regions of one reference sequence.
+  @discussion The chunk lists of all regions are merged, so each
+  compressed block is read at most once. Alignments lying between the
+  regions may also be returned.
+  @param  idx   pointer to the alignment index
+  @param  tid   chromosome ID as is defined in the header
+  @param  n     number of regions
+  @param  begs  start coordinates, 0-based
+  @param  ends  end coordinates, 0-based
+ */
+bam_iter_t bam_iter_query_multi(const bam_index_t *idx, int tid, int n, const int *begs, const int *ends);
 int bam_iter_read(bamFile fp, bam_iter_t iter, bam1_t *b);
 void bam_iter_destroy(bam_iter_t iter);
 
@@ -53,7 +53,7 @@ unsigned char *bam_aux_get(const bam1_t *b, const char tag[2])
 	int y = tag[0] << 8 | tag[1];
 
 	s = bam1_aux(b);
-	while ((s < b->data) + b->data_len)
+	while (s < b->data + b->data_len)
 	{
 		int x = (int)s[0] << 8 | s[1];
 		s += 2;
@@ -113,11 +113,33 @@ void bam_destroy_header_hash(bam_header_t *header)
 int bam_get_tid(const bam_header_t *header, const char *seq_name)
 {
 	khint_t k;
-	khash_t(s) *h = (khash_t(s)*)header->hash;
+	int i;
+	int ret;
+	khash_t(s) *h;
+	bam_header_t *hdr = (bam_header_t*)header;
 
+	// the name hash is a cache that is filled on demand
+	if (hdr->hash == 0)
+		hdr->hash = kh_init(s);
+
+	h = (khash_t(s)*)hdr->hash;
 	k = kh_get(s, h, seq_name);
 
-	return k == kh_end(h) ? -1 : kh_value(h, k);
+	if (k != kh_end(h))
+		return kh_value(h, k);
+
+	// enter target names in header order only until the requested one is found
+	while (hdr->n_hashed < hdr->n_targets)
+	{
+		i = hdr->n_hashed++;
+		k = kh_put(s, h, hdr->target_name[i], &ret);
+		if (ret)
+			kh_value(h, k) = i;
+		if (strcmp(hdr->target_name[i], seq_name) == 0)
+			return kh_value(h, k);
+	}
+
+	return -1;
 }
 
 int bam_aux2i(const unsigned char *s)
@@ -236,20 +236,11 @@ int sam_header_parse(bam_header_t *h)
 
 void bam_init_header_hash2(bam_header_t *header)
 {
-	int i;
-
+	// names are entered by bam_get_tid() as they are looked up
 	if (header->hash == 0)
 	{
-		int ret = 0;
-		khiter_t iter;
-		khash_t(s) *h;
-
-		header->hash = h = kh_init(s);
-		for (i=0; i < header->n_targets; ++i)
-		{
-			iter = kh_put(s, h, header->target_name[i], &ret);
-			kh_value(h, iter) = i;
-		}
+		header->hash = kh_init(s);
+		header->n_hashed = 0;
 	}
 }
 
@@ -283,6 +274,403 @@ bam_header_t *sam_header_read(tamFile fp)
 	return header;
 }
 
+static inline int cigar2qlen(const bam1_core_t *c, const unsigned int *cigar)
+{
+	int k;
+	int l = 0;
+
+	for (k=0; k < c->n_cigar; ++k)
+	{
+		int op = cigar[k] & BAM_CIGAR_MASK;
+
+		if ((op == BAM_CMATCH) || (op == BAM_CINS) || (op == BAM_CSOFT_CLIP) || (op == BAM_CEQUAL) || (op == BAM_CDIFF))
+			l += cigar[k] >> BAM_CIGAR_SHIFT;
+	}
+
+	return l;
+}
+
+int sam_read1(tamFile fp, bam_header_t *header, bam1_t *b)
+{
+	int ret;
+	int doff;
+	int doff0;
+	int dret;
+	int z = 0;
+	bam1_core_t *c = &b->core;
+	kstring_t *str = fp->str;
+	kstream_t *ks = fp->ks;
+
+	if (fp->is_first)
+	{
+		// the query name was already read by sam_header_read()
+		fp->is_first = 0;
+		ret = str->l;
+	}
+	else
+	{
+		// skip empty lines
+		do
+		{
+			ret = ks_getuntil(fp->ks, KS_SEP_TAB, str, &dret);
+			if (ret >= 0)
+				z += str->l + 1;
+		} while (ret == 0);
+	}
+
+	if (ret < 0)
+		return -1;
+
+	++fp->n_lines;
+	doff = 0;
+
+	// query name
+	c->l_qname = strlen(str->s) + 1;
+	memcpy(alloc_data(b, doff + c->l_qname) + doff, str->s, c->l_qname);
+	doff += c->l_qname;
+
+	// flag
+	{
+		long flag;
+		char *s;
+
+		ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret);
+		z += str->l + 1;
+		flag = strtol((char*)str->s, &s, 0);
+
+		// flag given as a string of characters
+		if (*s)
+		{
+			flag = 0;
+			for (s=str->s; *s; ++s)
+				flag |= bam_char2flag_table[(int)*s];
+		}
+
+		c->flag = flag;
+	}
+
+	// reference, position and mapping quality
+	ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret);
+	z += str->l + 1;
+	c->tid = bam_get_tid(header, str->s);
+
+	if ((c->tid < 0) && strcmp(str->s, "*"))
+	{
+		if (header->n_targets == 0)
+		{
+			fprintf(stderr, "[sam_read1] missing header? Abort!\n");
+			exit(1);
+		}
+		else
+			fprintf(stderr, "[sam_read1] reference '%s' is recognized as '*'.\n", str->s);
+	}
+
+	ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret);
+	z += str->l + 1;
+	c->pos = isdigit(str->s[0]) ? atoi(str->s) - 1 : -1;
+	ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret);
+	z += str->l + 1;
+	c->qual = isdigit(str->s[0]) ? atoi(str->s) : 0;
+
+	if (ret < 0)
+		return -2;
+
+	// cigar
+	c->n_cigar = 0;
+
+	if (ks_getuntil(ks, KS_SEP_TAB, str, &dret) < 0)
+		return -3;
+
+	z += str->l + 1;
+
+	if (str->s[0] != '*')
+	{
+		char *s;
+		char *t;
+		int i;
+		int op;
+		long x;
+		unsigned int *cigar;
+
+		for (s=str->s; *s; ++s)
+		{
+			if (isalpha(*s) || (*s == '='))
+				++c->n_cigar;
+			else if (!isdigit(*s))
+				parse_error(fp->n_lines, "invalid CIGAR character");
+		}
+
+		b->data = alloc_data(b, doff + c->n_cigar * 4);
+		cigar = bam1_cigar(b);
+
+		for (i=0, s=str->s; i != c->n_cigar; ++i)
+		{
+			x = strtol(s, &t, 10);
+			op = toupper(*t);
+
+			if (op == 'M')
+				op = BAM_CMATCH;
+			else if (op == 'I')
+				op = BAM_CINS;
+			else if (op == 'D')
+				op = BAM_CDEL;
+			else if (op == 'N')
+				op = BAM_CREF_SKIP;
+			else if (op == 'S')
+				op = BAM_CSOFT_CLIP;
+			else if (op == 'H')
+				op = BAM_CHARD_CLIP;
+			else if (op == 'P')
+				op = BAM_CPAD;
+			else if (op == '=')
+				op = BAM_CEQUAL;
+			else if (op == 'X')
+				op = BAM_CDIFF;
+			else if (op == 'B')
+				op = BAM_CBACK;
+			else
+				parse_error(fp->n_lines, "invalid CIGAR operation");
+
+			s = t + 1;
+			cigar[i] = bam_cigar_gen(x, op);
+		}
+
+		if (*s)
+			parse_error(fp->n_lines, "unmatched CIGAR operation");
+
+		c->bin = bam_reg2bin(c->pos, bam_calend(c, cigar));
+		doff += c->n_cigar * 4;
+	}
+	else
+	{
+		if (!(c->flag & BAM_FUNMAP))
+		{
+			fprintf(stderr, "Parse warning at line %lld: mapped sequence without CIGAR\n", (long long)fp->n_lines);
+			c->flag |= BAM_FUNMAP;
+		}
+
+		c->bin = bam_reg2bin(c->pos, c->pos + 1);
+	}
+
+	// mate reference, mate position and insert size
+	ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret);
+	z += str->l + 1;
+	c->mtid = strcmp(str->s, "=") ? bam_get_tid(header, str->s) : c->tid;
+	ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret);
+	z += str->l + 1;
+	c->mpos = isdigit(str->s[0]) ? atoi(str->s) - 1 : -1;
+	ret = ks_getuntil(ks, KS_SEP_TAB, str, &dret);
+	z += str->l + 1;
+	c->isize = ((str->s[0] == '-') || isdigit(str->s[0])) ? atoi(str->s) : 0;
+
+	if (ret < 0)
+		return -4;
+
+	// sequence and qualities
+	{
+		int i;
+		unsigned char *p = 0;
+
+		if (ks_getuntil(ks, KS_SEP_TAB, str, &dret) < 0)
+			return -5;
+
+		z += str->l + 1;
+
+		if (strcmp(str->s, "*"))
+		{
+			c->l_qseq = strlen(str->s);
+
+			if (c->n_cigar && (c->l_qseq != cigar2qlen(c, bam1_cigar(b))))
+				parse_error(fp->n_lines, "CIGAR and sequence length are inconsistent");
+
+			p = (unsigned char*)alloc_data(b, doff + c->l_qseq + (c->l_qseq+1)/2) + doff;
+			memset(p, 0, (c->l_qseq+1)/2);
+
+			for (i=0; i < c->l_qseq; ++i)
+				p[i/2] |= bam_nt16_table[(int)str->s[i]] << 4*(1-i%2);
+		}
+		else
+		{
+			c->l_qseq = 0;
+			p = b->data + doff;
+		}
+
+		if (ks_getuntil(ks, KS_SEP_TAB, str, &dret) < 0)
+			return -6;
+
+		z += str->l + 1;
+
+		if (strcmp(str->s, "*") && (c->l_qseq != (int)strlen(str->s)))
+			parse_error(fp->n_lines, "sequence and quality are inconsistent");
+
+		p += (c->l_qseq+1)/2;
+
+		if (strcmp(str->s, "*") == 0)
+			for (i=0; i < c->l_qseq; ++i)
+				p[i] = 0xff;
+		else
+			for (i=0; i < c->l_qseq; ++i)
+				p[i] = str->s[i] - 33;
+
+		doff += c->l_qseq + (c->l_qseq+1)/2;
+	}
+
+	// auxiliary fields
+	doff0 = doff;
+
+	if ((dret != '\n') && (dret != '\r'))
+	{
+		while (ks_getuntil(ks, KS_SEP_TAB, str, &dret) >= 0)
+		{
+			unsigned char *s;
+			unsigned char type;
+
+			z += str->l + 1;
+
+			if ((str->l < 6) || (str->s[2] != ':') || (str->s[4] != ':'))
+				parse_error(fp->n_lines, "missing colon in auxiliary data");
+
+			type = str->s[3];
+			s = alloc_data(b, doff + 3) + doff;
+			s[0] = str->s[0];
+			s[1] = str->s[1];
+			doff += 2;
+
+			if ((type == 'A') || (type == 'a') || (type == 'c') || (type == 'C'))
+			{
+				s = alloc_data(b, doff + 2) + doff;
+				s[0] = 'A';
+				s[1] = str->s[5];
+				doff += 2;
+			}
+			else if ((type == 'I') || (type == 'i'))
+			{
+				long long x = atoll(str->s + 5);
+
+				s = alloc_data(b, doff + 5) + doff;
+
+				if ((x < 0) && (x >= -127))
+				{
+					s[0] = 'c';
+					*(signed char*)(s+1) = (signed char)x;
+					doff += 2;
+				}
+				else if ((x < 0) && (x >= -32767))
+				{
+					s[0] = 's';
+					*(short*)(s+1) = (short)x;
+					doff += 3;
+				}
+				else if (x < 0)
+				{
+					s[0] = 'i';
+					*(int*)(s+1) = (int)x;
+					doff += 5;
+				}
+				else if (x <= 255)
+				{
+					s[0] = 'C';
+					s[1] = (unsigned char)x;
+					doff += 2;
+				}
+				else if (x <= 65535)
+				{
+					s[0] = 'S';
+					*(unsigned short*)(s+1) = (unsigned short)x;
+					doff += 3;
+				}
+				else
+				{
+					s[0] = 'I';
+					*(unsigned int*)(s+1) = (unsigned int)x;
+					doff += 5;
+				}
+			}
+			else if (type == 'f')
+			{
+				s = alloc_data(b, doff + 5) + doff;
+				s[0] = 'f';
+				*(float*)(s+1) = (float)atof(str->s + 5);
+				doff += 5;
+			}
+			else if (type == 'd')
+			{
+				s = alloc_data(b, doff + 9) + doff;
+				s[0] = 'd';
+				*(double*)(s+1) = atof(str->s + 5);
+				doff += 9;
+			}
+			else if ((type == 'Z') || (type == 'H'))
+			{
+				int size = 1 + (str->l - 5) + 1;
+
+				s = alloc_data(b, doff + size) + doff;
+				s[0] = type;
+				memcpy(s+1, str->s + 5, str->l - 5);
+				s[str->l - 4] = 0;
+				doff += size;
+			}
+			else if (type == 'B')
+			{
+				int i;
+				int n;
+				int size = 0;
+				char *t;
+				char *e;
+				unsigned char sub = str->s[5];
+
+				// count the elements of the array
+				for (i=6, n=0; i < (int)str->l; ++i)
+					if (str->s[i] == ',')
+						++n;
+
+				if ((sub == 'c') || (sub == 'C'))
+					size = 1;
+				else if ((sub == 's') || (sub == 'S'))
+					size = 2;
+				else if ((sub == 'i') || (sub == 'I') || (sub == 'f'))
+					size = 4;
+				else
+					parse_error(fp->n_lines, "unrecognized array type");
+
+				s = alloc_data(b, doff + 6 + n * size) + doff;
+				s[0] = 'B';
+				s[1] = sub;
+				memcpy(s+2, &n, 4);
+				s += 6;
+				t = str->s + 7;
+
+				for (i=0; i < n; ++i, t = e + 1, s += size)
+				{
+					if (sub == 'f')
+						*(float*)s = (float)strtod(t, &e);
+					else if (size == 1)
+						*s = (unsigned char)strtol(t, &e, 0);
+					else if (size == 2)
+						*(unsigned short*)s = (unsigned short)strtol(t, &e, 0);
+					else
+						*(unsigned int*)s = (unsigned int)strtoll(t, &e, 0);
+				}
+
+				doff += 6 + n * size;
+			}
+			else
+				parse_error(fp->n_lines, "unrecognized type");
+
+			if ((dret == '\n') || (dret == '\r'))
+				break;
+		}
+	}
+
+	b->l_aux = doff - doff0;
+	b->data_len = doff;
+
+	if (bam_no_B)
+		bam_remove_B(b);
+
+	return z;
+}
+
 tamFile sam_open(const char *fn)
 {
 	tamFile fp;
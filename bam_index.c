@@ -1,5 +1,6 @@
 #include <ctype.h>
 #include <assert.h>
+#include <limits.h>
 #include "bam.h"
 #include "khash.h"
 #include "ksort.h"
@@ -13,6 +14,8 @@
 // 1<<14 is the size of minimum bin.
 #define BAM_LIDX_SHIFT 14
 #define BAM_MAX_BIN 37450 // =(8^6-1)/7+1
+// number of levels below the root bin in the BAI scheme
+#define BAM_LEVELS 5
 
 typedef struct
 {
@@ -28,6 +31,7 @@ typedef struct
 	unsigned int m;
 	unsigned int n;
 	pair64_t *list;
+	unsigned long long loff;     // CSI only: first alignment overlapping the bin
 } bam_binlist_t;
 
 typedef struct
@@ -43,8 +47,13 @@ struct __bam_index_t
 {
 	int n;
 	unsigned long long n_no_coor;           // unmapped reads without coordinate
-	khash_t(i) **index;
+	khash_t(i) **index;                     // 0 for a reference not yet parsed from raw
 	bam_lidx_t *index2;
+	unsigned char *raw;                     // contents of the index file
+	unsigned long long *raw_off;            // offset of each reference in raw
+	int is_csi;                             // loaded from a CSI rather than a BAI file
+	int min_shift;                          // size of the smallest bin is 1<<min_shift
+	int n_lvls;                             // number of levels below the root bin
 };
 
 
@@ -61,6 +70,8 @@ struct __bam_iter_t
 	pair64_t *off;
 };
 
+static void bam_index_load_tid(const bam_index_t *idx, int tid);
+
 void bam_index_destroy(bam_index_t *idx)
 {
 	khint_t k;
@@ -74,6 +85,9 @@ void bam_index_destroy(bam_index_t *idx)
 		khash_t(i) *index = idx->index[i];
 		bam_lidx_t *index2 = idx->index2 + i;
 
+		if (index == 0)
+			continue;
+
 		for (k=kh_begin(index); k != kh_end(index); ++k)
 		{
 			if (kh_exist(index, k))
@@ -86,125 +100,694 @@ void bam_index_destroy(bam_index_t *idx)
 
 	free(idx->index);
 	free(idx->index2);
+	free(idx->raw);
+	free(idx->raw_off);
 	free(idx);
 }
 
-static bam_index_t *bam_index_load_core(FILE *fp)
+struct __bam_index_builder_t
 {
-	int i;
-	char magic[4];
 	bam_index_t *idx;
+	int last_tid;                           // reference of the previous alignment
+	int save_tid;                           // reference of the open bin
+	int last_coor;                          // position of the previous alignment
+	int unplaced;                           // reads without coordinates have started
+	int unsorted;                           // an alignment was found out of order
+	unsigned int last_bin;                  // bin of the previous alignment
+	unsigned int save_bin;                  // bin whose chunk is still open
+	unsigned long long save_off;            // start of the open chunk
+	unsigned long long last_off;            // end of the previous alignment
+	unsigned long long off_beg;             // start of the current reference
+	unsigned long long n_mapped;
+	unsigned long long n_unmapped;
+	unsigned long long n_no_coor;
+};
+
+static inline void insert_offset(khash_t(i) *h, int bin, unsigned long long beg, unsigned long long end)
+{
+	khint_t k;
+	bam_binlist_t *l;
+	int ret;
+
+	k = kh_put(i, h, bin, &ret);
+	l = &kh_value(h, k);
 
-	if (fp == 0)
+	// bin not yet present
+	if (ret)
 	{
-		fprintf(stderr, "[bam_index_load_core] fail to load index.\n");
+		l->m = 1;
+		l->n = 0;
+		l->list = (pair64_t*)calloc(l->m, 16);
+	}
+
+	if (l->n == l->m)
+	{
+		l->m <<= 1;
+		l->list = (pair64_t*)realloc(l->list, l->m * 16);
+	}
+
+	l->list[l->n].u = beg;
+	l->list[l->n++].v = end;
+}
+
+static inline void insert_offset2(bam_lidx_t *index2, const bam1_t *b, unsigned long long offset)
+{
+	int i;
+	int beg;
+	int end;
+
+	beg = b->core.pos >> BAM_LIDX_SHIFT;
+	end = (bam_calend(&b->core, bam1_cigar(b)) - 1) >> BAM_LIDX_SHIFT;
+
+	if (index2->m < end + 1)
+	{
+		int old_m = index2->m;
+		index2->m = end + 1;
+		kroundup32(index2->m);
+		index2->offset = (unsigned long long*)realloc(index2->offset, index2->m * 8);
+		// unset entries are all ones, since a text file indexed for tabix may have a line at offset 0
+		memset(index2->offset + old_m, 0xff, 8 * (index2->m - old_m));
+	}
+
+	for (i=beg; i <= end; ++i)
+	{
+		if (index2->offset[i] == (unsigned long long)-1)
+			index2->offset[i] = offset;
+	}
+
+	if (index2->n < end + 1)
+		index2->n = end + 1;
+}
+
+static void merge_chunks(bam_index_t *idx)
+{
+	khash_t(i) *index;
+	int i;
+	int l;
+	int m;
+	khint_t k;
+
+	// chunks starting in the block where the previous one ends are joined
+	for (i=0; i < idx->n; ++i)
+	{
+		index = idx->index[i];
+		for (k=kh_begin(index); k != kh_end(index); ++k)
+		{
+			bam_binlist_t *p;
+
+			if (!kh_exist(index, k) || (kh_key(index, k) == BAM_MAX_BIN))
+				continue;
+
+			p = &kh_value(index, k);
+			m = 0;
+			for (l=1; l < (int)p->n; ++l)
+			{
+				if (p->list[m].v >> 16 == p->list[l].u >> 16)
+					p->list[m].v = p->list[l].v;
+				else
+					p->list[++m] = p->list[l];
+			}
+			p->n = m + 1;
+		}
+	}
+}
+
+static void fill_missing(bam_index_t *idx)
+{
+	int i;
+	int j;
+
+	for (i=0; i < idx->n; ++i)
+	{
+		bam_lidx_t *idx2 = &idx->index2[i];
+		for (j=0; j < idx2->n; ++j)
+		{
+			if (idx2->offset[j] == (unsigned long long)-1)
+				idx2->offset[j] = (j > 0) ? idx2->offset[j-1] : 0;
+		}
+	}
+}
+
+bam_index_builder_t *bam_index_builder_init(int n_targets, unsigned long long off)
+{
+	int i;
+	bam_index_builder_t *bi;
+
+	bi = (bam_index_builder_t*)calloc(1, sizeof(bam_index_builder_t));
+	bi->idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
+	bi->idx->n = n_targets;
+	bi->idx->min_shift = BAM_LIDX_SHIFT;
+	bi->idx->n_lvls = BAM_LEVELS;
+	bi->idx->index = (khash_t(i)**)calloc(n_targets, sizeof(void*));
+	for (i=0; i < n_targets; ++i)
+		bi->idx->index[i] = kh_init(i);
+	bi->idx->index2 = (bam_lidx_t*)calloc(n_targets, sizeof(bam_lidx_t));
+
+	bi->save_tid = bi->last_tid = -1;
+	bi->save_bin = bi->last_bin = 0xffffffffu;
+	bi->last_coor = -1;
+	bi->save_off = bi->last_off = bi->off_beg = off;
+
+	return bi;
+}
+
+int bam_index_builder_push(bam_index_builder_t *bi, const bam1_t *b, unsigned long long off)
+{
+	const bam1_core_t *c = &b->core;
+	bam_index_t *idx = bi->idx;
+
+	if (bi->unsorted)
+		return -1;
+
+	if (c->tid < 0)
+		++bi->n_no_coor;
+
+	// only reads without coordinates may follow the first of them
+	if (bi->unplaced)
+	{
+		if (c->tid >= 0)
+		{
+			fprintf(stderr, "[bam_index_builder_push] the alignment is not sorted: reads without coordinates prior to reads with coordinates.\n");
+			bi->unsorted = 1;
+			return -1;
+		}
+		bi->last_off = off;
 		return 0;
 	}
 
-	fread(magic, 1, 4, fp);
+	// change of reference sequence
+	if ((bi->last_tid < c->tid) || ((bi->last_tid >= 0) && (c->tid < 0)))
+	{
+		bi->last_tid = c->tid;
+		bi->last_bin = 0xffffffffu;
+	}
+	else if (bi->last_tid > c->tid)
+	{
+		fprintf(stderr, "[bam_index_builder_push] the alignment is not sorted (%s): %d-th chr > %d-th chr\n",
+				bam1_qname(b), bi->last_tid + 1, c->tid + 1);
+		bi->unsorted = 1;
+		return -1;
+	}
+	else if ((c->tid >= 0) && (bi->last_coor > c->pos))
+	{
+		fprintf(stderr, "[bam_index_builder_push] the alignment is not sorted (%s): %d > %d in %d-th chr\n",
+				bam1_qname(b), bi->last_coor, c->pos, c->tid + 1);
+		bi->unsorted = 1;
+		return -1;
+	}
+
+	if ((c->tid >= 0) && !(c->flag & BAM_FUNMAP))
+		insert_offset2(&idx->index2[c->tid], b, bi->last_off);
 
-	if (strncmp(magic, "BAI\1", 4))
+	// close the chunk of the previous bin
+	if (c->bin != bi->last_bin)
 	{
-		fprintf(stderr, "[bam_index_load] wrong magic number.\n");
-		fclose(fp);
+		if (bi->save_bin != 0xffffffffu)
+			insert_offset(idx->index[bi->save_tid], bi->save_bin, bi->save_off, bi->last_off);
+
+		// write the meta bin of the finished reference sequence
+		if ((bi->last_bin == 0xffffffffu) && (bi->save_tid >= 0))
+		{
+			insert_offset(idx->index[bi->save_tid], BAM_MAX_BIN, bi->off_beg, bi->last_off);
+			insert_offset(idx->index[bi->save_tid], BAM_MAX_BIN, bi->n_mapped, bi->n_unmapped);
+			bi->n_mapped = bi->n_unmapped = 0;
+			bi->off_beg = bi->last_off;
+		}
+
+		bi->save_off = bi->last_off;
+		bi->save_bin = bi->last_bin = c->bin;
+		bi->save_tid = c->tid;
+
+		if (bi->save_tid < 0)
+		{
+			bi->unplaced = 1;
+			bi->last_off = off;
+			return 0;
+		}
+	}
+
+	if (c->flag & BAM_FUNMAP)
+		++bi->n_unmapped;
+	else
+		++bi->n_mapped;
+
+	bi->last_off = off;
+	bi->last_coor = c->pos;
+
+	return 0;
+}
+
+bam_index_t *bam_index_builder_finish(bam_index_builder_t *bi, unsigned long long off)
+{
+	bam_index_t *idx = bi->idx;
+
+	if (bi->unsorted)
+	{
+		bam_index_destroy(idx);
+		free(bi);
 		return 0;
 	}
 
-	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
-	fread(&idx->n, 4, 1, fp);
+	if (!bi->unplaced && (bi->save_tid >= 0))
+	{
+		insert_offset(idx->index[bi->save_tid], bi->save_bin, bi->save_off, off);
+		insert_offset(idx->index[bi->save_tid], BAM_MAX_BIN, bi->off_beg, off);
+		insert_offset(idx->index[bi->save_tid], BAM_MAX_BIN, bi->n_mapped, bi->n_unmapped);
+	}
+
+	merge_chunks(idx);
+	fill_missing(idx);
+	idx->n_no_coor = bi->n_no_coor;
+	free(bi);
+
+	return idx;
+}
+
+typedef int (*index_write_f)(const void *data, int len, void *fp);
+
+static int write_file(const void *data, int len, void *fp)
+{
+	return (fwrite(data, 1, len, (FILE*)fp) == (size_t)len) ? 0 : -1;
+}
 
+static int write_bgzf(const void *data, int len, void *fp)
+{
+	return (bgzf_write((BGZF*)fp, data, len) == len) ? 0 : -1;
+}
+
+static int write_int32(index_write_f put, void *fp, unsigned int x)
+{
 	if (bam_is_be)
-		bam_swap_endian_4p(&idx->n);
+		bam_swap_endian_4p(&x);
+	return put(&x, 4, fp);
+}
 
-	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
-	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
+static int write_int64(index_write_f put, void *fp, unsigned long long y)
+{
+	if (bam_is_be)
+		bam_swap_endian_8p(&y);
+	return put(&y, 8, fp);
+}
+
+// bins and linear index of each reference sequence, shared by the BAI and tabix formats
+static int save_bins(const bam_index_t *idx, index_write_f put, void *fp)
+{
+	int i;
+	int ret = 0;
+	khint_t k;
 
 	for (i=0; i < idx->n; ++i)
 	{
 		khash_t(i) *index;
 		bam_lidx_t *index2 = idx->index2 + i;
-		unsigned int key;
-		unsigned int size;
-		khint_t k;
 		int j;
-		int ret;
-		bam_binlist_t *p;
-
-		index = idx->index[i] = kh_init(i);
 
-		// load binning index
-		fread(&size, 4, 1, fp);
+		bam_index_load_tid(idx, i);
+		index = idx->index[i];
 
-		if (bam_is_be)
-			bam_swap_endian_4p(&size);
+		// write binning index
+		ret |= write_int32(put, fp, kh_size(index));
 
-		for (j=0; j < (int)size; ++j)
+		for (k=kh_begin(index); k != kh_end(index); ++k)
 		{
-			fread(&key, 4, 1, fp);
+			bam_binlist_t *p;
 
-			if (bam_is_be)
-				bam_swap_endian_4p(&key);
+			if (!kh_exist(index, k))
+				continue;
 
-			k = kh_put(i, index, key, &ret);
 			p = &kh_value(index, k);
-			fread(&p->n, 4, 1, fp);
-
-			if (bam_is_be)
-				bam_swap_endian_4p(&p->n);
-
-			p->m = p->n;
-			p->list = (pair64_t*)malloc(p->m*16);
-			fread(p->list, 16, p->n, fp);
+			ret |= write_int32(put, fp, kh_key(index, k));
+			ret |= write_int32(put, fp, p->n);
 
-			if (bam_is_be)
+			for (j=0; j < (int)p->n; ++j)
 			{
-				int x;
-				for (x=0; x < p->n; ++x)
-				{
-					bam_swap_endian_8p(&p->list[x].u);
-					bam_swap_endian_8p(&p->list[x].v);
-				}
+				ret |= write_int64(put, fp, p->list[j].u);
+				ret |= write_int64(put, fp, p->list[j].v);
 			}
 		}
 
-		// load linear index
-		fread(&index2->n, 4, 1, fp);
+		// write linear index
+		ret |= write_int32(put, fp, index2->n);
+
+		for (j=0; j < index2->n; ++j)
+			ret |= write_int64(put, fp, index2->offset[j]);
+	}
+
+	// number of reads without coordinates
+	ret |= write_int64(put, fp, idx->n_no_coor);
+
+	return ret;
+}
+
+void bam_index_save(const bam_index_t *idx, FILE *fp)
+{
+	fwrite("BAI\1", 1, 4, fp);
+	write_int32(write_file, fp, idx->n);
+	save_bins(idx, write_file, fp);
+	fflush(fp);
+}
+
+int bam_index_save_tabix(const bam_index_t *idx, BGZF *fp, const int *conf, const char *names, int l_nm)
+{
+	int i;
+	int ret = 0;
+
+	ret |= write_bgzf("TBI\1", 4, fp);
+	ret |= write_int32(write_bgzf, fp, idx->n);
+	for (i=0; i < 6; ++i)
+		ret |= write_int32(write_bgzf, fp, conf[i]);
+	ret |= write_int32(write_bgzf, fp, l_nm);
+	ret |= write_bgzf(names, l_nm, fp);
+	ret |= save_bins(idx, write_bgzf, fp);
 
-		if (bam_is_be)
-			bam_swap_endian_4p(&index2->n);
+	return ret;
+}
 
-		index2->m = index2->n;
-		index2->offset = (unsigned long long*)calloc(index2->m, 8);
-		fread(index2->offset, index2->n, 8, fp);
+int bam_index_build(const char *fn)
+{
+	int ret = 0;
+	char *fnidx;
+	FILE *fpidx;
+	bamFile fp;
+	bam_header_t *h;
+	bam1_t *b;
+	bam_index_builder_t *bi;
+	bam_index_t *idx;
 
-		if (bam_is_be)
-			for (j=0; j < index2->n; ++j)
-				bam_swap_endian_8p(&index2->offset[j]);
+	if ((fp = bam_open(fn, "r")) == 0)
+	{
+		fprintf(stderr, "[bam_index_build] fail to open the BAM file.\n");
+		return -1;
 	}
 
-	if (fread(&idx->n_no_coor, 8, 1, fp) == 0)
-		idx->n_no_coor = 0;
+	h = bam_header_read(fp);
+	bi = bam_index_builder_init(h->n_targets, bam_tell(fp));
+	bam_header_destroy(h);
+	b = bam_init1();
 
+	while ((ret = bam_read1(fp, b)) >= 0)
+	{
+		if (bam_index_builder_push(bi, b, bam_tell(fp)) < 0)
+			break;
+	}
+
+	if (ret < -1)
+		fprintf(stderr, "[bam_index_build] truncated file? Continue anyway. (%d)\n", ret);
+
+	idx = bam_index_builder_finish(bi, bam_tell(fp));
+	bam_destroy1(b);
+	bam_close(fp);
+
+	if (idx == 0)
+		return -1;
+
+	fnidx = (char*)calloc(strlen(fn) + 5, 1);
+	strcpy(fnidx, fn);
+	strcat(fnidx, ".bai");
+
+	if ((fpidx = fopen(fnidx, "wb")) == 0)
+	{
+		fprintf(stderr, "[bam_index_build] fail to create the index file.\n");
+		free(fnidx);
+		bam_index_destroy(idx);
+		return -1;
+	}
+
+	bam_index_save(idx, fpidx);
+	fclose(fpidx);
+	free(fnidx);
+	bam_index_destroy(idx);
+
+	return 0;
+}
+
+static inline unsigned int raw_get_4(const unsigned char *p)
+{
+	unsigned int x;
+
+	memcpy(&x, p, 4);
 	if (bam_is_be)
-		bam_swap_endian_8p(&idx->n_no_coor);
+		bam_swap_endian_4p(&x);
+
+	return x;
+}
+
+static inline unsigned long long raw_get_8(const unsigned char *p)
+{
+	unsigned long long x;
+
+	memcpy(&x, p, 8);
+	if (bam_is_be)
+		bam_swap_endian_8p(&x);
+
+	return x;
+}
+
+static void bam_index_load_tid(const bam_index_t *_idx, int tid)
+{
+	bam_index_t *idx = (bam_index_t*)_idx;
+	khash_t(i) *index;
+	bam_lidx_t *index2 = idx->index2 + tid;
+	const unsigned char *p;
+	unsigned int key;
+	unsigned int size;
+	khint_t k;
+	int j;
+	int x;
+	int ret;
+	bam_binlist_t *l;
+
+	if (idx->index[tid])
+		return;
+
+	index = idx->index[tid] = kh_init(i);
+	p = idx->raw + idx->raw_off[tid];
+
+	// load binning index
+	size = raw_get_4(p);
+	p += 4;
+
+	for (j=0; j < (int)size; ++j)
+	{
+		key = raw_get_4(p);
+		k = kh_put(i, index, key, &ret);
+		l = &kh_value(index, k);
+		p += 4;
+
+		// CSI keeps a linear offset in each bin instead of a linear index
+		if (idx->is_csi)
+		{
+			l->loff = raw_get_8(p);
+			p += 8;
+		}
+
+		l->n = raw_get_4(p);
+		p += 4;
+		l->m = l->n;
+		l->list = (pair64_t*)malloc(l->m * 16);
+
+		for (x=0; x < (int)l->n; ++x)
+		{
+			l->list[x].u = raw_get_8(p);
+			l->list[x].v = raw_get_8(p + 8);
+			p += 16;
+		}
+	}
+
+	if (idx->is_csi)
+		return;
+
+	// load linear index
+	index2->n = raw_get_4(p);
+	p += 4;
+	index2->m = index2->n;
+	index2->offset = (unsigned long long*)calloc(index2->m, 8);
+
+	for (j=0; j < index2->n; ++j)
+	{
+		index2->offset[j] = raw_get_8(p);
+		p += 8;
+	}
+}
+
+static bam_index_t *bam_index_load_core(unsigned char *raw, size_t l_raw)
+{
+	int i;
+	int j;
+	int is_csi;
+	size_t pos;
+	size_t bin_size;
+	unsigned int size;
+	bam_index_t *idx;
+
+	if (raw == 0)
+	{
+		fprintf(stderr, "[bam_index_load_core] fail to load index.\n");
+		return 0;
+	}
+
+	if ((l_raw >= 8) && (strncmp((char*)raw, "BAI\1", 4) == 0))
+		is_csi = 0;
+	else if ((l_raw >= 16) && (strncmp((char*)raw, "CSI\1", 4) == 0))
+		is_csi = 1;
+	else
+	{
+		fprintf(stderr, "[bam_index_load] wrong magic number.\n");
+		free(raw);
+		return 0;
+	}
+
+	idx = (bam_index_t*)calloc(1, sizeof(bam_index_t));
+	idx->raw = raw;
+	idx->is_csi = is_csi;
+
+	// the CSI header sets the bin geometry and may carry auxiliary data
+	if (is_csi)
+	{
+		idx->min_shift = raw_get_4(raw + 4);
+		idx->n_lvls = raw_get_4(raw + 8);
+		pos = 16 + (size_t)raw_get_4(raw + 12);
+		bin_size = 16;
+	}
+	else
+	{
+		idx->min_shift = BAM_LIDX_SHIFT;
+		idx->n_lvls = BAM_LEVELS;
+		pos = 4;
+		bin_size = 8;
+	}
+
+	if ((pos + 4 > l_raw) || (idx->min_shift < 0) || (idx->n_lvls < 0) || (idx->min_shift + 3 * idx->n_lvls > 62))
+	{
+		fprintf(stderr, "[bam_index_load] invalid index header.\n");
+		bam_index_destroy(idx);
+		return 0;
+	}
+
+	idx->n = raw_get_4(raw + pos);
+	pos += 4;
+	idx->index = (khash_t(i)**)calloc(idx->n, sizeof(void*));
+	idx->index2 = (bam_lidx_t*)calloc(idx->n, sizeof(bam_lidx_t));
+	idx->raw_off = (unsigned long long*)calloc(idx->n, 8);
+
+	// record where each reference starts by skipping over its bins and linear index
+	for (i=0; i < idx->n; ++i)
+	{
+		idx->raw_off[i] = pos;
+
+		if (pos + 4 > l_raw)
+			break;
+		size = raw_get_4(raw + pos);
+		pos += 4;
+
+		for (j=0; (j < (int)size) && (pos + bin_size <= l_raw); ++j)
+			pos += bin_size + 16 * (size_t)raw_get_4(raw + pos + bin_size - 4);
+
+		if (j < (int)size)
+			break;
+
+		if (!is_csi)
+		{
+			if (pos + 4 > l_raw)
+				break;
+			pos += 4 + 8 * (size_t)raw_get_4(raw + pos);
+		}
+	}
+
+	if ((i < idx->n) || (pos > l_raw))
+	{
+		fprintf(stderr, "[bam_index_load] truncated index file.\n");
+		bam_index_destroy(idx);
+		return 0;
+	}
+
+	if (pos + 8 <= l_raw)
+		idx->n_no_coor = raw_get_8(raw + pos);
+	else
+		idx->n_no_coor = 0;
 
 	return idx;
 }
 
-bam_index_t *bam_index_load_local(const char *_fn)
+static unsigned char *bam_index_read_file(const char *fnidx, size_t *l_raw)
 {
 	FILE *fp;
+	BGZF *fpz;
+	unsigned char magic[2];
+	unsigned char *raw;
+	size_t m_raw;
+	int n;
+
+	if ((fp = fopen(fnidx, "rb")) == 0)
+		return 0;
+
+	m_raw = 0x10000;
+	*l_raw = 0;
+	raw = (unsigned char*)malloc(m_raw);
+
+	// CSI files are BGZF compressed; BAI files are not
+	if ((fread(magic, 1, 2, fp) == 2) && (magic[0] == 0x1f) && (magic[1] == 0x8b))
+	{
+		fclose(fp);
+		if ((fpz = bgzf_open(fnidx, "r")) == 0)
+		{
+			free(raw);
+			return 0;
+		}
+		while ((n = bgzf_read(fpz, raw + *l_raw, m_raw - *l_raw)) > 0)
+		{
+			*l_raw += n;
+			if (*l_raw == m_raw)
+			{
+				m_raw <<= 1;
+				raw = (unsigned char*)realloc(raw, m_raw);
+			}
+		}
+		bgzf_close(fpz);
+	}
+	else
+	{
+		rewind(fp);
+		while ((n = fread(raw + *l_raw, 1, m_raw - *l_raw, fp)) > 0)
+		{
+			*l_raw += n;
+			if (*l_raw == m_raw)
+			{
+				m_raw <<= 1;
+				raw = (unsigned char*)realloc(raw, m_raw);
+			}
+		}
+		fclose(fp);
+	}
+
+	return raw;
+}
+
+bam_index_t *bam_index_load_local(const char *_fn)
+{
 	char *fnidx;
 	char *fn;
+	unsigned char *raw;
+	size_t l_raw = 0;
 
 	fn = strdup(_fn);
 	fnidx = (char*)calloc(strlen(fn) + 5, 1);
+
+	// try "{fn}.csi" first as it also covers references beyond 512 Mb
 	strcpy(fnidx, fn);
-	strcat(fnidx, ".bai");
-	fp = fopen(fnidx, "rb");
+	strcat(fnidx, ".csi");
+	raw = bam_index_read_file(fnidx, &l_raw);
+
+	// try "{fn}.bai"
+	if (raw == 0)
+	{
+		strcpy(fnidx, fn);
+		strcat(fnidx, ".bai");
+		raw = bam_index_read_file(fnidx, &l_raw);
+	}
 
 	// try "{base}.bai"
-	if (fp == 0)
+	if (raw == 0)
 	{
 		char *s = strstr(fn, "bam");
 
@@ -212,19 +795,15 @@ bam_index_t *bam_index_load_local(const char *_fn)
 		{
 			strcpy(fnidx, fn);
 			fnidx[strlen(fn)-1] = 'i';
-			fp = fopen(fnidx, "rb");
+			raw = bam_index_read_file(fnidx, &l_raw);
 		}
 	}
 
 	free(fnidx);
 	free(fn);
 
-	if (fp)
-	{
-		bam_index_t *idx = bam_index_load_core(fp);
-		fclose(fp);
-		return idx;
-	}
+	if (raw)
+		return bam_index_load_core(raw, l_raw);
 	else
 		return 0;
 }
@@ -241,34 +820,45 @@ bam_index_t *bam_index_load(const char *fn)
 	return idx;
 }
 
-static inline int reg2bins(unsigned int beg, unsigned int end, unsigned short list[BAM_MAX_BIN])
+static int reg2bins(long long beg, long long end, int min_shift, int n_lvls, unsigned int **list, int *m_list)
 {
 	int i = 0;
-	int k;
+	int l;
+	int s;
+	long long t;
+	long long b;
+	long long e;
+	long long k;
 
 	if (beg >= end)
 		return 0;
 
-	if (end >= 1u << 29)
-		end = 1u << 29;
+	s = min_shift + 3 * n_lvls;
 
-	--end;
-	list[i++] = 0;
+	if (end >= 1LL << s)
+		end = 1LL << s;
 
-	for (k=1+(beg>>26); k <= 1 + (end >> 26); ++k)
-		list[i++] = k;
+	--end;
 
-	for (k=9+(beg>>23); k <= 9 + (end >> 23); ++k)
-		list[i++] = k;
+	// one run of bins per level, from the root down to the smallest bins
+	for (l=0, t=0; l <= n_lvls; s -= 3, t += 1LL << (3 * l), ++l)
+	{
+		b = t + (beg >> s);
+		e = t + (end >> s);
 
-	for (k=73+(beg>>20); k <= 73 + (end >> 20); ++k)
-		list[i++] = k;
+		if (b > e)
+			continue;
 
-	for (k=585+(beg>>17); k <= 585 + (end >> 17); ++k)
-		list[i++] = k;
+		if (i + (e - b + 1) > *m_list)
+		{
+			*m_list = i + (int)(e - b + 1);
+			kroundup32(*m_list);
+			*list = (unsigned int*)realloc(*list, *m_list * sizeof(unsigned int));
+		}
 
-	for (k=4681+(beg>>14); k <= 4681 + (end >> 14); ++k)
-		list[i++] = k;
+		for (k=b; k <= e; ++k)
+			(*list)[i++] = (unsigned int)k;
+	}
 
 	return i;
 }
@@ -281,36 +871,46 @@ static inline int is_overlap(unsigned int beg, unsigned int end, const bam1_t *b
 	return ((rend > beg) && (rbeg < end));
 }
 
-// bam_fetch helper function retrieves
-bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
+// append the chunks of the index that may hold alignments overlapping tid:beg-end
+static void iter_add_region(const bam_index_t *idx, int tid, int beg, int end, unsigned int **bins, int *m_bins, pair64_t **off, int *n_off, int *m_off)
 {
-	unsigned short *bins;
 	int i;
+	int j;
 	int n_bins;
-	int n_off;
-	pair64_t *off;
 	khint_t k;
 	khash_t(i) *index;
 	unsigned long long min_off;
-	bam_iter_t iter = 0;
 
-	if (beg < 0)
-		beg = 0;
+	n_bins = reg2bins(beg, end, idx->min_shift, idx->n_lvls, bins, m_bins);
+	index = idx->index[tid];
 
-	if (end < beg)
-		return 0;
+	if (idx->is_csi)
+	{
+		// the smallest bin at beg holding data, or failing that its nearest left sibling or ancestor
+		unsigned int bin;
+		unsigned int first;
 
-	// initialize iter
-	iter = (bam_iter_t)calloc(1, sizeof(struct __bam_iter_t));
-	iter->tid = tid, iter->beg = beg, iter->end = end;
-	iter->i = -1;
-	
-	//
-	bins = (unsigned short*)calloc(BAM_MAX_BIN, 2);
-	n_bins = reg2bins(beg, end, bins);
-	index = idx->index[tid];
+		min_off = 0;
+		if ((long long)beg < (1LL << (idx->min_shift + 3 * idx->n_lvls)))
+		{
+			bin = (((1LL << (3 * idx->n_lvls)) - 1) / 7) + (beg >> idx->min_shift);
+			k = kh_get(i, index, bin);
 
-	if (idx->index2[tid].n > 0)
+			while ((k == kh_end(index)) && (bin > 0))
+			{
+				first = (((bin - 1) >> 3) << 3) + 1;
+				if (bin > first)
+					--bin;
+				else
+					bin = (bin - 1) >> 3;
+				k = kh_get(i, index, bin);
+			}
+
+			if (k != kh_end(index))
+				min_off = kh_value(index, k).loff;
+		}
+	}
+	else if (idx->index2[tid].n > 0)
 	{
 		min_off = ((beg >> BAM_LIDX_SHIFT) >= idx->index2[tid].n) ? idx->index2[tid].offset[idx->index2[tid].n-1] : idx->index2[tid].offset[beg>>BAM_LIDX_SHIFT];
 
@@ -334,75 +934,114 @@ bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
 	else
 		min_off = 0;
 
-	for (i=n_off = 0; i < n_bins; ++i)
+	for (i=0; i < n_bins; ++i)
 	{
-		if ((k = kh_get(i, index, bins[i])) != kh_end(index))
-			n_off += kh_value(index, k).n;
-	}
-
-	if (n_off == 0)
-	{
-		free(bins);
-		return iter;
-	}
-
-	off = (pair64_t*)calloc(n_off, 16);
-	for (i=n_off = 0; i < n_bins; ++i)
-	{
-		if ((k = kh_get(i, index, bins[i])) != kh_end(index))
+		if ((k = kh_get(i, index, (*bins)[i])) != kh_end(index))
 		{
-			int j;
 			bam_binlist_t *p = &kh_value(index, k);
+
+			if (*n_off + p->n > *m_off)
+			{
+				*m_off = *n_off + p->n;
+				kroundup32(*m_off);
+				*off = (pair64_t*)realloc(*off, *m_off * 16);
+			}
+
 			for (j=0; j < p->n; ++j)
 				if (p->list[j].v > min_off)
-					off[n_off++] = p->list[j];
+					(*off)[(*n_off)++] = p->list[j];
 		}
 	}
+}
+
+// bam_fetch helper function retrieves
+bam_iter_t bam_iter_query(const bam_index_t *idx, int tid, int beg, int end)
+{
+	return bam_iter_query_multi(idx, tid, 1, &beg, &end);
+}
+
+bam_iter_t bam_iter_query_multi(const bam_index_t *idx, int tid, int n, const int *begs, const int *ends)
+{
+	unsigned int *bins = 0;
+	int m_bins = 0;
+	int i;
+	int l;
+	int r;
+	int beg;
+	int n_off = 0;
+	int m_off = 0;
+	pair64_t *off = 0;
+	bam_iter_t iter = 0;
+
+	// initialize iter
+	iter = (bam_iter_t)calloc(1, sizeof(struct __bam_iter_t));
+	iter->tid = tid, iter->beg = INT_MAX, iter->end = 0;
+	iter->i = -1;
+
+	bam_index_load_tid(idx, tid);
+
+	// the chunks of all regions are pooled so that no block is read twice
+	for (r=0; r < n; ++r)
+	{
+		beg = begs[r] < 0 ? 0 : begs[r];
+
+		if (ends[r] < beg)
+			continue;
+
+		if (beg < iter->beg)
+			iter->beg = beg;
+		if (ends[r] > iter->end)
+			iter->end = ends[r];
+
+		iter_add_region(idx, tid, beg, ends[r], &bins, &m_bins, &off, &n_off, &m_off);
+	}
 
 	free(bins);
 
+	if (iter->beg > iter->end)
+	{
+		free(off);
+		free(iter);
+		return 0;
+	}
+
 	if (n_off == 0)
 	{
 		free(off);
 		return iter;
 	}
-	{
-		bam1_t *b = (bam1_t*)calloc(1, sizeof(bam1_t));
-		int l;
-		ks_introsort(off, n_off, off);
 
-		// resolve completely contained adjacent blocks
-		for (i=1, l=0; i < n_off; ++i)
-			if (off[l].v < off[i].v)
-				off[++l] = off[i];
+	ks_introsort(off, n_off, off);
 
-		n_off = l + 1;
+	// resolve completely contained adjacent blocks
+	for (i=1, l=0; i < n_off; ++i)
+		if (off[l].v < off[i].v)
+			off[++l] = off[i];
 
-		// resolve overlaps between adjacent blocks
-		// this may happen due to the merge in indexing
-		for (i = 1; i < n_off; ++i)
-			if (off[i-1].v >= off[i].u)
-				off[i-1].v = off[i].u;
-		{
-			// merge adjacent blocks
+	n_off = l + 1;
+
+	// resolve overlaps between adjacent blocks
+	// this may happen due to the merge in indexing
+	for (i = 1; i < n_off; ++i)
+		if (off[i-1].v >= off[i].u)
+			off[i-1].v = off[i].u;
+
+	// merge adjacent blocks
 #if defined(BAM_TRUE_OFFSET) || defined(BAM_VIRTUAL_OFFSET16)
-			for (i=1, l=0; i < n_off; ++i)
-			{
+	for (i=1, l=0; i < n_off; ++i)
+	{
 #ifdef BAM_TRUE_OFFSET
-				if (off[l].v + BAM_MIN_CHUNK_GAP > off[i].u)
-					off[l].v = off[i].v;
+		if (off[l].v + BAM_MIN_CHUNK_GAP > off[i].u)
+			off[l].v = off[i].v;
 #else
-				if ((off[l].v >> 16) == (off[i].u >> 16))
-					off[l].v = off[i].v;
+		if ((off[l].v >> 16) == (off[i].u >> 16))
+			off[l].v = off[i].v;
 #endif
-				else
-					off[++l] = off[i];
-			}
-			n_off = l + 1;
-#endif
-		}
-		bam_destroy1(b);
+		else
+			off[++l] = off[i];
 	}
+	n_off = l + 1;
+#endif
 
 	iter->n_off = n_off;
 	iter->off = off;
@@ -24,6 +24,7 @@ typedef struct __linkbuf_t
 	unsigned int beg;
 	unsigned int end;
 	cstate_t s;
+	int aux;
 	struct __linkbuf_t *next;
 } lbnode_t;
 
@@ -341,7 +342,10 @@ const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 
 				// actually always true...
 				if (resolve_cigar2(iter->plp + n_plp, iter->pos, &p->s))
+				{
+					iter->plp[n_plp].aux = p->aux;
 					++n_plp;
+				}
 			}
 		}
 
@@ -392,6 +396,11 @@ const bam_pileup1_t *bam_plp_next(bam_plp_t iter, int *_tid, int *_pos, int *_n_
 }
 
 int bam_plp_push(bam_plp_t iter, const bam1_t *b)
+{
+	return bam_plp_push_aux(iter, b, 0);
+}
+
+int bam_plp_push_aux(bam_plp_t iter, const bam1_t *b, int aux)
 {
 	if (iter->error)
 		return -1;
@@ -411,6 +420,7 @@ int bam_plp_push(bam_plp_t iter, const bam1_t *b)
 		iter->tail->beg = b->core.pos;
 		iter->tail->end = bam_calend(&b->core, bam1_cigar(b));
 		iter->tail->s = g_cstate_null;
+		iter->tail->aux = aux;
 
 		// initialize cstate_t
 		iter->tail->s.end = iter->tail->end - 1;
@@ -463,6 +473,11 @@ void bam_plbuf_destroy(bam_plbuf_t *buf)
 }
 
 int bam_plbuf_push(const bam1_t *b, bam_plbuf_t *buf)
+{
+	return bam_plbuf_push_aux(b, buf, 0);
+}
+
+int bam_plbuf_push_aux(const bam1_t *b, bam_plbuf_t *buf, int aux)
 {
 	int ret;
 	int n_plp;
@@ -470,7 +485,7 @@ int bam_plbuf_push(const bam1_t *b, bam_plbuf_t *buf)
 	int pos;
 	const bam_pileup1_t *plp;
 
-	ret = bam_plp_push(buf->iter, b);
+	ret = bam_plp_push_aux(buf->iter, b, aux);
 
 	if (ret < 0)
 		return ret;
@@ -249,20 +249,13 @@ BGZF *bgzf_fdopen(int fd, const char * __restrict mode)
         return NULL;
 }
 
-// Deflate the block in fp->uncompressed_block into fp->compressed_block.
-// Also adds an extra field that stores the compressed block length.
-static int deflate_block(BGZF *fp, int block_length)
+int bgzf_compress(void *dst, int *dlen, const void *src, int slen, int level)
 {
-    bgzf_byte_t *buffer;
-    int buffer_size;
-    int input_length;
+    bgzf_byte_t *buffer = (bgzf_byte_t*)dst;
     int compressed_length;
     int status;
-    int remaining;
     unsigned int crc;
-
-    buffer = (bgzf_byte_t*)fp->compressed_block;
-    buffer_size = fp->compressed_block_size;
+    z_stream zs;
 
     // Init gzip header
     buffer[0] = GZIP_ID1;
@@ -284,68 +277,73 @@ static int deflate_block(BGZF *fp, int block_length)
     buffer[16] = 0; // placeholder for block length
     buffer[17] = 0;
 
+    zs.zalloc = NULL;
+    zs.zfree = NULL;
+    zs.next_in = (Bytef*)src;
+    zs.avail_in = slen;
+    zs.next_out = (Bytef*)&buffer[BLOCK_HEADER_LENGTH];
+    zs.avail_out = bgzf_min(*dlen, MAX_BLOCK_SIZE) - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+    status = deflateInit2(&zs, level, Z_DEFLATED, GZIP_WINDOW_BITS, Z_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (status != Z_OK)
+        return -1;
+    status = deflate(&zs, Z_FINISH);
+    if (status != Z_STREAM_END)
+    {
+        deflateEnd(&zs);
+        // Not enough space in buffer.
+        return (status == Z_OK) ? 1 : -1;
+    }
+    if (deflateEnd(&zs) != Z_OK)
+        return -1;
+
+    compressed_length = zs.total_out + BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
+    packInt16((unsigned char*)&buffer[16], compressed_length-1);
+    crc = crc32(0L, NULL, 0L);
+    crc = crc32(crc, (Bytef*)src, slen);
+    packInt32((unsigned char*)&buffer[compressed_length-8], crc);
+    packInt32((unsigned char*)&buffer[compressed_length-4], slen);
+    *dlen = compressed_length;
+
+    return 0;
+}
+
+// Deflate the block in fp->uncompressed_block into fp->compressed_block.
+// Also adds an extra field that stores the compressed block length.
+static int deflate_block(BGZF *fp, int block_length)
+{
+    int input_length;
+    int compressed_length;
+    int status;
+    int remaining;
+
     // loop to retry for blocks that do not compress enough
     input_length = block_length;
-    compressed_length = 0;
 
     while (1)
     {
-        z_stream zs;
-        zs.zalloc = NULL;
-        zs.zfree = NULL;
-        zs.next_in = (Bytef*)fp->uncompressed_block;
-        zs.avail_in = input_length;
-        zs.next_out = (Bytef*)&buffer[BLOCK_HEADER_LENGTH];
-        zs.avail_out = buffer_size - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
-        status = deflateInit2(&zs, fp->compress_level, Z_DEFLATED, GZIP_WINDOW_BITS, Z_DEFAULT_MEM_LEVEL, Z_DEFAULT_STRATEGY);
-        if (status != Z_OK)
+        compressed_length = fp->compressed_block_size;
+        status = bgzf_compress(fp->compressed_block, &compressed_length, fp->uncompressed_block, input_length, fp->compress_level);
+        if (status == 1)
         {
-            report_error(fp, "deflate init failed");
-            return -1;
-        }
-        status = deflate(&zs, Z_FINISH);
-        if (status != Z_STREAM_END)
-        {
-            deflateEnd(&zs);
-            if (status == Z_OK)
+            // Can happen in the rare case the input doesn't compress enough.
+            // Reduce the amount of input until it fits.
+            input_length -= 1024;
+            if (input_length <= 0)
             {
-                // Not enough space in buffer.
-                // Can happen in the rare case the input doesn't compress enough.
-                // Reduce the amount of input until it fits.
-                input_length -= 1024;
-                if (input_length <= 0)
-                {
-                    // should never happen
-                    report_error(fp, "input reduction failed");
-                    return -1;
-                }
-                continue;
+                // should never happen
+                report_error(fp, "input reduction failed");
+                return -1;
             }
-            report_error(fp, "deflate failed");
-            return -1;
+            continue;
         }
-        status = deflateEnd(&zs);
-        if (status != Z_OK)
+        if (status != 0)
         {
-            report_error(fp, "deflate end failed");
-            return -1;
-        }
-        compressed_length = zs.total_out;
-        compressed_length += BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH;
-        if (compressed_length > MAX_BLOCK_SIZE)
-        {
-            // should never happen
-            report_error(fp, "deflate overflow");
+            report_error(fp, "deflate failed");
             return -1;
         }
         break;
     }
 
-    packInt16((unsigned char*)&buffer[16], compressed_length-1);
-    crc = crc32(0L, NULL, 0L);
-    crc = crc32(crc, (Bytef*)fp->uncompressed_block, input_length);
-    packInt32((unsigned char*)&buffer[compressed_length-8], crc);
-    packInt32((unsigned char*)&buffer[compressed_length-4], input_length);
     remaining = block_length - input_length;
     if (remaining > 0)
     {
@@ -102,6 +102,15 @@ int bgzf_read(BGZF *fp, void *data, int length);
  */
 int bgzf_write(BGZF *fp, const void *data, int length);
 
+/*
+ * Compress slen bytes from src into a complete BGZF block at dst, which
+ * holds *dlen bytes; *dlen is set to the length of the block.  Does not
+ * touch any BGZF stream, so blocks may be compressed in parallel.
+ * Returns zero on success, 1 if the block does not fit in dst.
+ * Returns -1 on error.
+ */
+int bgzf_compress(void *dst, int *dlen, const void *src, int slen, int level);
+
 /*
  * Return a virtual file pointer to the current location in the file.
  * No interpetation of the value should be made, other than a subsequent
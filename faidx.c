@@ -39,6 +39,9 @@ struct __faidx_t
     int n, m;
     char **name;
     khash_t(s) *hash;
+    char *text;            // contents of the .fai file
+    size_t l_text;
+    size_t parsed;         // bytes of text already entered into the hash
 };
 
 #ifndef kroundup32
@@ -193,11 +196,15 @@ faidx_t *fai_build_core(RAZF *rz)
     return idx;
 }
 
+static void fai_parse_all(const faidx_t *fai);
+
 void fai_save(const faidx_t *fai, FILE *fp)
 {
     khint_t k;
     int i;
 
+    fai_parse_all(fai);
+
     for (i=0; i < fai->n; ++i)
     {
         faidx1_t x;
@@ -214,8 +221,36 @@ void fai_save(const faidx_t *fai, FILE *fp)
 faidx_t *fai_read(FILE *fp)
 {
     faidx_t *fai;
-    char *buf;
+    size_t m_text;
+    size_t n;
+
+    fai = (faidx_t*)calloc(1, sizeof(faidx_t));
+    fai->hash = kh_init(s);
+
+    // lines are only parsed when fai_lookup() reaches them
+    m_text = 0x10000;
+    fai->text = (char*)malloc(m_text + 1);
+
+    while ((n = fread(fai->text + fai->l_text, 1, m_text - fai->l_text, fp)) > 0)
+    {
+        fai->l_text += n;
+        if (fai->l_text == m_text)
+        {
+            m_text <<= 1;
+            fai->text = (char*)realloc(fai->text, m_text + 1);
+        }
+    }
+
+    fai->text[fai->l_text] = 0;
+
+    return fai;
+}
+
+static int fai_parse_next(faidx_t *fai)
+{
     char *p;
+    char *q;
+    char *eol;
     int len;
     int line_len;
     int line_blen;
@@ -225,26 +260,67 @@ faidx_t *fai_read(FILE *fp)
     long long offset;
 #endif
 
-    fai = (faidx_t*)calloc(1, sizeof(faidx_t));
-    fai->hash = kh_init(s);
-    buf = (char*)calloc(0x10000, 1);
+    p = fai->text + fai->parsed;
+    eol = strchr(p, '\n');
 
-    while (!feof(fp) && fgets(buf, 0x10000, fp))
+    if (eol)
     {
-        for (p=buf; *p && isgraph(*p); ++p);
-        *p = 0;
-        ++p;
+        *eol = 0;
+        fai->parsed = eol - fai->text + 1;
+    }
+    else
+        fai->parsed = fai->l_text;
+
+    for (q=p; *q && isgraph(*q); ++q);
+
+    // skip blank lines
+    if (q == p)
+        return -1;
+
+    if (*q)
+        *q++ = 0;
+
 #ifdef _WIN32
-        sscanf(p, "%d%ld%d%d", &len, &offset, &line_blen, &line_len);
+    sscanf(q, "%d%ld%d%d", &len, &offset, &line_blen, &line_len);
 #else
-        sscanf(p, "%d%lld%d%d", &len, &offset, &line_blen, &line_len);
+    sscanf(q, "%d%lld%d%d", &len, &offset, &line_blen, &line_len);
 #endif
-        fai_insert_index(fai, buf, len, line_len, line_blen, offset);
+    fai_insert_index(fai, p, len, line_len, line_blen, offset);
+
+    return fai->n - 1;
+}
+
+static int fai_lookup(const faidx_t *fai, const char *name, faidx1_t *val)
+{
+    khint_t k;
+    int i;
+    faidx_t *idx = (faidx_t*)fai;
+
+    k = kh_get(s, idx->hash, name);
+
+    // enter index lines in file order only until the requested one is found
+    if (k == kh_end(idx->hash))
+    {
+        while (idx->parsed < idx->l_text)
+            if (((i = fai_parse_next(idx)) >= 0) && (strcmp(idx->name[i], name) == 0))
+                break;
+
+        k = kh_get(s, idx->hash, name);
+        if (k == kh_end(idx->hash))
+            return -1;
     }
 
-    free(buf);
+    *val = kh_value(idx->hash, k);
 
-    return fai;
+    return 0;
+}
+
+static void fai_parse_all(const faidx_t *fai)
+{
+    faidx_t *idx = (faidx_t*)fai;
+
+    while (idx->parsed < idx->l_text)
+        fai_parse_next(idx);
 }
 
 void fai_destroy(faidx_t *fai)
@@ -255,6 +331,7 @@ void fai_destroy(faidx_t *fai)
         free(fai->name[i]);
 
     free(fai->name);
+    free(fai->text);
     kh_destroy(s, fai->hash);
 
     if (fai->rz)
@@ -345,14 +422,11 @@ char *fai_fetch(const faidx_t *fai, const char *str, int *len)
     char *s, c;
 	int i, l, k;
 	int name_end;
-    khiter_t iter;
     faidx1_t val;
-    khash_t(s) *h;
     int beg;
     int end;
 
     beg = end = -1;
-    h = fai->hash;
     name_end = l = strlen(str);
     s = (char*)malloc(l+1);
 
@@ -391,14 +465,12 @@ char *fai_fetch(const faidx_t *fai, const char *str, int *len)
             name_end = l;
 
         s[name_end] = 0;
-        iter = kh_get(s, h, s);
 
         // cannot find the sequence name
-        if (iter == kh_end(h))
+        if (fai_lookup(fai, s, &val) < 0)
         {
             //try str as the name
-            iter = kh_get(s, h, str);
-            if (iter == kh_end(h))
+            if (fai_lookup(fai, str, &val) < 0)
             {
                 *len = 0;
                 free(s);
@@ -411,9 +483,12 @@ char *fai_fetch(const faidx_t *fai, const char *str, int *len)
             }
         }
     }
-    else
-        iter = kh_get(s, h, str);
-    val = kh_value(h, iter);
+    else if (fai_lookup(fai, str, &val) < 0)
+    {
+        *len = 0;
+        free(s);
+        return 0;
+    }
 
     // parse the interval
     if (name_end < l)
@@ -468,6 +543,8 @@ char *fai_fetch(const faidx_t *fai, const char *str, int *len)
 
 int faidx_fetch_nseq(const faidx_t *fai)
 {
+    fai_parse_all(fai);
+
     return fai->n;
 }
 
@@ -475,18 +552,13 @@ char *faidx_fetch_seq(const faidx_t *fai, char *c_name, int p_beg_i, int p_end_i
 {
     int l;
     char c;
-    khiter_t iter;
     faidx1_t val;
     char *seq = NULL;
 
     // Adjust position
-    iter = kh_get(s, fai->hash, c_name);
-
-    if (iter == kh_end(fai->hash))
+    if (fai_lookup(fai, c_name, &val) < 0)
         return 0;
 
-    val = kh_value(fai->hash, iter);
-
     if (p_end_i < p_beg_i)
         p_beg_i = p_end_i;
 
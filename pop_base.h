@@ -1,7 +1,35 @@
 #include "popbam.h"
 #include "tables.h"
 
-template <class T> unsigned long long* callBase(T *t, int n, const bam_pileup1_t *pl)
+/*! \def PICK_PILEUP(func, flag)
+ *  \brief Select the instantiation of a pileup callback matching the option flags
+ */
+#define PICK_PILEUP(func, flag) \
+	(((flag) & BAM_HAPLOID) ? PICK_PILEUP_QUAL(func, flag, BAM_HAPLOID) : \
+	 ((flag) & BAM_DIPLOID) ? PICK_PILEUP_QUAL(func, flag, BAM_DIPLOID) : PICK_PILEUP_QUAL(func, flag, 0))
+
+/*! \def PICK_PILEUP_QUAL(func, flag, f)
+ *  \brief Add the quality encoding to the flags of a pileup callback
+ */
+#define PICK_PILEUP_QUAL(func, flag, f) \
+	(((flag) & BAM_ILLUMINA) ? PICK_PILEUP_HET(func, flag, (f) | BAM_ILLUMINA) : PICK_PILEUP_HET(func, flag, f))
+
+/*! \def PICK_PILEUP_HET(func, flag, f)
+ *  \brief Add heterozygote handling to the flags of a pileup callback
+ */
+#define PICK_PILEUP_HET(func, flag, f) \
+	(((flag) & BAM_HETEROZYGOTE) ? func<(f) | BAM_HETEROZYGOTE> : func<f>)
+
+/*!
+ * \fn unsigned long long *callBase(T *t, int n, const bam_pileup1_t *pl)
+ * \brief Calls the base from the pileup at each position
+ * \tparam F    Option flags the caller was compiled for
+ * \param t     Pointer to the analysis data structure
+ * \param n     The number of reads in the pileup
+ * \param pl    Pointer to the pileup
+ * \return      Pointer to the consensus base call information for the individuals
+ */
+template <unsigned int F, class T> unsigned long long* callBase(T *t, int n, const bam_pileup1_t *pl)
 {
 	int i = 0;
 	int j = 0;
@@ -12,16 +40,22 @@ template <class T> unsigned long long* callBase(T *t, int n, const bam_pileup1_t
 	int si = -1;
 	int rmsq = 0;
 	int n_smpl = t->sm->n;
+	const int ploidy = (F & BAM_HAPLOID) ? 1 : 2;
 	unsigned short k = 0;
 	unsigned short *bases = nullptr;
 	unsigned long long rms = 0;
 	unsigned long long *cb;
 	std::vector<int> depth(n_smpl, 0);
-	unsigned char *s = nullptr;
 	float q[16];
-	std::string msg;
 	bam_pileup1_t ***p = nullptr;
-	kstring_t buf;
+
+	// calls replayed from a genotype cache need no pileup
+	if (t->cached)
+	{
+		cb = new unsigned long long [n_smpl];
+		std::copy(t->cached, t->cached + n_smpl, cb);
+		return cb;
+	}
 
 	// allocate memory pileup data
 	try
@@ -36,30 +70,13 @@ template <class T> unsigned long long* callBase(T *t, int n, const bam_pileup1_t
 		std::cerr << "bad_alloc caught: " << ba.what() << std::endl;
 	}
 
-	memset(&buf, 0, sizeof(kstring_t));
-
-	// partition pileup according to sample
+	// partition pileup according to sample id assigned when the read was fetched
 	for (i = 0; i < n; i++)
 	{
 		if ((pl+i)->is_del || (pl+i)->is_refskip || ((pl+i)->b->core.flag & BAM_FUNMAP))
 			continue;
-		s = bam_aux_get((pl+i)->b, "RG");
 
-		// skip reads with no read group tag
-		if (!s)
-			continue;
-		else
-			si = bam_smpl_rg2smid(t->sm, t->bamfile.c_str(), (char*)(s+1), &buf);
-		if (si < 0)
-			si = bam_smpl_rg2smid(t->sm, t->bamfile.c_str(), 0, &buf);
-
-		if (si < 0)
-		{
-			free(buf.s);
-			std::string rogue_rg(bam_aux2Z(s));
-			msg = "Problem assigning read group " + rogue_rg + " to a sample.\nPlease check BAM header for correct SM and PO tags";
-			fatalError(msg);
-		}
+		si = (pl+i)->aux;
 
 		if (depth[si] < t->maxDepth)
 		{
@@ -89,7 +106,7 @@ template <class T> unsigned long long* callBase(T *t, int n, const bam_pileup1_t
 			{
 				tmp_baseQ = bam1_qual(p[j][i]->b)[p[j][i]->qpos];
 
-				if (t->flag & BAM_ILLUMINA)
+				if (F & BAM_ILLUMINA)
 					baseQ = tmp_baseQ > 31 ? tmp_baseQ - 31 : 0;
 				else
 					baseQ = tmp_baseQ;
@@ -117,13 +134,13 @@ template <class T> unsigned long long* callBase(T *t, int n, const bam_pileup1_t
 			}
 
 			// calculate genotype likelihoods
-			errmod_cal(t->em, k, NBASES, bases, q);
+			errmod_cal<ploidy>(t->em, k, NBASES, bases, q);
 
 			// finalize root mean quality score
 			rms = (unsigned long long)(sqrt((float)(rmsq) / k) + 0.499);
 
 			// get consensus base call
-			cb[j] = gl2cns(q, k);
+			cb[j] = gl2cns<ploidy>(q, k);
 
 			// add root-mean map quality score to cb array
 			cb[j] |= rms << (CHAR_BIT * 6);
@@ -140,7 +157,6 @@ template <class T> unsigned long long* callBase(T *t, int n, const bam_pileup1_t
 	for (i = 0; i < n_smpl; i++)
 		delete [] p[i];
 	delete [] p;
-	free(buf.s);
 
 	return cb;
 }
@@ -0,0 +1,411 @@
+/** \file pop_cache.cpp
+ *  \brief Functions for writing and reading genotype caches
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "popbam.h"
+
+///
+/// Definitions
+///
+
+/*! \def CACHE_MAGIC
+ *  \brief First bytes of a genotype cache
+ */
+#define CACHE_MAGIC "PGC\1"
+
+/*! \def INDEX_MAGIC
+ *  \brief First bytes of the index of a genotype cache
+ */
+#define INDEX_MAGIC "PGI\1"
+
+/*!
+ * \fn static void packInt(unsigned char *buf, unsigned long long v, int bytes)
+ * \brief Stores an integer in little-endian byte order
+ */
+static void packInt(unsigned char *buf, unsigned long long v, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		buf[i] = (v >> (CHAR_BIT * i)) & 0xff;
+}
+
+/*!
+ * \fn static unsigned long long unpackInt(const unsigned char *buf, int bytes)
+ * \brief Reads an integer stored in little-endian byte order
+ */
+static unsigned long long unpackInt(const unsigned char *buf, int bytes)
+{
+	unsigned long long v = 0;
+
+	for (int i = 0; i < bytes; i++)
+		v |= (unsigned long long)buf[i] << (CHAR_BIT * i);
+
+	return v;
+}
+
+static int writeInt(BGZF *fp, int v)
+{
+	unsigned char buf[4];
+
+	packInt(buf, (unsigned int)v, 4);
+	return (bgzf_write(fp, buf, 4) == 4) ? 0 : -1;
+}
+
+static int readInt(BGZF *fp, int *v)
+{
+	unsigned char buf[4];
+
+	if (bgzf_read(fp, buf, 4) != 4)
+		return -1;
+	*v = (int)unpackInt(buf, 4);
+	return 0;
+}
+
+genoCache::genoCache(void)
+{
+	flag = 0;
+	nsmpl = 0;
+	fp = nullptr;
+	writing = false;
+	tid = -1;
+	last = -1;
+	iblock = 0;
+	isite = 0;
+	done = true;
+	qtid = -1;
+	qend = 0;
+}
+
+genoCache::~genoCache(void)
+{
+	close();
+}
+
+bool genoCache::isCache(const std::string &fn)
+{
+	char magic[4];
+	BGZF *in = bgzf_open(fn.c_str(), "r");
+	bool found = false;
+
+	if (!in)
+		return false;
+
+	found = (bgzf_read(in, magic, 4) == 4) && (memcmp(magic, CACHE_MAGIC, 4) == 0);
+	bgzf_close(in);
+
+	return found;
+}
+
+int genoCache::create(const std::string &fn, const popbamOptions *p, int n)
+{
+	cachefile = fn;
+	fp = bgzf_open(fn.c_str(), "w");
+	if (!fp)
+		return -1;
+
+	writing = true;
+	flag = p->flag & (BAM_ILLUMINA | BAM_HAPLOID);
+	nsmpl = n;
+	tid = -1;
+	last = -1;
+
+	// the headers of the input files define the samples and the reference sequences
+	if ((bgzf_write(fp, CACHE_MAGIC, 4) != 4) || (writeInt(fp, flag) < 0) || (writeInt(fp, nsmpl) < 0) ||
+		(writeInt(fp, p->bamfiles.size()) < 0))
+		return -1;
+
+	for (size_t i = 0; i < p->bamfiles.size(); i++)
+	{
+		if ((writeInt(fp, p->bamfiles[i].size()) < 0) ||
+			(bgzf_write(fp, p->bamfiles[i].c_str(), p->bamfiles[i].size()) != (int)p->bamfiles[i].size()) ||
+			(bam_header_write(fp, p->bam_in[i]->header) < 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+int genoCache::push(int t, int p, const unsigned long long *cb)
+{
+	// target regions may overlap, so a site may be called more than once
+	if ((t == tid) && (p <= last))
+		return 0;
+
+	if (!pos.empty() && ((t != tid) || (pos.size() == CACHE_CHUNK)))
+		if (writeBlock() < 0)
+			return -1;
+
+	tid = t;
+	last = p;
+	pos.push_back(p);
+	calls.insert(calls.end(), cb, cb + nsmpl);
+
+	return 0;
+}
+
+int genoCache::writeBlock(void)
+{
+	int n = pos.size();
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	unsigned char *b = nullptr;
+	cacheBlock_t e;
+
+	e.tid = tid;
+	e.beg = pos.front();
+	e.end = pos.back() + 1;
+	e.offset = bgzf_tell(fp);
+	index.push_back(e);
+
+	// the block holds its reference sequence and number of sites, the
+	// distances between sites, and then the calls of each sample; every
+	// field is split into byte planes, so that the high bytes of the
+	// distances and the quality fields of the calls form long runs
+	packed.assign(8 + 4 * n + 8 * n * nsmpl, 0);
+	b = &packed[0];
+	packInt(b, (unsigned int)tid, 4);
+	packInt(b + 4, (unsigned int)n, 4);
+	b += 8;
+
+	for (k = 0; k < 4; k++, b += n)
+		for (i = 0; i < n; i++)
+			b[i] = ((unsigned int)(pos[i] - (i ? pos[i-1] : 0)) >> (CHAR_BIT * k)) & 0xff;
+
+	for (j = 0; j < nsmpl; j++)
+		for (k = 0; k < 8; k++, b += n)
+			for (i = 0; i < n; i++)
+				b[i] = (calls[i*nsmpl+j] >> (CHAR_BIT * k)) & 0xff;
+
+	pos.clear();
+	calls.clear();
+
+	return (bgzf_write(fp, &packed[0], packed.size()) == (int)packed.size()) ? 0 : -1;
+}
+
+int genoCache::open(const std::string &fn)
+{
+	int i = 0;
+	int l = 0;
+	int nfiles = 0;
+	char magic[4];
+	unsigned char buf[20];
+	std::string idxfile = fn + ".pgi";
+	FILE *fpidx = nullptr;
+	cacheBlock_t e;
+
+	cachefile = fn;
+	fp = bgzf_open(fn.c_str(), "r");
+	if (!fp)
+		return -1;
+
+	writing = false;
+	if ((bgzf_read(fp, magic, 4) != 4) || (memcmp(magic, CACHE_MAGIC, 4) != 0) ||
+		(readInt(fp, &i) < 0) || (readInt(fp, &nsmpl) < 0) || (readInt(fp, &nfiles) < 0))
+		return -1;
+	flag = i;
+
+	for (i = 0; i < nfiles; i++)
+	{
+		if ((readInt(fp, &l) < 0) || (l < 0))
+			return -1;
+
+		std::string name(l, '\0');
+		if ((bgzf_read(fp, &name[0], l) != l))
+			return -1;
+
+		bam_header_t *h = bam_header_read(fp);
+		if (!h)
+			return -1;
+
+		files.push_back(name);
+		headers.push_back(h);
+	}
+
+	// load the index of the blocks
+	fpidx = fopen(idxfile.c_str(), "rb");
+	if (!fpidx)
+	{
+		std::cerr << "No index for genotype cache " << fn << std::endl;
+		return -1;
+	}
+
+	if ((fread(buf, 1, 8, fpidx) != 8) || (memcmp(buf, INDEX_MAGIC, 4) != 0))
+	{
+		fclose(fpidx);
+		return -1;
+	}
+
+	l = (int)unpackInt(buf + 4, 4);
+	for (i = 0; i < l; i++)
+	{
+		if (fread(buf, 1, 20, fpidx) != 20)
+		{
+			fclose(fpidx);
+			return -1;
+		}
+		e.tid = (int)unpackInt(buf, 4);
+		e.beg = (int)unpackInt(buf + 4, 4);
+		e.end = (int)unpackInt(buf + 8, 4);
+		e.offset = unpackInt(buf + 12, 8);
+		index.push_back(e);
+	}
+	fclose(fpidx);
+
+	iblock = index.size();
+
+	return 0;
+}
+
+int genoCache::readBlock(size_t blk)
+{
+	int n = 0;
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	unsigned char head[8];
+	const unsigned char *b = nullptr;
+
+	// consecutive blocks are read without seeking
+	if ((iblock + 1 != blk) && (bgzf_seek(fp, index[blk].offset, SEEK_SET) < 0))
+		return -2;
+
+	if (bgzf_read(fp, head, 8) != 8)
+		return -2;
+
+	n = (int)unpackInt(head + 4, 4);
+	packed.resize(4 * n + 8 * n * nsmpl);
+	if (bgzf_read(fp, &packed[0], packed.size()) != (int)packed.size())
+		return -2;
+
+	pos.assign(n, 0);
+	calls.assign(n * nsmpl, 0);
+	b = &packed[0];
+
+	for (k = 0; k < 4; k++, b += n)
+		for (i = 0; i < n; i++)
+			pos[i] |= (int)b[i] << (CHAR_BIT * k);
+	for (i = 1; i < n; i++)
+		pos[i] += pos[i-1];
+
+	for (j = 0; j < nsmpl; j++)
+		for (k = 0; k < 8; k++, b += n)
+			for (i = 0; i < n; i++)
+				calls[i*nsmpl+j] |= (unsigned long long)b[i] << (CHAR_BIT * k);
+
+	iblock = blk;
+	isite = 0;
+
+	return 0;
+}
+
+int genoCache::query(int t, int beg, int end)
+{
+	int ret = 0;
+	size_t blk = 0;
+
+	qtid = t;
+	qend = end;
+
+	// first block of the reference sequence reaching into the region
+	blk = std::lower_bound(index.begin(), index.end(), std::make_pair(t, beg),
+		[](const cacheBlock_t &e, const std::pair<int, int> &q)
+		{
+			return (e.tid < q.first) || ((e.tid == q.first) && (e.end <= q.second));
+		}) - index.begin();
+
+	done = (blk == index.size()) || (index[blk].tid != t) || (index[blk].beg >= end);
+	if (done)
+		return 0;
+
+	// windows along a sequence usually fall in the block already read
+	if ((blk != iblock) && ((ret = readBlock(blk)) < 0))
+		return ret;
+
+	isite = std::lower_bound(pos.begin(), pos.end(), beg) - pos.begin();
+
+	return 0;
+}
+
+int genoCache::next(int *p, const unsigned long long **cb)
+{
+	int ret = 0;
+
+	if (done)
+		return -1;
+
+	// continue into the next block of the same reference sequence
+	if (isite == pos.size())
+	{
+		if ((iblock + 1 >= index.size()) || (index[iblock+1].tid != qtid) || (index[iblock+1].beg >= qend))
+		{
+			done = true;
+			return -1;
+		}
+		if ((ret = readBlock(iblock + 1)) < 0)
+			return ret;
+	}
+
+	if (pos[isite] >= qend)
+	{
+		done = true;
+		return -1;
+	}
+
+	*p = pos[isite];
+	*cb = &calls[isite*nsmpl];
+	++isite;
+
+	return 0;
+}
+
+int genoCache::close(void)
+{
+	int ret = 0;
+	unsigned char buf[20];
+	std::string idxfile = cachefile + ".pgi";
+	FILE *fpidx = nullptr;
+
+	if (!fp)
+		return 0;
+
+	if (writing)
+	{
+		if (!pos.empty() && (writeBlock() < 0))
+			ret = -1;
+
+		// the index is written next to the cache, like the index of a BAM file
+		fpidx = fopen(idxfile.c_str(), "wb");
+		if (!fpidx)
+			ret = -1;
+		else
+		{
+			memcpy(buf, INDEX_MAGIC, 4);
+			packInt(buf + 4, index.size(), 4);
+			if (fwrite(buf, 1, 8, fpidx) != 8)
+				ret = -1;
+			for (size_t i = 0; (ret == 0) && (i < index.size()); i++)
+			{
+				packInt(buf, (unsigned int)index[i].tid, 4);
+				packInt(buf + 4, (unsigned int)index[i].beg, 4);
+				packInt(buf + 8, (unsigned int)index[i].end, 4);
+				packInt(buf + 12, index[i].offset, 8);
+				if (fwrite(buf, 1, 20, fpidx) != 20)
+					ret = -1;
+			}
+			if (fclose(fpidx) != 0)
+				ret = -1;
+		}
+	}
+
+	if (bgzf_close(fp) < 0)
+		ret = -1;
+	fp = nullptr;
+
+	for (size_t i = 0; i < headers.size(); i++)
+		bam_header_destroy(headers[i]);
+	headers.clear();
+
+	return ret;
+}
@@ -0,0 +1,156 @@
+/** \file pop_call.cpp
+ *  \brief Functions for writing consensus calls to a genotype cache
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "pop_call.h"
+
+int mainCall(int argc, char *argv[])
+{
+	int chr = 0;                  //! chromosome identifier
+	int ref = 0;                  //! ref
+	std::string msg;              //! string for error message
+	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
+	bam_plbuf_t *buf;             //! pileup buffer
+
+	// initialize user command line options
+	popbamOptions p(argc, argv);
+
+	if (p.errorCount > 0)
+		usageCall(p.errorMsg);
+
+	// check input BAM file for errors
+	p.checkBAM();
+
+	// initialize the sample data structure
+	sm = bam_smpl_init();
+
+	// add samples
+	bam_smpl_add(sm, &p);
+
+	// initialize the call data structure
+	callData t(p);
+	t.sm = sm;
+
+	// the calls of a site are read back as one word per sample
+	if (sm->n > 64)
+		fatalError("popbam can analyze at most 64 samples");
+
+	// initialize error model
+	t.em = errmod_init(0.17);
+
+	if (t.out.create(p.outfile, &p, sm->n) < 0)
+	{
+		msg = "Cannot write genotype cache " + p.outfile;
+		fatalError(msg);
+	}
+
+	// iterate through all target regions; every column of the pileup is written
+	for (size_t j = 0; j < p.regions.size(); ++j)
+	{
+		ref = p.regions[j].tid;
+		t.setRegion(p.regions[j]);
+
+		// fetch reference sequence of each new scaffold
+		if ((j == 0) || (ref != chr))
+		{
+			chr = ref;
+			t.fetchReference(&p, chr);
+		}
+
+		// initialize pileup
+		buf = bam_plbuf_init(PICK_PILEUP(makeCall, p.flag), &t);
+
+		// fetch region from bam file
+		if (t.fetchRegion(&p, ref, buf) < 0)
+		{
+			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
+			fatalError(msg);
+		}
+
+		// finalize pileup
+		bam_plbuf_push(0, buf);
+
+		// take out the garbage
+		bam_plbuf_destroy(buf);
+	}
+	// end of region iteration
+
+	if (t.out.close() < 0)
+	{
+		msg = "Failed to write genotype cache " + p.outfile;
+		fatalError(msg);
+	}
+
+	p.closeBAM();
+
+	return 0;
+}
+
+template <unsigned int F>
+int makeCall(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
+{
+	unsigned long long *cb = nullptr;
+	callData *t = nullptr;
+
+	// get control data structure
+	t = (callData*)data;
+
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
+	{
+		// call bases
+		cb = callBase<F>(t, n, pl);
+
+		// quality filters are applied when the cache is read, so they can differ between analyses
+		if (t->out.push(tid, pos, cb) < 0)
+			fatalError("Failed to write genotype cache");
+
+		// take out the garbage
+		delete [] cb;
+	}
+
+	return 0;
+}
+
+callData::callData(const popbamOptions &p)
+{
+	// inherit values from popbamOptions
+	flag = p.flag;
+	minDepth = p.minDepth;
+	maxDepth = p.maxDepth;
+	minMapQ = p.minMapQ;
+	minBaseQ = p.minBaseQ;
+	hetPrior = p.hetPrior;
+
+	// initialize native variables
+	derived_type = CALL;
+}
+
+void usageCall(const std::string msg)
+{
+	std::cerr << msg << std::endl << std::endl;
+	std::cerr << "Usage:   popbam call [options] -O out.pgc <in1.bam|-> [in2.bam ...] [region]" << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "Options: -O  FILE    genotype cache to write; indexed in FILE.pgi" << std::endl;
+	std::cerr << "         -i          base qualities are Illumina 1.3+               [ default: Sanger ]" << std::endl;
+	std::cerr << "         -h  FILE    Input header file                              [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, called instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads                     [ default: 1 ]" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
+	std::cerr << "         -f  FILE    Reference fastA file" << std::endl;
+	std::cerr << "         -x  INT     maximum read coverage                          [ default: 255 ]" << std::endl;
+	std::cerr << "         -a  INT     minimum map quality                            [ default: 13 ]" << std::endl;
+	std::cerr << "         -b  INT     minimum base quality                           [ default: 13 ]" << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "The cache is given in place of the BAM files to snp, haplo, diverge, tree, nucdiv, ld and sfs," << std::endl;
+	std::cerr << "which then apply their own -m, -x, -q and -s filters to the stored calls." << std::endl;
+	std::cerr << std::endl;
+	exit(EXIT_FAILURE);
+}
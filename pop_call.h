@@ -0,0 +1,43 @@
+/** \file pop_call.h
+ *  \brief Header for the pop_call.cpp file
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "pop_base.h"
+
+//
+// Define data structures
+//
+
+/*!
+ * \class callData
+ * \brief A derived class for passing parameters and data to the call function
+ */
+class callData: public popbamData
+{
+	public:
+		// constructor
+		callData(const popbamOptions&);
+
+		// member public variables
+		genoCache out;                          //!< Genotype cache being written
+};
+
+///
+/// Function prototypes
+///
+
+/*!
+ * \fn int makeCall(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
+ * \brief Writes the consensus calls of all samples at a column of the pileup to the genotype cache
+ * \tparam F Option flags the callback is compiled for
+ * \param tid Chromosome identifier
+ * \param pos Genomic position
+ * \param n The read depth
+ * \param pl A pointer to the alignment covering a single position
+ * \param data A pointer to the user-passed data
+ */
+template <unsigned int F> int makeCall(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+
+void usageCall(const std::string);
@@ -8,15 +8,8 @@
 
 int mainDiverge(int argc, char *argv[])
 {
-	bool found = false;           //! is the outgroup sequence found?
-	int chr = 0;                  //! chromosome identifier
-	int beg = 0;                  //! beginning coordinate for analysis
-	int end = 0;                  //! end coordinate for analysis
-	int ref = 0;                  //! ref
-	long nWindows = 0;            //! number of windows
-	std::string msg;              //! string for error message
-	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
-	bam_plbuf_t *buf = nullptr;   //! pileup buffer
+	bam_pileup_f func = nullptr;  //! pileup callback
+	popbamData *t = nullptr;      //! diverge data structure
 
 	// initialize user command line options
 	popbamOptions p(argc, argv);
@@ -27,133 +20,90 @@ int mainDiverge(int argc, char *argv[])
 	// check input BAM file for errors
 	p.checkBAM();
 
-	// initialize the sample data structure
-	sm = bam_smpl_init();
+	// set up the diverge analysis
+	t = initDiverge(p, &func);
+
+	// results go to a compressed and indexed file instead of stdout
+	if (!p.outfile.empty())
+		openResults(p, "diverge", t, p.outfile);
 
-	// add samples
-	bam_smpl_add(sm, &p);
+	// iterate through all windows along specified genomic region or all target regions
+	runWindows(p, std::vector<popbamData*>(1, t), func, t);
 
-	// initialize the diverge data structre
-	divergeData t(p);
-	t.sm = sm;
+	if (!p.outfile.empty())
+		closeResults(t, p.outfile);
+
+	delete t;
+	p.closeBAM();
+
+	return 0;
+}
+
+popbamData *initDiverge(const popbamOptions &p, bam_pileup_f *func)
+{
+	divergeData *t = nullptr;
+	bool found = false;           //! is the outgroup sequence found?
+	std::string msg;              //! string for error message
+
+	// initialize the diverge data structure
+	t = new divergeData(p);
+
+	// initialize the sample data structure and add samples
+	t->sm = bam_smpl_init();
+	bam_smpl_add(t->sm, &p);
 
 	// initialize error model
-	t.em = errmod_init(0.17);
+	t->em = errmod_init(0.17);
 
 	// if outgroup option is used check to make sure it exists
 	if (p.flag & BAM_OUTGROUP)
 	{
-		for (int i = 0; i < t.sm->n; i++)
-			if (strcmp(t.sm->smpl[i], t.outgroup.c_str()) == 0)
+		for (int i = 0; i < t->sm->n; ++i)
+		{
+			if (strcmp(t->sm->smpl[i], t->outgroup.c_str()) == 0)
 			{
-				t.outidx = i;
+				t->outidx = i;
 				found = true;
 			}
+		}
+
 		if (!found)
 		{
-			msg = "Specified outgroup " + t.outgroup + " not found";
+			msg = "Specified outgroup " + t->outgroup + " not found";
 			fatalError(msg);
 		}
 	}
 
-	// parse genomic region
-	int k = bam_parse_region(p.h, p.region, &chr, &beg, &end);
-	if (k < 0)
+	// steps opening and closing each window; site-count windows also take them from the pileup
+	t->openWindow = [t, &p](void)
 	{
-		msg = "Bad genome coordinates: " + p.region;
-		fatalError(msg);
-	}
-
-	// fetch reference sequence
-	t.ref_base = faidx_fetch_seq(p.fai_file, p.h->target_name[chr], 0, 0x7fffffff, &(t.len));
-
-	// calculate the number of windows
-	if (p.flag & BAM_WINDOW)
-		nWindows = ((end - beg) - 1) / p.winSize;
-	else
-	{
-		p.winSize = end - beg;
-		nWindows = 1;
-	}
-
-	// iterate through all windows along specified genomic region
-	for (long j = 0; j < nWindows; ++j)
-	{
-		// construct genome coordinate string
-		std::string scaffold_name(p.h->target_name[chr]);
-		std::ostringstream winc(scaffold_name);
-
-		winc.seekp(0, std::ios::end);
-		winc << ':' << beg + (j * p.winSize) + 1 << '-' << ((j + 1) * p.winSize) + (beg - 1);
-
-		std::string winCoord = winc.str();
-
 		// initialize number of sites to zero
-		t.num_sites = 0;
-
-		// parse the BAM file and check if region is retrieved from the reference
-		if (p.flag & BAM_WINDOW)
-		{
-			k = bam_parse_region(p.h, winCoord, &ref, &(t.beg), &(t.end));
-			if (k < 0)
-			{
-				msg = "Bad window coordinates " + winCoord;
-				fatalError(msg);
-			}
-		}
-		else
-		{
-			ref = chr;
-			t.beg = beg;
-			t.end = end;
-			if (ref < 0)
-			{
-				msg = "Bad scaffold name: " + p.region;
-				fatalError(msg);
-			}
-		}
+		t->num_sites = 0;
 
 		// initialize diverge specific variables
-		t.allocDiverge();
+		t->allocDiverge();
 
 		// create population assignments
-		t.assignPops(&p);
+		t->assignPops(&p);
 
 		// set default minimum sample size as
 		// the number of samples in the population
-		t.setMinPop_n();
-
-		// initialize pileup
-		buf = bam_plbuf_init(makeDiverge, &t);
-
-		// fetch region from bam file
-		if ((bam_fetch(p.bam_in->x.bam, p.idx, ref, t.beg, t.end, buf, fetch_func)) < 0)
-		{
-			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
-			fatalError(msg);
-		}
-
-		// finalize pileup
-		bam_plbuf_push(0, buf);
+		t->setMinPop_n();
+	};
 
-		// print results to stdout
-		t.calcDiverge();
-		t.printDiverge(std::string(p.h->target_name[chr]));
-
-		// take out the garbage
-		bam_plbuf_destroy(buf);
-	}
-	// end of window interation
+	t->closeWindow = [t, &p](void)
+	{
+		// print results
+		t->calcDiverge();
+		t->printDiverge(std::string(p.h->target_name[t->tid]));
+	};
 
-	errmod_destroy(t.em);
-	samclose(p.bam_in);
-	bam_index_destroy(p.idx);
-	bam_smpl_destroy(sm);
-	free(t.ref_base);
+	*func = PICK_PILEUP(makeDiverge, p.flag);
 
-	return 0;
+	return t;
 }
 
+template <unsigned int F>
 int makeDiverge(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
 {
 	int i = 0;
@@ -165,14 +115,21 @@ int makeDiverge(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *
 	// get control data structure
 	t = (divergeData*)data;
 
-	// only consider sites located in designated region
-	if ((t->beg <= (int)pos) && (t->end > (int)pos))
+	// site-count windows are closed as the pileup moves past them
+	if (t->winSites > 0)
+		t->checkWindow(pos);
+
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
 	{
+		// make room for one more site
+		t->growSites();
+
 		// call bases
-		cb = callBase(t, n, pl);
+		cb = callBase<F>(t, n, pl);
 
-		// resolve heterozygous sites
-		if (!(t->flag & BAM_HETEROZYGOTE))
+		// resolve heterozygous sites; haploid calls have none
+		if (!(F & (BAM_HETEROZYGOTE | BAM_HAPLOID)))
 			cleanHeterozygotes(t->sm->n, cb, (int)t->ref_base[pos], t->minSNPQ);
 
 		// determine if site is segregating
@@ -184,24 +141,30 @@ int makeDiverge(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *
 		for (i = 0; i < t->sm->npops; i++)
 			t->pop_sample_mask[i] = sample_cov & t->pop_mask[i];
 
-		if (bitcount64(sample_cov) == t->sm->n)
+		if ((int)kernels.count(sample_cov) == t->sm->n)
 		{
-			// calculate the site type
-			t->types[t->num_sites] = calculateSiteType(t->sm->n, cb);
-
 			if (fq > 0)
 			{
+				// calculate the site type
+				t->types[t->segsites] = calculateSiteType(t->sm->n, cb);
+
 				t->hap.pos[t->segsites] = pos;
 				t->hap.ref[t->segsites] = (unsigned char)bam_nt16_table[(int)t->ref_base[pos]];
+
+				// one record holds the calls of all individuals at the site
+				hCall_t *call = t->hap.call + (size_t)t->segsites * t->sm->n;
+				unsigned long long geno = 0;
+
 				for (i = 0; i < t->sm->n; i++)
 				{
-					t->hap.rms[i][t->segsites] = (cb[i] >> (CHAR_BIT * 6)) & 0xffff;
-					t->hap.snpq[i][t->segsites] = (cb[i] >> (CHAR_BIT * 4)) & 0xffff;
-					t->hap.num_reads[i][t->segsites] = (cb[i] >> (CHAR_BIT * 2)) & 0xffff;
-					t->hap.base[i][t->segsites] = bam_nt16_table[(int)iupac[(cb[i] >> CHAR_BIT) & 0xff]];
+					call[i].rms = (cb[i] >> (CHAR_BIT * 6)) & 0xffff;
+					call[i].snpq = (cb[i] >> (CHAR_BIT * 4)) & 0xffff;
+					call[i].num_reads = (cb[i] >> (CHAR_BIT * 2)) & 0xffff;
+					call[i].base = bam_nt16_table[(int)iupac[(cb[i] >> CHAR_BIT) & 0xff]];
 					if (cb[i] & 0x2ULL)
-						t->hap.seq[i][t->segsites/64] |= 0x1ULL << t->segsites % 64;
+						geno |= 0x1ULL << i;
 				}
+				t->hap.geno[t->segsites] = geno;
 				t->hap.idx[t->segsites] = t->num_sites;
 				t->segsites++;
 			}
@@ -225,9 +188,9 @@ int divergeData::calcDiverge(void)
 	switch (output)
 	{
 		case 0:
+			sampleMajor(&hap);
 			for (i = 0; i < sm->n; i++)
-				for (j = 0; j <= SEG_IDX(segsites); j++)
-					ind_div[i] += bitcount64(hap.seq[i][j]);
+				ind_div[i] = kernels.countArray(hap.seq[i], SEG_IDX(segsites) + 1);
 			break;
 		case 1:
 			for (i = 0; i < sm->npops; i++)
@@ -235,13 +198,13 @@ int divergeData::calcDiverge(void)
 				num_snps[i] = 0;
 				for (j = 0; j < segsites; j++)
 				{
-					pop_type = types[hap.idx[j]] & pop_mask[i];
+					pop_type = types[j] & pop_mask[i];
 
 					// check if outgroup is different from reference
-					if ((flag & BAM_OUTGROUP) && CHECK_BIT(types[hap.idx[j]], outidx))
-						freq = pop_nsmpl[i] - bitcount64(pop_type);
+					if ((flag & BAM_OUTGROUP) && CHECK_BIT(types[j], outidx))
+						freq = pop_nsmpl[i] - kernels.count(pop_type);
 					else
-						freq = bitcount64(pop_type);
+						freq = kernels.count(pop_type);
 					if ((freq > 0) && (freq < pop_nsmpl[i]) && !(flag & BAM_NOSINGLETONS))
 						++num_snps[i];
 					else if ((freq > 1) && (freq < pop_nsmpl[i]) && (flag & BAM_NOSINGLETONS))
@@ -261,7 +224,6 @@ int divergeData::calcDiverge(void)
 divergeData::divergeData(const popbamOptions &p)
 {
 	// inherit values from popbamOptions
-	bamfile = p.bamfile;
 	flag = p.flag;
 	minDepth = p.minDepth;
 	maxDepth = p.maxDepth;
@@ -269,6 +231,8 @@ divergeData::divergeData(const popbamOptions &p)
 	minSNPQ = p.minSNPQ;
 	minMapQ = p.minMapQ;
 	minBaseQ = p.minBaseQ;
+	winSites = p.winSites;
+	winSpan = (flag & BAM_WINDOW) ? p.winSize : 0x7fffffff;
 	hetPrior = p.hetPrior;
 	dist = p.dist;
 	minSites = p.minSites;
@@ -280,47 +244,34 @@ divergeData::divergeData(const popbamOptions &p)
 
 int divergeData::allocDiverge(void)
 {
-	int i = 0;
-	int length = end - beg;
 	int n = sm->n;
 	int npops = sm->npops;
 
+	// arrays of the previous window are given back to the arena
+	arena.reset();
 	segsites = 0;
+	site_cap = SITE_CHUNK;
+	seg_cap = SITE_CHUNK;
 
 	try
 	{
-		types = new unsigned long long [length]();
-		pop_mask = new unsigned long long [npops]();
-		pop_nsmpl = new unsigned char [npops]();
-		pop_sample_mask = new unsigned long long [npops]();
-		min_pop_n = new unsigned short [npops]();
-		num_snps = new int [npops]();
-		hap.pos = new unsigned int [length]();
-		hap.idx = new unsigned int [length]();
-		hap.ref = new unsigned char [length]();
-		hap.seq = new unsigned long long* [n];
-		hap.base = new unsigned char* [n];
-		hap.rms = new unsigned short* [n];
-		hap.snpq = new unsigned short* [n];
-		hap.num_reads = new unsigned short* [n];
+		types = arena.alloc<unsigned long long>(seg_cap);
+		pop_mask = arena.alloc<unsigned long long>(npops);
+		pop_nsmpl = arena.alloc<unsigned char>(npops);
+		pop_sample_mask = arena.alloc<unsigned long long>(npops);
+		min_pop_n = arena.alloc<unsigned short>(npops);
+		num_snps = arena.alloc<int>(npops);
 		switch (output)
 		{
 			case 0:
-				ind_div = new unsigned short [n]();
+				ind_div = arena.alloc<unsigned short>(n);
 				break;
 			case 1:
-				pop_div = new unsigned short [npops]();
+				pop_div = arena.alloc<unsigned short>(npops);
 			default:
 				break;
 		}
-		for (i = 0; i < n; i++)
-		{
-			hap.seq[i] = new unsigned long long [length]();
-			hap.base[i] = new unsigned char [length]();
-			hap.rms[i] = new unsigned short [length]();
-			hap.snpq[i] = new unsigned short [length]();
-			hap.num_reads[i] = new unsigned short [length]();
-		}
+		allocHap(&hap);
 	}
 	catch (std::bad_alloc& ba)
 	{
@@ -330,43 +281,17 @@ int divergeData::allocDiverge(void)
 	return 0;
 }
 
-divergeData::~divergeData(void)
+void divergeData::growSites(void)
 {
-	int i = 0;
+	int cap = 2 * seg_cap;
 
-	delete [] pop_mask;
-	delete [] types;
-	delete [] pop_nsmpl;
-	delete [] pop_sample_mask;
-	delete [] num_snps;
-	delete [] min_pop_n;
-	delete [] hap.pos;
-	delete [] hap.idx;
-	delete [] hap.ref;
-	switch (output)
-	{
-		case 0:
-			delete [] ind_div;
-			break;
-		case 1:
-			delete [] pop_div;
-			break;
-		default:
-			break;
-	}
-	for (i = 0; i < sm->n; i++)
+	// segregating sites
+	if (segsites >= seg_cap)
 	{
-		delete [] hap.seq[i];
-		delete [] hap.base[i];
-		delete [] hap.num_reads[i];
-		delete [] hap.snpq[i];
-		delete [] hap.rms[i];
+		types = arena.extend(types, seg_cap, cap);
+		extendHap(&hap, cap);
+		seg_cap = cap;
 	}
-	delete [] hap.seq;
-	delete [] hap.base;
-	delete [] hap.snpq;
-	delete [] hap.rms;
-	delete [] hap.num_reads;
 }
 
 int divergeData::printDiverge(const std::string scaffold)
@@ -374,9 +299,8 @@ int divergeData::printDiverge(const std::string scaffold)
 	int i = 0;
 	double pdist = 0.0;
 	double jc = 0.0;
-	std::stringstream out;
 
-	out << scaffold << '\t' << beg + 1 << '\t' << end + 1 << '\t' << num_sites;
+	os << scaffold << '\t' << beg + 1 << '\t' << lastBase() << '\t' << num_sites;
 
 	switch (output)
 	{
@@ -387,21 +311,21 @@ int divergeData::printDiverge(const std::string scaffold)
 				{
 					if (dist == "pdist")
 					{
-						out << "\td[" << sm->smpl[i] << "]:";
-						out << '\t' << std::fixed << std::setprecision(5) << (double)(ind_div[i]) / num_sites;
+						os << "\td[" << sm->smpl[i] << "]:";
+						os << '\t' << fixedValue((double)(ind_div[i]) / num_sites, 5);
 					}
 					else if (dist == "jc")
 					{
 						pdist = (double)(ind_div[i]) / num_sites;
 						jc = -0.75 * log(1.0 - pdist * (4.0 / 3.0));
-						out << "\td[" << sm->smpl[i] << "]:";
-						out << '\t' << std::fixed << std::setprecision(5) << jc;
+						os << "\td[" << sm->smpl[i] << "]:";
+						os << '\t' << fixedValue(jc, 5);
 					}
 					else
-						out << "\td[" << sm->smpl[i] << "]:\t" << std::setw(7) << "NA";
+						os << "\td[" << sm->smpl[i] << "]:\t     NA";
 				}
 				else
-					out << "\td[" << sm->smpl[i] << "]:\t" << std::setw(7) << "NA";
+					os << "\td[" << sm->smpl[i] << "]:\t     NA";
 			}
 			break;
 		case 1:
@@ -409,15 +333,15 @@ int divergeData::printDiverge(const std::string scaffold)
 			{
 				if (num_sites >= minSites)
 				{
-					out << "\tFixed[" << sm->popul[i] << "]:\t" << pop_div[i];
-					out << "\tSeg[" << sm->popul[i] << "]:\t" << num_snps[i];
-					out << "\td[" << sm->popul[i] << "]:";
+					os << "\tFixed[" << sm->popul[i] << "]:\t" << pop_div[i];
+					os << "\tSeg[" << sm->popul[i] << "]:\t" << num_snps[i];
+					os << "\td[" << sm->popul[i] << "]:";
 					if (dist == "pdist")
 					{
 						if (flag & BAM_SUBSTITUTE)
-							out << '\t' << std::fixed << std::setprecision(5) << (double)(pop_div[i]) / num_sites;
+							os << '\t' << fixedValue((double)(pop_div[i]) / num_sites, 5);
 						else
-							out << '\t' << std::fixed << std::setprecision(5) << (double)(pop_div[i] + num_snps[i]) / num_sites;
+							os << '\t' << fixedValue((double)(pop_div[i] + num_snps[i]) / num_sites, 5);
 					}
 					else if (dist == "jc")
 					{
@@ -426,27 +350,27 @@ int divergeData::printDiverge(const std::string scaffold)
 						else
 							pdist = (double)(pop_div[i] + num_snps[i]) / num_sites;
 						jc = -0.75 * log(1.0 - pdist * (4.0 / 3.0));
-						out << '\t' << std::fixed << std::setprecision(5) << jc;
+						os << '\t' << fixedValue(jc, 5);
 					}
 					else
 					{
-						out << "\tFixed[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
-						out << "\tSeg[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
-						out << "\td[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+						os << "\tFixed[" << sm->popul[i] << "]:\t     NA";
+						os << "\tSeg[" << sm->popul[i] << "]:\t     NA";
+						os << "\td[" << sm->popul[i] << "]:\t     NA";
 					}
 				}
 				else
 				{
-					out << "\tFixed[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
-					out << "\tSeg[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
-					out << "\td[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+					os << "\tFixed[" << sm->popul[i] << "]:\t     NA";
+					os << "\tSeg[" << sm->popul[i] << "]:\t     NA";
+					os << "\td[" << sm->popul[i] << "]:\t     NA";
 				}
 			}
 			break;
 		default:
 			break;
 	}
-	std::cout << out.str() << std::endl;
+	os << '\n';
 
 	return 0;
 }
@@ -464,16 +388,28 @@ int divergeData::setMinPop_n(void)
 void usageDiverge(const std::string msg)
 {
 	std::cerr << msg << std::endl << std::endl;
-	std::cerr << "Usage:   popbam diverge [options] <in.bam> [region]" << std::endl;
+	std::cerr << "Usage:   popbam diverge [options] <in1.bam|-> [in2.bam ...] [region]" << std::endl;
 	std::cerr << std::endl;
 	std::cerr << "Options: -i          base qualities are Illumina 1.3+     [ default: Sanger ]" << std::endl;
 	std::cerr << "         -h  FILE    Input header file                    [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -G  FILE    sample to population map of a bgzipped VCF file given as input" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads           [ default: 1 ]" << std::endl;
+	std::cerr << "         -O  FILE    write results to FILE, compressed with BGZF and indexed for tabix" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
 	std::cerr << "         -d  STR     distance metric (pdist or jc)        [ default: pdist ]" << std::endl;
 	std::cerr << "         -o  INT     analysis option                      [ default: 0 ]" << std::endl;
 	std::cerr << "                     0 : output individual divergence" << std::endl;
 	std::cerr << "                     1 : population divergence statistics" << std::endl;
 	std::cerr << "         -p  STR     sample name of outgroup              [ default: reference ]" << std::endl;
 	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
+	std::cerr << "         -g  INT     close windows after INT segregating sites (-w: longest window)" << std::endl;
+	std::cerr << "         -c  INT     close windows after INT callable sites (-w: longest window)" << std::endl;
 	std::cerr << "         -k  INT     minimum number of sites in window    [ default: 10 ]" << std::endl;
 	std::cerr << "         -n  INT     minimum sample size per population   [ default: all samples present ]" << std::endl;
 	std::cerr << "         -t          only count substitutions" << std::endl;
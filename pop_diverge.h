@@ -19,9 +19,6 @@ class divergeData: public popbamData
 		// constructor
 		divergeData(const popbamOptions&);
 
-		// destructor
-		~divergeData(void);
-
 		// member public variables
 		int output;                             //!< Analysis output option
 		std::string outgroup;                   //!< Sample name of outgroup to use
@@ -35,6 +32,7 @@ class divergeData: public popbamData
 		// member public functions
 		int calcDiverge(void);
 		int allocDiverge(void);
+		void growSites(void);
 		int setMinPop_n(void);
 		int printDiverge(const std::string);
 
@@ -49,26 +47,16 @@ class divergeData: public popbamData
 /// Function prototypes
 ///
 
-/*!
-* \fn unsigned long long *callBase(bam_sample_t *sm, errmod_t *em, int n, const bam_pileup1_t *pl)
-* \brief Calls the base from the pileup at each position
-* \param sm     Pointer to the sample data structure
-* \param em     Pointer to the error model structure
-* \param n      The number of reads in the pileup
-* \param pl     Pointer to the pileup
-* \return       Pointer to the consensus base call information for the individuals
-*/
-template unsigned long long* callBase<divergeData>(divergeData *t, int n, const bam_pileup1_t *pl);
-
 /*!
  * \fn int makeDiverge(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
  * \brief Calculate divergence with reference genome sequence
+ * \tparam F Option flags the callback is compiled for
  * \param tid Chromosome identifier
  * \param pos Genomic position
  * \param n The read depth
  * \param pl A pointer to the alignment covering a single position
  * \param data A pointer to the user-passed data
  */
-int makeDiverge(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+template <unsigned int F> int makeDiverge(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
 
 void usageDiverge(const std::string);
@@ -8,14 +8,8 @@
 
 int mainHaplo(int argc, char *argv[])
 {
-	int chr = 0;                  //! chromosome identifier
-	int beg = 0;                  //! beginning coordinate for analysis
-	int end = 0;                  //! end coordinate for analysis
-	int ref = 0;                  //! ref
-	long nWindows = 0;            //! number of windows
-	std::string msg;              //! string for error message
-	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
-	bam_plbuf_t *buf = nullptr;   //! pileup buffer
+	bam_pileup_f func = nullptr;  //! pileup callback
+	popbamData *t = nullptr;      //! haplo data structure
 
 	// initialize user command line options
 	popbamOptions p(argc, argv);
@@ -26,115 +20,67 @@ int mainHaplo(int argc, char *argv[])
 	// check input BAM file for errors
 	p.checkBAM();
 
-	// initialize the sample data structure
-	sm = bam_smpl_init();
+	// set up the haplo analysis
+	t = initHaplo(p, &func);
 
-	// add samples
-	bam_smpl_add(sm, &p);
+	// results go to a compressed and indexed file instead of stdout
+	if (!p.outfile.empty())
+		openResults(p, "haplo", t, p.outfile);
 
-	// initialize the haplo data structure
-	haploData t(p);
-	t.sm = sm;
+	// iterate through all windows along specified genomic region or all target regions
+	runWindows(p, std::vector<popbamData*>(1, t), func, t);
 
-	// initialize error model
-	t.em = errmod_init(0.17);
+	if (!p.outfile.empty())
+		closeResults(t, p.outfile);
 
-	// parse genomic region
-	int k = bam_parse_region(p.h, p.region, &chr, &beg, &end);
-	if (k < 0)
-	{
-		msg = "Bad genome coordinates: " + p.region;
-		fatalError(msg);
-	}
+	delete t;
+	p.closeBAM();
 
-	// fetch reference sequence
-	t.ref_base = faidx_fetch_seq(p.fai_file, p.h->target_name[chr], 0, 0x7fffffff, &(t.len));
+	return 0;
+}
 
-	// calculate the number of windows
-	if (p.flag & BAM_WINDOW)
-		nWindows = ((end - beg) - 1) / p.winSize;
-	else
-	{
-		p.winSize = end - beg;
-		nWindows = 1;
-	}
+popbamData *initHaplo(const popbamOptions &p, bam_pileup_f *func)
+{
+	haploData *t = nullptr;
 
-	// iterate through all windows along specified genomic region
-	for (long i = 0; i < nWindows; ++i)
-	{
-		// construct genome coordinate string
-		std::string scaffold_name(p.h->target_name[chr]);
-		std::ostringstream winc(scaffold_name);
+	// initialize the haplo data structure
+	t = new haploData(p);
 
-		winc.seekp(0, std::ios::end);
-		winc << ':' << beg + (i * p.winSize) + 1 << '-' << ((i + 1) * p.winSize) + (beg - 1);
+	// initialize the sample data structure and add samples
+	t->sm = bam_smpl_init();
+	bam_smpl_add(t->sm, &p);
 
-		std::string winCoord = winc.str();
+	// initialize error model
+	t->em = errmod_init(0.17);
 
+	// each region is a single window
+	t->openWindow = [t, &p](void)
+	{
 		// initialize number of sites to zero
-		t.num_sites = 0;
-
-		// parse the BAM file and check if region is retrieved from the reference
-		if (p.flag & BAM_WINDOW)
-		{
-			k = bam_parse_region(p.h, winCoord, &ref, &(t.beg), &(t.end));
-			if (k < 0)
-			{
-				msg = "Bad window coordinates " + winCoord;
-				fatalError(msg);
-			}
-		}
-		else
-		{
-			ref = chr;
-			t.beg = beg;
-			t.end = end;
-			if (ref < 0)
-			{
-				msg = "Bad scaffold name: " + p.region;
-				fatalError(msg);
-			}
-		}
+		t->num_sites = 0;
 
-		// initialize diverge specific variables
-		t.allocHaplo();
+		// initialize haplo specific variables
+		t->allocHaplo();
 
 		// create population assignments
-		t.assignPops(&p);
-
-		// initialize pileup
-		buf = bam_plbuf_init(makeHaplo, &t);
-
-		// fetch region from bam file
-		if ((bam_fetch(p.bam_in->x.bam, p.idx, ref, t.beg, t.end, buf, fetch_func)) < 0)
-		{
-			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
-			fatalError(msg);
-		}
-
-		// finalize pileup
-		bam_plbuf_push(0, buf);
+		t->assignPops(&p);
+	};
 
+	t->closeWindow = [t, &p](void)
+	{
 		// calculate haplotype-based statistics
-		t.calcHaplo();
+		t->calcHaplo();
 
-		// print results to stdout
-		t.printHaplo(std::string(p.h->target_name[chr]));
+		// print results
+		t->printHaplo(std::string(p.h->target_name[t->tid]));
+	};
 
-		// take out the garbage
-		bam_plbuf_destroy(buf);
-	}
-	// end of window interation
-
-	errmod_destroy(t.em);
-	samclose(p.bam_in);
-	bam_index_destroy(p.idx);
-	bam_smpl_destroy(sm);
-	free(t.ref_base);
+	*func = PICK_PILEUP(makeHaplo, p.flag);
 
-	return 0;
+	return t;
 }
 
+template <unsigned int F>
 int makeHaplo(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
 {
 	int i = 0;
@@ -147,14 +93,17 @@ int makeHaplo(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl
 	// get control data structure
 	t = (haploData*)data;
 
-	// only consider sites located in designated region
-	if ((t->beg <= (int)pos) && (t->end > (int)pos))
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
 	{
+		// make room for one more site
+		t->growSites();
+
 		// call bases
-		cb = callBase(t, n, pl);
+		cb = callBase<F>(t, n, pl);
 
-		// resolve heterozygous sites
-		if (!(t->flag & BAM_HETEROZYGOTE))
+		// resolve heterozygous sites; haploid calls have none
+		if (!(F & (BAM_HETEROZYGOTE | BAM_HAPLOID)))
 			cleanHeterozygotes(t->sm->n, cb, (int)t->ref_base[pos], t->minSNPQ);
 
 		// determine if site is segregating
@@ -168,10 +117,10 @@ int makeHaplo(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl
 		{
 			unsigned long long pc = 0;
 			pc = sample_cov & t->pop_mask[i];
-			unsigned int ncov = bitcount64(pc);
+			unsigned int ncov = kernels.count(pc);
 			unsigned int req = (unsigned int)((t->minPop * t->pop_nsmpl[i]) + 0.4999);
 			unsigned long long type = calculateSiteType(t->sm->n, cb);
-			unsigned short segi = bitcount64(type & t->pop_mask[i]);
+			unsigned short segi = kernels.countAnd(type, t->pop_mask[i]);
 			int k = 0;
 			if ((ncov == t->pop_nsmpl[i]) && (segi > 0) && (segi < t->pop_nsmpl[i]))
 			{
@@ -281,7 +230,7 @@ int haploData::calcEHHS(void)
 			for (j = 0; j < segsites; j++)
 			{
 				pop_type = types[j] & pop_mask[i];
-				popf = bitcount64(pop_type);
+				popf = kernels.count(pop_type);
 				if ((popf > 1) && (popf < (pop_nsmpl[i] - 1)))
 					pop_site.push_back(pop_type);
 			}
@@ -313,7 +262,7 @@ int haploData::calcEHHS(void)
 			}
 
 			// calculate site heterozygosity
-			popf = bitcount64(max_site);
+			popf = kernels.count(max_site);
 			sh = (1.0 - ((double)(SQ(popf) + ((pop_nsmpl[i] - popf) * (pop_nsmpl[i] - popf))) / SQ(pop_nsmpl[i]))) * (double)(pop_nsmpl[i] / (pop_nsmpl[i] - 1));
 
 			// calculate site-specific extended haplotype homozygosity
@@ -360,10 +309,9 @@ int haploData::printHaplo(const std::string scaffold)
 {
 	int i = 0;
 	int j = 0;
-	std::stringstream out;
 
 	//print coordinate information and number of aligned sites
-	out << scaffold << '\t' << beg + 1 << '\t' << end+1 << '\t' << num_sites;
+	os << scaffold << '\t' << beg + 1 << '\t' << lastBase() << '\t' << num_sites;
 
 	switch(output)
 	{
@@ -372,14 +320,14 @@ int haploData::printHaplo(const std::string scaffold)
 		{
 			if (num_sites >= minSites)
 			{
-				out << "\tK[" << sm->popul[i] << "]:\t" << nhaps[i];
-				out << "\tKdiv[" << sm->popul[i] << "]:";
-				out << '\t' << std::fixed << std::setprecision(5) << 1.0 - hdiv[i];
+				os << "\tK[" << sm->popul[i] << "]:\t" << nhaps[i];
+				os << "\tKdiv[" << sm->popul[i] << "]:";
+				os << '\t' << fixedValue(1.0 - hdiv[i], 5);
 			}
 			else
 			{
-				out << "\tK[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
-				out << "\tKdiv[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+				os << "\tK[" << sm->popul[i] << "]:\t     NA";
+				os << "\tKdiv[" << sm->popul[i] << "]:\t     NA";
 			}
 		}
 		break;
@@ -389,15 +337,15 @@ int haploData::printHaplo(const std::string scaffold)
 			if (num_sites >= minSites)
 			{
 				if (isnan(ehhs[i]))
-					out << "\tEHHS[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+					os << "\tEHHS[" << sm->popul[i] << "]:\t     NA";
 				else
 				{
-					out << "\tEHHS[" << sm->popul[i] << "]:";
-					out << '\t' << std::fixed << std::setprecision(5) << ehhs[i];
+					os << "\tEHHS[" << sm->popul[i] << "]:";
+					os << '\t' << fixedValue(ehhs[i], 5);
 				}
 			}
 			else
-				out << "\tEHHS[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+				os << "\tEHHS[" << sm->popul[i] << "]:\t     NA";
 		}
 		break;
 	case 2:
@@ -405,11 +353,11 @@ int haploData::printHaplo(const std::string scaffold)
 		{
 			if (num_sites >= minSites)
 			{
-				out << "\tpi[" << sm->popul[i] << "]:";
-				out << '\t' << std::fixed << std::setprecision(5) << piw[i];
+				os << "\tpi[" << sm->popul[i] << "]:";
+				os << '\t' << fixedValue(piw[i], 5);
 			}
 			else
-				out << "\tpi[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+				os << "\tpi[" << sm->popul[i] << "]:\t     NA";
 		}
 
 		for (i = 0; i < sm->npops-1; i++)
@@ -418,15 +366,15 @@ int haploData::printHaplo(const std::string scaffold)
 			{
 				if (num_sites >= minSites)
 				{
-					out << "\tdxy[" << sm->popul[i] << "-" << sm->popul[j] << "]:";
-					out << '\t' << std::fixed << std::setprecision(5) << pib[UTIDX(sm->npops,i,j)];
-					out << "\tmin[" << sm->popul[i] << "-" << sm->popul[j] << "]:";
-					out << '\t' << minDxy[UTIDX(sm->npops,i,j)];
+					os << "\tdxy[" << sm->popul[i] << "-" << sm->popul[j] << "]:";
+					os << '\t' << fixedValue(pib[UTIDX(sm->npops,i,j)], 5);
+					os << "\tmin[" << sm->popul[i] << "-" << sm->popul[j] << "]:";
+					os << '\t' << minDxy[UTIDX(sm->npops,i,j)];
 				}
 				else
 				{
-					out << "\tdxy[" << sm->popul[i] << "-" << sm->popul[j] << "]:\t" << std::setw(7) << "NA";
-					out << "\tmin[" << sm->popul[i] << "-" << sm->popul[j] << "]:\t" << std::setw(7) << "NA";
+					os << "\tdxy[" << sm->popul[i] << "-" << sm->popul[j] << "]:\t     NA";
+					os << "\tmin[" << sm->popul[i] << "-" << sm->popul[j] << "]:\t     NA";
 				}
 			}
 		}
@@ -436,7 +384,7 @@ int haploData::printHaplo(const std::string scaffold)
 	}
 
 	// print final output stream
-	std::cout << out.str() << std::endl;
+	os << '\n';
 
 	return 0;
 }
@@ -444,7 +392,6 @@ int haploData::printHaplo(const std::string scaffold)
 haploData::haploData(const popbamOptions &p)
 {
 	// inherit values from popbamOptions
-	bamfile = p.bamfile;
 	flag = p.flag;
 	minDepth = p.minDepth;
 	maxDepth = p.maxDepth;
@@ -463,32 +410,33 @@ haploData::haploData(const popbamOptions &p)
 
 int haploData::allocHaplo(void)
 {
-	const int length = end - beg;
 	const int npairs = BINOM(sm->n);
 	const int npops = sm->npops;
 
+	// arrays of the previous window are given back to the arena
+	arena.reset();
 	segsites = 0;
+	site_cap = SITE_CHUNK;
+	seg_cap = SITE_CHUNK;
 
 	try
 	{
-		types = new unsigned long long [length]();
-		pop_mask = new unsigned long long [npops]();
-		pop_nsmpl = new unsigned char [npops]();
-		nhaps = new int [npops]();
-		hdiv = new double [npops]();
-		piw = new double [npops]();
-		pib = new double [npops*(npops-1)]();
-		ehhs = new double [npops]();
-		minDxy = new unsigned int [npops*(npops-1)]();
-		diff_matrix = new unsigned int [npairs];
-		nsite_matrix = new unsigned int [npairs];
+		types = arena.alloc<unsigned long long>(seg_cap);
+		pop_mask = arena.alloc<unsigned long long>(npops);
+		pop_nsmpl = arena.alloc<unsigned char>(npops);
+		nhaps = arena.alloc<int>(npops);
+		hdiv = arena.alloc<double>(npops);
+		piw = arena.alloc<double>(npops);
+		pib = arena.alloc<double>(npops*(npops-1));
+		ehhs = arena.alloc<double>(npops);
+		minDxy = arena.alloc<unsigned int>(npops*(npops-1));
+		diff_matrix = arena.alloc<unsigned int>(npairs);
+		nsite_matrix = arena.alloc<unsigned int>(npairs);
+		// population sizes are not known until assignPops(), so reserve
+		// a haplotype string for every sample
 		hap.resize(npops);
 		for (int i = 0; i < npops; ++i)
-		{
-			hap[i].resize(pop_nsmpl[i]);
-			for (int j = 0; j < pop_nsmpl[i]; ++j)
-				hap[i][j] = "";
-		}
+			hap[i].assign(sm->n, "");
 	}
 	catch (std::bad_alloc& ba)
 	{
@@ -498,28 +446,35 @@ int haploData::allocHaplo(void)
 	return 0;
 }
 
-haploData::~haploData(void)
+void haploData::growSites(void)
 {
-	delete [] pop_mask;
-	delete [] types;
-	delete [] pop_nsmpl;
-	delete [] hdiv;
-	delete [] nhaps;
-	delete [] piw;
-	delete [] pib;
-	delete [] ehhs;
-	delete [] minDxy;
-	delete [] diff_matrix;
-	delete [] nsite_matrix;
+	int cap = 2 * seg_cap;
+
+	// segregating sites
+	if (segsites >= seg_cap)
+	{
+		types = arena.extend(types, seg_cap, cap);
+		seg_cap = cap;
+	}
 }
 
 void usageHaplo(const std::string msg)
 {
 	std::cerr << msg << std::endl << std::endl;
-	std::cerr << "Usage:   popbam haplo [options] <in.bam> [region]" << std::endl;
+	std::cerr << "Usage:   popbam haplo [options] <in1.bam|-> [in2.bam ...] [region]" << std::endl;
 	std::cerr << std::endl;
 	std::cerr << "Options: -i          base qualities are Illumina 1.3+               [ default: Sanger ]" << std::endl;
 	std::cerr << "         -h  FILE    Input header file                              [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -G  FILE    sample to population map of a bgzipped VCF file given as input" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads                     [ default: 1 ]" << std::endl;
+	std::cerr << "         -O  FILE    write results to FILE, compressed with BGZF and indexed for tabix" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
 	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
 	std::cerr << "         -k  FLT     minimum proportion of sites covered in window  [ default: 0.5 ]" << std::endl;
 	std::cerr << "         -n  FLT     minimum proportion of population covered       [ default: 1.0 ]" << std::endl;
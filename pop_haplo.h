@@ -33,9 +33,6 @@ class haploData: public popbamData
 		// constructor
 		haploData(const popbamOptions&);
 
-		// destructor
-		~haploData(void);
-
 		// member public variables
 		double minSites;                            //!< User-specified minimum number of aligned sites to perform analysis
 		double minPop;                              //!< Minimum proportion of samples present
@@ -46,6 +43,7 @@ class haploData: public popbamData
 
 		// member public functions
 		int allocHaplo(void);
+		void growSites(void);
 		int calcHaplo(void);
 		int printHaplo(const std::string);
 
@@ -68,27 +66,17 @@ class haploData: public popbamData
 /// Function prototypes
 ///
 
-/*!
-* \fn unsigned long long *callBase(bam_sample_t *sm, errmod_t *em, int n, const bam_pileup1_t *pl)
-* \brief Calls the base from the pileup at each position
-* \param sm     Pointer to the sample data structure
-* \param em     Pointer to the error model structure
-* \param n      The number of reads in the pileup
-* \param pl     Pointer to the pileup
-* \return       Pointer to the consensus base call information for the individuals
-*/
-template unsigned long long* callBase<haploData>(haploData *t, int n, const bam_pileup1_t *pl);
-
 /*!
  * \fn int make_haplo(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
  * \brief Calculate haplotype-based statistics
+ * \tparam F Option flags the callback is compiled for
  * \param tid Chromosome identifier
  * \param pos Genomic position
  * \param n The read depth
  * \param pl A pointer to the alignment covering a single position
  * \param data A pointer to the user-passed data
  */
-int makeHaplo(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+template <unsigned int F> int makeHaplo(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
 
 void usageHaplo(const std::string);
 
@@ -0,0 +1,405 @@
+/** \file pop_index.cpp
+ *  \brief Functions for building the index of a BAM file
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "pop_index.h"
+#include "getopt_pp.h"
+#include "bam_endian.h"
+
+///
+/// Definitions
+///
+
+/*! \def BATCH_BLOCKS
+ *  \brief Number of BGZF blocks inflated together
+ */
+#define BATCH_BLOCKS 256
+
+/*! \def BLOCK_HEADER_LENGTH
+ *  \brief Length of the gzip header of a BGZF block
+ */
+#define BLOCK_HEADER_LENGTH 18
+
+/*! \def BLOCK_FOOTER_LENGTH
+ *  \brief Length of the CRC32 and ISIZE fields ending a BGZF block
+ */
+#define BLOCK_FOOTER_LENGTH 8
+
+/*! \def MAX_BLOCK_SIZE
+ *  \brief Largest size of an inflated BGZF block
+ */
+#define MAX_BLOCK_SIZE 0x10000
+
+int mainIndex(int argc, char *argv[])
+{
+	int nthreads = 1;                     //! number of inflating threads
+	std::string msg;                      //! string for error message
+	std::vector<std::string> bamfiles;    //! input BAM files
+
+	// get the popbam function and iterate argv
+	argv++;
+	argc--;
+
+	GetOpt::GetOpt_pp args(argc, argv);
+
+	args >> GetOpt::Option('j', nthreads);
+	args >> GetOpt::GlobalOption(bamfiles);
+
+	if (bamfiles.empty())
+		usageIndex("Need to specify BAM file name");
+
+	if (nthreads < 1)
+		usageIndex("Need at least one thread for inflating input files");
+
+	for (size_t i = 0; i < bamfiles.size(); i++)
+	{
+		if (!is_file_exist(bamfiles[i].c_str()))
+		{
+			msg = "Specified input file: " + bamfiles[i] + " does not exist";
+			usageIndex(msg);
+		}
+	}
+
+	for (size_t i = 0; i < bamfiles.size(); i++)
+	{
+		bamIndexer x(bamfiles[i], nthreads);
+
+		if (x.build() < 0)
+		{
+			msg = "Failed to build index for BAM file " + bamfiles[i];
+			fatalError(msg);
+		}
+	}
+
+	return 0;
+}
+
+bamIndexer::bamIndexer(const std::string &fn, int nt)
+{
+	bamfile = fn;
+	fp = nullptr;
+	coffset = 0;
+	skip = 0;
+	nthreads = nt;
+	n[0] = n[1] = 0;
+	need = 4;
+	b = bam_init1();
+	bi = nullptr;
+}
+
+bamIndexer::~bamIndexer(void)
+{
+	waitInflate();
+
+	if (fp)
+		fclose(fp);
+	if (bi)
+		bam_index_destroy(bam_index_builder_finish(bi, 0));
+	bam_destroy1(b);
+}
+
+int bamIndexer::build(void)
+{
+	int ret = 0;
+	int slot = 0;
+	unsigned long long off = 0;
+	bamFile bf;
+	bam_header_t *h;
+	bam_index_t *idx;
+	FILE *fpidx;
+	std::string idxfile;
+
+	// the header is read through the BGZF layer to find the first alignment
+	if ((bf = bam_open(bamfile.c_str(), "r")) == 0)
+		return -1;
+
+	if ((h = bam_header_read(bf)) == 0)
+	{
+		bam_close(bf);
+		return -1;
+	}
+
+	off = bam_tell(bf);
+	bi = bam_index_builder_init(h->n_targets, off);
+	bam_header_destroy(h);
+	bam_close(bf);
+
+	// the blocks after the header are read raw
+	if ((fp = fopen(bamfile.c_str(), "rb")) == 0)
+		return -1;
+
+	coffset = off >> 16;
+	skip = off & 0xffff;
+
+	if (fseeko(fp, coffset, SEEK_SET) < 0)
+		return -1;
+
+	// inflate the next batch while the current one is parsed
+	if (readBlocks(slot) < 0)
+		return -1;
+	startInflate(slot);
+
+	for (;;)
+	{
+		waitInflate();
+
+		if (n[slot] == 0)
+			break;
+
+		if ((ret = readBlocks(slot ^ 1)) < 0)
+			break;
+
+		startInflate(slot ^ 1);
+
+		if ((ret = parseBlocks(slot)) < 0)
+			break;
+
+		slot ^= 1;
+	}
+
+	waitInflate();
+
+	if (ret < 0)
+		return ret;
+
+	if (!rec.empty())
+		std::cerr << "Alignment truncated at the end of BAM file " << bamfile << ", continuing anyway" << std::endl;
+
+	idx = bam_index_builder_finish(bi, coffset << 16);
+	bi = nullptr;
+
+	if (!idx)
+		return -1;
+
+	idxfile = bamfile + ".bai";
+	if ((fpidx = fopen(idxfile.c_str(), "wb")) == 0)
+	{
+		bam_index_destroy(idx);
+		return -1;
+	}
+
+	bam_index_save(idx, fpidx);
+	fclose(fpidx);
+	bam_index_destroy(idx);
+
+	return 0;
+}
+
+int bamIndexer::readBlocks(int slot)
+{
+	int i = 0;
+	int csize = 0;
+	size_t count = 0;
+	unsigned char header[BLOCK_HEADER_LENGTH];
+	std::vector<bgzfBlock_t> &blocks = batch[slot];
+
+	for (i = 0; i < BATCH_BLOCKS; i++)
+	{
+		if ((count = fread(header, 1, BLOCK_HEADER_LENGTH, fp)) == 0)
+			break;
+
+		// only the standard BGZF header with a single BC extra field is accepted
+		if ((count != BLOCK_HEADER_LENGTH) || (header[0] != 31) || (header[1] != 139) || (header[2] != 8) ||
+			!(header[3] & 4) || (header[10] != 6) || (header[11] != 0) || (header[12] != 'B') || (header[13] != 'C'))
+		{
+			std::cerr << "Invalid BGZF block at offset " << coffset << " of BAM file " << bamfile << std::endl;
+			return -1;
+		}
+
+		csize = (header[16] | (header[17] << 8)) + 1;
+		if (csize < BLOCK_HEADER_LENGTH + BLOCK_FOOTER_LENGTH)
+			return -1;
+
+		if (i == (int)blocks.size())
+			blocks.push_back(bgzfBlock_t());
+
+		bgzfBlock_t &blk = blocks[i];
+		blk.coffset = coffset;
+		blk.csize = csize;
+		blk.cdata.resize(csize);
+		memcpy(&blk.cdata[0], header, BLOCK_HEADER_LENGTH);
+
+		if (fread(&blk.cdata[BLOCK_HEADER_LENGTH], 1, csize - BLOCK_HEADER_LENGTH, fp) != (size_t)(csize - BLOCK_HEADER_LENGTH))
+		{
+			std::cerr << "Truncated BGZF block at offset " << coffset << " of BAM file " << bamfile << std::endl;
+			return -1;
+		}
+
+		coffset += csize;
+	}
+
+	n[slot] = i;
+
+	return i;
+}
+
+void bamIndexer::startInflate(int slot)
+{
+	next_block = 0;
+
+	for (int t = 0; t < nthreads; t++)
+		workers.push_back(std::thread(&bamIndexer::inflateBlocks, this, slot));
+}
+
+void bamIndexer::waitInflate(void)
+{
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	workers.clear();
+}
+
+void bamIndexer::inflateBlocks(int slot)
+{
+	int i = 0;
+	int ret = 0;
+	z_stream zs;
+
+	// claim blocks until the whole batch is inflated
+	while ((i = next_block++) < n[slot])
+	{
+		bgzfBlock_t &blk = batch[slot][i];
+		unsigned char *c = &blk.cdata[0];
+		unsigned char *footer = c + blk.csize - 4;
+
+		blk.usize = footer[0] | (footer[1] << 8) | (footer[2] << 16) | (footer[3] << 24);
+		blk.udata.resize(MAX_BLOCK_SIZE);
+
+		memset(&zs, 0, sizeof(z_stream));
+		zs.next_in = c + BLOCK_HEADER_LENGTH;
+		zs.avail_in = blk.csize - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
+		zs.next_out = &blk.udata[0];
+		zs.avail_out = MAX_BLOCK_SIZE;
+
+		if (inflateInit2(&zs, -15) != Z_OK)
+		{
+			blk.status = -1;
+			continue;
+		}
+
+		ret = inflate(&zs, Z_FINISH);
+		blk.status = ((ret == Z_STREAM_END) && ((int)zs.total_out == blk.usize)) ? 0 : -1;
+		inflateEnd(&zs);
+	}
+}
+
+int bamIndexer::parseBlocks(int slot)
+{
+	int pos = 0;
+	int block_len = 0;
+	size_t take = 0;
+	unsigned long long end_off = 0;
+
+	for (int i = 0; i < n[slot]; i++)
+	{
+		bgzfBlock_t &blk = batch[slot][i];
+		const unsigned char *u = &blk.udata[0];
+
+		if (blk.status < 0)
+		{
+			std::cerr << "Failed to inflate BGZF block at offset " << blk.coffset << " of BAM file " << bamfile << std::endl;
+			return -1;
+		}
+
+		// the header may end partway into the first block
+		pos = skip;
+		skip = 0;
+
+		while (pos < blk.usize)
+		{
+			take = std::min(need - rec.size(), (size_t)(blk.usize - pos));
+			rec.insert(rec.end(), u + pos, u + pos + take);
+			pos += take;
+
+			if (rec.size() < need)
+				continue;
+
+			if (need == 4)
+			{
+				// the length of the record is known; collect the rest of it
+				memcpy(&block_len, &rec[0], 4);
+				if (bam_is_be)
+					bam_swap_endian_4p(&block_len);
+				if (block_len < (int)BAM_CORE_SIZE)
+					return -1;
+				need += block_len;
+				continue;
+			}
+
+			// a record ending with its block ends at the start of the next block
+			if (pos == blk.usize)
+				end_off = (blk.coffset + blk.csize) << 16;
+			else
+				end_off = (blk.coffset << 16) | pos;
+
+			if (pushRecord(end_off) < 0)
+				return -1;
+
+			rec.clear();
+			need = 4;
+		}
+	}
+
+	return 0;
+}
+
+int bamIndexer::pushRecord(unsigned long long end_off)
+{
+	int i = 0;
+	unsigned int x[8];
+	unsigned int *cigar = nullptr;
+	bam1_core_t *c = &b->core;
+	const unsigned char *r = &rec[4];
+
+	memcpy(x, r, BAM_CORE_SIZE);
+
+	if (bam_is_be)
+		for (i = 0; i < 8; ++i)
+			bam_swap_endian_4p(x + i);
+
+	// same unpacking as bam_read1()
+	c->tid = x[0];
+	c->pos = x[1];
+	c->bin = x[2] >> 16;
+	c->qual = x[2] >> 8 & 0xff;
+	c->l_qname = x[2] & 0xff;
+	c->flag = x[3] >> 16;
+	c->n_cigar = x[3] & 0xffff;
+	c->l_qseq = x[4];
+	c->mtid = x[5];
+	c->mpos = x[6];
+	c->isize = x[7];
+	b->data_len = rec.size() - 4 - BAM_CORE_SIZE;
+
+	if (b->m_data < b->data_len)
+	{
+		b->m_data = b->data_len;
+		kroundup32(b->m_data);
+		b->data = (unsigned char*)realloc(b->data, b->m_data);
+	}
+
+	memcpy(b->data, r + BAM_CORE_SIZE, b->data_len);
+	b->l_aux = b->data_len - c->n_cigar * 4 - c->l_qname - c->l_qseq - (c->l_qseq + 1) / 2;
+
+	// only the CIGAR is read by the index builder
+	if (bam_is_be)
+	{
+		cigar = bam1_cigar(b);
+		for (i = 0; i < (int)c->n_cigar; ++i)
+			bam_swap_endian_4p(cigar + i);
+	}
+
+	return bam_index_builder_push(bi, b, end_off);
+}
+
+void usageIndex(const std::string msg)
+{
+	std::cerr << msg << std::endl << std::endl;
+	std::cerr << "Usage:   popbam index [options] <in1.bam> [in2.bam ...]" << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "Options: -j  INT     number of inflating threads          [ default: 1 ]" << std::endl;
+	std::cerr << std::endl;
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,73 @@
+/** \file pop_index.h
+ *  \brief Header for the pop_index.cpp file
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "popbam.h"
+#include <zlib.h>
+
+//
+// Define data structures
+//
+
+/*!
+ * \class bamIndexer
+ * \brief Builds the BAI index of a BAM file, inflating its BGZF blocks on several threads
+ */
+class bamIndexer
+{
+	public:
+		// constructor
+		bamIndexer(const std::string &fn, int nthreads);
+
+		// destructor
+		~bamIndexer(void);
+
+		// member public functions
+		int build(void);
+
+	private:
+		/*!
+		 * \struct bgzfBlock_t
+		 * \brief One compressed block of the input file and its inflated contents
+		 */
+		typedef struct
+		{
+			unsigned long long coffset;         //!< File offset of the block
+			int csize;                          //!< Size of the compressed block
+			int usize;                          //!< Size of the inflated block
+			int status;                         //!< 0 if the block inflated cleanly
+			std::vector<unsigned char> cdata;   //!< The compressed block
+			std::vector<unsigned char> udata;   //!< The inflated block
+		} bgzfBlock_t;
+
+		// member private functions
+		int readBlocks(int slot);
+		int parseBlocks(int slot);
+		int pushRecord(unsigned long long end_off);
+		void inflateBlocks(int slot);
+		void startInflate(int slot);
+		void waitInflate(void);
+
+		// member private variables
+		std::string bamfile;                    //!< File name of the input BAM file
+		FILE *fp;                               //!< Raw stream of the input file
+		unsigned long long coffset;             //!< File offset of the next block to be read
+		int skip;                               //!< Bytes of the first block already taken by the header
+		int nthreads;                           //!< Number of inflating threads
+		std::vector<bgzfBlock_t> batch[2];      //!< Blocks being parsed and blocks being inflated
+		int n[2];                               //!< Number of blocks in each batch
+		std::vector<std::thread> workers;       //!< Threads inflating the next batch
+		std::atomic<int> next_block;            //!< Next block to be claimed by an inflating thread
+		std::vector<unsigned char> rec;         //!< Bytes of the alignment record being assembled
+		size_t need;                            //!< Bytes needed to complete the length or the record
+		bam1_t *b;                              //!< The last decoded alignment
+		bam_index_builder_t *bi;                //!< Index under construction
+};
+
+///
+/// Function prototypes
+///
+
+void usageIndex(const std::string);
@@ -0,0 +1,306 @@
+/** \file pop_kernels.cpp
+ *  \brief Population count kernels selected for the running processor
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "popbam.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+#include <immintrin.h>
+#if defined(__clang__) ? (__clang_major__ >= 6) : (__GNUC__ >= 8)
+#define KERNELS_AVX512
+#endif
+#endif
+
+///
+/// Definitions
+///
+
+/*! \def KERNEL_COUNT
+ *  \brief Count the bits of the first operand
+ */
+#define KERNEL_COUNT 0
+
+/*! \def KERNEL_AND
+ *  \brief Count the bits set in both operands
+ */
+#define KERNEL_AND 1
+
+/*! \def KERNEL_XOR
+ *  \brief Count the bits differing between the operands
+ */
+#define KERNEL_XOR 2
+
+/*!
+ * \fn static inline unsigned long long combine(unsigned long long x, unsigned long long y)
+ * \brief Combine two words according to the kernel operation
+ */
+template<int op>
+static inline unsigned long long combine(unsigned long long x, unsigned long long y)
+{
+	return op == KERNEL_AND ? x & y : (op == KERNEL_XOR ? x ^ y : x);
+}
+
+/*!
+ * \fn static unsigned long long countOne(const unsigned long long *a, int n)
+ * \brief Adapt an array kernel to a single operand
+ */
+template<unsigned long long (*f)(const unsigned long long*, const unsigned long long*, int)>
+static unsigned long long countOne(const unsigned long long *a, int n)
+{
+	return f(a, 0, n);
+}
+
+//
+// Portable kernels
+//
+
+static unsigned int countWord(unsigned long long x)
+{
+	x = (x & 0x5555555555555555ULL) + ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x & 0x0F0F0F0F0F0F0F0FULL) + ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+	return (x * 0x0101010101010101ULL) >> 56;
+}
+
+template<int op>
+static unsigned int countPair(unsigned long long x, unsigned long long y)
+{
+	return countWord(combine<op>(x, y));
+}
+
+template<int op>
+static unsigned long long countWords(const unsigned long long *a, const unsigned long long *b, int n)
+{
+	int i = 0;
+	unsigned long long total = 0;
+
+	for (i = 0; i < n; i++)
+		total += countWord(combine<op>(a[i], op == KERNEL_COUNT ? 0 : b[i]));
+
+	return total;
+}
+
+#ifdef KERNELS_X86
+
+//
+// Hardware POPCNT
+//
+
+__attribute__((target("popcnt")))
+static unsigned int countWordHW(unsigned long long x)
+{
+	return __builtin_popcountll(x);
+}
+
+template<int op>
+__attribute__((target("popcnt")))
+static unsigned int countPairHW(unsigned long long x, unsigned long long y)
+{
+	return __builtin_popcountll(combine<op>(x, y));
+}
+
+template<int op>
+__attribute__((target("popcnt")))
+static unsigned long long countWordsHW(const unsigned long long *a, const unsigned long long *b, int n)
+{
+	int i = 0;
+	unsigned long long total = 0;
+
+	for (i = 0; i < n; i++)
+		total += __builtin_popcountll(combine<op>(a[i], op == KERNEL_COUNT ? 0 : b[i]));
+
+	return total;
+}
+
+//
+// AVX2 Harley-Seal
+//
+
+template<int op>
+__attribute__((target("avx2")))
+static inline __m256i load256(const unsigned long long *a, const unsigned long long *b, int i)
+{
+	__m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+
+	if (op == KERNEL_AND)
+		return _mm256_and_si256(x, _mm256_loadu_si256((const __m256i*)(b + i)));
+	else if (op == KERNEL_XOR)
+		return _mm256_xor_si256(x, _mm256_loadu_si256((const __m256i*)(b + i)));
+	return x;
+}
+
+/*!
+ * \fn static inline __m256i count256(__m256i v)
+ * \brief Count the bits of each 64-bit lane by nibble table lookup
+ */
+__attribute__((target("avx2")))
+static inline __m256i count256(__m256i v)
+{
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, low));
+	__m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+/*!
+ * \fn static inline void csa256(__m256i &h, __m256i &l, __m256i a, __m256i b, __m256i c)
+ * \brief Carry-save adder of three bit vectors
+ */
+__attribute__((target("avx2")))
+static inline void csa256(__m256i &h, __m256i &l, __m256i a, __m256i b, __m256i c)
+{
+	__m256i u = _mm256_xor_si256(a, b);
+
+	h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+	l = _mm256_xor_si256(u, c);
+}
+
+template<int op>
+__attribute__((target("avx2,popcnt")))
+static unsigned long long countWordsAVX2(const unsigned long long *a, const unsigned long long *b, int n)
+{
+	int i = 0;
+	unsigned long long total = 0;
+	__m256i sum = _mm256_setzero_si256();
+	__m256i ones = _mm256_setzero_si256();
+	__m256i twos = _mm256_setzero_si256();
+	__m256i fours = _mm256_setzero_si256();
+	__m256i eights = _mm256_setzero_si256();
+	__m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+
+	// sixteen vectors are reduced to one count per iteration
+	for (; i + 64 <= n; i += 64)
+	{
+		csa256(twosA, ones, ones, load256<op>(a, b, i), load256<op>(a, b, i + 4));
+		csa256(twosB, ones, ones, load256<op>(a, b, i + 8), load256<op>(a, b, i + 12));
+		csa256(foursA, twos, twos, twosA, twosB);
+		csa256(twosA, ones, ones, load256<op>(a, b, i + 16), load256<op>(a, b, i + 20));
+		csa256(twosB, ones, ones, load256<op>(a, b, i + 24), load256<op>(a, b, i + 28));
+		csa256(foursB, twos, twos, twosA, twosB);
+		csa256(eightsA, fours, fours, foursA, foursB);
+		csa256(twosA, ones, ones, load256<op>(a, b, i + 32), load256<op>(a, b, i + 36));
+		csa256(twosB, ones, ones, load256<op>(a, b, i + 40), load256<op>(a, b, i + 44));
+		csa256(foursA, twos, twos, twosA, twosB);
+		csa256(twosA, ones, ones, load256<op>(a, b, i + 48), load256<op>(a, b, i + 52));
+		csa256(twosB, ones, ones, load256<op>(a, b, i + 56), load256<op>(a, b, i + 60));
+		csa256(foursB, twos, twos, twosA, twosB);
+		csa256(eightsB, fours, fours, foursA, foursB);
+		csa256(sixteens, eights, eights, eightsA, eightsB);
+		sum = _mm256_add_epi64(sum, count256(sixteens));
+	}
+
+	sum = _mm256_slli_epi64(sum, 4);
+	sum = _mm256_add_epi64(sum, _mm256_slli_epi64(count256(eights), 3));
+	sum = _mm256_add_epi64(sum, _mm256_slli_epi64(count256(fours), 2));
+	sum = _mm256_add_epi64(sum, _mm256_slli_epi64(count256(twos), 1));
+	sum = _mm256_add_epi64(sum, count256(ones));
+
+	for (; i + 4 <= n; i += 4)
+		sum = _mm256_add_epi64(sum, count256(load256<op>(a, b, i)));
+
+	total = (unsigned long long)_mm256_extract_epi64(sum, 0) + (unsigned long long)_mm256_extract_epi64(sum, 1) +
+	        (unsigned long long)_mm256_extract_epi64(sum, 2) + (unsigned long long)_mm256_extract_epi64(sum, 3);
+
+	for (; i < n; i++)
+		total += __builtin_popcountll(combine<op>(a[i], op == KERNEL_COUNT ? 0 : b[i]));
+
+	return total;
+}
+
+#ifdef KERNELS_AVX512
+
+//
+// AVX-512 VPOPCNTDQ
+//
+
+template<int op>
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static unsigned long long countWordsAVX512(const unsigned long long *a, const unsigned long long *b, int n)
+{
+	int i = 0;
+	__m512i x;
+	__m512i sum = _mm512_setzero_si512();
+	__mmask8 m = 0xff;
+
+	// the last partial vector is read through a mask
+	for (i = 0; i < n; i += 8)
+	{
+		if (n - i < 8)
+			m = (__mmask8)((1U << (n - i)) - 1);
+		x = _mm512_maskz_loadu_epi64(m, a + i);
+		if (op == KERNEL_AND)
+			x = _mm512_and_si512(x, _mm512_maskz_loadu_epi64(m, b + i));
+		else if (op == KERNEL_XOR)
+			x = _mm512_xor_si512(x, _mm512_maskz_loadu_epi64(m, b + i));
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+	}
+
+	return _mm512_reduce_add_epi64(sum);
+}
+
+#endif
+#endif
+
+//
+// Kernel selection
+//
+
+/*!
+ * \fn static bitKernels_t selectKernels(void)
+ * \brief Choose the fastest kernels the processor supports
+ */
+static bitKernels_t selectKernels(void)
+{
+	bitKernels_t k;
+
+	k.count = countWord;
+	k.countAnd = countPair<KERNEL_AND>;
+	k.countXor = countPair<KERNEL_XOR>;
+	k.countArray = countOne<countWords<KERNEL_COUNT>>;
+	k.countAndArray = countWords<KERNEL_AND>;
+	k.countXorArray = countWords<KERNEL_XOR>;
+	k.name = "generic";
+
+#ifdef KERNELS_X86
+	__builtin_cpu_init();
+
+	if (!__builtin_cpu_supports("popcnt"))
+		return k;
+
+	k.count = countWordHW;
+	k.countAnd = countPairHW<KERNEL_AND>;
+	k.countXor = countPairHW<KERNEL_XOR>;
+	k.countArray = countOne<countWordsHW<KERNEL_COUNT>>;
+	k.countAndArray = countWordsHW<KERNEL_AND>;
+	k.countXorArray = countWordsHW<KERNEL_XOR>;
+	k.name = "popcnt";
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		k.countArray = countOne<countWordsAVX2<KERNEL_COUNT>>;
+		k.countAndArray = countWordsAVX2<KERNEL_AND>;
+		k.countXorArray = countWordsAVX2<KERNEL_XOR>;
+		k.name = "avx2";
+	}
+
+#ifdef KERNELS_AVX512
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+	{
+		k.countArray = countOne<countWordsAVX512<KERNEL_COUNT>>;
+		k.countAndArray = countWordsAVX512<KERNEL_AND>;
+		k.countXorArray = countWordsAVX512<KERNEL_XOR>;
+		k.name = "avx512vpopcntdq";
+	}
+#endif
+#endif
+
+	return k;
+}
+
+bitKernels_t kernels = selectKernels();
@@ -7,14 +7,8 @@
 
 int mainLD(int argc, char *argv[])
 {
-	int chr = 0;                  //! chromosome identifier
-	int beg = 0;                  //! beginning coordinate for analysis
-	int end = 0;                  //! end coordinate for analysis
-	int ref = 0;                  //! ref
-	long num_windows = 0;         //! number of windows
-	std::string msg;              //! string for error message
-	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
-	bam_plbuf_t *buf = nullptr;   //! pileup buffer
+	bam_pileup_f func = nullptr;  //! pileup callback
+	popbamData *t = nullptr;      //! ld data structure
 
 	// initialize user command line options
 	popbamOptions p(argc, argv);
@@ -25,117 +19,68 @@ int mainLD(int argc, char *argv[])
 	// check input BAM file for errors
 	p.checkBAM();
 
-	// initialize the sample data structure
-	sm = bam_smpl_init();
+	// set up the ld analysis
+	t = initLD(p, &func);
 
-	// add samples
-	bam_smpl_add(sm, &p);
+	// results go to a compressed and indexed file instead of stdout
+	if (!p.outfile.empty())
+		openResults(p, "ld", t, p.outfile);
 
-	// initialize the ld data structre
-	ldData t(p);
-	t.sm = sm;
+	// iterate through all windows along specified genomic region or all target regions
+	runWindows(p, std::vector<popbamData*>(1, t), func, t);
 
-	// initialize error model
-	t.em = errmod_init(0.17);
-
-	// parse genomic region
-	int k = bam_parse_region(p.h, p.region, &chr, &beg, &end);
-	if (k < 0)
-	{
-		msg = "Bad genome coordinates: " + p.region;
-		fatalError(msg);
-	}
+	if (!p.outfile.empty())
+		closeResults(t, p.outfile);
 
-	// fetch reference sequence
-	t.ref_base = faidx_fetch_seq(p.fai_file, p.h->target_name[chr], 0, 0x7fffffff, &(t.len));
+	delete t;
+	p.closeBAM();
 
-	// calculate the number of windows
-	if (p.flag & BAM_WINDOW)
-		num_windows = ((end - beg) - 1) / p.winSize;
-	else
-	{
-		p.winSize = end - beg;
-		num_windows = 1;
-	}
+	return 0;
+}
 
-	// iterate through all windows along specified genomic region
-	for (long i = 0; i < num_windows; ++i)
-	{
+popbamData *initLD(const popbamOptions &p, bam_pileup_f *func)
+{
+	ldData *t = nullptr;
 
-		// construct genome coordinate string
-		std::string scaffold_name(p.h->target_name[chr]);
-		std::ostringstream winc(scaffold_name);
+	// initialize the ld data structure
+	t = new ldData(p);
 
-		winc.seekp(0, std::ios::end);
-		winc << ':' << beg + (i * p.winSize) + 1 << '-' << ((i + 1) * p.winSize) + (beg - 1);
+	// initialize the sample data structure and add samples
+	t->sm = bam_smpl_init();
+	bam_smpl_add(t->sm, &p);
 
-		std::string winCoord = winc.str();
+	// initialize error model
+	t->em = errmod_init(0.17);
 
+	// steps opening and closing each window; site-count windows also take them from the pileup
+	t->openWindow = [t, &p](void)
+	{
 		// initialize number of sites to zero
-		t.num_sites = 0;
-
-		// parse the BAM file and check if region is retrieved from the reference
-		if (p.flag & BAM_WINDOW)
-		{
-			k = bam_parse_region(p.h, winCoord, &ref, &(t.beg), &(t.end));
-			if (k < 0)
-			{
-				msg = "Bad window coordinates " + winCoord;
-				fatalError(msg);
-			}
-		}
-		else
-		{
-			ref = chr;
-			t.beg = beg;
-			t.end = end;
-			if (ref < 0)
-			{
-				msg = "Bad scaffold name: " + p.region;
-				fatalError(msg);
-			}
-		}
+		t->num_sites = 0;
 
 		// initialize nucdiv variables
-		t.allocLD();
+		t->allocLD();
 
 		// create population assignments
-		t.assignPops(&p);
-
-		// initialize pileup
-		buf = bam_plbuf_init(makeLD, &t);
-
-		// fetch region from bam file
-		if ((bam_fetch(p.bam_in->x.bam, p.idx, ref, t.beg, t.end, buf, fetch_func)) < 0)
-		{
-			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
-			fatalError(msg);
-		}
-
-		// finalize pileup
-		bam_plbuf_push(0, buf);
+		t->assignPops(&p);
+	};
 
+	t->closeWindow = [t, &p](void)
+	{
 		// calculate linkage disequilibrium statistics
 		ld_func fp[3] = {&ldData::calcZns, &ldData::calcOmegamax, &ldData::calcWall};
-		(t.*fp[p.output])();
+		(t->*fp[p.output])();
 
-		// print results to stdout
-		t.printLD(std::string(p.h->target_name[chr]));
+		// print results
+		t->printLD(std::string(p.h->target_name[t->tid]));
+	};
 
-		// take out the garbage
-		bam_plbuf_destroy(buf);
-	}
-	// end of window interation
+	*func = PICK_PILEUP(makeLD, p.flag);
 
-	errmod_destroy(t.em);
-	samclose(p.bam_in);
-	bam_index_destroy(p.idx);
-	bam_smpl_destroy(sm);
-	free(t.ref_base);
-
-	return 0;
+	return t;
 }
 
+template <unsigned int F>
 int makeLD(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
 {
 	int i = 0;
@@ -147,18 +92,28 @@ int makeLD(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, v
 	// get control data structure
 	t = (ldData*)data;
 
-	// only consider sites located in designated region
-	if ((t->beg <= (int)pos) && (t->end > (int)pos))
+	// site-count windows are closed as the pileup moves past them
+	if (t->winSites > 0)
+		t->checkWindow(pos);
+
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
 	{
+		// make room for one more site
+		t->growSites();
+
 		// call bases
-		cb = callBase(t, n, pl);
+		cb = callBase<F>(t, n, pl);
 
-		// resolve heterozygous sites
-		if (!(t->flag & BAM_HETEROZYGOTE))
+		// resolve heterozygous sites; haploid calls have none and diploid counts keep them
+		if (!(F & (BAM_HETEROZYGOTE | BAM_HAPLOID | BAM_DIPLOID)))
 			cleanHeterozygotes(t->sm->n, cb, (int)t->ref_base[pos], t->minSNPQ);
 
 		// determine if site is segregating
-		fq = segBase(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
+		if (F & BAM_DIPLOID)
+			fq = segGenotype(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
+		else
+			fq = segBase(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
 
 		// determine how many samples pass the quality filters
 		sample_cov = qualFilter(t->sm->n, cb, t->minRMSQ, t->minDepth, t->maxDepth);
@@ -168,7 +123,7 @@ int makeLD(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, v
 		{
 			unsigned long long pc = 0;
 			pc = sample_cov & t->pop_mask[i];
-			unsigned int ncov = bitcount64(pc);
+			unsigned int ncov = kernels.count(pc);
 			if (ncov == t->pop_nsmpl[i])
 				t->pop_cov[t->num_sites] |= 0x1U << i;
 		}
@@ -178,7 +133,11 @@ int makeLD(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, v
 		{
 			t->num_sites++;
 			if (fq > 0)
+			{
+				if (F & BAM_DIPLOID)
+					t->homs[t->segsites] = calculateHomType(t->sm->n, cb);
 				t->types[t->segsites++] = calculateSiteType(t->sm->n, cb);
+			}
 		}
 
 		// take out the garbage
@@ -207,14 +166,14 @@ int ldData::calcZns(void)
 	{
 		// Zero the SNP counter
 		num_snps[i] = 0;
-		n = pop_nsmpl[i];
+		n = (flag & BAM_DIPLOID) ? 2 * pop_nsmpl[i] : pop_nsmpl[i];
 
 		// iterate through segregating sites
 		for (j = 0; j < segsites - 1; j++)
 		{
 			// get first population-specific site and count of the "derived" allele
 			type0 = types[j] & pop_mask[i];
-			x0 = bitcount64(type0);
+			x0 = derivedCount(j, pop_mask[i]);
 
 			// if site 1 is variable within the population of interest
 			if ((x0 >= minFreq) && (x0 <= (n - minFreq)))
@@ -227,13 +186,18 @@ int ldData::calcZns(void)
 				{
 					// get second population-specific site and count of the "derived" allele
 					type1 = types[k] & pop_mask[i];
-					x1 = bitcount64(type1);
+					x1 = derivedCount(k, pop_mask[i]);
 
 					// if site 2 is variable within the population of interest -> calculate r2
 					if ((x1 >= minFreq) && (x1 <= (n - minFreq)))
 					{
-						x11 = bitcount64(type0 & type1);
-						zns[i] += SQ(x0 * x1 - n * x11) / (double)((n - x0) * x0 * (n - x1) * x1);
+						if (flag & BAM_DIPLOID)
+							zns[i] += genotypeR2(j, k, pop_mask[i], x0, x1, pop_nsmpl[i]);
+						else
+						{
+							x11 = kernels.countAnd(type0, type1);
+							zns[i] += SQ(x0 * x1 - n * x11) / (double)((n - x0) * x0 * (n - x1) * x1);
+						}
 					}
 				}
 			}
@@ -290,12 +254,12 @@ int ldData::calcOmegamax(void)
 		num_snps[j] = 0;
 		count1 = 0;
 		count2 = 0;
-		n = pop_nsmpl[j];
+		n = (flag & BAM_DIPLOID) ? 2 * pop_nsmpl[j] : pop_nsmpl[j];
 
 		for (i = 0; i < segsites - 1; i++)
 		{
 			type0 = types[i] & pop_mask[j];
-			x0 = bitcount64(type0);
+			x0 = derivedCount(i, pop_mask[j]);
 
 			// if site 1 is variable within the population of interest
 			if ((x0 >= minFreq) && (x0 <= (n - minFreq)))
@@ -305,7 +269,7 @@ int ldData::calcOmegamax(void)
 				for (k = i + 1; k < segsites; k++)
 				{
 					type1 = types[k] & pop_mask[j];
-					x1 = bitcount64(type1);
+					x1 = derivedCount(k, pop_mask[j]);
 
 					// if site 2 is variable within the population of interest
 					if ((x1 >= minFreq) && (x1 <= (n - minFreq)))
@@ -313,8 +277,13 @@ int ldData::calcOmegamax(void)
 						++count2;
 
 						// calculate r2
-						x11 = bitcount64(type0 & type1);
-						r2[count1][count2] = SQ(x0 * x1 - n * x11) / (double)((n - x0) * x0 * (n - x1) * x1);
+						if (flag & BAM_DIPLOID)
+							r2[count1][count2] = genotypeR2(i, k, pop_mask[j], x0, x1, pop_nsmpl[j]);
+						else
+						{
+							x11 = kernels.countAnd(type0, type1);
+							r2[count1][count2] = SQ(x0 * x1 - n * x11) / (double)((n - x0) * x0 * (n - x1) * x1);
+						}
 						r2[count2][count1] = r2[count1][count2];
 					}
 				}
@@ -372,6 +341,33 @@ int ldData::calcOmegamax(void)
 	return 0;
 }
 
+double ldData::genotypeR2(int s0, int s1, unsigned long long mask, int x0, int x1, int n) const
+{
+	double sxy = 0.0;
+	double sxx = 0.0;
+	double syy = 0.0;
+	double den = 0.0;
+	unsigned long long p0 = types[s0] & mask;
+	unsigned long long p1 = types[s1] & mask;
+	unsigned long long h0 = homs[s0] & mask;
+	unsigned long long h1 = homs[s1] & mask;
+
+	// the genotype of an individual counts its derived alleles, one from the
+	// carrier plane and one more from the homozygote plane, so the sums of
+	// squares and products are popcounts of the planes and their overlaps
+	sxx = kernels.count(p0) + 3.0 * kernels.count(h0);
+	syy = kernels.count(p1) + 3.0 * kernels.count(h1);
+	sxy = (double)kernels.countAnd(p0, p1) + kernels.countAnd(p0, h1) + kernels.countAnd(h0, p1) + kernels.countAnd(h0, h1);
+
+	// composite r2 is the squared correlation of genotypes across individuals;
+	// a site where every individual has the same genotype carries no information
+	den = (n * sxx - (double)x0 * x0) * (n * syy - (double)x1 * x1);
+	if (den <= 0.0)
+		return 0.0;
+
+	return SQ(n * sxy - (double)x0 * x1) / den;
+}
+
 int ldData::calcWall(void)
 {
 	int i = 0;
@@ -466,15 +462,14 @@ int ldData::calcWall(void)
 int ldData::printLD(const std::string scaffold)
 {
 	int i = 0;
-	std::stringstream out;
 
 	//print coordinate information and number of aligned sites
-	out << scaffold << '\t' << beg + 1 << '\t' << end + 1 << '\t' << num_sites;
+	os << scaffold << '\t' << beg + 1 << '\t' << lastBase() << '\t' << num_sites;
 
 	//print results for each population
 	for (i = 0; i < sm->npops; i++)
 	{
-		out << "\tS[" << sm->popul[i] << "]:\t" << num_snps[i];
+		os << "\tS[" << sm->popul[i] << "]:\t" << num_snps[i];
 
 		//If window passes the minimum number of SNPs filter
 		if (num_snps[i] >= minSNPs)
@@ -482,24 +477,24 @@ int ldData::printLD(const std::string scaffold)
 			switch (output)
 			{
 			case 0:
-				out << "\tZns[" << sm->popul[i] << "]:";
-				out << '\t' << std::fixed << std::setprecision(5) << zns[i];
+				os << "\tZns[" << sm->popul[i] << "]:";
+				os << '\t' << fixedValue(zns[i], 5);
 				break;
 			case 1:
-				out << "\tomax[" << sm->popul[i] << "]:";
-				out << '\t' << std::fixed << std::setprecision(5) << omegamax[i];
+				os << "\tomax[" << sm->popul[i] << "]:";
+				os << '\t' << fixedValue(omegamax[i], 5);
 				break;
 			case 2:
-				out << "\tB[" << sm->popul[i] << "]:";
-				out << '\t' << std::fixed << std::setprecision(5) << wallb[i];
-				out << "\tQ[" << sm->popul[i] << "]:";
-				out << "\t" << std::fixed << std::setprecision(5) << wallq[i];
+				os << "\tB[" << sm->popul[i] << "]:";
+				os << '\t' << fixedValue(wallb[i], 5);
+				os << "\tQ[" << sm->popul[i] << "]:";
+				os << "\t" << fixedValue(wallq[i], 5);
 				wallb[i] = 0.0;
 				wallq[i] = 0.0;
 				break;
 			default:
-				out << "\tZns[" << sm->popul[i] << "]:";
-				out << '\t' << std::fixed << std::setprecision(5) << zns[i];
+				os << "\tZns[" << sm->popul[i] << "]:";
+				os << '\t' << fixedValue(zns[i], 5);
 				break;
 			}
 		}
@@ -508,25 +503,25 @@ int ldData::printLD(const std::string scaffold)
 			switch (output)
 			{
 			case 0:
-				out << "\tZns[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+				os << "\tZns[" << sm->popul[i] << "]:\t     NA";
 				break;
 			case 1:
-				out << "\tomax[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+				os << "\tomax[" << sm->popul[i] << "]:\t     NA";
 				break;
 			case 2:
-				out << "\tB[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
-				out << "\tQ[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+				os << "\tB[" << sm->popul[i] << "]:\t     NA";
+				os << "\tQ[" << sm->popul[i] << "]:\t     NA";
 				wallb[i] = 0.0;
 				wallq[i] = 0.0;
 				break;
 			default:
-				out << "\tZns[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+				os << "\tZns[" << sm->popul[i] << "]:\t     NA";
 				break;
 			}
 		}
 	}
 
-	std::cout << out.str() << std::endl;
+	os << '\n';
 
 	return 0;
 }
@@ -535,7 +530,6 @@ int ldData::printLD(const std::string scaffold)
 ldData::ldData(const popbamOptions &p)
 {
 	// inherit values from popbamOptions
-	bamfile = p.bamfile;
 	flag = p.flag;
 	minDepth = p.minDepth;
 	maxDepth = p.maxDepth;
@@ -543,6 +537,8 @@ ldData::ldData(const popbamOptions &p)
 	minSNPQ = p.minSNPQ;
 	minMapQ = p.minMapQ;
 	minBaseQ = p.minBaseQ;
+	winSites = p.winSites;
+	winSpan = (flag & BAM_WINDOW) ? p.winSize : 0x7fffffff;
 	hetPrior = p.hetPrior;
 	output = p.output;
 	minSites = p.minSites;
@@ -558,32 +554,37 @@ ldData::ldData(const popbamOptions &p)
 
 int ldData::allocLD(void)
 {
-	int length = end - beg;
 	int npops = sm->npops;
 
+	// arrays of the previous window are given back to the arena
+	arena.reset();
 	segsites = 0;
+	site_cap = SITE_CHUNK;
+	seg_cap = SITE_CHUNK;
 
 	try
 	{
-		types = new unsigned long long [length]();
-		pop_mask = new unsigned long long [npops]();
-		pop_nsmpl = new unsigned char [npops]();
-		pop_cov = new unsigned int [length]();
-		num_snps = new int [npops]();
+		types = arena.alloc<unsigned long long>(seg_cap);
+		if (flag & BAM_DIPLOID)
+			homs = arena.alloc<unsigned long long>(seg_cap);
+		pop_mask = arena.alloc<unsigned long long>(npops);
+		pop_nsmpl = arena.alloc<unsigned char>(npops);
+		pop_cov = arena.alloc<unsigned int>(site_cap);
+		num_snps = arena.alloc<int>(npops);
 		switch (output)
 		{
 		case 0:
-			zns = new double [npops]();
+			zns = arena.alloc<double>(npops);
 			break;
 		case 1:
-			omegamax = new double [npops]();
+			omegamax = arena.alloc<double>(npops);
 			break;
 		case 2:
-			wallb = new double [npops]();
-			wallq = new double [npops]();
+			wallb = arena.alloc<double>(npops);
+			wallq = arena.alloc<double>(npops);
 			break;
 		default:
-			zns = new double [npops]();
+			zns = arena.alloc<double>(npops);
 			break;
 		}
 	}
@@ -595,44 +596,53 @@ int ldData::allocLD(void)
 	return 0;
 }
 
-ldData::~ldData(void)
+void ldData::growSites(void)
 {
-	delete [] pop_mask;
-	delete [] types;
-	delete [] pop_nsmpl;
-	delete [] pop_cov;
-	delete [] num_snps;
-	switch(output)
+	int cap = 2 * seg_cap;
+
+	// aligned sites
+	if (num_sites >= site_cap)
+	{
+		pop_cov = arena.extend(pop_cov, site_cap, 2 * site_cap);
+		site_cap *= 2;
+	}
+
+	// segregating sites
+	if (segsites >= seg_cap)
 	{
-	case 0:
-		delete[] zns;
-		break;
-	case 1:
-		delete [] omegamax;
-		break;
-	case 2:
-		delete [] wallb;
-		delete [] wallq;
-		break;
-	default:
-		delete [] zns;
-		break;
+		types = arena.extend(types, seg_cap, cap);
+		if (flag & BAM_DIPLOID)
+			homs = arena.extend(homs, seg_cap, cap);
+		seg_cap = cap;
 	}
 }
 
 void usageLD(const std::string msg)
 {
 	std::cerr << msg << std::endl << std::endl;
-	std::cerr << "Usage:   popbam ld [options] <in.bam> [region]" << std::endl;
+	std::cerr << "Usage:   popbam ld [options] <in1.bam|-> [in2.bam ...] [region]" << std::endl;
 	std::cerr << std::endl;
 	std::cerr << "Options: -i          base qualities are Illumina 1.3+               [ default: Sanger ]" << std::endl;
 	std::cerr << "         -h  FILE    Input header file                              [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -G  FILE    sample to population map of a bgzipped VCF file given as input" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -D          count alleles over both chromosomes of diploid individuals" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads                     [ default: 1 ]" << std::endl;
+	std::cerr << "         -O  FILE    write results to FILE, compressed with BGZF and indexed for tabix" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
 	std::cerr << "         -e          exclude singletons from LD calculations        [ default: include singletons ]" << std::endl;
 	std::cerr << "         -o  INT     analysis option                                [ default: 0 ]" << std::endl;
 	std::cerr << "                     0 : Kelly's ZnS statistic" << std::endl;
 	std::cerr << "                     1 : Omega max" << std::endl;
 	std::cerr << "                     2 : Wall's B and Q congruency statistics" << std::endl;
 	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
+	std::cerr << "         -g  INT     close windows after INT segregating sites (-w: longest window)" << std::endl;
+	std::cerr << "         -c  INT     close windows after INT callable sites (-w: longest window)" << std::endl;
 	std::cerr << "         -k  FLT     minimum proportion of aligned sites in window  [ default: 0.5 ]" << std::endl;
 	std::cerr << "         -f  FILE    reference fastA file" << std::endl;
 	std::cerr << "         -n  INT     mimimum number of snps to consider window      [ default: 10 ]" << std::endl;
@@ -30,9 +30,6 @@ class ldData: public popbamData
 		// constructor
 		ldData(const popbamOptions&);
 
-		// destructor
-		~ldData(void);
-
 		// member variables
 		int output;                             //!< Analysis output option
 		unsigned int *pop_cov;                  //!< Boolean for population coverage
@@ -50,34 +47,29 @@ class ldData: public popbamData
 		int calcOmegamax(void);
 		int calcWall(void);
 		int allocLD(void);
+		void growSites(void);
 		int printLD(const std::string);
+
+	private:
+		// member private functions
+		double genotypeR2(int s0, int s1, unsigned long long mask, int x0, int x1, int n) const;
 };
 
 ///
 /// Function prototypes
 ///
 
-/*!
-* \fn unsigned long long *callBase(bam_sample_t *sm, errmod_t *em, int n, const bam_pileup1_t *pl)
-* \brief Calls the base from the pileup at each position
-* \param sm     Pointer to the sample data structure
-* \param em     Pointer to the error model structure
-* \param n      The number of reads in the pileup
-* \param pl     Pointer to the pileup
-* \return       Pointer to the consensus base call information for the individuals
-*/
-template unsigned long long* callBase<ldData>(ldData *t, int n, const bam_pileup1_t *pl);
-
 /*!
  * \fn int make_ld(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
  * \brief Runs the linkage disequilibrium analysis
+ * \tparam F Option flags the callback is compiled for
  * \param tid Chromosome identifier
  * \param pos Genomic position
  * \param n The read depth
  * \param pl A pointer to the alignment covering a single position
  * \param data A pointer to the user-passed data
  */
-int makeLD(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+template <unsigned int F> int makeLD(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
 
 void usageLD(const std::string);
 
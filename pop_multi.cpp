@@ -0,0 +1,206 @@
+/** \file pop_multi.cpp
+ *  \brief Functions for running several analyses over one pass through the reads
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "pop_multi.h"
+
+/*!
+ * \fn static popbamData *initAnalysis(const std::string &name, const popbamOptions &p, bam_pileup_f *func)
+ * \brief Sets up the data and pileup callback of the named analysis
+ */
+static popbamData *initAnalysis(const std::string &name, const popbamOptions &p, bam_pileup_f *func)
+{
+	if (name == "snp")
+		return initSNP(p, func);
+	else if (name == "haplo")
+		return initHaplo(p, func);
+	else if (name == "diverge")
+		return initDiverge(p, func);
+	else if (name == "tree")
+		return initTree(p, func);
+	else if (name == "nucdiv")
+		return initNucdiv(p, func);
+	else if (name == "ld")
+		return initLD(p, func);
+	else
+		return initSFS(p, func);
+}
+
+int mainMulti(int argc, char *argv[])
+{
+	std::string fn;               //! name of an output file
+	std::string msg;              //! string for error message
+	std::vector<std::string> fns; //! names of all output files
+	std::vector<filterSet_t> fs;  //! filter thresholds of each result set
+	bam_pileup_f func = nullptr;  //! pileup callback of an analysis
+	std::ofstream *out = nullptr; //! output file of an analysis
+
+	// initialize user command line options
+	popbamOptions p(argc, argv);
+
+	if (p.errorCount > 0)
+		usageMulti(p.errorMsg);
+
+	// check input BAM file for errors
+	p.checkBAM();
+
+	// without a sweep there is a single result set with the thresholds of -s, -m and -q
+	fs = p.sweep;
+	if (fs.empty())
+	{
+		filterSet_t f = {p.minSNPQ, p.minDepth, p.minRMSQ};
+		fs.push_back(f);
+	}
+
+	// set up each analysis with its own output file for every result set; the
+	// thresholds of a sweep are applied after the bases are called, so all
+	// result sets share the calls
+	multiData t;
+	for (size_t k = 0; k < fs.size(); ++k)
+	{
+		for (size_t i = 0; i < p.analyses.size(); ++i)
+		{
+			std::stringstream name;
+
+			name << p.outfile << '.' << p.analyses[i];
+			if (!p.sweep.empty())
+				name << ".s" << fs[k].minSNPQ << 'm' << fs[k].minDepth << 'q' << fs[k].minRMSQ;
+			name << ((p.flag & BAM_BGZFOUT) ? ".txt.gz" : ".txt");
+			fn = name.str();
+			fns.push_back(fn);
+
+			t.tasks.push_back(initAnalysis(p.analyses[i], p, &func));
+
+			// compressed results are written by the analysis itself
+			if (p.flag & BAM_BGZFOUT)
+				openResults(p, p.analyses[i], t.tasks.back(), fn);
+			else
+			{
+				out = new std::ofstream(fn.c_str());
+				t.streams.push_back(out);
+				if (!out->is_open())
+				{
+					msg = "Failed to open output file " + fn;
+					fatalError(msg);
+				}
+				t.tasks.back()->os.open(out);
+			}
+
+			t.tasks.back()->minSNPQ = fs[k].minSNPQ;
+			t.tasks.back()->minDepth = fs[k].minDepth;
+			t.tasks.back()->minRMSQ = fs[k].minRMSQ;
+			t.funcs.push_back(func);
+		}
+	}
+
+	// iterate through all windows along specified genomic region or all target regions
+	runWindows(p, t.tasks, PICK_PILEUP(makeMulti, p.flag), &t);
+
+	for (size_t i = 0; i < t.tasks.size(); ++i)
+	{
+		if (p.flag & BAM_BGZFOUT)
+		{
+			closeResults(t.tasks[i], fns[i]);
+			continue;
+		}
+
+		t.tasks[i]->os.close();
+		t.streams[i]->close();
+		if (t.streams[i]->fail())
+		{
+			msg = "Failed to write output file " + fns[i];
+			fatalError(msg);
+		}
+	}
+
+	p.closeBAM();
+
+	return 0;
+}
+
+template <unsigned int F>
+int makeMulti(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
+{
+	unsigned long long *cb = nullptr;
+	multiData *m = nullptr;
+	popbamData *t = nullptr;
+
+	// get control data structure
+	m = (multiData*)data;
+	t = m->tasks[0];
+
+	// windows of every analysis tile the region, so a site inside it is
+	// used by all of them; its bases are called once and handed on as if
+	// replayed from a genotype cache
+	if ((t->beg <= (int)pos) && (t->reg_end > (int)pos) && !t->isMasked(pos))
+		cb = callBase<F>(t, n, pl);
+
+	for (size_t i = 0; i < m->tasks.size(); ++i)
+	{
+		m->tasks[i]->cached = cb;
+		m->funcs[i](tid, pos, n, pl, m->tasks[i]);
+		m->tasks[i]->cached = nullptr;
+	}
+
+	// take out the garbage
+	delete [] cb;
+
+	return 0;
+}
+
+multiData::~multiData(void)
+{
+	for (size_t i = 0; i < tasks.size(); ++i)
+		delete tasks[i];
+	for (size_t i = 0; i < streams.size(); ++i)
+		delete streams[i];
+}
+
+void usageMulti(const std::string msg)
+{
+	std::cerr << msg << std::endl << std::endl;
+	std::cerr << "Usage:   popbam multi [options] -F LIST -O PREFIX <in1.bam|-> [in2.bam ...] [region]" << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "Options: -F  LIST    comma-separated analyses (snp, haplo, diverge, tree, nucdiv, ld, sfs)" << std::endl;
+	std::cerr << "         -O  STR     prefix of the output files; each analysis writes PREFIX.<analysis>.txt" << std::endl;
+	std::cerr << "         -Z          compress the output files with BGZF, as PREFIX.<analysis>.txt.gz indexed for tabix" << std::endl;
+	std::cerr << "         -T  LIST    comma-separated SNPQ:DEPTH:RMSQ thresholds; one result set each" << std::endl;
+	std::cerr << "                     is written to PREFIX.<analysis>.s<SNPQ>m<DEPTH>q<RMSQ>.txt" << std::endl;
+	std::cerr << "         -o  INT     analysis or output option passed to every analysis [ default: 0 ]" << std::endl;
+	std::cerr << "         -i          base qualities are Illumina 1.3+               [ default: Sanger ]" << std::endl;
+	std::cerr << "         -h  FILE    Input header file                              [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -G  FILE    sample to population map of a bgzipped VCF file given as input" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -D          count alleles over both chromosomes of diploid individuals (nucdiv, sfs, ld)" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads                     [ default: 1 ]" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
+	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
+	std::cerr << "         -g  INT     close windows after INT segregating sites (-w: longest window)" << std::endl;
+	std::cerr << "         -c  INT     close windows after INT callable sites (-w: longest window)" << std::endl;
+	std::cerr << "         -d  STR     distance metric (pdist or jc)                  [ default: pdist ]" << std::endl;
+	std::cerr << "         -p  STR     sample name of outgroup                        [ default: reference ]" << std::endl;
+	std::cerr << "         -k  FLT     minimum proportion of sites covered in window  [ default: 0.5 ]" << std::endl;
+	std::cerr << "         -n  FLT     minimum proportion of population covered       [ default: 1.0 ]" << std::endl;
+	std::cerr << "         -t          only count substitutions" << std::endl;
+	std::cerr << "         -e          exclude singleton polymorphisms" << std::endl;
+	std::cerr << "         -f  FILE    Reference fastA file" << std::endl;
+	std::cerr << "         -z  FLT     output heterozygous base calls                 [ default: consensus ]" << std::endl;
+	std::cerr << "         -m  INT     minimum read coverage                          [ default: 3 ]" << std::endl;
+	std::cerr << "         -x  INT     maximum read coverage                          [ default: 255 ]" << std::endl;
+	std::cerr << "         -q  INT     minimum rms mapping quality                    [ default: 25 ]" << std::endl;
+	std::cerr << "         -s  INT     minimum snp quality                            [ default: 25 ]" << std::endl;
+	std::cerr << "         -a  INT     minimum map quality                            [ default: 13 ]" << std::endl;
+	std::cerr << "         -b  INT     minimum base quality                           [ default: 13 ]" << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "The reads are decoded and the bases called once; each analysis accepts the options above" << std::endl;
+	std::cerr << "that its own command accepts, and ignores the others." << std::endl;
+	std::cerr << std::endl;
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,45 @@
+/** \file pop_multi.h
+ *  \brief Header for the pop_multi.cpp file
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "pop_base.h"
+
+//
+// Define data structures
+//
+
+/*!
+ * \class multiData
+ * \brief Analyses fed by one pass through the pileup in the multi function
+ */
+class multiData
+{
+	public:
+		// destructor
+		~multiData(void);
+
+		// member public variables
+		std::vector<popbamData*> tasks;         //!< Data of each analysis; the first one reads the input (owned)
+		std::vector<bam_pileup_f> funcs;        //!< Pileup callback of each analysis
+		std::vector<std::ofstream*> streams;    //!< Output file of each analysis (owned)
+};
+
+///
+/// Function prototypes
+///
+
+/*!
+ * \fn int makeMulti(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
+ * \brief Calls the bases of a column of the pileup once and passes them to every analysis
+ * \tparam F Option flags the callback is compiled for
+ * \param tid Chromosome identifier
+ * \param pos Genomic position
+ * \param n The read depth
+ * \param pl A pointer to the alignment covering a single position
+ * \param data A pointer to the user-passed data
+ */
+template <unsigned int F> int makeMulti(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+
+void usageMulti(const std::string);
@@ -8,14 +8,8 @@
 
 int mainNucdiv(int argc, char *argv[])
 {
-	int chr = 0;                  //! chromosome identifier
-	int beg = 0;                  //! beginning coordinate for analysis
-	int end = 0;                  //! end coordinate for analysis
-	int ref = 0;                  //! ref
-	long nWindows = 0;            //! number of windows
-	std::string msg;              //! string for error message
-	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
-	bam_plbuf_t *buf;             //! pileup buffer
+	bam_pileup_f func = nullptr;  //! pileup callback
+	popbamData *t = nullptr;      //! nucdiv data structure
 
 	// initialize user command line options
 	popbamOptions p(argc, argv);
@@ -26,115 +20,67 @@ int mainNucdiv(int argc, char *argv[])
 	// check input BAM file for errors
 	p.checkBAM();
 
-	// initialize the sample data structure
-	sm = bam_smpl_init();
+	// set up the nucdiv analysis
+	t = initNucdiv(p, &func);
 
-	// add samples
-	bam_smpl_add(sm, &p);
+	// results go to a compressed and indexed file instead of stdout
+	if (!p.outfile.empty())
+		openResults(p, "nucdiv", t, p.outfile);
 
-	// initialize the nucdiv data structre
-	nucdivData t(p);
-	t.sm = sm;
+	// iterate through all windows along specified genomic region or all target regions
+	runWindows(p, std::vector<popbamData*>(1, t), func, t);
 
-	// initialize error model
-	t.em = errmod_init(0.17);
+	if (!p.outfile.empty())
+		closeResults(t, p.outfile);
 
-	// parse genomic region
-	int k = bam_parse_region(p.h, p.region, &chr, &beg, &end);
-	if (k < 0)
-	{
-		msg = "Bad genome coordinates: " + p.region;
-		fatalError(msg);
-	}
+	delete t;
+	p.closeBAM();
 
-	// fetch reference sequence
-	t.ref_base = faidx_fetch_seq(p.fai_file, p.h->target_name[chr], 0, 0x7fffffff, &(t.len));
+	return 0;
+}
 
-	// calculate the number of windows
-	if (p.flag & BAM_WINDOW)
-		nWindows = ((end - beg) - 1) / p.winSize;
-	else
-	{
-		p.winSize = end - beg;
-		nWindows = 1;
-	}
+popbamData *initNucdiv(const popbamOptions &p, bam_pileup_f *func)
+{
+	nucdivData *t = nullptr;
 
-	// iterate through all windows along specified genomic region
-	for (long j = 0; j < nWindows; ++j)
-	{
-		// construct genome coordinate string
-		std::string scaffold_name(p.h->target_name[chr]);
-		std::ostringstream winc(scaffold_name);
+	// initialize the nucdiv data structre
+	t = new nucdivData(p);
 
-		winc.seekp(0, std::ios::end);
-		winc << ':' << beg + (j * p.winSize) + 1 << '-' << ((j + 1) * p.winSize) + (beg - 1);
+	// initialize the sample data structure and add samples
+	t->sm = bam_smpl_init();
+	bam_smpl_add(t->sm, &p);
 
-		std::string winCoord = winc.str();
+	// initialize error model
+	t->em = errmod_init(0.17);
 
+	// steps opening and closing each window; site-count windows also take them from the pileup
+	t->openWindow = [t, &p](void)
+	{
 		// initialize number of sites to zero
-		t.num_sites = 0;
-
-		// parse the BAM file and check if region is retrieved from the reference
-		if (p.flag & BAM_WINDOW)
-		{
-			k = bam_parse_region(p.h, winCoord, &ref, &(t.beg), &(t.end));
-			if (k < 0)
-			{
-				msg = "Bad window coordinates " + winCoord;
-				fatalError(msg);
-			}
-		}
-		else
-		{
-			ref = chr;
-			t.beg = beg;
-			t.end = end;
-			if (ref < 0)
-			{
-				msg = "Bad scaffold name: " + p.region;
-				fatalError(msg);
-			}
-		}
+		t->num_sites = 0;
 
 		// initialize nucdiv variables
-		t.allocNucdiv();
+		t->allocNucdiv();
 
 		// create population assignments
-		t.assignPops(&p);
-
-		// initialize pileup
-		buf = bam_plbuf_init(makeNucdiv, &t);
-
-		// fetch region from bam file
-		if ((bam_fetch(p.bam_in->x.bam, p.idx, ref, t.beg, t.end, buf, fetch_func)) < 0)
-		{
-			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
-			fatalError(msg);
-		}
-
-		// finalize pileup
-		bam_plbuf_push(0, buf);
+		t->assignPops(&p);
+	};
 
+	t->closeWindow = [t, &p](void)
+	{
 		// calculate nucleotide diversity in window
-		t.calcNucdiv();
-
-		// print results to stdout
-		t.printNucdiv(p.h->target_name[chr]);
+		t->calcNucdiv();
 
-		// take out the garbage
-		bam_plbuf_destroy(buf);
-	}
-	// end of window iteration
+		// print results
+		t->printNucdiv(p.h->target_name[t->tid]);
+	};
 
-	errmod_destroy(t.em);
-	samclose(p.bam_in);
-	bam_index_destroy(p.idx);
-	bam_smpl_destroy(sm);
-	free(t.ref_base);
+	*func = PICK_PILEUP(makeNucdiv, p.flag);
 
-	return 0;
+	return t;
 }
 
+template <unsigned int F>
 int makeNucdiv(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
 {
 	int i = 0;
@@ -147,18 +93,28 @@ int makeNucdiv(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *p
 	// get control data structure
 	t = (nucdivData*)data;
 
-	// only consider sites located in designated region
-	if ((t->beg <= (int)pos) && (t->end > (int)pos))
+	// site-count windows are closed as the pileup moves past them
+	if (t->winSites > 0)
+		t->checkWindow(pos);
+
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
 	{
+		// make room for one more site
+		t->growSites();
+
 		// call bases
-		cb = callBase(t, n, pl);
+		cb = callBase<F>(t, n, pl);
 
-		// resolve heterozygous sites
-		if (!(t->flag & BAM_HETEROZYGOTE))
+		// resolve heterozygous sites; haploid calls have none and diploid counts keep them
+		if (!(F & (BAM_HETEROZYGOTE | BAM_HAPLOID | BAM_DIPLOID)))
 			cleanHeterozygotes(t->sm->n, cb, (int)t->ref_base[pos], t->minSNPQ);
 
 		// determine if site is segregating
-		fq = segBase(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
+		if (F & BAM_DIPLOID)
+			fq = segGenotype(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
+		else
+			fq = segBase(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
 
 		// determine how many samples pass the quality filters
 		sample_cov = qualFilter(t->sm->n, cb, t->minRMSQ, t->minDepth, t->maxDepth);
@@ -171,7 +127,7 @@ int makeNucdiv(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *p
 		{
 			unsigned long long pc = 0;
 			pc = sample_cov & t->pop_mask[i];
-			ncov[i] = bitcount64(pc);
+			ncov[i] = kernels.count(pc);
 			unsigned int req = (unsigned int)((t->minPop * t->pop_nsmpl[i]) + 0.4999);
 			if (ncov[i] >= req)
 				t->pop_cov[t->num_sites] |= 0x1U << i;
@@ -183,8 +139,11 @@ int makeNucdiv(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *p
 			t->num_sites++;
 			if (fq > 0)
 			{
+				// sample sizes are counted in chromosomes
 				for (j = 0; j < t->sm->npops; ++j)
-					t->ncov[j][t->segsites] = ncov[j];
+					t->ncov[j][t->segsites] = (F & BAM_DIPLOID) ? 2 * ncov[j] : ncov[j];
+				if (F & BAM_DIPLOID)
+					t->homs[t->segsites] = calculateHomType(t->sm->n, cb);
 				t->types[t->segsites++] = calculateSiteType(t->sm->n, cb);
 			}
 		}
@@ -203,7 +162,6 @@ int nucdivData::calcNucdiv(void)
 	int j = 0;
 	int k = 0;
 	unsigned short **freq = nullptr;
-	unsigned long long pop_type = 0;
 	double sum = 0.0;
 
 	freq = new unsigned short* [sm->npops];
@@ -229,8 +187,7 @@ int nucdivData::calcNucdiv(void)
 		sum = 0.0;
 		for (j = 0; j < segsites; j++)
 		{
-			pop_type = types[j] & pop_mask[i];
-			freq[i][j] = bitcount64(pop_type);
+			freq[i][j] = derivedCount(j, pop_mask[i]);
 
 			if (ncov[i][j] > 1)
 				if (((flag & BAM_NOSINGLETONS) && (freq[i][j] > 1)) || !(flag & BAM_NOSINGLETONS))
@@ -266,40 +223,39 @@ int nucdivData::printNucdiv(const std::string scaffold)
 {
 	int i = 0;
 	int j = 0;
-	std::stringstream out;
 
-	out << scaffold << '\t' << beg + 1 << '\t' << end + 1;
+	os << scaffold << '\t' << beg + 1 << '\t' << lastBase();
 
 	for (i = 0; i < sm->npops; i++)
 	{
-		out << "\tns[" << sm->popul[i] << "]:";
-		out << '\t' << ns_within[i];
+		os << "\tns[" << sm->popul[i] << "]:";
+		os << '\t' << ns_within[i];
 		if (ns_within[i] >= minSites)
 		{
-			out << "\tpi[" << sm->popul[i] << "]:";
-			out << '\t' << std::fixed << std::setprecision(5) << piw[i];
+			os << "\tpi[" << sm->popul[i] << "]:";
+			os << '\t' << fixedValue(piw[i], 5);
 		}
 		else
-			out << "\tpi[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+			os << "\tpi[" << sm->popul[i] << "]:\t     NA";
 	}
 
 	for (i = 0; i < sm->npops - 1; i++)
 	{
 		for (j = i + 1; j < sm->npops; j++)
 		{
-			out << "\tns[" <<  sm->popul[i] << "-" << sm->popul[j] << "]:";
-			out << '\t' << ns_between[UTIDX(sm->npops,i,j)];
-			if (ns_between[UTIDX(sm->npops,i,j)] >= (unsigned long int)((end - beg) * minSites))
+			os << "\tns[" <<  sm->popul[i] << "-" << sm->popul[j] << "]:";
+			os << '\t' << ns_between[UTIDX(sm->npops,i,j)];
+			if (ns_between[UTIDX(sm->npops,i,j)] >= (unsigned long int)(unmaskedLength() * minSites))
 			{
-				out << "\tdxy[" << sm->popul[i] << "-" << sm->popul[j] << "]:";
-				out << '\t' << std::fixed << std::setprecision(5) << pib[UTIDX(sm->npops,i,j)];
+				os << "\tdxy[" << sm->popul[i] << "-" << sm->popul[j] << "]:";
+				os << '\t' << fixedValue(pib[UTIDX(sm->npops,i,j)], 5);
 			}
 			else
-				out << "\tdxy[" << sm->popul[i] << "-" << sm->popul[j] << "]:\t" << std::setw(7) << "NA";
+				os << "\tdxy[" << sm->popul[i] << "-" << sm->popul[j] << "]:\t     NA";
 		}
 	}
 
-	std::cout << out.str() << std::endl;
+	os << '\n';
 
 	return 0;
 }
@@ -308,7 +264,6 @@ int nucdivData::printNucdiv(const std::string scaffold)
 nucdivData::nucdivData(const popbamOptions &p)
 {
 	// inherit values from popbamOptions
-	bamfile = p.bamfile;
 	flag = p.flag;
 	minDepth = p.minDepth;
 	maxDepth = p.maxDepth;
@@ -316,6 +271,8 @@ nucdivData::nucdivData(const popbamOptions &p)
 	minSNPQ = p.minSNPQ;
 	minMapQ = p.minMapQ;
 	minBaseQ = p.minBaseQ;
+	winSites = p.winSites;
+	winSpan = (flag & BAM_WINDOW) ? p.winSize : 0x7fffffff;
 	hetPrior = p.hetPrior;
 	minSites = p.minSites;
 	minPop = p.minPop;
@@ -327,25 +284,30 @@ nucdivData::nucdivData(const popbamOptions &p)
 int nucdivData::allocNucdiv(void)
 {
 	int i = 0;
-	int length = end - beg;
 	int npops = sm->npops;
 
+	// arrays of the previous window are given back to the arena
+	arena.reset();
 	segsites = 0;
+	site_cap = SITE_CHUNK;
+	seg_cap = SITE_CHUNK;
 
 	try
 	{
-		types = new unsigned long long [length]();
-		ns_within = new unsigned long [npops] ();
-		ns_between = new unsigned long [npops*(npops-1)] ();
-		pop_mask = new unsigned long long [npops]();
-		pop_cov = new unsigned int [length]();
-		ncov = new unsigned int* [npops];
-		pop_nsmpl = new unsigned char [npops]();
-		piw = new double [npops]();
-		pib = new double [npops*(npops-1)]();
-		num_snps = new int [npops]();
+		types = arena.alloc<unsigned long long>(seg_cap);
+		if (flag & BAM_DIPLOID)
+			homs = arena.alloc<unsigned long long>(seg_cap);
+		ns_within = arena.alloc<unsigned long>(npops);
+		ns_between = arena.alloc<unsigned long>(npops*(npops-1));
+		pop_mask = arena.alloc<unsigned long long>(npops);
+		pop_cov = arena.alloc<unsigned int>(site_cap);
+		ncov = arena.alloc<unsigned int*>(npops);
+		pop_nsmpl = arena.alloc<unsigned char>(npops);
+		piw = arena.alloc<double>(npops);
+		pib = arena.alloc<double>(npops*(npops-1));
+		num_snps = arena.alloc<int>(npops);
 		for (i=0; i < npops; ++i)
-			ncov[i] = new unsigned int [length]();
+			ncov[i] = arena.alloc<unsigned int>(seg_cap);
 	}
 	catch (std::bad_alloc& ba)
 	{
@@ -355,32 +317,51 @@ int nucdivData::allocNucdiv(void)
 	return 0;
 }
 
-nucdivData::~nucdivData(void)
+void nucdivData::growSites(void)
 {
-	int npops = sm->npops;
+	int i = 0;
+	int cap = 2 * seg_cap;
 
-	delete [] pop_mask;
-	delete [] types;
-	delete [] pop_cov;
-	delete [] pop_nsmpl;
-	delete [] ns_within;
-	delete [] ns_between;
-	delete [] piw;
-	delete [] pib;
-	delete [] num_snps;
-	for (int i = 0; i < npops; ++i)
-		delete [] ncov[i];
-	delete [] ncov;
+	// aligned sites
+	if (num_sites >= site_cap)
+	{
+		pop_cov = arena.extend(pop_cov, site_cap, 2 * site_cap);
+		site_cap *= 2;
+	}
+
+	// segregating sites
+	if (segsites >= seg_cap)
+	{
+		types = arena.extend(types, seg_cap, cap);
+		if (flag & BAM_DIPLOID)
+			homs = arena.extend(homs, seg_cap, cap);
+		for (i = 0; i < sm->npops; i++)
+			ncov[i] = arena.extend(ncov[i], seg_cap, cap);
+		seg_cap = cap;
+	}
 }
 
 void usageNucdiv(const std::string msg)
 {
 	std::cerr << msg << std::endl << std::endl;
-	std::cerr << "Usage:   popbam nucdiv [options] <in.bam> [region]" << std::endl;
+	std::cerr << "Usage:   popbam nucdiv [options] <in1.bam|-> [in2.bam ...] [region]" << std::endl;
 	std::cerr << std::endl;
 	std::cerr << "Options: -i          base qualities are Illumina 1.3+               [ default: Sanger ]" << std::endl;
 	std::cerr << "         -h  FILE    Input header file                              [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -G  FILE    sample to population map of a bgzipped VCF file given as input" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -D          count alleles over both chromosomes of diploid individuals" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads                     [ default: 1 ]" << std::endl;
+	std::cerr << "         -O  FILE    write results to FILE, compressed with BGZF and indexed for tabix" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
 	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
+	std::cerr << "         -g  INT     close windows after INT segregating sites (-w: longest window)" << std::endl;
+	std::cerr << "         -c  INT     close windows after INT callable sites (-w: longest window)" << std::endl;
 	std::cerr << "         -k  FLT     minimum proportion of sites covered in window  [ default: 0.5 ]" << std::endl;
 	std::cerr << "         -n  FLT     minimum proportion of population covered       [ default: 1.0 ]" << std::endl;
 	std::cerr << "         -e          exclude singleton polymorphisms" << std::endl;
@@ -29,9 +29,6 @@ class nucdivData: public popbamData
 		// constructor
 		nucdivData(const popbamOptions&);
 
-		// destructor
-		~nucdivData(void);
-
 		// member public variables
 		unsigned int *pop_cov;                  //!< Boolean for population coverage
 		unsigned int **ncov;                    //!< Sample size per population per segregating site
@@ -43,6 +40,7 @@ class nucdivData: public popbamData
 		// member public functions
 		int calcNucdiv(void);
 		int allocNucdiv(void);
+		void growSites(void);
 		int printNucdiv(const std::string);
 
 	private:
@@ -56,26 +54,16 @@ class nucdivData: public popbamData
 /// Function prototypes
 ///
 
-/*!
-* \fn unsigned long long *callBase(bam_sample_t *sm, errmod_t *em, int n, const bam_pileup1_t *pl)
-* \brief Calls the base from the pileup at each position
-* \param sm     Pointer to the sample data structure
-* \param em     Pointer to the error model structure
-* \param n      The number of reads in the pileup
-* \param pl     Pointer to the pileup
-* \return       Pointer to the consensus base call information for the individuals
-*/
-template unsigned long long* callBase<nucdivData>(nucdivData *t, int n, const bam_pileup1_t *pl);
-
 /*!
  * \fn int makeNucdiv(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
  * \brief Runs the nucleotide diversity calculations
+ * \tparam F Option flags the callback is compiled for
  * \param tid Chromosome identifier
  * \param pos Genomic position
  * \param n The read depth
  * \param pl A pointer to the alignment covering a single position
  * \param data A pointer to the user-passed data
  */
-int makeNucdiv(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+template <unsigned int F> int makeNucdiv(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
 
 void usageNucdiv(const std::string);
@@ -1,23 +1,35 @@
 #include "popbam.h"
 #include "getopt_pp.h"
+#include <sys/stat.h>
 
 popbamOptions::popbamOptions(int argc, char *argv[])
 {
 	std::vector<std::string> glob_opts;
+	std::string funcs;
+	std::string sweepList;
 
 	// set default parameter values
 	flag = 0;
+	output = 0;
 	minSites = 10;
 	winSize = 1;
+	winSites = 0;
 	minRMSQ = 25;
 	minSNPQ = 25;
 	minDepth = 3;
 	maxDepth = 255;
 	minMapQ = 13;
 	minBaseQ = 13;
+	nthreads = 1;
+	minPop = 1.0;
 	hetPrior = 0.0001;
+	poolSize = 0;
+	minCount = 2;
 	dist = "pdist";
 	errorCount = 0;
+	fai_file = nullptr;
+	cache = nullptr;
+	vcf = nullptr;
 
 	// get the popbam function and iterate argv
 	popFunc = argv[1];
@@ -41,6 +53,18 @@ popbamOptions::popbamOptions(int argc, char *argv[])
 	args >> GetOpt::Option('n', minPop);
 	args >> GetOpt::Option('w', winSize);
 	args >> GetOpt::Option('d', dist);
+	args >> GetOpt::Option('l', listfile);
+	args >> GetOpt::Option('j', nthreads);
+	args >> GetOpt::Option('r', bedfile);
+	args >> GetOpt::Option('g', winSites);
+	args >> GetOpt::Option('c', winSites);
+	args >> GetOpt::Option('M', maskfile);
+	args >> GetOpt::Option('G', popfile);
+	args >> GetOpt::Option('P', poolSize);
+	args >> GetOpt::Option('A', minCount);
+	args >> GetOpt::Option('O', outfile);
+	args >> GetOpt::Option('F', funcs);
+	args >> GetOpt::Option('T', sweepList);
 
 	// get switches
 	if (args >> GetOpt::OptionPresent('w'))
@@ -64,10 +88,45 @@ popbamOptions::popbamOptions(int argc, char *argv[])
 		flag |= BAM_HETEROZYGOTE;
 	if (args >> GetOpt::OptionPresent('v'))
 		flag |= BAM_VARIANT;
+	if (args >> GetOpt::OptionPresent('S'))
+		flag |= BAM_SAMIN;
+	if (args >> GetOpt::OptionPresent('I'))
+		flag |= BAM_INDEXOUT;
+	if (args >> GetOpt::OptionPresent('r'))
+		flag |= BAM_BEDIN;
+	if (args >> GetOpt::OptionPresent('g'))
+		flag |= BAM_SNPWINDOW;
+	if (args >> GetOpt::OptionPresent('c'))
+		flag |= BAM_SITEWINDOW;
+	if (args >> GetOpt::OptionPresent('M'))
+		flag |= BAM_MASKIN;
+	if (args >> GetOpt::OptionPresent('L'))
+		flag |= BAM_SOFTMASK;
+	if (args >> GetOpt::OptionPresent('H'))
+		flag |= BAM_HAPLOID;
+	if (args >> GetOpt::OptionPresent('D'))
+		flag |= BAM_DIPLOID;
+	if (args >> GetOpt::OptionPresent('Z'))
+		flag |= BAM_BGZFOUT;
 
 	// get non-optioned arguments
 	args >> GetOpt::GlobalOption(glob_opts);
 
+	// the multi function runs each analysis of a comma-separated list
+	if (popFunc == "multi")
+	{
+		std::stringstream ss(funcs);
+		std::string a;
+
+		while (std::getline(ss, a, ','))
+			if (!a.empty())
+				analyses.push_back(a);
+	}
+	else
+		analyses.push_back(popFunc);
+
+	auto uses = [this](const std::string &a) { return std::find(analyses.begin(), analyses.end(), a) != analyses.end(); };
+
 	// run some checks on the command line
 
 	if ((dist != "pdist") && (dist != "jc"))
@@ -76,29 +135,194 @@ popbamOptions::popbamOptions(int argc, char *argv[])
 		errorCount++;
 	}
 
-	// check if output option is valid
-	if ((output < 0) || (output > 2))
+	// check the site-count window options
+	if ((flag & BAM_SNPWINDOW) && (flag & BAM_SITEWINDOW))
+	{
+		errorMsg = "Windows can close after segregating sites or callable sites, not both";
+		errorCount++;
+	}
+	else if ((flag & (BAM_SNPWINDOW | BAM_SITEWINDOW)) && (winSites < 1))
+	{
+		errorMsg = "Need at least one site per window";
+		errorCount++;
+	}
+	else if ((flag & (BAM_SNPWINDOW | BAM_SITEWINDOW)) && uses("haplo"))
+	{
+		errorMsg = "Site-count windows are not available for the haplo function";
+		errorCount++;
+	}
+
+	// pooled data are corrected for the number of chromosomes in each pool
+	if ((popFunc == "pool") && (poolSize < 2))
+	{
+		errorMsg = "Need the number of chromosomes in each pool (at least 2)";
+		errorCount++;
+	}
+	else if ((popFunc == "pool") && (minCount < 1))
+	{
+		errorMsg = "Minimum count of the minor allele must be at least 1";
+		errorCount++;
+	}
+
+	// diploid allele counts are only kept by the frequency-based functions
+	if ((flag & BAM_DIPLOID) && (flag & BAM_HAPLOID))
+	{
+		errorMsg = "Individuals cannot be both haploid and diploid";
+		errorCount++;
+	}
+	else if ((flag & BAM_DIPLOID) && std::any_of(analyses.begin(), analyses.end(),
+		[](const std::string &a) { return (a != "nucdiv") && (a != "sfs") && (a != "ld"); }))
+	{
+		errorMsg = "Diploid allele counts are only available for the nucdiv, sfs and ld functions";
+		errorCount++;
+	}
+	else if ((flag & BAM_DIPLOID) && uses("ld") && (output == 2))
+	{
+		errorMsg = "Wall's B and Q need phased haplotypes and are not available with diploid counts";
+		errorCount++;
+	}
+
+	// the call function writes the consensus calls of every site, without windows
+	if ((popFunc == "call") && outfile.empty())
+	{
+		errorMsg = "Need to specify the output genotype cache file";
+		errorCount++;
+	}
+	else if ((popFunc == "call") && (flag & (BAM_WINDOW | BAM_SNPWINDOW | BAM_SITEWINDOW)))
+	{
+		errorMsg = "Windows are not available for the call function";
+		errorCount++;
+	}
+
+	// each threshold tuple of a sweep is SNPQ:DEPTH:RMSQ
+	if (!sweepList.empty())
+	{
+		std::stringstream ss(sweepList);
+		std::string tuple;
+		filterSet_t fs;
+		char c1 = 0;
+		char c2 = 0;
+
+		while (std::getline(ss, tuple, ','))
+		{
+			std::stringstream ts(tuple);
+
+			if ((ts >> fs.minSNPQ >> c1 >> fs.minDepth >> c2 >> fs.minRMSQ) && (c1 == ':') && (c2 == ':') && ts.eof())
+				sweep.push_back(fs);
+			else
+			{
+				errorMsg = tuple + " is not a valid SNPQ:DEPTH:RMSQ threshold tuple";
+				errorCount++;
+			}
+		}
+	}
+
+	// the multi function writes the results of each analysis to its own file
+	if ((args >> GetOpt::OptionPresent('T')) && (popFunc != "multi"))
+	{
+		errorMsg = "Threshold sweeps are only available for the multi function";
+		errorCount++;
+	}
+	else if ((popFunc == "multi") && (args >> GetOpt::OptionPresent('T')) && sweepList.empty())
+	{
+		errorMsg = "Need at least one SNPQ:DEPTH:RMSQ threshold tuple";
+		errorCount++;
+	}
+	if ((flag & BAM_BGZFOUT) && (popFunc != "multi"))
+	{
+		errorMsg = "The -Z switch is only available for the multi function; other functions compress with -O";
+		errorCount++;
+	}
+	if (popFunc == "multi")
+	{
+		const std::string avail[] = {"snp", "haplo", "diverge", "tree", "nucdiv", "ld", "sfs"};
+
+		if (analyses.empty())
+		{
+			errorMsg = "Need a comma-separated list of analyses";
+			errorCount++;
+		}
+		for (size_t i = 0; i < analyses.size(); i++)
+		{
+			if (std::find(avail, avail + 7, analyses[i]) == avail + 7)
+			{
+				errorMsg = analyses[i] + " is not an analysis available to the multi function";
+				errorCount++;
+			}
+			else if (std::find(analyses.begin(), analyses.begin() + i, analyses[i]) != analyses.begin() + i)
+			{
+				errorMsg = analyses[i] + " is listed more than once";
+				errorCount++;
+			}
+		}
+		if (outfile.empty())
+		{
+			errorMsg = "Need to specify the prefix of the output files";
+			errorCount++;
+		}
+	}
+
+	// check if output option is valid; only snp has the VCF and BCF formats
+	if ((output < 0) || (output > ((popFunc == "snp") ? 4 : 2)))
 	{
 		errorMsg = "Not a valid output option";
 		errorCount++;
 	}
 
+	// the region is always the last non-optioned argument, unless target regions are read from a BED file
+	if (!glob_opts.empty() && !(flag & BAM_BEDIN))
+	{
+		region = glob_opts.back();
+		glob_opts.pop_back();
+	}
+
+	// read the optional list of input BAM files
+	if (!listfile.empty())
+	{
+		std::ifstream listin(listfile.c_str());
+		std::string line;
+
+		if (!listin)
+		{
+			errorMsg = "Specified BAM list file: " + listfile + " does not exist";
+			errorCount++;
+		}
+
+		while (std::getline(listin, line))
+			if (!line.empty() && (line[0] != '#'))
+				bamfiles.push_back(line);
+	}
+
+	bamfiles.insert(bamfiles.end(), glob_opts.begin(), glob_opts.end());
+
 	// if no input BAM file is specified -- print usage and exit
-	if (glob_opts.size() < 2)
+	if (bamfiles.empty() || (region.empty() && !(flag & BAM_BEDIN)))
 	{
 		errorMsg = "Need to specify BAM file name and region";
 		errorCount++;
 	}
-	else
+
+	// standard input can only be read once
+	if (std::count(bamfiles.begin(), bamfiles.end(), std::string("-")) > 1)
 	{
-		bamfile = glob_opts[0];
-		region = glob_opts[1];
+		errorMsg = "Standard input can only be given once as an input file";
+		errorCount++;
 	}
 
-	// check if specified BAM file exists on disk
-	if (!(is_file_exist(bamfile.c_str())))
+	// check if specified BAM files exist on disk
+	for (size_t i = 0; i < bamfiles.size(); i++)
 	{
-		errorMsg = "Specified input file: " + bamfile + " does not exist";
+		if ((bamfiles[i] != "-") && !(is_file_exist(bamfiles[i].c_str())))
+		{
+			errorMsg = "Specified input file: " + bamfiles[i] + " does not exist";
+			errorCount++;
+		}
+	}
+
+	// check the number of decoding threads
+	if (nthreads < 1)
+	{
+		errorMsg = "Need at least one thread for decoding input files";
 		errorCount++;
 	}
 
@@ -123,48 +347,170 @@ popbamOptions::popbamOptions(int argc, char *argv[])
 			errorCount++;
 		}
 	}
+
+	// check if BED file of target regions exists on disk
+	if ((flag & BAM_BEDIN) && !(is_file_exist(bedfile.c_str())))
+	{
+		errorMsg = "Specified BED file: " + bedfile + " does not exist";
+		errorCount++;
+	}
+
+	// check if BED file of masked regions exists on disk
+	if ((flag & BAM_MASKIN) && !(is_file_exist(maskfile.c_str())))
+	{
+		errorMsg = "Specified mask file: " + maskfile + " does not exist";
+		errorCount++;
+	}
 }
 
 int popbamOptions::checkBAM(void)
 {
 	std::string msg;
+	std::string headtext;
+
+	// read in new header text
+	if (flag & BAM_HEADERIN)
+	{
+		std::ifstream headin(headfile);
+		std::ostringstream headbuf;
+		headbuf << headin.rdbuf();
+		headtext = headbuf.str();
+	}
+
+	// a genotype cache written by the call function stands in for the BAM files it was called from
+	if ((bamfiles.size() == 1) && (bamfiles[0] != "-") && !(flag & BAM_SAMIN) && genoCache::isCache(bamfiles[0]))
+		return openCache(headtext);
+
+	// so does a compressed VCF file of genotypes called by another program
+	if ((bamfiles.size() == 1) && (bamfiles[0] != "-") && !(flag & BAM_SAMIN) && vcfReader::isVCF(bamfiles[0]))
+		return openVCF();
+
+	for (size_t i = 0; i < bamfiles.size(); i++)
+	{
+		samfile_t *in = samopen(bamfiles[i].c_str(), (flag & BAM_SAMIN) ? "r" : "rb", 0);
+
+		// check if BAM file is readable
+		if (!in)
+		{
+			msg = "Cannot read BAM file " + bamfiles[i];
+			fatalError(msg);
+		}
+
+		// check if BAM header is returned
+		if (!in->header)
+		{
+			msg = "Cannot read BAM header from file " + bamfiles[i];
+			fatalError(msg);
+		}
+
+		// the user header replaces the header text of every input file
+		if (flag & BAM_HEADERIN)
+			replaceHeader(in->header, headtext);
+
+		// all input files must be aligned to the same reference sequences
+		if (i == 0)
+			h = in->header;
+		else
+		{
+			bool same = (in->header->n_targets == h->n_targets);
+			for (int j = 0; same && (j < h->n_targets); j++)
+				same = (strcmp(in->header->target_name[j], h->target_name[j]) == 0);
+			if (!same)
+			{
+				msg = "Reference sequences in " + bamfiles[i] + " do not match those in " + bamfiles[0];
+				fatalError(msg);
+			}
+		}
+
+		bam_in.push_back(in);
 
-	bam_in = samopen(bamfile.c_str(), "rb", 0);
+		// files without an index are read sequentially from the start
+		bam_index_t *bi = nullptr;
+		if (!(flag & BAM_SAMIN) && (bamfiles[i] != "-"))
+			bi = bam_index_load(bamfiles[i].c_str());
+		if (!bi && (bamfiles[i] != "-"))
+			std::cerr << "No index for input file " << bamfiles[i] << ", reading it sequentially" << std::endl;
+		idx.push_back(bi);
+
+		// a regular BAM file read sequentially can be indexed on the way through
+		struct stat st;
+		bam_index_builder_t *ib = nullptr;
+		if (!bi && (flag & BAM_INDEXOUT) && !(flag & BAM_SAMIN) && (bamfiles[i] != "-") &&
+			(stat(bamfiles[i].c_str(), &st) == 0) && S_ISREG(st.st_mode))
+			ib = bam_index_builder_init(in->header->n_targets, bam_tell(in->x.bam));
+		idx_build.push_back(ib);
+	}
+
+	return layoutRegions();
+}
+
+int popbamOptions::openCache(const std::string &headtext)
+{
+	std::string msg;
 
-	// check if BAM file is readable
-	if (!bam_in)
+	if ((popFunc == "call") || (popFunc == "pool"))
 	{
-		msg = "Cannot read BAM file " + bamfile;
+		msg = "The " + popFunc + " function needs the aligned reads and cannot read genotype cache " + bamfiles[0];
 		fatalError(msg);
 	}
 
-	// check if BAM header is returned
-	if (!bam_in->header)
+	cache = new genoCache;
+	if (cache->open(bamfiles[0]) < 0)
 	{
-		msg = "Cannot read BAM header from file " + bamfile;
+		msg = "Cannot read genotype cache " + bamfiles[0];
 		fatalError(msg);
 	}
-	else
-		h = bam_in->header;
 
-	//read in new header text
+	// samples are defined by the headers of the files the calls were made from
+	bamfiles = cache->files;
 	if (flag & BAM_HEADERIN)
+		for (size_t i = 0; i < cache->headers.size(); i++)
+			replaceHeader(cache->headers[i], headtext);
+	h = cache->headers[0];
+
+	// the base calls were made under the options given to the call function
+	if ((flag & BAM_DIPLOID) && (cache->flag & BAM_HAPLOID))
+		fatalError("Genotype cache holds haploid calls, which cannot be counted as diploid");
+	flag = (flag & ~(BAM_ILLUMINA | BAM_HAPLOID)) | cache->flag;
+
+	return layoutRegions();
+}
+
+int popbamOptions::openVCF(void)
+{
+	std::string msg;
+
+	if ((popFunc == "call") || (popFunc == "pool"))
 	{
-		std::ifstream headin(headfile);
-		headin.seekg(0, std::ios::end);
-		h->l_text = headin.tellg();
-		headin.seekg(0, std::ios::beg);
-		h->text = (char*)realloc(h->text, (size_t)h->l_text);
-		headin.read(h->text, h->l_text);
-		headin.close();
+		msg = "The " + popFunc + " function needs the aligned reads and cannot read VCF file " + bamfiles[0];
+		fatalError(msg);
 	}
 
-	// check for bam index file
-	if (!(idx = bam_index_load(bamfile.c_str())))
+	if (popfile.empty())
+		fatalError("Need to specify the sample to population map of the VCF file with -G");
+
+	// samples and their populations are defined by the map rather than by read groups
+	vcf = new vcfReader;
+	if (vcf->open(bamfiles[0], popfile, maxDepth) < 0)
 	{
-		msg = "Index file not available for BAM file " + bamfile;
+		msg = "Cannot read VCF file " + bamfiles[0];
 		fatalError(msg);
 	}
+	h = vcf->header;
+
+	return layoutRegions();
+}
+
+void popbamOptions::replaceHeader(bam_header_t *hdr, const std::string &headtext)
+{
+	hdr->l_text = headtext.size();
+	hdr->text = (char*)realloc(hdr->text, headtext.size() + 1);
+	memcpy(hdr->text, headtext.c_str(), headtext.size() + 1);
+}
+
+int popbamOptions::layoutRegions(void)
+{
+	std::string msg;
 
 	// check if fastA reference index is available
 	fai_file = fai_load(reffile.c_str());
@@ -174,6 +520,195 @@ int popbamOptions::checkBAM(void)
 		fatalError(msg);
 	}
 
+	// lay out the windows or target regions to be analyzed
+	if (flag & BAM_BEDIN)
+	{
+		readBED(bedfile, regions, true);
+		if (regions.empty())
+		{
+			msg = "No target regions in BED file: " + bedfile;
+			fatalError(msg);
+		}
+	}
+	else
+		makeWindows();
+
+	// masked intervals are merged so each reference position is covered at most once
+	if (flag & BAM_MASKIN)
+	{
+		std::vector<bamRegion_t> bed;
+
+		readBED(maskfile, bed, false);
+		for (size_t i = 0; i < bed.size(); i++)
+		{
+			if (!mask.empty() && (mask.back().tid == bed[i].tid) && (mask.back().end >= bed[i].beg))
+				mask.back().end = std::max(mask.back().end, bed[i].end);
+			else
+				mask.push_back(bed[i]);
+		}
+	}
+
+	return 0;
+}
+
+int popbamOptions::makeWindows(void)
+{
+	int chr = 0;
+	int beg = 0;
+	int end = 0;
+	long nWindows = 0;
+	bool fixed = (flag & BAM_WINDOW) && !(flag & (BAM_SNPWINDOW | BAM_SITEWINDOW));
+	bamRegion_t r;
+	std::string msg;
+
+	// parse genomic region
+	if (bam_parse_region(h, region, &chr, &beg, &end) < 0)
+	{
+		msg = "Bad genome coordinates: " + region;
+		fatalError(msg);
+	}
+
+	if (chr < 0)
+	{
+		msg = "Bad scaffold name: " + region;
+		fatalError(msg);
+	}
+
+	// calculate the number of windows; site-count windows are laid out as the region is read
+	if (fixed)
+		nWindows = ((end - beg) - 1) / winSize;
+	else if (flag & BAM_WINDOW)
+		nWindows = 1;
+	else
+	{
+		winSize = end - beg;
+		nWindows = 1;
+	}
+
+	for (long j = 0; j < nWindows; ++j)
+	{
+		r.tid = chr;
+		r.beg = beg;
+		r.end = end;
+
+		// parse the window coordinates as if given on the command line
+		if (fixed)
+		{
+			std::string scaffold_name(h->target_name[chr]);
+			std::ostringstream winc(scaffold_name);
+
+			winc.seekp(0, std::ios::end);
+			winc << ':' << beg + (j * winSize) + 1 << '-' << ((j + 1) * winSize) + (beg - 1);
+
+			if (bam_parse_region(h, winc.str(), &(r.tid), &(r.beg), &(r.end)) < 0)
+			{
+				msg = "Bad window coordinates " + winc.str();
+				fatalError(msg);
+			}
+		}
+
+		regions.push_back(r);
+	}
+
 	return 0;
 }
 
+int popbamOptions::readBED(const std::string &fn, std::vector<bamRegion_t> &bed, bool strict)
+{
+	std::ifstream bedin(fn.c_str());
+	std::string line;
+	std::string name;
+	bamRegion_t r;
+	std::string msg;
+
+	while (std::getline(bedin, line))
+	{
+		// skip comment, track and browser lines
+		if (line.empty() || (line[0] == '#') || (line.compare(0, 5, "track") == 0) || (line.compare(0, 7, "browser") == 0))
+			continue;
+
+		std::istringstream fields(line);
+
+		if (!(fields >> name >> r.beg >> r.end) || (r.beg < 0) || (r.end <= r.beg))
+		{
+			msg = "Bad BED coordinates: " + line;
+			fatalError(msg);
+		}
+
+		// a mask may cover scaffolds that are not in the alignments
+		if ((r.tid = bam_get_tid(h, name.c_str())) < 0)
+		{
+			if (!strict)
+				continue;
+			msg = "Bad scaffold name in BED file: " + name;
+			fatalError(msg);
+		}
+
+		if (r.end > (int)h->target_len[r.tid])
+			r.end = h->target_len[r.tid];
+
+		bed.push_back(r);
+	}
+
+	// intervals are kept in coordinate order so the input is read in one pass
+	std::stable_sort(bed.begin(), bed.end(), [](const bamRegion_t &a, const bamRegion_t &b)
+	{
+		return (a.tid < b.tid) || ((a.tid == b.tid) && (a.beg < b.beg));
+	});
+
+	return 0;
+}
+
+int popbamOptions::closeBAM(void)
+{
+	std::string idxfile;
+
+	for (size_t i = 0; i < bam_in.size(); i++)
+	{
+		if (idx_build[i])
+		{
+			bam1_t *b = bam_init1();
+			bam_index_t *bi = nullptr;
+			FILE *fpidx = nullptr;
+
+			// index the alignments beyond the last region analyzed
+			while (bam_read1(bam_in[i]->x.bam, b) >= 0)
+				if (bam_index_builder_push(idx_build[i], b, bam_tell(bam_in[i]->x.bam)) < 0)
+					break;
+
+			bam_destroy1(b);
+			bi = bam_index_builder_finish(idx_build[i], bam_tell(bam_in[i]->x.bam));
+			idxfile = bamfiles[i] + ".bai";
+
+			if (!bi)
+				std::cerr << "Input file " << bamfiles[i] << " is not sorted, no index written" << std::endl;
+			else if ((fpidx = fopen(idxfile.c_str(), "wb")) == 0)
+				std::cerr << "Cannot write index file " << idxfile << std::endl;
+			else
+			{
+				bam_index_save(bi, fpidx);
+				fclose(fpidx);
+			}
+
+			bam_index_destroy(bi);
+		}
+
+		samclose(bam_in[i]);
+		bam_index_destroy(idx[i]);
+	}
+
+	bam_in.clear();
+	idx.clear();
+	idx_build.clear();
+
+	fai_destroy(fai_file);
+	fai_file = nullptr;
+
+	delete cache;
+	cache = nullptr;
+
+	delete vcf;
+	vcf = nullptr;
+
+	return 0;
+}
@@ -0,0 +1,500 @@
+/** \file pop_pool.cpp
+ *  \brief Functions for calculating diversity statistics from pooled samples
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "pop_pool.h"
+
+int mainPool(int argc, char *argv[])
+{
+	int chr = 0;                  //! chromosome identifier
+	int ref = 0;                  //! ref
+	std::string msg;              //! string for error message
+	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
+	bam_plbuf_t *buf;             //! pileup buffer
+
+	// initialize user command line options
+	popbamOptions p(argc, argv);
+
+	if (p.errorCount > 0)
+		usagePool(p.errorMsg);
+
+	// check input BAM file for errors
+	p.checkBAM();
+
+	// initialize the sample data structure; every sample is a pool
+	sm = bam_smpl_init();
+
+	// add samples
+	bam_smpl_add(sm, &p);
+
+	// initialize the pool data structre
+	poolData t(p);
+	t.sm = sm;
+	t.counts.resize(NBASES * sm->n);
+	t.os.threaded = (p.nthreads > 1);
+
+	// results go to a compressed and indexed file instead of stdout
+	if (!p.outfile.empty())
+		openResults(p, "pool", &t, p.outfile);
+
+	// steps opening and closing each window; site-count windows also take them from the pileup
+	t.openWindow = [&](void)
+	{
+		// initialize number of sites to zero
+		t.num_sites = 0;
+
+		// initialize pool variables
+		t.allocPool();
+	};
+
+	t.closeWindow = [&](void)
+	{
+		// calculate diversity statistics in window
+		t.calcPool();
+
+		// print results to stdout
+		t.printPool(p.h->target_name[chr]);
+	};
+
+	// iterate through all windows along specified genomic region or all target regions
+	for (size_t j = 0; j < p.regions.size(); ++j)
+	{
+		ref = p.regions[j].tid;
+		t.setRegion(p.regions[j]);
+
+		// fetch reference sequence of each new scaffold
+		if ((j == 0) || (ref != chr))
+		{
+			chr = ref;
+			t.fetchReference(&p, chr);
+		}
+
+		// open the first window of the region
+		t.openWindow();
+
+		// initialize pileup; alleles are counted without calling genotypes
+		buf = bam_plbuf_init((p.flag & BAM_ILLUMINA) ? makePool<BAM_ILLUMINA> : makePool<0>, &t);
+
+		// fetch region from bam file
+		if (t.fetchRegion(&p, ref, buf) < 0)
+		{
+			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
+			fatalError(msg);
+		}
+
+		// finalize pileup
+		bam_plbuf_push(0, buf);
+
+		// close the last window of the region
+		t.closeWindow();
+
+		// take out the garbage
+		bam_plbuf_destroy(buf);
+	}
+	// end of window iteration
+
+	if (!p.outfile.empty())
+		closeResults(&t, p.outfile);
+
+	p.closeBAM();
+
+	return 0;
+}
+
+template <unsigned int F>
+int makePool(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
+{
+	int i = 0;
+	int b = 0;
+	int baseQ = 0;
+	const bam_pileup1_t *p = nullptr;
+	poolData *t = nullptr;
+
+	// get control data structure
+	t = (poolData*)data;
+
+	// site-count windows are closed as the pileup moves past them
+	if (t->winSites > 0)
+		t->checkWindow(pos);
+
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
+	{
+		std::fill(t->counts.begin(), t->counts.end(), 0);
+
+		// count the alleles passing the quality filters in each pool
+		for (i = 0; i < n; i++)
+		{
+			p = pl + i;
+
+			if (p->is_del || p->is_refskip || (p->b->core.flag & BAM_FUNMAP))
+				continue;
+
+			baseQ = bam1_qual(p->b)[p->qpos];
+			if (F & BAM_ILLUMINA)
+				baseQ = baseQ > 31 ? baseQ - 31 : 0;
+
+			if ((baseQ < t->minBaseQ) || (p->b->core.qual < t->minMapQ))
+				continue;
+
+			b = bam_nt16_nt4_table[bam1_seqi(bam1_seq(p->b), p->qpos)];
+
+			if (b > 3)
+				continue;
+
+			++t->counts[p->aux * NBASES + b];
+		}
+
+		t->addSite();
+	}
+
+	return 0;
+}
+
+void poolData::addSite(void)
+{
+	int i = 0;
+	int j = 0;
+	int a = 0;
+	int cov = 0;
+	int major = 0;
+	int minor = -1;
+	int n = sm->n;
+	int total[NBASES] = {0, 0, 0, 0};
+	bool segregating = false;
+	unsigned long long callable = 0;
+	double h[64];
+	double f[64];
+
+	// pools with acceptable coverage
+	for (i = 0; i < n; i++)
+	{
+		const int *c = &counts[i * NBASES];
+
+		cov = c[0] + c[1] + c[2] + c[3];
+		if ((cov >= minDepth) && (cov <= maxDepth))
+		{
+			callable |= 0x1ULL << i;
+			for (a = 0; a < NBASES; a++)
+				total[a] += c[a];
+		}
+	}
+
+	if (!callable)
+		return;
+
+	num_sites++;
+
+	// the two most frequent alleles over all pools; other bases are taken as errors
+	for (a = 1; a < NBASES; a++)
+		if (total[a] > total[major])
+			major = a;
+	for (a = 0; a < NBASES; a++)
+		if ((a != major) && ((minor < 0) || (total[a] > total[minor])))
+			minor = a;
+
+	if (total[minor] >= minCount)
+	{
+		segregating = true;
+		segsites++;
+	}
+
+	// within-pool statistics
+	for (i = 0; i < n; i++)
+	{
+		if (!CHECK_BIT(callable, i))
+			continue;
+
+		const int c1 = counts[i * NBASES + major];
+		const int c2 = counts[i * NBASES + minor];
+		const int m = c1 + c2;
+
+		ns_within[i]++;
+		cov_sum[i] += m;
+		h[i] = 0.0;
+		f[i] = m > 0 ? (double)c1 / m : 0.0;
+
+		if (!segregating || (m < 2))
+			continue;
+
+		// heterozygosity corrected for sampling chromosomes into the pool and reads from it
+		h[i] = (2.0 * c1 * c2) / (m * (m - 1.0)) * poolSize / (poolSize - 1.0);
+
+		if ((c1 >= minCount) && (c2 >= minCount))
+		{
+			num_snps[i]++;
+			pi_sum[i] += (2.0 * c1 * c2) / (m * (m - 1.0)) / piCorrection(m);
+			theta_sum[i] += 1.0 / thetaCorrection(m);
+		}
+	}
+
+	// between-pool statistics
+	for (i = 0; i < n - 1; i++)
+	{
+		if (!CHECK_BIT(callable, i))
+			continue;
+
+		for (j = i + 1; j < n; j++)
+		{
+			if (!CHECK_BIT(callable, j))
+				continue;
+
+			ns_between[UTIDX(n,i,j)]++;
+			if (segregating)
+			{
+				hb_sum[UTIDX(n,i,j)] += f[i] * (1.0 - f[j]) + f[j] * (1.0 - f[i]);
+				hw_sum[UTIDX(n,i,j)] += 0.5 * (h[i] + h[j]);
+			}
+		}
+	}
+}
+
+double poolData::piCorrection(int cov)
+{
+	if (pi_corr[cov] <= 0.0)
+		calcCorrection(cov);
+
+	return pi_corr[cov];
+}
+
+double poolData::thetaCorrection(int cov)
+{
+	if (theta_corr[cov] <= 0.0)
+		calcCorrection(cov);
+
+	return theta_corr[cov];
+}
+
+void poolData::calcCorrection(int cov)
+{
+	int k = 0;
+	int m = 0;
+	double fk = 0.0;
+	double pmf = 0.0;
+	double pw = 0.0;
+	double pp = 0.0;
+	std::vector<double> lf(cov + 1);
+
+	for (m = 0; m <= cov; m++)
+		lf[m] = lgamma(m + 1.0);
+
+	// a derived allele at k of the pool's chromosomes has probability 1/k under the
+	// standard neutral model, and is seen in m of cov reads with binomial probability
+	for (k = 1; k < poolSize; k++)
+	{
+		fk = (double)k / poolSize;
+		for (m = minCount; m <= cov - minCount; m++)
+		{
+			pmf = exp(lf[cov] - lf[m] - lf[cov-m] + m * log(fk) + (cov - m) * log(1.0 - fk));
+			pw += pmf / k;
+			pp += pmf * (2.0 * m * (cov - m)) / (cov * (cov - 1.0)) / k;
+		}
+	}
+
+	pi_corr[cov] = pp;
+	theta_corr[cov] = pw;
+}
+
+int poolData::calcPool(void)
+{
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	int ne = 0;
+	int n = sm->n;
+	double a1 = 0.0;
+	double a2 = 0.0;
+	double b1 = 0.0;
+	double b2 = 0.0;
+	double e1 = 0.0;
+	double e2 = 0.0;
+	double s = 0.0;
+
+	for (i = 0; i < n; i++)
+	{
+		piw[i] = ns_within[i] > 0 ? pi_sum[i] / ns_within[i] : 0.0;
+		thw[i] = ns_within[i] > 0 ? theta_sum[i] / ns_within[i] : 0.0;
+		td[i] = 0.0;
+
+		// Tajima's variance taking the number of chromosomes as the smaller of
+		// the pool size and the mean coverage
+		s = num_snps[i];
+		ne = ns_within[i] > 0 ? (int)(cov_sum[i] / ns_within[i] + 0.5) : 0;
+		ne = ne < poolSize ? ne : poolSize;
+		if ((s < 1) || (ne < 2))
+			continue;
+
+		for (k = 1, a1 = a2 = 0.0; k < ne; k++)
+		{
+			a1 += 1.0 / k;
+			a2 += 1.0 / SQ((double)k);
+		}
+		b1 = (ne + 1.0) / (3.0 * (ne - 1));
+		b2 = (2.0 * (SQ((double)ne) + ne + 3.0)) / (9.0 * ne * (ne - 1));
+		e1 = (b1 - (1.0 / a1)) / a1;
+		e2 = (b2 - ((ne + 2.0) / (a1 * ne)) + (a2 / SQ(a1))) / (SQ(a1) + a2);
+		td[i] = (pi_sum[i] - theta_sum[i]) / sqrt(e1 * s + e2 * s * (s - 1));
+	}
+
+	for (i = 0; i < n - 1; i++)
+	{
+		for (j = i + 1; j < n; j++)
+		{
+			k = UTIDX(n,i,j);
+			dxy[k] = ns_between[k] > 0 ? hb_sum[k] / ns_between[k] : 0.0;
+			fst[k] = hb_sum[k] > 0.0 ? 1.0 - (hw_sum[k] / hb_sum[k]) : 0.0;
+		}
+	}
+
+	return 0;
+}
+
+int poolData::printPool(const std::string scaffold)
+{
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	int n = sm->n;
+
+	os << scaffold << '\t' << beg + 1 << '\t' << lastBase();
+
+	for (i = 0; i < n; i++)
+	{
+		os << "\tns[" << sm->smpl[i] << "]:";
+		os << '\t' << ns_within[i];
+		if (ns_within[i] >= minSites)
+		{
+			os << "\tpi[" << sm->smpl[i] << "]:";
+			os << '\t' << fixedValue(piw[i], 5);
+			os << "\ttheta[" << sm->smpl[i] << "]:";
+			os << '\t' << fixedValue(thw[i], 5);
+		}
+		else
+		{
+			os << "\tpi[" << sm->smpl[i] << "]:\t     NA";
+			os << "\ttheta[" << sm->smpl[i] << "]:\t     NA";
+		}
+		if ((ns_within[i] >= minSites) && (num_snps[i] > 0))
+		{
+			os << "\tD[" << sm->smpl[i] << "]:";
+			os << '\t' << fixedValue(td[i], 5);
+		}
+		else
+			os << "\tD[" << sm->smpl[i] << "]:\t     NA";
+	}
+
+	for (i = 0; i < n - 1; i++)
+	{
+		for (j = i + 1; j < n; j++)
+		{
+			k = UTIDX(n,i,j);
+			os << "\tns[" << sm->smpl[i] << "-" << sm->smpl[j] << "]:";
+			os << '\t' << ns_between[k];
+			if (ns_between[k] >= minSites)
+			{
+				os << "\tdxy[" << sm->smpl[i] << "-" << sm->smpl[j] << "]:";
+				os << '\t' << fixedValue(dxy[k], 5);
+			}
+			else
+				os << "\tdxy[" << sm->smpl[i] << "-" << sm->smpl[j] << "]:\t     NA";
+			if ((ns_between[k] >= minSites) && (hb_sum[k] > 0.0))
+			{
+				os << "\tfst[" << sm->smpl[i] << "-" << sm->smpl[j] << "]:";
+				os << '\t' << fixedValue(fst[k], 5);
+			}
+			else
+				os << "\tfst[" << sm->smpl[i] << "-" << sm->smpl[j] << "]:\t     NA";
+		}
+	}
+
+	os << '\n';
+
+	return 0;
+}
+
+poolData::poolData(const popbamOptions &p)
+{
+	// inherit values from popbamOptions
+	flag = p.flag;
+	minDepth = p.minDepth;
+	maxDepth = p.maxDepth;
+	minMapQ = p.minMapQ;
+	minBaseQ = p.minBaseQ;
+	winSites = p.winSites;
+	winSpan = (flag & BAM_WINDOW) ? p.winSize : 0x7fffffff;
+	minSites = p.minSites;
+	poolSize = p.poolSize;
+	minCount = p.minCount;
+
+	// initialize native variables
+	derived_type = POOL;
+
+	// corrections depend only on coverage and are computed when first needed
+	pi_corr.assign(maxDepth + 1, 0.0);
+	theta_corr.assign(maxDepth + 1, 0.0);
+}
+
+int poolData::allocPool(void)
+{
+	int n = sm->n;
+	int npairs = n * (n - 1) / 2 + 1;
+
+	// arrays of the previous window are given back to the arena
+	arena.reset();
+	segsites = 0;
+
+	try
+	{
+		ns_within = arena.alloc<unsigned long>(n);
+		ns_between = arena.alloc<unsigned long>(npairs);
+		num_snps = arena.alloc<int>(n);
+		cov_sum = arena.alloc<double>(n);
+		pi_sum = arena.alloc<double>(n);
+		theta_sum = arena.alloc<double>(n);
+		hw_sum = arena.alloc<double>(npairs);
+		hb_sum = arena.alloc<double>(npairs);
+		piw = arena.alloc<double>(n);
+		thw = arena.alloc<double>(n);
+		td = arena.alloc<double>(n);
+		dxy = arena.alloc<double>(npairs);
+		fst = arena.alloc<double>(npairs);
+	}
+	catch (std::bad_alloc& ba)
+	{
+		std::cerr << "bad_alloc caught: " << ba.what() << std::endl;
+	}
+
+	return 0;
+}
+
+void usagePool(const std::string msg)
+{
+	std::cerr << msg << std::endl << std::endl;
+	std::cerr << "Usage:   popbam pool [options] <in1.bam|-> [in2.bam ...] [region]" << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "Options: -i          base qualities are Illumina 1.3+               [ default: Sanger ]" << std::endl;
+	std::cerr << "         -h  FILE    Input header file                              [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads                     [ default: 1 ]" << std::endl;
+	std::cerr << "         -O  FILE    write results to FILE, compressed with BGZF and indexed for tabix" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
+	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
+	std::cerr << "         -g  INT     close windows after INT segregating sites (-w: longest window)" << std::endl;
+	std::cerr << "         -c  INT     close windows after INT callable sites (-w: longest window)" << std::endl;
+	std::cerr << "         -k  INT     minimum number of callable sites in window     [ default: 10 ]" << std::endl;
+	std::cerr << "         -P  INT     number of chromosomes in each pool" << std::endl;
+	std::cerr << "         -A  INT     minimum count of the minor allele              [ default: 2 ]" << std::endl;
+	std::cerr << "         -f  FILE    Reference fastA file" << std::endl;
+	std::cerr << "         -m  INT     minimum read coverage of a pool                [ default: 3 ]" << std::endl;
+	std::cerr << "         -x  INT     maximum read coverage of a pool                [ default: 255 ]" << std::endl;
+	std::cerr << "         -a  INT     minimum map quality                            [ default: 13 ]" << std::endl;
+	std::cerr << "         -b  INT     minimum base quality                           [ default: 13 ]" << std::endl;
+	std::cerr << std::endl;
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,79 @@
+/** \file pop_pool.h
+ *  \brief Header for the pop_pool.cpp file
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "pop_base.h"
+
+///
+/// Definitions
+///
+
+//
+// Define data structures
+//
+
+/*!
+ * \class poolData
+ * \brief A derived class for passing parameters and data to the pool function
+ */
+class poolData: public popbamData
+{
+	public:
+		// constructor
+		poolData(const popbamOptions&);
+
+		// member public variables
+		int poolSize;                           //!< Number of chromosomes in each pool
+		int minCount;                           //!< Minimum count of the minor allele for a site to segregate
+		std::vector<int> counts;                //!< Allele counts of each pool at the current column
+		unsigned long *ns_within;               //!< Number of callable sites of each pool
+		unsigned long *ns_between;              //!< Number of sites callable in each pair of pools
+		int *num_snps;                          //!< Number of segregating sites of each pool
+		double *cov_sum;                        //!< Summed coverage over the callable sites of each pool
+
+		// member public functions
+		int allocPool(void);
+		void addSite(void);
+		int calcPool(void);
+		int printPool(const std::string);
+
+	private:
+		// member private functions
+		double piCorrection(int cov);
+		double thetaCorrection(int cov);
+		void calcCorrection(int cov);
+
+		// member private variables
+		double minSites;                        //!< User-specified minimum proportion of callable sites to perform analysis
+		std::vector<double> pi_corr;            //!< Expected heterozygosity per unit theta at each coverage; 0 if not yet computed
+		std::vector<double> theta_corr;         //!< Expected probability of segregating per unit theta at each coverage
+		double *pi_sum;                         //!< Corrected nucleotide diversity summed over the sites of each pool
+		double *theta_sum;                      //!< Corrected Watterson's theta summed over the sites of each pool
+		double *hw_sum;                         //!< Mean within-pool heterozygosity summed over the sites of each pair
+		double *hb_sum;                         //!< Between-pool heterozygosity summed over the sites of each pair
+		double *piw;                            //!< Array of within-pool nucleotide diversity
+		double *thw;                            //!< Array of within-pool Watterson's theta
+		double *td;                             //!< Array of within-pool Tajima's D
+		double *dxy;                            //!< Array of between-pool Dxy values
+		double *fst;                            //!< Array of between-pool Fst values
+};
+
+///
+/// Function prototypes
+///
+
+/*!
+ * \fn int makePool(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
+ * \brief Counts the alleles of each pool at a column of the pileup
+ * \tparam F Option flags the callback is compiled for
+ * \param tid Chromosome identifier
+ * \param pos Genomic position
+ * \param n The read depth
+ * \param pl A pointer to the alignment covering a single position
+ * \param data A pointer to the user-passed data
+ */
+template <unsigned int F> int makePool(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+
+void usagePool(const std::string);
@@ -0,0 +1,429 @@
+/** \file pop_reader.cpp
+ *  \brief Functions for reading alignments merged from several BAM files
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "popbam.h"
+
+///
+/// Definitions
+///
+
+/*! \def CHUNK_READS
+ *  \brief Target number of alignments decoded from all files per chunk
+ */
+#define CHUNK_READS 65536
+
+/*! \def CHUNK_MIN
+ *  \brief Smallest span of reference covered by one chunk
+ */
+#define CHUNK_MIN 1024
+
+/*! \def CHUNK_MAX
+ *  \brief Largest span of reference covered by one chunk
+ */
+#define CHUNK_MAX 0x1000000
+
+bamReader::bamReader(const popbamOptions *p)
+{
+	streams.resize(p->bam_in.size());
+	streamed = false;
+
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		streams[i].in = p->bam_in[i];
+		streams[i].fp = p->bam_in[i]->x.bam;
+		streams[i].idx = p->idx[i];
+		streams[i].bi = p->idx_build[i];
+		streams[i].iter = 0;
+		streams[i].itid = -1;
+		streams[i].pending = bam_init1();
+		streams[i].has_pending = false;
+		streams[i].spill = bam_init1();
+		streams[i].held = false;
+		streams[i].at_eof = false;
+		streams[i].ncarry[0] = streams[i].ncarry[1] = 0;
+		streams[i].icarry = 0;
+		streams[i].status = -1;
+		if (!streams[i].idx)
+			streamed = true;
+		streams[i].n[0] = streams[i].n[1] = 0;
+		streams[i].cur = 0;
+	}
+
+	nthreads = p->nthreads < (int)streams.size() ? p->nthreads : (int)streams.size();
+	if (nthreads < 1)
+		nthreads = 1;
+	plan = &p->regions;
+	mask = nullptr;
+	iplan = 0;
+	qtid = -1;
+	qbeg = qend = 0;
+	cfrom = 0;
+	slot = 0;
+	limit = 0;
+	step = 16 * CHUNK_MIN;
+}
+
+bamReader::~bamReader(void)
+{
+	waitFill();
+
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		if (streams[i].iter)
+			bam_iter_destroy(streams[i].iter);
+		bam_destroy1(streams[i].pending);
+		bam_destroy1(streams[i].spill);
+		for (int j = 0; j < 2; j++)
+		{
+			for (size_t k = 0; k < streams[i].batch[j].size(); k++)
+				bam_destroy1(streams[i].batch[j][k]);
+			for (size_t k = 0; k < streams[i].carry[j].size(); k++)
+				bam_destroy1(streams[i].carry[j][k]);
+		}
+	}
+}
+
+int bamReader::query(int tid, int beg, int end, const std::vector<bamRegion_t> *m)
+{
+	bool planned = false;
+	std::vector<int> begs;
+	std::vector<int> ends;
+	std::vector<int> ibegs;
+	std::vector<int> iends;
+
+	// a previous region may have been abandoned with a chunk in flight
+	waitFill();
+
+	heap = mergeHeap();
+	mask = m;
+
+	// streamed input cannot go back to alignments it has already passed
+	if (streamed && ((tid < qtid) || ((tid == qtid) && (beg < cfrom))))
+		fatalError("Regions must be in increasing order when input is read sequentially");
+
+	// regions queried in the planned order share one pass through each reference
+	if ((iplan < plan->size()) && ((*plan)[iplan].tid == tid) && ((*plan)[iplan].beg == beg) && ((*plan)[iplan].end == end))
+	{
+		planned = true;
+		for (size_t r = iplan; (r < plan->size()) && ((*plan)[r].tid == tid); r++)
+		{
+			begs.push_back((*plan)[r].beg);
+			ends.push_back((*plan)[r].end);
+		}
+		++iplan;
+	}
+
+	qtid = tid;
+	qbeg = beg;
+	qend = end;
+
+	// alignments reaching the next region are replayed there, which may overlap this one
+	cfrom = end;
+	if (planned && (begs.size() > 1) && (begs[1] < cfrom))
+		cfrom = begs[1];
+
+	// index chunks holding only masked alignments are never read
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		if (streams[i].idx && (!planned || (streams[i].itid != tid)))
+		{
+			if (!planned)
+				unmasked(tid, beg, end, ibegs, iends);
+			for (size_t r = 0; r < begs.size(); r++)
+				unmasked(tid, begs[r], ends[r], ibegs, iends);
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		bamStream_t &s = streams[i];
+
+		if (s.idx && !planned)
+		{
+			if (s.iter)
+				bam_iter_destroy(s.iter);
+			s.iter = bam_iter_query_multi(s.idx, tid, (int)ibegs.size(), &ibegs[0], &iends[0]);
+			s.itid = -1;
+		}
+		else
+		{
+			if (s.idx && (s.itid != tid))
+			{
+				// the merged chunks of all remaining regions on this reference are read in order
+				if (s.iter)
+					bam_iter_destroy(s.iter);
+				s.iter = bam_iter_query_multi(s.idx, tid, (int)ibegs.size(), &ibegs[0], &iends[0]);
+				s.itid = tid;
+				s.ncarry[0] = s.ncarry[1] = 0;
+				s.held = false;
+				s.at_eof = (s.iter == 0);
+			}
+
+			// replay what the previous region collected
+			std::swap(s.carry[0], s.carry[1]);
+			s.ncarry[0] = s.ncarry[1];
+			s.ncarry[1] = 0;
+			s.icarry = 0;
+		}
+
+		s.has_pending = false;
+		s.status = 0;
+		s.n[0] = s.n[1] = 0;
+		s.cur = 0;
+	}
+
+	// decode the first chunk in the foreground and the next one behind it
+	slot = 0;
+	limit = beg + step;
+	startFill(1, limit);
+
+	return swapChunk() < -1 ? -2 : 0;
+}
+
+void bamReader::unmasked(int tid, int beg, int end, std::vector<int> &begs, std::vector<int> &ends)
+{
+	size_t n = begs.size();
+	int from = beg;
+	std::vector<bamRegion_t>::const_iterator m;
+
+	// the masked intervals of the current reference are merged and sorted
+	m = std::upper_bound(mask->begin(), mask->end(), beg, [](int pos, const bamRegion_t &r) { return pos < r.end; });
+	for (; (m != mask->end()) && (m->tid == tid) && (m->beg < end); ++m)
+	{
+		if (m->beg > from)
+		{
+			begs.push_back(from);
+			ends.push_back(m->beg);
+		}
+		from = m->end;
+	}
+
+	if (from < end)
+	{
+		begs.push_back(from);
+		ends.push_back(end);
+	}
+
+	// a fully masked region is still queried so the iterator stays valid
+	if (begs.size() == n)
+	{
+		begs.push_back(beg);
+		ends.push_back(end);
+	}
+}
+
+int bamReader::next(bam1_t **b, int *fileid)
+{
+	int ret = 0;
+
+	while (heap.empty())
+		if ((ret = swapChunk()) < 0)
+			return ret;
+
+	// the lowest coordinate among the heads of all batches goes next
+	int i = heap.top().second;
+	bamStream_t &s = streams[i];
+
+	heap.pop();
+	*b = s.batch[slot][s.cur++];
+	*fileid = i;
+
+	if (s.cur < s.n[slot])
+		heap.push(heapEntry(s.batch[slot][s.cur]->core.pos, i));
+
+	return 0;
+}
+
+int bamReader::swapChunk(void)
+{
+	int nreads = 0;
+	int next_pos = INT_MAX;
+	bool more = false;
+
+	waitFill();
+	slot ^= 1;
+
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		bamStream_t &s = streams[i];
+
+		if (s.status < -1)
+			return s.status;
+
+		s.cur = 0;
+		nreads += s.n[slot];
+
+		if (s.n[slot] > 0)
+			heap.push(heapEntry(s.batch[slot][0]->core.pos, (int)i));
+
+		if (s.has_pending)
+		{
+			more = true;
+			if (s.pending->core.pos < next_pos)
+				next_pos = s.pending->core.pos;
+		}
+		else if (s.status == 0)
+			more = true;
+	}
+
+	// size the next chunk after the density of this one
+	if (nreads > 0)
+	{
+		step = (int)((double)step * CHUNK_READS / nreads);
+		step = step < CHUNK_MIN ? CHUNK_MIN : (step > CHUNK_MAX ? CHUNK_MAX : step);
+	}
+
+	if (!more)
+	{
+		// nothing will be decoded into the other batch
+		for (size_t i = 0; i < streams.size(); i++)
+			streams[i].n[slot ^ 1] = 0;
+	}
+	else
+	{
+		// skip over stretches of reference without any alignments
+		if ((next_pos != INT_MAX) && (next_pos > limit))
+			limit = next_pos;
+		limit += step;
+		startFill(slot ^ 1, limit);
+	}
+
+	return (heap.empty() && !more) ? -1 : 0;
+}
+
+int bamReader::readRegion(bamStream_t &s, bam1_t *&b)
+{
+	int ret = 0;
+	bool carried = false;
+	unsigned int rend = 0;
+
+	if (s.idx && (s.itid < 0))
+		return bam_iter_read(s.fp, s.iter, b);
+
+	for (;;)
+	{
+		// alignments carried over from the previous region come first
+		if (s.icarry < s.ncarry[0])
+		{
+			std::swap(b, s.carry[0][s.icarry++]);
+			carried = true;
+		}
+		else if (s.held)
+		{
+			std::swap(b, s.spill);
+			s.held = false;
+			carried = false;
+		}
+		else if (s.at_eof)
+			return -1;
+		else if ((ret = s.idx ? bam_iter_read(s.fp, s.iter, b) : samread(s.in, b)) < 0)
+		{
+			s.at_eof = true;
+			return ret;
+		}
+		else
+		{
+			// every alignment passes through here once, in file order
+			if (s.bi)
+				bam_index_builder_push(s.bi, b, bam_tell(s.fp));
+			carried = false;
+		}
+
+		rend = b->core.n_cigar ? bam_calend(&b->core, bam1_cigar(b)) : b->core.pos + 1;
+
+		// the input is sorted, so everything after this alignment lies beyond the region
+		if ((b->core.tid < 0) || (b->core.tid > qtid) || ((b->core.tid == qtid) && (b->core.pos >= qend)))
+		{
+			// an alignment carried past a region nested in the last one may reach the next
+			if (carried)
+			{
+				if ((b->core.tid == qtid) && ((int)rend > cfrom))
+					carryOver(s, b);
+				continue;
+			}
+			std::swap(b, s.spill);
+			s.held = true;
+			return -1;
+		}
+
+		// skip alignments ending before the region
+		if ((b->core.tid < qtid) || ((int)rend <= qbeg))
+			continue;
+
+		// keep a copy of alignments reaching into the next region
+		if ((int)rend > cfrom)
+			carryOver(s, b);
+
+		return 0;
+	}
+}
+
+void bamReader::carryOver(bamStream_t &s, const bam1_t *b)
+{
+	if (s.ncarry[1] == (int)s.carry[1].size())
+		s.carry[1].push_back(bam_init1());
+	bam_copy1(s.carry[1][s.ncarry[1]++], b);
+}
+
+void bamReader::startFill(int fill_slot, int fill_limit)
+{
+	next_file = 0;
+
+	for (int t = 0; t < nthreads; t++)
+		workers.push_back(std::thread(&bamReader::fillChunk, this, fill_slot, fill_limit));
+}
+
+void bamReader::waitFill(void)
+{
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	workers.clear();
+}
+
+void bamReader::fillChunk(int fill_slot, int fill_limit)
+{
+	int i = 0;
+
+	// claim files until every file has been decoded up to the limit
+	while ((i = next_file++) < (int)streams.size())
+	{
+		int n = 0;
+		bamStream_t &s = streams[i];
+		std::vector<bam1_t*> &batch = s.batch[fill_slot];
+
+		for (;;)
+		{
+			if (n == (int)batch.size())
+				batch.push_back(bam_init1());
+
+			if (s.has_pending)
+			{
+				std::swap(batch[n], s.pending);
+				s.has_pending = false;
+			}
+			else if (s.status < 0)
+				break;
+			else if ((s.status = readRegion(s, batch[n])) < 0)
+				break;
+			else
+				s.status = 0;
+
+			// keep the first alignment past the limit for the next chunk
+			if (batch[n]->core.pos >= fill_limit)
+			{
+				std::swap(batch[n], s.pending);
+				s.has_pending = true;
+				break;
+			}
+
+			++n;
+		}
+
+		s.n[fill_slot] = n;
+	}
+}
@@ -9,10 +9,19 @@
 
 KHASH_MAP_INIT_STR(sm, int);
 
+static int add_file_samples(bam_sample_t*, const char*, const char*);
 static void add_sample_pair(bam_sample_t*, khash_t(sm)*, const char*, const char*);
 static void add_pop_pair(bam_sample_t*, khash_t(sm)*, const char*, const char*);
 
 int bam_smpl_add(bam_sample_t *sm, const popbamOptions *op)
+{
+	for (size_t i = 0; i < op->bamfiles.size(); i++)
+		add_file_samples(sm, op->bamfiles[i].c_str(), op->vcf ? op->vcf->header->text : op->cache ? op->cache->headers[i]->text : op->bam_in[i]->header->text);
+
+	return 0;
+}
+
+static int add_file_samples(bam_sample_t *sm, const char *fn, const char *txt)
 {
 	int n = 0;
 	const char *p = nullptr;
@@ -24,7 +33,7 @@ int bam_smpl_add(bam_sample_t *sm, const popbamOptions *op)
 	khash_t(sm) *sm2id = (khash_t(sm)*)sm->sm2id;
 	khash_t(sm) *pop2sm = (khash_t(sm)*)sm->pop2sm;
 
-	p = op->h->text;
+	p = txt;
 	n = 0;
 
 	memset(&buf, 0, sizeof(kstring_t));
@@ -53,7 +62,7 @@ int bam_smpl_add(bam_sample_t *sm, const popbamOptions *op)
 			or1 = *v;
 			*u = *v = '\0';
 			buf.l = 0;
-			kputs(op->bamfile.c_str(), &buf);
+			kputs(fn, &buf);
 			kputc('/', &buf);
 			kputs(q, &buf);
 			add_sample_pair(sm, sm2id, buf.s, r);
@@ -78,8 +87,8 @@ int bam_smpl_add(bam_sample_t *sm, const popbamOptions *op)
 			*u = *v = *w = '\0';
 			buf.l = 0;
 			bug.l = 0;
-			kputs(op->bamfile.c_str(), &buf);
-			kputs(op->bamfile.c_str(), &bug);
+			kputs(fn, &buf);
+			kputs(fn, &bug);
 			kputc('/', &buf);
 			kputc('/', &bug);
 			kputs(q, &buf);
@@ -100,8 +109,8 @@ int bam_smpl_add(bam_sample_t *sm, const popbamOptions *op)
 
 	if (n == 0)
 	{
-		add_sample_pair(sm, sm2id, op->bamfile.c_str(), op->bamfile.c_str());
-		add_pop_pair(sm, sm2id, op->bamfile.c_str(), op->bamfile.c_str());
+		add_sample_pair(sm, sm2id, fn, fn);
+		add_pop_pair(sm, sm2id, fn, fn);
 	}
 
 	free(buf.s);
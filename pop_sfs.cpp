@@ -7,15 +7,8 @@
 
 int mainSFS(int argc, char *argv[])
 {
-	bool found = false;           //! is the outgroup sequence found?
-	int chr = 0;                  //! chromosome identifier
-	int beg = 0;                  //! beginning coordinate for analysis
-	int end = 0;                  //! end coordinate for analysis
-	int ref = 0;                  //! ref
-	long nWindows = 0;            //! number of windows
-	std::string msg;              //! string for error message
-	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
-	bam_plbuf_t *buf = nullptr;   //! pileup buffer
+	bam_pileup_f func = nullptr;  //! pileup callback
+	popbamData *t = nullptr;      //! sfs data structure
 
 	// initialize user command line options
 	popbamOptions p(argc, argv);
@@ -26,155 +19,101 @@ int mainSFS(int argc, char *argv[])
 	// check input BAM file for errors
 	p.checkBAM();
 
-	// initialize the sample data structure
-	sm = bam_smpl_init();
+	// set up the sfs analysis
+	t = initSFS(p, &func);
+
+	// results go to a compressed and indexed file instead of stdout
+	if (!p.outfile.empty())
+		openResults(p, "sfs", t, p.outfile);
+
+	// iterate through all windows along specified genomic region or all target regions
+	runWindows(p, std::vector<popbamData*>(1, t), func, t);
+
+	if (!p.outfile.empty())
+		closeResults(t, p.outfile);
+
+	delete t;
+	p.closeBAM();
+
+	return 0;
+}
+
+popbamData *initSFS(const popbamOptions &p, bam_pileup_f *func)
+{
+	sfsData *t = nullptr;
+	bool found = false;           //! is the outgroup sequence found?
+	std::string msg;              //! string for error message
 
-	// add samples
-	bam_smpl_add(sm, &p);
+	// initialize the sfs data structure
+	t = new sfsData(p);
 
-	// initialize the sfs data structre
-	sfsData t(p);
-	t.sm = sm;
+	// initialize the sample data structure and add samples
+	t->sm = bam_smpl_init();
+	bam_smpl_add(t->sm, &p);
+	t->nchrom = (t->flag & BAM_DIPLOID) ? 2 * t->sm->n : t->sm->n;
 
 	// initialize error model
-	t.em = errmod_init(0.17);
+	t->em = errmod_init(0.17);
 
 	// if outgroup option is used check to make sure it exists
 	if (p.flag & BAM_OUTGROUP)
 	{
-		for (int i = 0; i < t.sm->n; ++i)
+		for (int i = 0; i < t->sm->n; ++i)
 		{
-			if (strcmp(t.sm->smpl[i], t.outgroup.c_str()) == 0)
+			if (strcmp(t->sm->smpl[i], t->outgroup.c_str()) == 0)
 			{
-				t.outidx = i;
+				t->outidx = i;
 				found = true;
 			}
 		}
+
 		if (!found)
 		{
-			msg = "Specified outgroup " + t.outgroup + " not found";
+			msg = "Specified outgroup " + t->outgroup + " not found";
 			fatalError(msg);
 		}
 	}
 
 	// calculate the constants for computation of Tajima's D
-	t.calc_a1();
-	t.calc_a2();
-	t.calc_e1();
-	t.calc_e2();
-	t.calc_dw();
-	t.calc_hw();
-
-	// parse genomic region
-	int k = bam_parse_region(p.h, p.region, &chr, &beg, &end);
-	if (k < 0)
+	t->calc_a1();
+	t->calc_a2();
+	t->calc_e1();
+	t->calc_e2();
+	t->calc_dw();
+	t->calc_hw();
+
+	// steps opening and closing each window; site-count windows also take them from the pileup
+	t->openWindow = [t, &p, found](void)
 	{
-		msg = "Bad genome coordinates: " + p.region;
-		fatalError(msg);
-	}
-
-	// fetch reference sequence
-	t.ref_base = faidx_fetch_seq(p.fai_file, p.h->target_name[chr], 0, 0x7fffffff, &(t.len));
-
-	// calculate the number of windows
-	if (p.flag & BAM_WINDOW)
-		nWindows = ((end - beg) - 1) / p.winSize;
-	else
-	{
-		p.winSize = end - beg;
-		nWindows = 1;
-	}
-
-	// iterate through all windows along specified genomic region
-	for (long j = 0; j < nWindows; ++j)
-	{
-		// construct genome coordinate string
-		std::string scaffold_name(p.h->target_name[chr]);
-		std::ostringstream winc(scaffold_name);
-
-		winc.seekp(0, std::ios::end);
-		winc << ':' << beg + (j * p.winSize) + 1 << '-' << ((j + 1) * p.winSize) + (beg - 1);
-
-		std::string winCoord = winc.str();
-
 		// initialize number of sites to zero
-		t.num_sites = 0;
-
-		// parse the BAM file and check if region is retrieved from the reference
-		if (p.flag & BAM_WINDOW)
-		{
-			k = bam_parse_region(p.h, winCoord, &ref, &(t.beg), &(t.end));
-			if (k < 0)
-			{
-				msg = "Bad window coordinates " + winCoord;
-				fatalError(msg);
-			}
-		}
-		else
-		{
-			ref = chr;
-			t.beg = beg;
-			t.end = end;
-			if (ref < 0)
-			{
-				msg = "Bad scaffold name: " + p.region;
-				fatalError(msg);
-			}
-		}
+		t->num_sites = 0;
 
 		// initialize nucdiv variables
-		t.allocSFS();
+		t->allocSFS();
 
 		// create population assignments
-		t.assignPops(&p);
+		t->assignPops(&p);
 
 		// assign outgroup population
 		if ((p.flag & BAM_OUTGROUP) && found)
-			t.assignOutpop();
-
-		// initialize pileup
-		buf = bam_plbuf_init(makeSFS, &t);
-
-		// fetch region from bam file
-		if ((bam_fetch(p.bam_in->x.bam, p.idx, ref, t.beg, t.end, buf, fetch_func)) < 0)
-		{
-			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
-			fatalError(msg);
-		}
-
-		// finalize pileup
-		bam_plbuf_push(0, buf);
+			t->assignOutpop();
+	};
 
+	t->closeWindow = [t, &p](void)
+	{
 		// calculate site frequency spectrum statistics
-		t.calcSFS();
+		t->calcSFS();
 
-		// print results to stdout
-		t.printSFS(std::string(p.h->target_name[chr]));
-
-		// take out the garbage
-		bam_plbuf_destroy(buf);
-	}
-	// end of window interation
+		// print results
+		t->printSFS(std::string(p.h->target_name[t->tid]));
+	};
 
-	errmod_destroy(t.em);
-	samclose(p.bam_in);
-	bam_index_destroy(p.idx);
-	for (int i = 0; i <= t.sm->n; ++i)
-	{
-		delete [] t.dw[i];
-		delete [] t.hw[i];
-	}
-	delete [] t.dw;
-	delete [] t.hw;
-	delete [] t.a1;
-	delete [] t.a2;
-	delete [] t.e1;
-	delete [] t.e2;
-	free(t.ref_base);
+	*func = PICK_PILEUP(makeSFS, p.flag);
 
-	return 0;
+	return t;
 }
 
+template <unsigned int F>
 int makeSFS(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
 {
 	int i = 0;
@@ -187,18 +126,28 @@ int makeSFS(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 	// get control data structure
 	t = (sfsData*)data;
 
-	// only consider sites located in designated region
-	if ((t->beg <= (int)pos) && (t->end > (int)pos))
+	// site-count windows are closed as the pileup moves past them
+	if (t->winSites > 0)
+		t->checkWindow(pos);
+
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
 	{
+		// make room for one more site
+		t->growSites();
+
 		// call bases
-		cb = callBase(t, n, pl);
+		cb = callBase<F>(t, n, pl);
 
-		// resolve heterozygous sites
-		if (!(t->flag & BAM_HETEROZYGOTE))
+		// resolve heterozygous sites; haploid calls have none and diploid counts keep them
+		if (!(F & (BAM_HETEROZYGOTE | BAM_HAPLOID | BAM_DIPLOID)))
 			cleanHeterozygotes(t->sm->n, cb, (int)t->ref_base[pos], t->minSNPQ);
 
 		// determine if site is segregating
-		fq = segBase(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
+		if (F & BAM_DIPLOID)
+			fq = segGenotype(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
+		else
+			fq = segBase(t->sm->n, cb, t->ref_base[pos], t->minSNPQ);
 
 		// determine how many samples pass the quality filters
 		sample_cov = qualFilter(t->sm->n, cb, t->minRMSQ, t->minDepth, t->maxDepth);
@@ -211,7 +160,7 @@ int makeSFS(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 		{
 			unsigned long long pc = 0;
 			pc = sample_cov & t->pop_mask[i];
-			ncov[i] = bitcount64(pc);
+			ncov[i] = kernels.count(pc);
 			unsigned int req = (unsigned int)((t->minPop * t->pop_nsmpl[i]) + 0.4999);
 			if (ncov[i] >= req)
 				t->pop_cov[t->num_sites] |= 0x1U << i;
@@ -223,8 +172,11 @@ int makeSFS(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 			t->num_sites++;
 			if (fq > 0)
 			{
+				// sample sizes are counted in chromosomes
 				for (j = 0; j < t->sm->npops; ++j)
-					t->ncov[j][t->segsites] = ncov[j];
+					t->ncov[j][t->segsites] = (F & BAM_DIPLOID) ? 2 * ncov[j] : ncov[j];
+				if (F & BAM_DIPLOID)
+					t->homs[t->segsites] = calculateHomType(t->sm->n, cb);
 				t->types[t->segsites++] = calculateSiteType(t->sm->n, cb);
 			}
 		}
@@ -244,7 +196,6 @@ int sfsData::calcSFS(void)
 	int s = 0;
 	int avgn = 0;
 	unsigned short freq = 0;
-	unsigned long long pop_type = 0;
 
 	// count number of aligned sites in each population
 	for (i = 0; i < num_sites; ++i)
@@ -254,21 +205,20 @@ int sfsData::calcSFS(void)
 
 	for (i = 0; i < sm->npops; i++)
 	{
-		if (ns[i] >= (unsigned long int)((end - beg) * minSites))
+		if (ns[i] >= (unsigned long int)(unmaskedLength() * minSites))
 		{
 			// get site frequency spectra and number of segregating sites
 			num_snps[i] = 0;
 			avgn = 0;
 			for (j = 0; j < segsites; j++)
 			{
-				pop_type = types[j] & pop_mask[i];
-
 				// check if outgroup is aligned and different from reference
-				// else the reference base is assumed to be ancestral
-				if ((flag & BAM_OUTGROUP) && (ncov[outpop][j] > 0) && CHECK_BIT(types[j], outidx))
-					freq = ncov[i][j] - bitcount64(pop_type);
+				// else the reference base is assumed to be ancestral; a diploid
+				// outgroup must be homozygous for the variant
+				if ((flag & BAM_OUTGROUP) && (ncov[outpop][j] > 0) && CHECK_BIT((flag & BAM_DIPLOID) ? homs[j] : types[j], outidx))
+					freq = ncov[i][j] - derivedCount(j, pop_mask[i]);
 				else
-					freq = bitcount64(pop_type);
+					freq = derivedCount(j, pop_mask[i]);
 
 				if ((freq > 0) && (freq < ncov[i][j]))
 				{
@@ -307,29 +257,28 @@ int sfsData::calcSFS(void)
 int sfsData::printSFS(const std::string scaffold)
 {
 	int i = 0;
-	std::stringstream out;
 
-	out << scaffold << '\t' << beg + 1 << '\t' << end + 1;
+	os << scaffold << '\t' << beg + 1 << '\t' << lastBase();
 
 	for (i = 0; i < sm->npops; i++)
 	{
-		out << "\tns[" << sm->popul[i] << "]:\t" << ns[i];
+		os << "\tns[" << sm->popul[i] << "]:\t" << ns[i];
 		if (isnan(td[i]))
-			out << "\tD[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+			os << "\tD[" << sm->popul[i] << "]:\t     NA";
 		else
 		{
-			out << "\tD[" << sm->popul[i] << "]:";
-			out << '\t' << std::fixed << std::setprecision(5) << td[i];
+			os << "\tD[" << sm->popul[i] << "]:";
+			os << '\t' << fixedValue(td[i], 5);
 		}
 		if (isnan(fwh[i]))
-			out << "\tH[" << sm->popul[i] << "]:\t" << std::setw(7) << "NA";
+			os << "\tH[" << sm->popul[i] << "]:\t     NA";
 		else
 		{
-			out << "\tH[" << sm->popul[i] << "]:";
-			out << '\t' << std::fixed << std::setprecision(5) << fwh[i];
+			os << "\tH[" << sm->popul[i] << "]:";
+			os << '\t' << fixedValue(fwh[i], 5);
 		}
 	}
-	std::cout << out.str() << std::endl;
+	os << '\n';
 
 	return 0;
 }
@@ -338,7 +287,6 @@ int sfsData::printSFS(const std::string scaffold)
 sfsData::sfsData(const popbamOptions &p)
 {
 	// inherit values from popbamOptions
-	bamfile = p.bamfile;
 	flag = p.flag;
 	minDepth = p.minDepth;
 	maxDepth = p.maxDepth;
@@ -346,6 +294,8 @@ sfsData::sfsData(const popbamOptions &p)
 	minSNPQ = p.minSNPQ;
 	minMapQ = p.minMapQ;
 	minBaseQ = p.minBaseQ;
+	winSites = p.winSites;
+	winSpan = (flag & BAM_WINDOW) ? p.winSize : 0x7fffffff;
 	hetPrior = p.hetPrior;
 	minSites = p.minSites;
 	minPop = p.minPop;
@@ -353,28 +303,59 @@ sfsData::sfsData(const popbamOptions &p)
 	// initialize native variables
 	derived_type = SFS;
 	outidx = 0;
+	nchrom = 0;
+	dw = nullptr;
+	hw = nullptr;
+	a1 = nullptr;
+	a2 = nullptr;
+	e1 = nullptr;
+	e2 = nullptr;
+}
+
+sfsData::~sfsData(void)
+{
+	// the constants are computed once, for the whole run
+	if (dw && hw)
+	{
+		for (int i = 0; i <= nchrom; ++i)
+		{
+			delete [] dw[i];
+			delete [] hw[i];
+		}
+	}
+	delete [] dw;
+	delete [] hw;
+	delete [] a1;
+	delete [] a2;
+	delete [] e1;
+	delete [] e2;
 }
 
 int sfsData::allocSFS(void)
 {
-	int length = end - beg;
 	int npops = sm->npops;
 
+	// arrays of the previous window are given back to the arena
+	arena.reset();
 	segsites = 0;
+	site_cap = SITE_CHUNK;
+	seg_cap = SITE_CHUNK;
 
 	try
 	{
-		types = new unsigned long long [length]();
-		ns = new unsigned long int [npops]();
-		ncov = new unsigned int* [npops];
-		pop_mask = new unsigned long long [npops]();
-		pop_nsmpl = new unsigned char [npops]();
-		pop_cov = new unsigned int [length]();
-		num_snps = new int [npops]();
-		td = new double [npops]();
-		fwh = new double [npops]();
+		types = arena.alloc<unsigned long long>(seg_cap);
+		if (flag & BAM_DIPLOID)
+			homs = arena.alloc<unsigned long long>(seg_cap);
+		ns = arena.alloc<unsigned long int>(npops);
+		ncov = arena.alloc<unsigned int*>(npops);
+		pop_mask = arena.alloc<unsigned long long>(npops);
+		pop_nsmpl = arena.alloc<unsigned char>(npops);
+		pop_cov = arena.alloc<unsigned int>(site_cap);
+		num_snps = arena.alloc<int>(npops);
+		td = arena.alloc<double>(npops);
+		fwh = arena.alloc<double>(npops);
 		for (int i = 0; i < npops; ++i)
-			ncov[i] = new unsigned int [length]();
+			ncov[i] = arena.alloc<unsigned int>(seg_cap);
 	}
 	catch (std::bad_alloc& ba)
 	{
@@ -384,33 +365,40 @@ int sfsData::allocSFS(void)
 	return 0;
 }
 
-sfsData::~sfsData(void)
+void sfsData::growSites(void)
 {
-	int npops = sm->npops;
+	int i = 0;
+	int cap = 2 * seg_cap;
+
+	// aligned sites
+	if (num_sites >= site_cap)
+	{
+		pop_cov = arena.extend(pop_cov, site_cap, 2 * site_cap);
+		site_cap *= 2;
+	}
 
-	delete [] pop_mask;
-	delete [] ns;
-	delete [] types;
-	delete [] pop_nsmpl;
-	delete [] pop_cov;
-	delete [] num_snps;
-	delete [] td;
-	delete [] fwh;
-	for (int i = 0; i < npops; ++i)
-		delete [] ncov[i];
-	delete [] ncov;
+	// segregating sites
+	if (segsites >= seg_cap)
+	{
+		types = arena.extend(types, seg_cap, cap);
+		if (flag & BAM_DIPLOID)
+			homs = arena.extend(homs, seg_cap, cap);
+		for (i = 0; i < sm->npops; i++)
+			ncov[i] = arena.extend(ncov[i], seg_cap, cap);
+		seg_cap = cap;
+	}
 }
 
 int sfsData::calc_dw(void)
 {
 	int i = 0;
 
-	dw = new double* [sm->n+1];
-	for (i = 0; i <= sm->n; ++i)
-		dw[i] = new double [sm->n+1]();
+	dw = new double* [nchrom+1];
+	for (i = 0; i <= nchrom; ++i)
+		dw[i] = new double [nchrom+1]();
 
-	for (int n = 2; n <= sm->n; ++n)
-		for(i = 1; i <= sm->n; ++i)
+	for (int n = 2; n <= nchrom; ++n)
+		for(i = 1; i <= nchrom; ++i)
 			dw[n][i] = (((2.0 * i * (n - i)) / (SQ(n-1))) - (1.0 / a1[n]));
 
 	return 0;
@@ -431,12 +419,12 @@ int sfsData::calc_hw(void)
 {
 	int i = 0;
 
-	hw = new double* [sm->n+1];
-	for (i = 0; i <= sm->n; ++i)
-		hw[i] = new double [sm->n+1]();
+	hw = new double* [nchrom+1];
+	for (i = 0; i <= nchrom; ++i)
+		hw[i] = new double [nchrom+1]();
 
-	for (int n = 2; n <= sm->n; ++n)
-		for (i = 1; i <= sm->n; ++i)
+	for (int n = 2; n <= nchrom; ++n)
+		for (i = 1; i <= nchrom; ++i)
 			hw[n][i] = ((1.0 / a1[n]) - ((double)(i) / (n - 1)));
 
 	return 0;
@@ -444,11 +432,11 @@ int sfsData::calc_hw(void)
 
 int sfsData::calc_a1(void)
 {
-	a1 = new double [sm->n+1];
+	a1 = new double [nchrom+1];
 	a1[0] = a1[1] = 1.0;
 
 	// consider all sample sizes
-	for (int i = 2; i <= sm->n; i++)
+	for (int i = 2; i <= nchrom; i++)
 	{
 		a1[i] = 0;
 		for (int j = 1; j < i; j++)
@@ -460,11 +448,11 @@ int sfsData::calc_a1(void)
 
 int sfsData::calc_a2(void)
 {
-	a2 = new double [sm->n+2];
+	a2 = new double [nchrom+2];
 	a2[0] = a2[1] = 1.0;
 
 	// consider all sample sizes
-	for (int i = 2; i <= sm->n+1; i++)
+	for (int i = 2; i <= nchrom+1; i++)
 	{
 		a2[i] = 0;
 		for (int j = 1; j < i; j++)
@@ -476,10 +464,10 @@ int sfsData::calc_a2(void)
 
 int sfsData::calc_e1(void)
 {
-	e1 = new double [sm->n+1];
+	e1 = new double [nchrom+1];
 	e1[0] = e1[1] = 1.0;
 
-	for (int i = 2; i <= sm->n; i++)
+	for (int i = 2; i <= nchrom; i++)
 	{
 		double b1 = (i + 1.0) / (3.0 * (i-1));
 		e1[i] = (b1 - (1.0 / a1[i])) / a1[i];
@@ -490,24 +478,39 @@ int sfsData::calc_e1(void)
 
 int sfsData::calc_e2(void)
 {
-	e2 = new double [sm->n+1];
+	e2 = new double [nchrom+1];
 	e2[0] = e2[1] = 1.0;
 
-	for (int i = 2; i <= sm->n; i++)
+	for (int i = 2; i <= nchrom; i++)
 	{
 		double b2 = (2.0 * (SQ(i) + i + 3.0)) / (9.0 * i * (i-1));
 		e2[i] = (b2 - ((i + 2.0) / (a1[i] * i)) + (a2[i] / SQ(a1[i]))) / (SQ(a1[i]) + a2[i]);
 	}
+
+	return 0;
 }
 
 void usageSFS(const std::string msg)
 {
 	std::cerr << msg << std::endl << std::endl;
-	std::cerr << "Usage:   popbam sfs [options] <in.bam> [region]" << std::endl;
+	std::cerr << "Usage:   popbam sfs [options] <in1.bam|-> [in2.bam ...] [region]" << std::endl;
 	std::cerr << std::endl;
 	std::cerr << "Options: -i          base qualities are Illumina 1.3+               [ default: Sanger ]" << std::endl;
 	std::cerr << "         -h  FILE    Input header file                              [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -G  FILE    sample to population map of a bgzipped VCF file given as input" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -D          count alleles over both chromosomes of diploid individuals" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads                     [ default: 1 ]" << std::endl;
+	std::cerr << "         -O  FILE    write results to FILE, compressed with BGZF and indexed for tabix" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
 	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
+	std::cerr << "         -g  INT     close windows after INT segregating sites (-w: longest window)" << std::endl;
+	std::cerr << "         -c  INT     close windows after INT callable sites (-w: longest window)" << std::endl;
 	std::cerr << "         -p  STR     sample name of outgroup                        [ default: reference ]" << std::endl;
 	std::cerr << "         -k  FLT     minimum proportion of sites covered in window  [ default: 0.5 ]" << std::endl;
 	std::cerr << "         -n  FLT     minimum proportion of population covered       [ default: 1.0 ]" << std::endl;
@@ -41,6 +41,7 @@ class sfsData: public popbamData
 		std::string outgroup;                   //!< Sample name of outgroup to use
 		int outidx;                             //!< Index of outgroup sequence
 		int outpop;                             //!< Population of outgroup sequence
+		int nchrom;                             //!< Number of chromosomes sampled; twice the number of individuals under -D
 		double **dw;                            //!< Matrix of weights for Tajima's D calculation
 		double **hw;                            //!< Matrix of weights for Fay and Wu's H calculation
 		double *a1;                             //!< Constants for Tajima's D calculation
@@ -52,6 +53,7 @@ class sfsData: public popbamData
 
 		// member functions
 		int allocSFS(void);
+		void growSites(void);
 		int printSFS(const std::string);
 		int assignOutpop(void);
 		int calc_dw(void);
@@ -67,26 +69,16 @@ class sfsData: public popbamData
 /// Function prototypes
 ///
 
-/*!
-* \fn unsigned long long *callBase(bam_sample_t *sm, errmod_t *em, int n, const bam_pileup1_t *pl)
-* \brief Calls the base from the pileup at each position
-* \param sm     Pointer to the sample data structure
-* \param em     Pointer to the error model structure
-* \param n      The number of reads in the pileup
-* \param pl     Pointer to the pileup
-* \return       Pointer to the consensus base call information for the individuals
-*/
-template unsigned long long* callBase<sfsData>(sfsData *t, int n, const bam_pileup1_t *pl);
-
 /*!
  * \fn int makeSFS(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
  * \brief Runs the site frequency spectrum analysis
+ * \tparam F Option flags the callback is compiled for
  * \param tid Chromosome identifier
  * \param pos Genomic position
  * \param n The read depth
  * \param pl A pointer to the alignment covering a single position
  * \param data A pointer to the user-passed data
  */
-int makeSFS(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+template <unsigned int F> int makeSFS(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
 
 void usageSFS(const std::string);
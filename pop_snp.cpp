@@ -7,15 +7,8 @@
 
 int mainSNP(int argc, char *argv[])
 {
-	bool found = false;           //! is the outgroup found?
-	int chr = 0;                  //! chromosome identifier
-	int beg = 0;                  //! beginning coordinate for analysis
-	int end = 0;                  //! end coordinate for analysis
-	int ref = 0;                  //! reference allele
-	long nWindows = 0;            //! total number of windows
-	std::string msg;              //! string for error message
-	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
-	bam_plbuf_t *buf = nullptr;   //! pileup buffer
+	bam_pileup_f func = nullptr;  //! pileup callback
+	popbamData *t = nullptr;      //! snp data structure
 
 	// initialize user command line options
 	popbamOptions p(argc, argv);
@@ -26,137 +19,107 @@ int mainSNP(int argc, char *argv[])
 	// check input BAM file for errors
 	p.checkBAM();
 
-	// initialize the sample data structure
-	sm = bam_smpl_init();
+	// set up the snp analysis
+	t = initSNP(p, &func);
+
+	// results go to a compressed and indexed file instead of stdout; VCF
+	// output has been sent there by initSNP, ahead of its header
+	if (!p.outfile.empty() && (p.output < 3))
+		openResults(p, "snp", t, p.outfile);
+
+	// iterate through all windows along specified genomic region or all target regions
+	runWindows(p, std::vector<popbamData*>(1, t), func, t);
+
+	if (!p.outfile.empty())
+		closeResults(t, p.outfile);
+
+	delete t;
+	p.closeBAM();
+
+	return 0;
+}
+
+popbamData *initSNP(const popbamOptions &p, bam_pileup_f *func)
+{
+	snpData *t = nullptr;
+	bool found = false;           //! is the outgroup sequence found?
+	std::string msg;              //! string for error message
 
-	// add samples
-	bam_smpl_add(sm, &p);
+	// initialize the snp data structure
+	t = new snpData(p);
 
-	// initialize the snp data structre
-	snpData t(p);
-	t.sm = sm;
+	// initialize the sample data structure and add samples
+	t->sm = bam_smpl_init();
+	bam_smpl_add(t->sm, &p);
 
 	// initialize error model
-	t.em = errmod_init(0.17);
+	t->em = errmod_init(0.17);
 
 	// if outgroup option is used check to make sure it exists
 	if (p.flag & BAM_OUTGROUP)
 	{
-		for (int i = 0; i < t.sm->n; ++i)
+		for (int i = 0; i < t->sm->n; ++i)
 		{
-			if (strcmp(t.sm->smpl[i], t.outgroup.c_str()) == 0)
+			if (strcmp(t->sm->smpl[i], t->outgroup.c_str()) == 0)
 			{
-				t.outidx = i;
+				t->outidx = i;
 				found = true;
 			}
 		}
 
 		if (!found)
 		{
-			msg = "Specified outgroup " + t.outgroup + " not found";
+			msg = "Specified outgroup " + t->outgroup + " not found";
 			fatalError(msg);
 		}
 	}
 
-	// parse genomic region
-	int k = bam_parse_region(p.h, p.region, &chr, &beg, &end);
-	if (k < 0)
+	// steps opening and closing each window; site-count windows also take them from the pileup
+	t->openWindow = [t, &p](void)
 	{
-		msg = "Bad genome coordinates: " + p.region;
-		fatalError(msg);
-	}
-
-	// fetch reference sequence
-	t.ref_base = faidx_fetch_seq(p.fai_file, p.h->target_name[chr], 0, 0x7fffffff, &(t.len));
-
-	// calculate the number of windows
-	if (p.flag & BAM_WINDOW)
-		nWindows = ((end - beg) - 1) / p.winSize;
-	else
-	{
-		p.winSize = end - beg;
-		nWindows = 1;
-	}
-
-	// iterate through all windows along specified genomic region
-	for (long j = 0; j < nWindows; ++j)
-	{
-		// construct genome coordinate string
-		std::string scaffold_name(p.h->target_name[chr]);
-		std::ostringstream winc(scaffold_name);
-
-		winc.seekp(0, std::ios::end);
-		winc << ':' << beg + (j * p.winSize) + 1 << '-' << ((j + 1) * p.winSize) + (beg - 1);
-
-		std::string winCoord = winc.str();
-
 		// initialize number of sites to zero
-		t.num_sites = 0;
-
-		// parse the BAM file and check if region is retrieved from the reference
-		if (p.flag & BAM_WINDOW)
-		{
-			k = bam_parse_region(p.h, winCoord, &ref, &(t.beg), &(t.end));
-
-			if (k < 0)
-			{
-				msg = "Bad window coordinates " + winCoord;
-				fatalError(msg);
-			}
-		}
-		else
-		{
-			ref = chr;
-			t.beg = beg;
-			t.end = end;
-
-			if (ref < 0)
-			{
-				msg = "Bad scaffold name: " + p.region;
-				fatalError(msg);
-			}
-		}
+		t->num_sites = 0;
 
 		// initialize diverge specific variables
-		t.allocSNP();
+		t->allocSNP();
 
 		// create population assignments
-		t.assignPops(&p);
-
-		// print ms header if first window iteration
-		if ((t.output == 2) && (j == 0))
-			t.printMSHeader(nWindows);
+		t->assignPops(&p);
 
-		// initialize pileup
-		buf = bam_plbuf_init(makeSNP, &t);
-
-		// fetch region from bam file
-		if ((bam_fetch(p.bam_in->x.bam, p.idx, ref, t.beg, t.end, buf, fetch_func)) < 0)
+		// print ms header before the first window
+		if ((t->output == 2) && !t->msHeader)
 		{
-			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
-			fatalError(msg);
+			t->printMSHeader(p.regions.size());
+			t->msHeader = true;
 		}
+	};
 
-		// finalize pileup
-		bam_plbuf_push(0, buf);
+	t->closeWindow = [t, &p](void)
+	{
+		// print results
+		t->print_SNP(std::string(p.h->target_name[t->tid]));
+	};
 
-		// print results to stdout
-		t.print_SNP(std::string(p.h->target_name[chr]));
+	// VCF and BCF output is streamed from the pileup rather than printed per window
+	if (p.output >= 3)
+	{
+		if ((p.output == 3) && !p.outfile.empty())
+			openResults(p, "snp", t, p.outfile);
 
-		// take out the garbage
-		bam_plbuf_destroy(buf);
+		t->vcf = new vcfWriter;
+		if ((t->vcf->open(p.outfile, p.output == 4, &t->os) < 0) || (t->vcf->writeHeader(&p, t->sm) < 0))
+		{
+			msg = "Failed to open VCF output " + p.outfile;
+			fatalError(msg);
+		}
 	}
-	// end of window interation
 
-	errmod_destroy(t.em);
-	samclose(p.bam_in);
-	bam_index_destroy(p.idx);
-	bam_smpl_destroy(sm);
-	free(t.ref_base);
+	*func = PICK_PILEUP(makeSNP, p.flag);
 
-	return 0;
+	return t;
 }
 
+template <unsigned int F>
 int makeSNP(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
 {
 	int i = 0;
@@ -168,14 +131,21 @@ int makeSNP(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 	// get control data structure
 	t = (snpData*)data;
 
-	// only consider sites located in designated region
-	if ((t->beg <= (int)pos) && (t->end > (int)pos))
+	// site-count windows are closed as the pileup moves past them
+	if (t->winSites > 0)
+		t->checkWindow(pos);
+
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
 	{
+		// make room for one more site
+		t->growSites();
+
 		// call bases
-		cb = callBase(t, n, pl);
+		cb = callBase<F>(t, n, pl);
 
-		// resolve heterozygous sites
-		if (!(t->flag & BAM_HETEROZYGOTE))
+		// resolve heterozygous sites; haploid calls have none
+		if (!(F & (BAM_HETEROZYGOTE | BAM_HAPLOID)))
 			cleanHeterozygotes(t->sm->n, cb, (int)t->ref_base[pos], t->minSNPQ);
 
 		// determine if site is segregating
@@ -193,7 +163,7 @@ int makeSNP(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 			unsigned long long pc = 0;
 
 			pc = sample_cov & t->pop_mask[i];
-			ncov[i] = bitcount64(pc);
+			ncov[i] = kernels.count(pc);
 
 			unsigned int req = (unsigned int)((t->minPop * t->pop_nsmpl[i]) + 0.4999);
 
@@ -210,21 +180,34 @@ int makeSNP(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 					t->ncov[i][t->segsites] = ncov[i];
 				t->types[t->segsites] = calculateSiteType(t->sm->n, cb);
 
-				// add to the haplotype matrix
-				t->hap.pos[t->segsites] = pos;
-				t->hap.ref[t->segsites] = bam_nt16_table[(int)t->ref_base[pos]];
-
-				for (i = 0; i < t->sm->n; i++)
+				// VCF and BCF records are written as the sites are called
+				if (t->vcf)
 				{
-					t->hap.rms[i][t->segsites] = (cb[i] >> (CHAR_BIT * 6)) & 0xffff;
-					t->hap.snpq[i][t->segsites] = (cb[i] >> (CHAR_BIT * 4)) & 0xffff;
-					t->hap.num_reads[i][t->segsites] = (cb[i]>>(CHAR_BIT * 2)) & 0xffff;
-					t->hap.base[i][t->segsites] = bam_nt16_table[(int)iupac[(cb[i] >> CHAR_BIT) & 0xff]];
-
-					if (cb[i] & 0x2ULL)
-						t->hap.seq[i][t->segsites/64] |= 0x1ULL << t->segsites % 64;
+					if (t->vcf->writeSite(tid, pos, t->ref_base[pos], cb) < 0)
+						fatalError("Failed to write VCF output");
+				}
+				else
+				{
+					// add to the haplotype matrix
+					t->hap.pos[t->segsites] = pos;
+					t->hap.ref[t->segsites] = bam_nt16_table[(int)t->ref_base[pos]];
+
+					// one record holds the calls of all individuals at the site
+					hCall_t *call = t->hap.call + (size_t)t->segsites * t->sm->n;
+					unsigned long long geno = 0;
+
+					for (i = 0; i < t->sm->n; i++)
+					{
+						call[i].rms = (cb[i] >> (CHAR_BIT * 6)) & 0xffff;
+						call[i].snpq = (cb[i] >> (CHAR_BIT * 4)) & 0xffff;
+						call[i].num_reads = (cb[i] >> (CHAR_BIT * 2)) & 0xffff;
+						call[i].base = bam_nt16_table[(int)iupac[(cb[i] >> CHAR_BIT) & 0xff]];
+						if (cb[i] & 0x2ULL)
+							geno |= 0x1ULL << i;
+					}
+					t->hap.geno[t->segsites] = geno;
+					t->hap.idx[t->segsites] = t->num_sites;
 				}
-				t->hap.idx[t->segsites] = t->num_sites;
 				t->segsites++;
 			}
 			t->num_sites++;
@@ -240,8 +223,12 @@ int makeSNP(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 
 int snpData::print_SNP(const std::string scaffold)
 {
+	// VCF and BCF records were written as the sites were called
+	if (vcf)
+		return 0;
+
 	snp_func fp[3] = {&snpData::printSNP, &snpData::printSweep, &snpData::printMS};
-	(this->*fp[output])(scaffold);
+	return (this->*fp[output])(scaffold);
 }
 
 int snpData::printSNP(const std::string scaffold)
@@ -251,19 +238,20 @@ int snpData::printSNP(const std::string scaffold)
 
 	for (i = 0; i < segsites; i++)
 	{
-		std::stringstream out;
-		out << scaffold << '\t' << hap.pos[i] + 1 << '\t';
-		out << bam_nt16_rev_table[hap.ref[i]];
+		os << scaffold << '\t' << hap.pos[i] + 1 << '\t';
+		os << bam_nt16_rev_table[hap.ref[i]];
 
+		// the calls of all individuals at a site are stored together
+		const hCall_t *call = hap.call + (size_t)i * sm->n;
 		for (j = 0; j < sm->n; j++)
 		{
-			out << '\t' << bam_nt16_rev_table[hap.base[j][i]];
-			out << '\t' << hap.snpq[j][i];
-			out << '\t' << hap.rms[j][i];
-			out << '\t' << hap.num_reads[j][i];
+			os << '\t' << bam_nt16_rev_table[call[j].base];
+			os << '\t' << call[j].snpq;
+			os << '\t' << call[j].rms;
+			os << '\t' << call[j].num_reads;
 		}
 
-		std::cout << out.str() << std::endl;
+		os << '\n';
 	}
 
 	return 0;
@@ -279,8 +267,7 @@ int snpData::printSweep(const std::string scaffold)
 
 	for (i = 0; i < segsites; i++)
 	{
-		std::stringstream out;
-		out << scaffold << '\t' << hap.pos[i] + 1;
+		os << scaffold << '\t' << hap.pos[i] + 1;
 
 		for (j = 0; j < sm->npops; j++)
 		{
@@ -289,14 +276,14 @@ int snpData::printSweep(const std::string scaffold)
 
 			// polarize the mutation at the site
 			if ((flag & BAM_OUTGROUP) && CHECK_BIT(types[i], outidx))
-				freq = ncov[j][i] - bitcount64(pop_type);
+				freq = ncov[j][i] - kernels.count(pop_type);
 			else
-				freq = bitcount64(pop_type);
+				freq = kernels.count(pop_type);
 
-			out << '\t' << freq << '\t' << ncov[j][i];
+			os << '\t' << freq << '\t' << ncov[j][i];
 		}
 
-		std::cout << out.str() << std::endl;
+		os << '\n';
 	}
 
 	return 0;
@@ -306,66 +293,66 @@ int snpData::printMS(const std::string scaffold)
 {
 	int i = 0;
 	int j = 0;
-	std::stringstream out;
 
-	out << "//\n" << "segsites: " << segsites << "\npositions: ";
+	sampleMajor(&hap);
+
+	os << "//\n" << "segsites: " << segsites << "\npositions: ";
 
 	for (i = 0; i < segsites; i++)
-		out << std::setprecision(8) << (double)(hap.pos[i] - beg) / (end - beg) << ' ';
-	out << '\n';
+		os << sigValue((double)(hap.pos[i] - beg) / (end - beg), 8) << ' ';
+	os << '\n';
 
 	for (i = 0; i < sm->n; i++)
 	{
 		for (j = 0; j < segsites; j++)
 		{
-			if ((flag & BAM_OUTGROUP) && CHECK_BIT(types[hap.idx[j]], outidx))
+			if ((flag & BAM_OUTGROUP) && CHECK_BIT(types[j], outidx))
 			{
 				if (CHECK_BIT(hap.seq[i][j/64], j % 64))
-					out << '0';
+					os << '0';
 				else
-					out << '1';
+					os << '1';
 			}
 			else
 			{
 				if (CHECK_BIT(hap.seq[i][j/64], j % 64))
-					out << '1';
+					os << '1';
 				else
-					out << '0';
+					os << '0';
 			}
 		}
-		out << '\n';
+		os << '\n';
 	}
-	std::cout << out.str() << std::endl;
+	os << '\n';
 	return 0;
 }
 
 int snpData::printMSHeader(long nwindows)
 {
 	int i = 0;
-	std::stringstream out;
 
 	if (sm->npops > 1)
 	{
-		out << "ms " << sm->n << ' ' << nwindows;
-		out << " -t 5.0 -I " << sm->npops << ' ';
+		os << "ms " << sm->n << ' ' << nwindows;
+		os << " -t 5.0 -I " << sm->npops << ' ';
 
 		for (i = 0; i < sm->npops; i++)
-			out << (int)(pop_nsmpl[i]) << ' ';
+			os << (int)(pop_nsmpl[i]) << ' ';
 	}
 	else
 	{
-		out << "ms " << sm->n << ' ' << nwindows << " -t 5.0 ";
+		os << "ms " << sm->n << ' ' << nwindows << " -t 5.0 ";
 	}
 
-	out << "\n1350154902";
-	std::cout << out.str() << std::endl << std::endl;
+	os << "\n1350154902\n\n";
+
+	return 0;
 }
 
 
 snpData::snpData(const popbamOptions &p)
 {
 	// inherit values from popbamOptions
-	bamfile = p.bamfile;
 	flag = p.flag;
 	minDepth = p.minDepth;
 	maxDepth = p.maxDepth;
@@ -373,6 +360,8 @@ snpData::snpData(const popbamOptions &p)
 	minSNPQ = p.minSNPQ;
 	minMapQ = p.minMapQ;
 	minBaseQ = p.minBaseQ;
+	winSites = p.winSites;
+	winSpan = (flag & BAM_WINDOW) ? p.winSize : 0x7fffffff;
 	hetPrior = p.hetPrior;
 	minPop = p.minPop;
 	output = p.output;
@@ -380,95 +369,99 @@ snpData::snpData(const popbamOptions &p)
 	// initialize native variables
 	derived_type = SNP;
 	outidx = 0;
+	msHeader = false;
+	vcf = nullptr;
+}
+
+snpData::~snpData(void)
+{
+	if (vcf && (vcf->close() < 0))
+		fatalError("Failed to write VCF output");
+	delete vcf;
 }
 
 int snpData::allocSNP(void)
 {
 	int i = 0;
-	const int length = end - beg;
-	const int n = sm->n;
 	const int npops = sm->npops;
 
+	// arrays of the previous window are given back to the arena
+	arena.reset();
 	segsites = 0;
+	site_cap = SITE_CHUNK;
+	seg_cap = SITE_CHUNK;
 
 	try
 	{
-		types = new unsigned long long [length]();
-		pop_mask = new unsigned long long [npops]();
-		pop_nsmpl = new unsigned char [npops]();
-		pop_cov = new unsigned int [length]();
-		hap.pos = new unsigned int [length]();
-		hap.idx = new unsigned int [length]();
-		hap.ref = new unsigned char [length]();
-		hap.seq = new unsigned long long* [n];
-		hap.base = new unsigned char* [n];
-		hap.rms = new unsigned short* [n];
-		hap.snpq = new unsigned short* [n];
-		hap.num_reads = new unsigned short* [n];
-		ncov = new unsigned int* [npops];
-
-		for (i = 0; i < n; i++)
-		{
-			hap.seq[i] = new unsigned long long [length]();
-			hap.base[i] = new unsigned char [length]();
-			hap.rms[i] = new unsigned short [length]();
-			hap.snpq[i] = new unsigned short [length]();
-			hap.num_reads[i] = new unsigned short [length]();
-		}
+		types = arena.alloc<unsigned long long>(seg_cap);
+		pop_mask = arena.alloc<unsigned long long>(npops);
+		pop_nsmpl = arena.alloc<unsigned char>(npops);
+		pop_cov = arena.alloc<unsigned int>(site_cap);
+		ncov = arena.alloc<unsigned int*>(npops);
+		allocHap(&hap);
 
 		for (i = 0; i < npops; i++)
-			ncov[i] = new unsigned int [length]();
+			ncov[i] = arena.alloc<unsigned int>(seg_cap);
 	}
 	catch (std::bad_alloc& ba)
 	{
 		std::cerr << "bad_alloc caught: " << ba.what() << std::endl;
 	}
+
+	return 0;
 }
 
-snpData::~snpData(void)
+void snpData::growSites(void)
 {
 	int i = 0;
-	int npops = sm->npops;
-
-	delete [] pop_mask;
-	delete [] pop_nsmpl;
-	delete [] pop_cov;
-	delete [] types;
-	delete [] hap.pos;
-	delete [] hap.idx;
-	delete [] hap.ref;
-	for (i = 0; i < sm->n; i++)
+	int cap = 2 * seg_cap;
+
+	// aligned sites
+	if (num_sites >= site_cap)
 	{
-		delete [] hap.seq[i];
-		delete [] hap.base[i];
-		delete [] hap.num_reads[i];
-		delete [] hap.snpq[i];
-		delete [] hap.rms[i];
+		pop_cov = arena.extend(pop_cov, site_cap, 2 * site_cap);
+		site_cap *= 2;
+	}
+
+	// segregating sites
+	if (segsites >= seg_cap)
+	{
+		types = arena.extend(types, seg_cap, cap);
+		for (i = 0; i < sm->npops; i++)
+			ncov[i] = arena.extend(ncov[i], seg_cap, cap);
+		extendHap(&hap, cap);
+		seg_cap = cap;
 	}
-	for (i = 0; i < npops; i++)
-		delete [] ncov[i];
-	delete [] ncov;
-	delete [] hap.seq;
-	delete [] hap.base;
-	delete [] hap.snpq;
-	delete [] hap.rms;
-	delete [] hap.num_reads;
 }
 
 void usageSNP(const std::string msg)
 {
 	std::cerr << msg << std::endl << std::endl;
-	std::cerr << "Usage:   popbam snp [options] <in.bam> [region]" << std::endl << std::endl;
+	std::cerr << "Usage:   popbam snp [options] <in1.bam|-> [in2.bam ...] [region]" << std::endl << std::endl;
 	std::cerr << "Options: -i          base qualities are Illumina 1.3+               [ default: Sanger ]" << std::endl;
 	std::cerr << "         -h  FILE    Input header file                              [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -G  FILE    sample to population map of a bgzipped VCF file given as input" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads                     [ default: 1 ]" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
 	std::cerr << "         -v          output variant sites only                      [ default: all sites ]" << std::endl;
 	std::cerr << "         -z  FLT     output heterozygous base calls                 [ default: consensus ]" << std::endl;
 	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
+	std::cerr << "         -g  INT     close windows after INT segregating sites (-w: longest window)" << std::endl;
+	std::cerr << "         -c  INT     close windows after INT callable sites (-w: longest window)" << std::endl;
 	std::cerr << "         -p  STR     sample name of outgroup                        [ default: reference ]" << std::endl;
 	std::cerr << "         -o  INT     output format                                  [ default: 0 ]" << std::endl;
 	std::cerr << "                     0 : popbam snp format" << std::endl;
 	std::cerr << "                     1 : SweepFinder snp format" << std::endl;
 	std::cerr << "                     2 : MS format" << std::endl;
+	std::cerr << "                     3 : VCF, streamed as the sites are called" << std::endl;
+	std::cerr << "                     4 : BCF, streamed as the sites are called" << std::endl;
+	std::cerr << "         -O  FILE    write to a BGZF-compressed FILE, indexed for tabix [ default: stdout ]" << std::endl;
 	std::cerr << "         -n  FLT     minimum proportion of population covered       [ default: 1.0 ]" << std::endl;
 	std::cerr << "         -f  FILE    Reference fastA file" << std::endl;
 	std::cerr << "         -m  INT     minimum read coverage                          [ default: 3 ]" << std::endl;
@@ -27,12 +27,15 @@ class snpData: public popbamData
 		unsigned int **ncov;                    //!< Sample size per population per segregating site
 		unsigned long long **pop_sample_mask;   //!< Bit mask for samples covered from a specific population
 		int output;                             //!< User-specified output mode
+		bool msHeader;                          //!< Whether the ms header has been printed
+		vcfWriter *vcf;                         //!< Writer of the VCF or BCF records streamed from the pileup; 0 for other formats
 		std::string outgroup;                   //!< Sample name of outgroup to use
 		int outidx;                             //!< Index of outgroup sequence
 		double minPop;                         //!< Minimum proportion of samples present
 
 		// member public functions
 		int allocSNP(void);
+		void growSites(void);
 		int printMSHeader(long);
 		int print_SNP(const std::string);
 
@@ -47,27 +50,17 @@ class snpData: public popbamData
 /// Function prototypes
 ///
 
-/*!
-* \fn unsigned long long *callBase(bam_sample_t *sm, errmod_t *em, int n, const bam_pileup1_t *pl)
-* \brief Calls the base from the pileup at each position
-* \param sm     Pointer to the sample data structure
-* \param em     Pointer to the error model structure
-* \param n      The number of reads in the pileup
-* \param pl     Pointer to the pileup
-* \return       Pointer to the consensus base call information for the individuals
-*/
-template unsigned long long* callBase<snpData>(snpData *t, int n, const bam_pileup1_t *pl);
-
 /*!
  * \fn int makeSNP(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
  * \brief Runs the SNP analysis
+ * \tparam F Option flags the callback is compiled for
  * \param tid Chromosome identifier
  * \param pos Genomic position
  * \param n The read depth
  * \param pl A pointer to the alignment covering a single position
  * \param data A pointer to the user-passed data
  */
-int makeSNP(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+template <unsigned int F> int makeSNP(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
 
 void usageSNP(const std::string);
 
@@ -8,14 +8,8 @@
 
 int mainTree(int argc, char *argv[])
 {
-	int chr = 0;                  //! chromosome identifier
-	int beg = 0;                  //! beginning coordinate for analysis
-	int end = 0;                  //! end coordinate for analysis
-	int ref = 0;                  //! ref
-	long nWindows = 1;            //! number of windows
-	std::string msg;              //! string for error message
-	bam_sample_t *sm = nullptr;   //!< Pointer to the sample information for the input BAM file
-	bam_plbuf_t *buf = nullptr;   //! pileup buffer
+	bam_pileup_f func = nullptr;  //! pileup callback
+	popbamData *t = nullptr;      //! tree data structure
 
 	// initialize user command line options
 	popbamOptions p(argc, argv);
@@ -26,122 +20,73 @@ int mainTree(int argc, char *argv[])
 	// check input BAM file for errors
 	p.checkBAM();
 
-	// initialize the sample data structure
-	sm = bam_smpl_init();
+	// set up the tree analysis
+	t = initTree(p, &func);
 
-	// add samples
-	bam_smpl_add(sm, &p);
+	// results go to a compressed and indexed file instead of stdout
+	if (!p.outfile.empty())
+		openResults(p, "tree", t, p.outfile);
 
-	// initialize the tree data structure
-	treeData t(p);
-	t.sm = sm;
+	// iterate through all windows along specified genomic region or all target regions
+	runWindows(p, std::vector<popbamData*>(1, t), func, t);
 
-	// initialize error model
-	t.em = errmod_init(0.17);
+	if (!p.outfile.empty())
+		closeResults(t, p.outfile);
 
-	// extract name of reference sequence
-	t.refid = get_refid(p.h->text);
+	delete t;
+	p.closeBAM();
 
-	// parse genomic region
-	int k = bam_parse_region(p.h, p.region, &chr, &beg, &end);
-	if (k < 0)
-	{
-		msg = "Bad genome coordinates: " + p.region;
-		fatalError(msg);
-	}
+	return 0;
+}
 
-	// fetch reference sequence
-	t.ref_base = faidx_fetch_seq(p.fai_file, p.h->target_name[chr], 0, 0x7fffffff, &(t.len));
+popbamData *initTree(const popbamOptions &p, bam_pileup_f *func)
+{
+	treeData *t = nullptr;
 
-	// calculate the number of windows
-	if (p.flag & BAM_WINDOW)
-		nWindows = ((end - beg) - 1) / p.winSize;
-	else
-	{
-		p.winSize = end - beg;
-		nWindows = 1;
-	}
+	// initialize the tree data structure
+	t = new treeData(p);
 
-	// iterate through all windows along specified genomic region
-	for (long j = 0; j < nWindows; ++j)
-	{
-		// construct genome coordinate string
-		std::string scaffold_name(p.h->target_name[chr]);
-		std::ostringstream winc(scaffold_name);
+	// initialize the sample data structure and add samples
+	t->sm = bam_smpl_init();
+	bam_smpl_add(t->sm, &p);
 
-		winc.seekp(0, std::ios::end);
-		winc << ':' << beg + (j * p.winSize) + 1 << '-' << ((j + 1) * p.winSize) + (beg - 1);
+	// initialize error model
+	t->em = errmod_init(0.17);
 
-		std::string winCoord = winc.str();
+	// extract name of reference sequence
+	t->refid = get_refid(p.h->text);
 
+	// steps opening and closing each window; site-count windows also take them from the pileup
+	t->openWindow = [t, &p](void)
+	{
 		// initialize number of sites to zero
-		t.num_sites = 0;
-
-		// parse the BAM file and check if region is retrieved from the reference
-		if (p.flag & BAM_WINDOW)
-		{
-			k = bam_parse_region(p.h, winCoord, &ref, &(t.beg), &(t.end));
-			if (k < 0)
-			{
-				msg = "Bad window coordinates " + winCoord;
-				fatalError(msg);
-			}
-		}
-		else
-		{
-			ref = chr;
-			t.beg = beg;
-			t.end = end;
-			if (ref < 0)
-			{
-				msg = "Bad scaffold name: " + p.region;
-				fatalError(msg);
-			}
-		}
+		t->num_sites = 0;
 
 		// initialize tree-specific variables
-		t.allocTree();
+		t->allocTree();
 
 		// create population assignments
-		t.assignPops(&p);
-
-		// initialize pileup
-		buf = bam_plbuf_init(makeTree, &t);
-
-		// fetch region from bam file
-		if ((bam_fetch(p.bam_in->x.bam, p.idx, ref, t.beg, t.end, buf, fetch_func)) < 0)
-		{
-			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
-			fatalError(msg);
-		}
-
-		// finalize pileup
-		bam_plbuf_push(0, buf);
+		t->assignPops(&p);
+	};
 
+	t->closeWindow = [t, &p](void)
+	{
 		// count pairwise differences
-		calcDiffMatrix(&t);
+		calcDiffMatrix(t);
 
 		// construct distance matrix
-		t.calcDistMatrix();
+		t->calcDistMatrix();
 
 		// construct nj tree
-		t.makeNJ(std::string(p.h->target_name[chr]));
-
-		// take out the garbage
-		bam_plbuf_destroy(buf);
-	}
-	// end of window interation
+		t->makeNJ(std::string(p.h->target_name[t->tid]));
+	};
 
-	errmod_destroy(t.em);
-	samclose(p.bam_in);
-	bam_index_destroy(p.idx);
-	bam_smpl_destroy(sm);
-	delete [] t.refid;
-	free(t.ref_base);
+	*func = PICK_PILEUP(makeTree, p.flag);
 
-	return 0;
+	return t;
 }
 
+template <unsigned int F>
 int makeTree(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
 {
 	int i = 0;
@@ -153,14 +98,21 @@ int makeTree(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 	// get control data structure
 	t = (treeData*)data;
 
-	// only consider sites located in designated region
-	if ((t->beg <= (int)pos) && (t->end > (int)pos))
+	// site-count windows are closed as the pileup moves past them
+	if (t->winSites > 0)
+		t->checkWindow(pos);
+
+	// only consider unmasked sites located in designated region
+	if ((t->beg <= (int)pos) && (t->end > (int)pos) && !t->isMasked(pos))
 	{
+		// make room for one more site
+		t->growSites();
+
 		// call bases
-		cb = callBase(t, n, pl);
+		cb = callBase<F>(t, n, pl);
 
-		// resolve heterozygous sites
-		if (!(t->flag & BAM_HETEROZYGOTE))
+		// resolve heterozygous sites; haploid calls have none
+		if (!(F & (BAM_HETEROZYGOTE | BAM_HAPLOID)))
 			cleanHeterozygotes(t->sm->n, cb, (int)t->ref_base[pos], t->minSNPQ);
 
 		// determine if site is segregating
@@ -172,24 +124,30 @@ int makeTree(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl,
 		for (i = 0; i < t->sm->npops; i++)
 			t->pop_sample_mask[i] = sample_cov & t->pop_mask[i];
 
-		if (bitcount64(sample_cov) == t->sm->n)
+		if ((int)kernels.count(sample_cov) == t->sm->n)
 		{
-			// calculate the site type
-			t->types[t->num_sites] = calculateSiteType(t->sm->n, cb);
-
 			if (fq > 0)
 			{
+				// calculate the site type
+				t->types[t->segsites] = calculateSiteType(t->sm->n, cb);
+
 				t->hap.pos[t->segsites] = pos;
 				t->hap.ref[t->segsites] = bam_nt16_table[(int)t->ref_base[pos]];
+
+				// one record holds the calls of all individuals at the site
+				hCall_t *call = t->hap.call + (size_t)t->segsites * t->sm->n;
+				unsigned long long geno = 0;
+
 				for (i = 0; i < t->sm->n; i++)
 				{
-					t->hap.rms[i][t->segsites] = (cb[i] >> (CHAR_BIT * 6)) & 0xffff;
-					t->hap.snpq[i][t->segsites] = (cb[i] >> (CHAR_BIT * 4)) & 0xffff;
-					t->hap.num_reads[i][t->segsites] = (cb[i]>>(CHAR_BIT * 2)) & 0xffff;
-					t->hap.base[i][t->segsites] = bam_nt16_table[(int)iupac[(cb[i] >> CHAR_BIT) & 0xff]];
+					call[i].rms = (cb[i] >> (CHAR_BIT * 6)) & 0xffff;
+					call[i].snpq = (cb[i] >> (CHAR_BIT * 4)) & 0xffff;
+					call[i].num_reads = (cb[i] >> (CHAR_BIT * 2)) & 0xffff;
+					call[i].base = bam_nt16_table[(int)iupac[(cb[i] >> CHAR_BIT) & 0xff]];
 					if (cb[i] & 0x2ULL)
-						t->hap.seq[i][t->segsites/64] |= 0x1ULL << t->segsites % 64;
+						geno |= 0x1ULL << i;
 				}
+				t->hap.geno[t->segsites] = geno;
 				t->hap.idx[t->segsites] = t->num_sites;
 				t->segsites++;
 			}
@@ -211,8 +169,8 @@ int treeData::makeNJ(const std::string scaffold)
 
 	if ((num_sites < minSites) || (segsites < 1))
 	{
-		std::cout << scaffold << '\t' << beg + 1 << '\t' << end + 1 << '\t' << num_sites;
-		std::cout << "\tNA" << std::endl;
+		os << scaffold << '\t' << beg + 1 << '\t' << lastBase() << '\t' << num_sites;
+		os << "\tNA\n";
 		return 0;
 	}
 
@@ -244,12 +202,14 @@ int treeData::makeNJ(const std::string scaffold)
 
 	joinTree(curtree, cluster);
 	curtree.start = curtree.nodep[0]->back;
-	std::cout << scaffold << '\t' << beg + 1 << '\t' << end + 1 << '\t' << num_sites << '\t';
+	os << scaffold << '\t' << beg + 1 << '\t' << lastBase() << '\t' << num_sites << '\t';
 	printTree(curtree.start, curtree.start);
 
 	freeTree(&curtree.nodep);
 	delete [] cluster;
 	delete [] enterorder;
+
+	return 0;
 }
 
 void treeData::joinTree(tree curtree, node **cluster)
@@ -461,31 +421,31 @@ void treeData::printTree(node *p, node *start)
 	if (p->tip)
 	{
 		if (p->index == 1)
-			std::cout << refid;
+			os << refid;
 		else
-			std::cout << sm->smpl[p->index-2];
+			os << sm->smpl[p->index-2];
 	}
 	else
 	{
-		std::cout << '(';
+		os << '(';
 		printTree(p->next->back, start);
-		std::cout << ',';
+		os << ',';
 		printTree(p->next->next->back, start);
 		if (p == start)
 		{
-			std::cout << ',';
+			os << ',';
 			printTree(p->back, start);
 		}
-		std::cout << ')';
+		os << ')';
 	}
 	if (p == start)
-		std::cout << ';' << std::endl;
+		os << ";\n";
 	else
 	{
 		if (p->v < 0)
-			std::cout << ":0.00000";
+			os << ":0.00000";
 		else
-			std::cout << ':' << std::fixed << std::setprecision(5) << p->v;
+			os << ':' << fixedValue(p->v, 5);
 	}
 }
 
@@ -493,15 +453,15 @@ void calcDiffMatrix(treeData *t)
 {
 	int i = 0;
 	int j = 0;
-	int k = 0;
 	int n = t->sm->n;
-	int segs = t->segsites;
+	int words = SEG_IDX(t->segsites) + 1;
+
+	t->sampleMajor(&t->hap);
 
 	// calculate number of differences with reference sequence
 	for (i = 0; i < n; i++)
 	{
-		for (k = 0; k <= SEG_IDX(segs); k++)
-			t->diff_matrix[i+1][0] += bitcount64(t->hap.seq[i][k]);
+		t->diff_matrix[i+1][0] = kernels.countArray(t->hap.seq[i], words);
 		t->diff_matrix[0][i+1] = t->diff_matrix[i+1][0];
 	}
 
@@ -509,8 +469,7 @@ void calcDiffMatrix(treeData *t)
 	for (i = 0; i < n - 1; i++)
 		for (j = i + 1; j < n; j++)
 		{
-			for (k = 0; k <= SEG_IDX(segs); k++)
-				t->diff_matrix[j+1][i+1] += hamming_distance(t->hap.seq[i][k], t->hap.seq[j][k]);
+			t->diff_matrix[j+1][i+1] = kernels.countXorArray(t->hap.seq[i], t->hap.seq[j], words);
 			t->diff_matrix[i+1][j+1] = t->diff_matrix[j+1][i+1];
 		}
 }
@@ -535,6 +494,8 @@ int treeData::calcDistMatrix(void)
 			}
 		}
 	}
+
+	return 0;
 }
 
 void treeData::initTree(ptarray *treenode)
@@ -616,7 +577,6 @@ void treeData::freeTree(ptarray *treenode)
 treeData::treeData(const popbamOptions &p)
 {
 	// inherit values from popbamOptions
-	bamfile = p.bamfile;
 	flag = p.flag;
 	minDepth = p.minDepth;
 	maxDepth = p.maxDepth;
@@ -624,6 +584,8 @@ treeData::treeData(const popbamOptions &p)
 	minSNPQ = p.minSNPQ;
 	minMapQ = p.minMapQ;
 	minBaseQ = p.minBaseQ;
+	winSites = p.winSites;
+	winSpan = (flag & BAM_WINDOW) ? p.winSize : 0x7fffffff;
 	hetPrior = p.hetPrior;
 	minSites = p.minSites;
 	dist = p.dist;
@@ -633,44 +595,38 @@ treeData::treeData(const popbamOptions &p)
 	refid = NULL;
 }
 
+treeData::~treeData(void)
+{
+	delete [] refid;
+}
+
 int treeData::allocTree(void)
 {
 	int i = 0;
-	int length = end - beg;
 	int n = sm->n;
 	int npops = sm->npops;
 
 	ntaxa = n + 1;
+
+	// arrays of the previous window are given back to the arena
+	arena.reset();
 	segsites = 0;
+	site_cap = SITE_CHUNK;
+	seg_cap = SITE_CHUNK;
 
 	try
 	{
-		types = new unsigned long long [length]();
-		pop_mask = new unsigned long long [npops]();
-		pop_nsmpl = new unsigned char [npops]();
-		pop_sample_mask = new unsigned long long [npops]();
-		hap.pos = new unsigned int [length]();
-		hap.idx = new unsigned int [length]();
-		hap.ref = new unsigned char [length]();
-		hap.seq = new unsigned long long* [n];
-		hap.base = new unsigned char* [n];
-		hap.rms = new unsigned short* [n];
-		hap.snpq = new unsigned short* [n];
-		hap.num_reads = new unsigned short* [n];
-		diff_matrix = new unsigned short* [ntaxa];
-		dist_matrix = new double* [ntaxa];
-		for (i = 0; i < n; i++)
-		{
-			hap.seq[i] = new unsigned long long [length]();
-			hap.base[i] = new unsigned char [length]();
-			hap.rms[i] = new unsigned short [length]();
-			hap.snpq[i] = new unsigned short [length]();
-			hap.num_reads[i] = new unsigned short [length]();
-		}
+		types = arena.alloc<unsigned long long>(seg_cap);
+		pop_mask = arena.alloc<unsigned long long>(npops);
+		pop_nsmpl = arena.alloc<unsigned char>(npops);
+		pop_sample_mask = arena.alloc<unsigned long long>(npops);
+		diff_matrix = arena.alloc<unsigned short*>(ntaxa);
+		dist_matrix = arena.alloc<double*>(ntaxa);
+		allocHap(&hap);
 		for (i = 0; i < ntaxa; i++)
 		{
-			diff_matrix[i] = new unsigned short [ntaxa]();
-			dist_matrix[i] = new double [ntaxa]();
+			diff_matrix[i] = arena.alloc<unsigned short>(ntaxa);
+			dist_matrix[i] = arena.alloc<double>(ntaxa);
 		}
 	}
 	catch (std::bad_alloc& ba)
@@ -681,48 +637,40 @@ int treeData::allocTree(void)
 	return 0;
 }
 
-treeData::~treeData(void)
+void treeData::growSites(void)
 {
-	int i = 0;
+	int cap = 2 * seg_cap;
 
-	delete [] pop_mask;
-	delete [] types;
-	delete [] pop_nsmpl;
-	delete [] pop_sample_mask;
-	delete [] hap.pos;
-	delete [] hap.idx;
-	delete [] hap.ref;
-	for (i = 0; i < sm->n; i++)
-	{
-		delete [] hap.seq[i];
-		delete [] hap.base[i];
-		delete [] hap.num_reads[i];
-		delete [] hap.snpq[i];
-		delete [] hap.rms[i];
-	}
-	for (i = 0; i < ntaxa; i++)
+	// segregating sites
+	if (segsites >= seg_cap)
 	{
-		delete [] diff_matrix[i];
-		delete [] dist_matrix[i];
+		types = arena.extend(types, seg_cap, cap);
+		extendHap(&hap, cap);
+		seg_cap = cap;
 	}
-	delete [] hap.seq;
-	delete [] hap.base;
-	delete [] hap.snpq;
-	delete [] hap.rms;
-	delete [] hap.num_reads;
-	delete [] diff_matrix;
-	delete [] dist_matrix;
 }
 
 void usageTree(const std::string msg)
 {
 	std::cerr << msg << std::endl << std::endl;
-	std::cerr << "Usage:   popbam tree [options] <in.bam> [region]" << std::endl;
+	std::cerr << "Usage:   popbam tree [options] <in1.bam|-> [in2.bam ...] [region]" << std::endl;
 	std::cerr << std::endl;
 	std::cerr << "Options: -i          base qualities are Illumina 1.3+     [ default: Sanger ]" << std::endl;
 	std::cerr << "         -h  FILE    Input header file                    [ default: none ]" << std::endl;
+	std::cerr << "         -l  FILE    file listing input BAM files, one per line" << std::endl;
+	std::cerr << "         -r  FILE    BED file of target regions, analyzed instead of [region]" << std::endl;
+	std::cerr << "         -M  FILE    BED file of regions to skip" << std::endl;
+	std::cerr << "         -G  FILE    sample to population map of a bgzipped VCF file given as input" << std::endl;
+	std::cerr << "         -L          skip lowercase (soft-masked) reference bases" << std::endl;
+	std::cerr << "         -H          individuals are haploid or inbred lines" << std::endl;
+	std::cerr << "         -j  INT     number of decoding threads           [ default: 1 ]" << std::endl;
+	std::cerr << "         -O  FILE    write results to FILE, compressed with BGZF and indexed for tabix" << std::endl;
+	std::cerr << "         -S          input files are SAM rather than BAM" << std::endl;
+	std::cerr << "         -I          index unindexed BAM files while reading them" << std::endl;
 	std::cerr << "         -d  STR     distance (pdist or jc)               [ default: pdist ]" << std::endl;
 	std::cerr << "         -w  INT     use sliding window of size (kb)" << std::endl;
+	std::cerr << "         -g  INT     close windows after INT segregating sites (-w: longest window)" << std::endl;
+	std::cerr << "         -c  INT     close windows after INT callable sites (-w: longest window)" << std::endl;
 	std::cerr << "         -k  INT     minimum number of sites in window    [ default: 10 ]" << std::endl;
 	std::cerr << "         -f  FILE    Reference fastA file" << std::endl;
 	std::cerr << "         -m  INT     minimum read coverage                [ default: 3 ]" << std::endl;
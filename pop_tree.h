@@ -70,6 +70,7 @@ class treeData: public popbamData
 		int makeNJ(const std::string);
 		int calcDistMatrix(void);
 		int allocTree(void);
+		void growSites(void);
 		void joinTree(tree, node**);
 		void printTree(node*, node*);
 		void hookup(node*, node*);
@@ -82,27 +83,17 @@ class treeData: public popbamData
 /// Function prototypes
 ///
 
-/*!
-* \fn unsigned long long *callBase(bam_sample_t *sm, errmod_t *em, int n, const bam_pileup1_t *pl)
-* \brief Calls the base from the pileup at each position
-* \param sm     Pointer to the sample data structure
-* \param em     Pointer to the error model structure
-* \param n      The number of reads in the pileup
-* \param pl     Pointer to the pileup
-* \return       Pointer to the consensus base call information for the individuals
-*/
-template unsigned long long* callBase<treeData>(treeData *t, int n, const bam_pileup1_t *pl);
-
 /*!
  * \fn int make_tree(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data)
  * \brief Runs the neighbor-joining tree construction procedure
+ * \tparam F Option flags the callback is compiled for
  * \param tid Chromosome identifier
  * \param pos Genomic position
  * \param n The read depth
  * \param pl A pointer to the alignment covering a single position
  * \param data A pointer to the user-passed data
  */
-int makeTree(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
+template <unsigned int F> int makeTree(unsigned int tid, unsigned int pos, int n, const bam_pileup1_t *pl, void *data);
 
 void usageTree(const std::string);
 
@@ -41,6 +41,7 @@ KSORT_INIT_GENERIC(uint16_t)
 
 void bam_init_header_hash(bam_header_t *header);
 
+template <int ploidy>
 unsigned long long gl2cns(float q[16], unsigned short k)
 {
 	unsigned char i = 0;
@@ -54,9 +55,10 @@ unsigned long long gl2cns(float q[16], unsigned short k)
 	float likelihood = 0.0;
 	std::string msg;
 
+	// haploid individuals only carry the homozygous genotypes
 	for (i = 0; i < NBASES; ++i)
 	{
-		for (j = i; j < NBASES; ++j)
+		for (j = i; j < (ploidy == 1 ? i + 1 : NBASES); ++j)
 		{
 			likelihood = q[i << 2 | j];
 			if (likelihood < min)
@@ -78,6 +80,9 @@ unsigned long long gl2cns(float q[16], unsigned short k)
 	return snp_quality + num_reads + genotype;
 }
 
+template unsigned long long gl2cns<1>(float q[16], unsigned short k);
+template unsigned long long gl2cns<2>(float q[16], unsigned short k);
+
 unsigned long long qualFilter(int num_samples, unsigned long long *cb, int min_rmsQ, int min_depth, int max_depth)
 {
 	int i = 0;
@@ -125,10 +130,10 @@ int segBase(int num_samples, unsigned long long *cb, char ref, int min_snpq)
 			++baseCount[allele1];
 		}
 		// if SNP quality is low, revert both alleles to the reference allele
-		else if ((allele1 == allele2) && (iupac[genotype] != ref) && (snp_quality < min_snpq))
+		else if ((allele1 == allele2) && (iupac[genotype] != ref) && (snp_quality < min_snpq) && (iupac_rev[(unsigned char)ref] < NBASES))
 		{
-			cb[i] -= (genotype-iupac_rev[(int)ref]) << CHAR_BIT;
-			cb[i] -= (genotype-iupac_rev[(int)ref]) << (CHAR_BIT+2);
+			cb[i] -= (unsigned long long)(allele1 - iupac_rev[(unsigned char)ref]) << CHAR_BIT;
+			cb[i] -= (unsigned long long)(allele1 - iupac_rev[(unsigned char)ref]) << (CHAR_BIT+2);
 		}
 		else
 			continue;
@@ -150,6 +155,69 @@ int segBase(int num_samples, unsigned long long *cb, char ref, int min_snpq)
 		return baseCount[k];
 }
 
+int segGenotype(int num_samples, unsigned long long *cb, char ref, int min_snpq)
+{
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	int r = iupac_rev[(unsigned char)ref];
+	unsigned char genotype = 0;
+	unsigned char allele1 = 0;
+	unsigned char allele2 = 0;
+	unsigned short snp_quality = 0;
+	int baseCount[NBASES] = {0, 0, 0, 0};
+
+	for (i = 0; i < num_samples; ++i)
+	{
+		genotype = (cb[i] >> CHAR_BIT) & 0xff;
+		allele1 = (genotype >> 2) & 0x3;
+		allele2 = genotype & 0x3;
+		snp_quality = (cb[i] >> (CHAR_BIT * 4)) & 0xffff;
+
+		if (iupac[genotype] == ref)
+			continue;
+
+		// carriers of a high quality variant contribute one chromosome per derived allele
+		if (snp_quality >= min_snpq)
+		{
+			cb[i] |= 0x2ULL;
+			if (allele1 == allele2)
+			{
+				cb[i] |= 0x4ULL;
+				baseCount[allele1] += 2;
+			}
+			else
+			{
+				if (allele1 != r)
+					++baseCount[allele1];
+				if (allele2 != r)
+					++baseCount[allele2];
+			}
+		}
+		// if SNP quality is low, revert both alleles to the reference allele
+		else if (r < NBASES)
+		{
+			cb[i] &= ~(0xffULL << CHAR_BIT);
+			cb[i] |= (unsigned long long)(r << 2 | r) << CHAR_BIT;
+		}
+	}
+
+	// check for infinite sites model
+	for (i = 0, j = 0, k = 0; i < NBASES; ++i)
+	{
+		if (baseCount[i] > 0)
+		{
+			++j;
+			k = i;
+		}
+	}
+
+	if (j > 1)
+		return -1;
+	else
+		return baseCount[k];
+}
+
 void cleanHeterozygotes(int num_samples, unsigned long long *cb, int ref, int min_snpq)
 {
 	int i = 0;
@@ -268,6 +336,7 @@ void errmod_destroy(errmod_t *em)
 }
 
 // qual:6, strand:1, base:4
+template <int ploidy>
 int errmod_cal(const errmod_t *em, unsigned short n, int m, unsigned short *bases, float *q)
 {
 	call_aux_t aux;
@@ -335,7 +404,7 @@ int errmod_cal(const errmod_t *em, unsigned short n, int m, unsigned short *base
 			q[j * m + j] = tmp1;
 		}
 		// heterozygous
-		for (k = j + 1; k < m; ++k)
+		for (k = j + 1; k < (ploidy == 1 ? 0 : m); ++k)
 		{
 			int cjk = aux.c[j] + aux.c[k];
 
@@ -371,23 +440,16 @@ int errmod_cal(const errmod_t *em, unsigned short n, int m, unsigned short *base
 	return 0;
 }
 
+template int errmod_cal<1>(const errmod_t *em, unsigned short n, int m, unsigned short *bases, float *q);
+template int errmod_cal<2>(const errmod_t *em, unsigned short n, int m, unsigned short *bases, float *q);
+
 void bam_init_header_hash(bam_header_t *header)
 {
-	int i = 0;
-
+	// names are entered by bam_get_tid() as they are looked up
 	if (header->hash == NULL)
 	{
-		int ret = 0;
-		khiter_t iter;
-		khash_t(s) *h;
-
-		header->hash = h = kh_init(s);
-
-		for (i = 0; i < header->n_targets; ++i)
-		{
-			iter = kh_put(s, h, header->target_name[i], &ret);
-			kh_value(h, iter) = i;
-		}
+		header->hash = kh_init(s);
+		header->n_hashed = 0;
 	}
 }
 
@@ -395,11 +457,9 @@ int bam_parse_region(bam_header_t *header, std::string region, int *ref_id, int
 {
 	std::size_t l = 0;
 	std::size_t name_end = 0;
-	khiter_t iter;
-	khash_t(s) *h;
+	int tid = -1;
 
 	bam_init_header_hash(header);
-	h = (khash_t(s)*)header->hash;
 	*ref_id = *beg = *end = -1;
 	name_end = l = region.length();
 
@@ -428,15 +488,15 @@ int bam_parse_region(bam_header_t *header, std::string region, int *ref_id, int
 			name_end = l;
 		std::string scaffold_name = region.substr(0, name_end);
 
-		// get a hash iterator to the scaffold name in the header
-		iter = kh_get(s, h, scaffold_name.c_str());
+		// look up the scaffold name in the header
+		tid = bam_get_tid(header, scaffold_name.c_str());
 
 		// cannot find the sequence name
-		if (iter == kh_end(h))
+		if (tid < 0)
 		{
 			// try the entire region string as the lookup key
-			iter = kh_get(s, h, region.c_str());
-			if (iter == kh_end(h))
+			tid = bam_get_tid(header, region.c_str());
+			if (tid < 0)
 			{
 				std::cerr << "Cannot find sequence name " << region << " in header" << std::endl;
 				return -1;
@@ -444,12 +504,12 @@ int bam_parse_region(bam_header_t *header, std::string region, int *ref_id, int
 		}
 	}
 	else
-		iter = kh_get(s, h, region.c_str());
+		tid = bam_get_tid(header, region.c_str());
 
-	if (iter == kh_end(h))
+	if (tid < 0)
 		return -1;
 	
-	*ref_id = kh_val(h, iter);
+	*ref_id = tid;
 
 	// parse the interval
 	if (name_end < l)
@@ -0,0 +1,737 @@
+/** \file pop_vcf.cpp
+ *  \brief Functions for writing consensus calls as VCF and BCF, and for reading called genotypes from VCF
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "popbam.h"
+#include "tables.h"
+
+///
+/// Definitions
+///
+
+/*! \def BCF_MAGIC
+ *  \brief First bytes of a BCF 2.2 file
+ */
+#define BCF_MAGIC "BCF\2\2"
+
+/*! \def BCF_INT8
+ *  \brief Type code of 8-bit integers in a BCF record
+ */
+#define BCF_INT8 1
+
+/*! \def BCF_INT32
+ *  \brief Type code of 32-bit integers in a BCF record
+ */
+#define BCF_INT32 3
+
+/*! \def BCF_CHAR
+ *  \brief Type code of characters in a BCF record
+ */
+#define BCF_CHAR 7
+
+/*! \def VCF_BIN_SHIFT
+ *  \brief Size of the bins of the linear index of a VCF file as a power of two; 16 kb, as in tabix
+ */
+#define VCF_BIN_SHIFT 14
+
+/*! \def VCF_QUAL
+ *  \brief SNP and mapping quality given to genotypes without GQ or MQ fields
+ */
+#define VCF_QUAL 99
+
+/*!
+ * \fn static void pack32(std::vector<unsigned char> &buf, unsigned int v)
+ * \brief Appends a 32-bit integer in little-endian byte order
+ */
+static void pack32(std::vector<unsigned char> &buf, unsigned int v)
+{
+	for (int i = 0; i < 4; i++)
+		buf.push_back((v >> (CHAR_BIT * i)) & 0xff);
+}
+
+vcfWriter::vcfWriter(void)
+{
+	fp = nullptr;
+	os = nullptr;
+	binary = false;
+	nsmpl = 0;
+	ploidy = 2;
+	h = nullptr;
+}
+
+vcfWriter::~vcfWriter(void)
+{
+	close();
+}
+
+int vcfWriter::open(const std::string &fn, bool bcf, textWriter *out)
+{
+	binary = bcf;
+	os = out;
+
+	// BCF is compressed here; VCF text goes through the writer of the
+	// results, which compresses and indexes it when written to a file
+	if (!binary)
+		return 0;
+	else if (!fn.empty())
+		fp = bgzf_open(fn.c_str(), "w");
+	else
+		fp = bgzf_fdopen(fileno(stdout), "w");
+
+	return fp ? 0 : -1;
+}
+
+int vcfWriter::emit(const void *data, size_t len)
+{
+	if (fp)
+		return (bgzf_write(fp, data, len) == (int)len) ? 0 : -1;
+
+	os->write((const char*)data, len);
+	return 0;
+}
+
+void vcfWriter::packTyped(int type, int count)
+{
+	// counts of 15 and more follow the descriptor as a typed integer
+	if (count < 15)
+		indiv.push_back((count << 4) | type);
+	else
+	{
+		indiv.push_back((15 << 4) | type);
+		indiv.push_back((1 << 4) | BCF_INT32);
+		pack32(indiv, count);
+	}
+}
+
+int vcfWriter::writeHeader(const popbamOptions *p, const bam_sample_t *sm)
+{
+	int i = 0;
+	std::stringstream out;
+	std::string text;
+	std::vector<unsigned char> head;
+
+	nsmpl = sm->n;
+	ploidy = (p->flag & BAM_HAPLOID) ? 1 : 2;
+	h = p->h;
+
+	// the order of the FILTER and FORMAT lines fixes the dictionary of BCF keys: PASS, GT, DP, GQ, MQ
+	out << "##fileformat=VCFv4.2\n";
+	out << "##FILTER=<ID=PASS,Description=\"All filters passed\">\n";
+	out << "##source=popbam " << POPBAM_RELEASE << '\n';
+	out << "##reference=file://" << p->reffile << '\n';
+	for (i = 0; i < h->n_targets; i++)
+		out << "##contig=<ID=" << h->target_name[i] << ",length=" << h->target_len[i] << ">\n";
+	out << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype; missing if the call fails the depth or mapping quality filters\">\n";
+	out << "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Number of reads\">\n";
+	out << "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"SNP quality of the consensus call\">\n";
+	out << "##FORMAT=<ID=MQ,Number=1,Type=Integer,Description=\"Root mean square mapping quality\">\n";
+	out << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+	for (i = 0; i < nsmpl; i++)
+		out << '\t' << sm->smpl[i];
+	out << '\n';
+	text = out.str();
+
+	if (!binary)
+		return emit(text.c_str(), text.size());
+
+	head.assign(BCF_MAGIC, BCF_MAGIC + 5);
+	pack32(head, text.size() + 1);
+	head.insert(head.end(), text.c_str(), text.c_str() + text.size() + 1);
+
+	return emit(&head[0], head.size());
+}
+
+int vcfWriter::writeSite(int tid, int pos, char ref, const unsigned long long *cb)
+{
+	int i = 0;
+	int j = 0;
+	int nalleles = 1;
+	int r = iupac_rev[toupper((unsigned char)ref)];
+	int index[NBASES] = {-1, -1, -1, -1};
+	char alleles[NBASES + 1];
+	unsigned char a[2];
+	std::vector<unsigned char> lens;
+
+	// the reference allele comes first and the other alleles in order of appearance
+	alleles[0] = (r < NBASES) ? "ACGT"[r] : 'N';
+	if (r < NBASES)
+		index[r] = 0;
+	for (i = 0; i < nsmpl; i++)
+	{
+		if (!(cb[i] & 0x1ULL))
+			continue;
+		a[0] = (cb[i] >> (CHAR_BIT + 2)) & 0x3;
+		a[1] = (cb[i] >> CHAR_BIT) & 0x3;
+		for (j = 0; j < ploidy; j++)
+		{
+			if (index[a[j]] < 0)
+			{
+				index[a[j]] = nalleles;
+				alleles[nalleles++] = "ACGT"[a[j]];
+			}
+		}
+	}
+
+	if (!binary)
+	{
+		std::stringstream out;
+
+		out << h->target_name[tid] << '\t' << pos + 1 << "\t.\t" << alleles[0] << '\t';
+		if (nalleles == 1)
+			out << '.';
+		for (i = 1; i < nalleles; i++)
+			out << (i > 1 ? "," : "") << alleles[i];
+		out << "\t.\t.\t.\tGT:DP:GQ:MQ";
+
+		for (i = 0; i < nsmpl; i++)
+		{
+			a[0] = (cb[i] >> (CHAR_BIT + 2)) & 0x3;
+			a[1] = (cb[i] >> CHAR_BIT) & 0x3;
+			out << '\t';
+			for (j = 0; j < ploidy; j++)
+			{
+				if (j > 0)
+					out << '/';
+				if (cb[i] & 0x1ULL)
+					out << index[a[j]];
+				else
+					out << '.';
+			}
+			out << ':' << ((cb[i] >> (CHAR_BIT * 2)) & 0xffff);
+			out << ':' << ((cb[i] >> (CHAR_BIT * 4)) & 0xffff);
+			out << ':' << ((cb[i] >> (CHAR_BIT * 6)) & 0xffff);
+		}
+		out << '\n';
+		line = out.str();
+
+		return emit(line.c_str(), line.size());
+	}
+
+	// site fields: no ID, QUAL, FILTER or INFO
+	shared.clear();
+	pack32(shared, tid);
+	pack32(shared, pos);
+	pack32(shared, 1);
+	pack32(shared, 0x7f800001);
+	pack32(shared, (unsigned int)nalleles << 16);
+	pack32(shared, (4U << 24) | nsmpl);
+	shared.push_back(BCF_CHAR);
+	for (i = 0; i < nalleles; i++)
+	{
+		shared.push_back((1 << 4) | BCF_CHAR);
+		shared.push_back(alleles[i]);
+	}
+	shared.push_back(0);
+
+	// sample fields, each keyed by its place in the dictionary of the header
+	indiv.clear();
+	indiv.push_back((1 << 4) | BCF_INT8);
+	indiv.push_back(1);
+	packTyped(BCF_INT8, ploidy);
+	for (i = 0; i < nsmpl; i++)
+	{
+		a[0] = (cb[i] >> (CHAR_BIT + 2)) & 0x3;
+		a[1] = (cb[i] >> CHAR_BIT) & 0x3;
+		for (j = 0; j < ploidy; j++)
+			indiv.push_back((cb[i] & 0x1ULL) ? (index[a[j]] + 1) << 1 : 0);
+	}
+	for (int k = 0; k < 3; k++)
+	{
+		indiv.push_back((1 << 4) | BCF_INT8);
+		indiv.push_back(k + 2);
+		packTyped(BCF_INT32, 1);
+		for (i = 0; i < nsmpl; i++)
+			pack32(indiv, (cb[i] >> (CHAR_BIT * 2 * (k + 1))) & 0xffff);
+	}
+
+	pack32(lens, shared.size());
+	pack32(lens, indiv.size());
+
+	if ((emit(&lens[0], lens.size()) < 0) || (emit(&shared[0], shared.size()) < 0) || (emit(&indiv[0], indiv.size()) < 0))
+		return -1;
+
+	return 0;
+}
+
+int vcfWriter::close(void)
+{
+	int ret = 0;
+
+	if (fp)
+	{
+		if (bgzf_close(fp) < 0)
+			ret = -1;
+		fp = nullptr;
+	}
+	os = nullptr;
+
+	return ret;
+}
+
+vcfReader::vcfReader(void)
+{
+	nsmpl = 0;
+	header = nullptr;
+	fp = nullptr;
+	offset = 0;
+	defaultDepth = 0;
+	qtid = -1;
+	qbeg = 0;
+	qend = 0;
+	last = -1;
+	done = true;
+}
+
+vcfReader::~vcfReader(void)
+{
+	if (fp)
+		bgzf_close(fp);
+	if (header)
+		bam_header_destroy(header);
+}
+
+bool vcfReader::isVCF(const std::string &fn)
+{
+	char magic[16];
+	BGZF *in = bgzf_open(fn.c_str(), "r");
+	bool found = false;
+
+	if (!in)
+		return false;
+
+	found = (bgzf_read(in, magic, 16) == 16) && (memcmp(magic, "##fileformat=VCF", 16) == 0);
+	bgzf_close(in);
+
+	return found;
+}
+
+int vcfReader::readLine(void)
+{
+	int c = 0;
+
+	line.clear();
+	offset = bgzf_tell(fp);
+	while (((c = bgzf_getc(fp)) >= 0) && (c != '\n'))
+		line.push_back(c);
+
+	if (c == -2)
+		return -2;
+
+	return ((c == -1) && line.empty()) ? -1 : 0;
+}
+
+int vcfReader::open(const std::string &fn, const std::string &popfile, int depth)
+{
+	int ret = 0;
+	size_t i = 0;
+	std::string msg;
+	std::string text;
+	std::string name;
+	std::string pop;
+	std::vector<std::string> contigs;
+	std::vector<unsigned int> lengths;
+	std::vector<std::string> assemblies;
+	std::vector<std::string> samples;
+	std::vector<std::pair<std::string, std::string> > popmap;
+
+	fp = bgzf_open(fn.c_str(), "r");
+	if (!fp)
+		return -1;
+	defaultDepth = depth;
+
+	// the reference sequences are named by the contig lines and the samples by the column header
+	while ((ret = readLine()) == 0)
+	{
+		if (line.compare(0, 10, "##contig=<") == 0)
+		{
+			size_t id = line.find("ID=");
+			size_t len = line.find("length=");
+			size_t as = line.find("assembly=");
+
+			if (id == std::string::npos)
+				return -1;
+			contigs.push_back(line.substr(id + 3, line.find_first_of(",>", id) - id - 3));
+			lengths.push_back((len == std::string::npos) ? 0 : strtoul(line.c_str() + len + 7, nullptr, 10));
+			assemblies.push_back((as == std::string::npos) ? "" : line.substr(as + 9, line.find_first_of(",>", as) - as - 9));
+		}
+		else if (line.compare(0, 6, "#CHROM") == 0)
+		{
+			std::stringstream ss(line);
+			std::string field;
+
+			for (i = 0; std::getline(ss, field, '\t'); i++)
+				if (i >= 9)
+					samples.push_back(field);
+			break;
+		}
+		else if (line[0] != '#')
+			return -1;
+	}
+	if (ret != 0)
+		return -1;
+
+	if (contigs.empty())
+	{
+		msg = "VCF file " + fn + " has no ##contig lines naming its reference sequences";
+		fatalError(msg);
+	}
+	if (samples.empty())
+	{
+		msg = "VCF file " + fn + " has no samples";
+		fatalError(msg);
+	}
+
+	// every sample is assigned to a population by the map
+	std::ifstream in(popfile.c_str());
+	if (!in)
+	{
+		msg = "Cannot read population map " + popfile;
+		fatalError(msg);
+	}
+	while (in >> name >> pop)
+		popmap.push_back(std::make_pair(name, pop));
+
+	// the samples and populations are given to the rest of popbam as read groups of a BAM header
+	header = bam_header_init();
+	header->n_targets = contigs.size();
+	header->target_name = (char**)calloc(contigs.size(), sizeof(char*));
+	header->target_len = (unsigned int*)calloc(contigs.size(), sizeof(unsigned int));
+	for (i = 0; i < contigs.size(); i++)
+	{
+		header->target_name[i] = strdup(contigs[i].c_str());
+		header->target_len[i] = lengths[i];
+		text += "@SQ\tSN:" + contigs[i] + "\tLN:" + std::to_string(lengths[i]);
+		text += (assemblies[i].empty() ? "" : "\tAS:" + assemblies[i]) + "\n";
+	}
+	for (i = 0; i < samples.size(); i++)
+	{
+		std::vector<std::pair<std::string, std::string> >::const_iterator m = popmap.begin();
+
+		while ((m != popmap.end()) && (m->first != samples[i]))
+			++m;
+		if (m == popmap.end())
+		{
+			msg = "Sample " + samples[i] + " of VCF file " + fn + " is not assigned to a population in " + popfile;
+			fatalError(msg);
+		}
+		text += "@RG\tID:" + samples[i] + "\tSM:" + samples[i] + "\tPO:" + m->second + "\n";
+	}
+	header->l_text = text.size();
+	header->text = strdup(text.c_str());
+
+	nsmpl = samples.size();
+	calls.assign(nsmpl, 0);
+
+	// without a tabix index the records are located by reading the file once
+	linear.assign(contigs.size(), std::vector<unsigned long long>());
+	if (loadIndex(fn + ".tbi") < 0)
+		return buildIndex();
+
+	return 0;
+}
+
+int vcfReader::loadIndex(const std::string &fn)
+{
+	int i = 0;
+	int j = 0;
+	int t = 0;
+	int n = 0;
+	unsigned char buf[36];
+	std::vector<unsigned char> skip;
+	std::vector<std::string> names;
+	BGZF *in = nullptr;
+
+	if (!is_file_exist(fn.c_str()) || !(in = bgzf_open(fn.c_str(), "r")))
+		return -1;
+
+	// magic, number of sequences, column layout and length of the sequence names
+	if ((bgzf_read(in, buf, 36) != 36) || (memcmp(buf, "TBI\1", 4) != 0))
+	{
+		bgzf_close(in);
+		return -1;
+	}
+	n = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
+	t = buf[32] | (buf[33] << 8) | (buf[34] << 16) | (buf[35] << 24);
+
+	skip.resize(t);
+	if ((t > 0) && (bgzf_read(in, &skip[0], t) != t))
+	{
+		bgzf_close(in);
+		return -1;
+	}
+	for (i = 0; i < t; i += names.back().size() + 1)
+		names.push_back(std::string((const char*)&skip[i]));
+
+	// only the linear index is kept; the bins are skipped
+	for (i = 0; (i < n) && (i < (int)names.size()); i++)
+	{
+		int nbin = 0;
+		int nchunk = 0;
+		int nintv = 0;
+
+		if (bgzf_read(in, buf, 4) != 4)
+			break;
+		nbin = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+		for (j = 0; j < nbin; j++)
+		{
+			if (bgzf_read(in, buf, 8) != 8)
+				break;
+			nchunk = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
+			skip.resize(16 * nchunk);
+			if ((nchunk > 0) && (bgzf_read(in, &skip[0], 16 * nchunk) != 16 * nchunk))
+				break;
+		}
+		if ((j < nbin) || (bgzf_read(in, buf, 4) != 4))
+			break;
+		nintv = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+		skip.resize(8 * nintv);
+		if ((nintv > 0) && (bgzf_read(in, &skip[0], 8 * nintv) != 8 * nintv))
+			break;
+
+		t = bam_get_tid(header, names[i].c_str());
+		if (t < 0)
+			continue;
+		linear[t].assign(nintv, 0);
+		for (j = 0; j < 8 * nintv; j++)
+			linear[t][j/8] |= (unsigned long long)skip[j] << (CHAR_BIT * (j % 8));
+	}
+	bgzf_close(in);
+
+	return (i == n) ? 0 : -1;
+}
+
+int vcfReader::buildIndex(void)
+{
+	int ret = 0;
+	int t = 0;
+	int p = 0;
+	size_t bin = 0;
+
+	for (size_t i = 0; i < linear.size(); i++)
+		linear[i].clear();
+
+	while ((ret = readLine()) == 0)
+	{
+		size_t tab = line.find('\t');
+
+		if (line.empty() || (line[0] == '#') || (tab == std::string::npos))
+			continue;
+
+		line[tab] = '\0';
+		t = bam_get_tid(header, line.c_str());
+		p = atoi(line.c_str() + tab + 1) - 1;
+		if ((t < 0) || (p < 0))
+			continue;
+
+		bin = p >> VCF_BIN_SHIFT;
+		if (linear[t].size() <= bin)
+			linear[t].resize(bin + 1, 0);
+		if (linear[t][bin] == 0)
+			linear[t][bin] = offset;
+	}
+
+	return (ret == -1) ? 0 : -1;
+}
+
+int vcfReader::query(int t, int beg, int end)
+{
+	qtid = t;
+	qbeg = beg;
+	qend = end;
+	last = -1;
+	done = true;
+
+	if ((t < 0) || (t >= (int)linear.size()))
+		return 0;
+
+	// the first bin holding records at or after the beginning of the region
+	for (size_t i = beg >> VCF_BIN_SHIFT; i < linear[t].size(); i++)
+	{
+		if (linear[t][i] == 0)
+			continue;
+		if (bgzf_seek(fp, linear[t][i], SEEK_SET) < 0)
+			return -2;
+		done = false;
+		break;
+	}
+
+	return 0;
+}
+
+int vcfReader::next(int *p, const unsigned long long **cb)
+{
+	int ret = 0;
+	int t = 0;
+	int pos = 0;
+
+	while (!done)
+	{
+		if ((ret = readLine()) < 0)
+		{
+			done = true;
+			return ret;
+		}
+		if (line.empty() || (line[0] == '#'))
+			continue;
+
+		ret = parseRecord(&t, &pos);
+
+		// records are sorted within each reference sequence
+		if ((t != qtid) || (pos >= qend))
+		{
+			done = true;
+			break;
+		}
+
+		// indels and other records that are not SNVs are skipped; only the first record of a position is used
+		if ((ret > 0) || (pos < qbeg) || (pos <= last))
+			continue;
+
+		last = pos;
+		*p = pos;
+		*cb = &calls[0];
+		return 0;
+	}
+
+	return -1;
+}
+
+/*!
+ * \fn static int baseIndex(char c)
+ * \brief Returns the index of a nucleotide in ACGT order, or -1 for any other allele
+ */
+static int baseIndex(char c)
+{
+	switch (toupper((unsigned char)c))
+	{
+		case 'A': return 0;
+		case 'C': return 1;
+		case 'G': return 2;
+		case 'T': return 3;
+		default: return -1;
+	}
+}
+
+int vcfReader::parseRecord(int *t, int *p)
+{
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	int fgt = -1;
+	int fdp = -1;
+	int fgq = -1;
+	int fmq = -1;
+	int alleles[2];
+	long v[3];
+	std::vector<char*> field;
+	std::vector<char*> sub;
+	std::vector<int> bases;
+	char *s = &line[0];
+	char *e = nullptr;
+	std::string msg;
+
+	// split the record into its columns
+	field.push_back(s);
+	for (; *s; s++)
+	{
+		if (*s == '\t')
+		{
+			*s = '\0';
+			field.push_back(s + 1);
+		}
+	}
+	if ((int)field.size() != 9 + nsmpl)
+	{
+		msg = "Malformed VCF record at " + std::string(field[0]) + ":" + (field.size() > 1 ? std::string(field[1]) : "");
+		fatalError(msg);
+	}
+
+	*t = bam_get_tid(header, field[0]);
+	*p = atoi(field[1]) - 1;
+	if (*t < 0)
+	{
+		msg = "VCF record on " + std::string(field[0]) + ", which is missing from the ##contig lines";
+		fatalError(msg);
+	}
+
+	// the reference and each alternate allele must be single bases
+	if (strlen(field[3]) != 1)
+		return 1;
+	bases.push_back(baseIndex(field[3][0]));
+	if (strcmp(field[4], ".") != 0)
+	{
+		for (s = field[4]; ; s = e + 1)
+		{
+			e = strchr(s, ',');
+			if ((e ? e - s : (long)strlen(s)) != 1)
+				return 1;
+			bases.push_back(baseIndex(*s));
+			if (!e)
+				break;
+		}
+	}
+
+	// positions of the fields of each genotype
+	for (s = field[8], i = 0; s; i++)
+	{
+		e = strchr(s, ':');
+		if (strncmp(s, "GT", 2) == 0 && ((s[2] == ':') || (s[2] == '\0')))
+			fgt = i;
+		else if (strncmp(s, "DP", 2) == 0 && ((s[2] == ':') || (s[2] == '\0')))
+			fdp = i;
+		else if (strncmp(s, "GQ", 2) == 0 && ((s[2] == ':') || (s[2] == '\0')))
+			fgq = i;
+		else if (strncmp(s, "MQ", 2) == 0 && ((s[2] == ':') || (s[2] == '\0')))
+			fmq = i;
+		s = e ? e + 1 : nullptr;
+	}
+
+	for (i = 0; i < nsmpl; i++)
+	{
+		sub.clear();
+		for (s = field[9+i]; s; s = e ? e + 1 : nullptr)
+		{
+			sub.push_back(s);
+			e = strchr(s, ':');
+			if (e)
+				*e = '\0';
+		}
+
+		// a missing or non-SNV allele leaves the sample without a call
+		calls[i] = 0;
+		if ((fgt < 0) || (fgt >= (int)sub.size()))
+			continue;
+		for (s = sub[fgt], k = 0; *s && (k < 2); k++)
+		{
+			j = strtol(s, &e, 10);
+			if ((e == s) || (j < 0) || (j >= (int)bases.size()) || (bases[j] < 0))
+				break;
+			alleles[k] = bases[j];
+			s = ((*e == '/') || (*e == '|')) ? e + 1 : e;
+		}
+		if ((k == 0) || (*s && (k < 2)))
+			continue;
+		if (k == 1)
+			alleles[1] = alleles[0];
+
+		// depth and qualities default to values passing the filters
+		v[0] = defaultDepth;
+		v[1] = VCF_QUAL;
+		v[2] = VCF_QUAL;
+		if ((fdp >= 0) && (fdp < (int)sub.size()) && isdigit((unsigned char)sub[fdp][0]))
+			v[0] = strtol(sub[fdp], nullptr, 10);
+		if ((fgq >= 0) && (fgq < (int)sub.size()) && isdigit((unsigned char)sub[fgq][0]))
+			v[1] = strtol(sub[fgq], nullptr, 10);
+		if ((fmq >= 0) && (fmq < (int)sub.size()) && isdigit((unsigned char)sub[fmq][0]))
+			v[2] = strtol(sub[fmq], nullptr, 10);
+
+		// consensus calls keep the smaller base first, whatever the order of the GT field
+		calls[i] = (unsigned long long)((std::min(alleles[0], alleles[1]) << 2) | std::max(alleles[0], alleles[1])) << CHAR_BIT;
+		for (j = 0; j < 3; j++)
+			calls[i] |= (unsigned long long)std::min(v[j], 0xffffL) << (CHAR_BIT * 2 * (j + 1));
+	}
+
+	return 0;
+}
@@ -0,0 +1,616 @@
+/** \file pop_writer.cpp
+ *  \brief Functions for the buffered writer of the results
+ *  \author Daniel Garrigan
+ *  \version 0.4
+*/
+
+#include "popbam.h"
+
+///
+/// Definitions
+///
+
+/*! \def BGZF_BLOCK_SIZE
+ *  \brief Largest size of a compressed BGZF block
+ */
+#define BGZF_BLOCK_SIZE 0x10000
+
+/*!
+ * \fn static bool readCoordinate(const char *s, const char *e, int *v)
+ * \brief Reads a positive coordinate from the characters in [s, e)
+ */
+static bool readCoordinate(const char *s, const char *e, int *v)
+{
+	long long x = 0;
+
+	if (s == e)
+		return false;
+
+	for (; s < e; ++s)
+	{
+		if (!isdigit(*s) || ((x = 10 * x + (*s - '0')) > INT_MAX))
+			return false;
+	}
+
+	*v = (int)x;
+
+	return x > 0;
+}
+
+bgzfWriter::bgzfWriter(void)
+{
+	fp = nullptr;
+	coffset = 0;
+	nthreads = 1;
+	src = nullptr;
+	srcLen = 0;
+	nblocks = 0;
+	header = nullptr;
+	memset(conf, 0, sizeof(conf));
+	bi = nullptr;
+	b = bam_init1();
+	lastTid = -1;
+	unindexed = false;
+}
+
+bgzfWriter::~bgzfWriter(void)
+{
+	close();
+	if (bi)
+		bam_index_destroy(bam_index_builder_finish(bi, 0));
+	bam_destroy1(b);
+}
+
+int bgzfWriter::open(const std::string &fn, int nt)
+{
+	filename = fn;
+	nthreads = std::max(nt, 1);
+	coffset = 0;
+	fp = fopen(fn.c_str(), "wb");
+
+	return fp ? 0 : -1;
+}
+
+void bgzfWriter::indexBy(const bam_header_t *h, int format, int colEnd)
+{
+	// lines are indexed by sequence name and 1-based coordinates, with
+	// the column headers and the VCF meta lines skipped as comments
+	header = h;
+	conf[0] = format;
+	conf[1] = 1;
+	conf[2] = 2;
+	conf[3] = colEnd;
+	conf[4] = '#';
+	conf[5] = 0;
+}
+
+int bgzfWriter::write(const char *s, size_t len)
+{
+	int ret = 0;
+
+	if (!fp)
+		return -1;
+
+	if (len == 0)
+		return 0;
+
+	src = s;
+	srcLen = len;
+	nblocks = (len + BGZF_TEXT_BLOCK - 1) / BGZF_TEXT_BLOCK;
+	if ((int)blocks.size() < nblocks)
+		blocks.resize(nblocks);
+
+	startDeflate();
+	waitDeflate();
+
+	// the blocks are written in order once all of them are compressed
+	for (int i = 0; i < nblocks; i++)
+	{
+		textBlock_t &blk = blocks[i];
+
+		blk.coffset = coffset;
+		if ((blk.csize < 0) || (fwrite(&blk.cdata[0], 1, blk.csize, fp) != (size_t)blk.csize))
+		{
+			ret = -1;
+			break;
+		}
+		coffset += blk.csize;
+	}
+
+	if ((ret == 0) && header)
+		indexLines(s, len);
+
+	return ret;
+}
+
+void bgzfWriter::startDeflate(void)
+{
+	next_block = 0;
+
+	// a single block is not worth a thread
+	if ((nthreads == 1) || (nblocks == 1))
+	{
+		deflateBlocks();
+		return;
+	}
+
+	for (int t = 0; t < std::min(nthreads, nblocks); t++)
+		workers.push_back(std::thread(&bgzfWriter::deflateBlocks, this));
+}
+
+void bgzfWriter::waitDeflate(void)
+{
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	workers.clear();
+}
+
+void bgzfWriter::deflateBlocks(void)
+{
+	int i = 0;
+	size_t beg = 0;
+
+	// claim blocks until the whole text is compressed
+	while ((i = next_block++) < nblocks)
+	{
+		textBlock_t &blk = blocks[i];
+
+		beg = (size_t)i * BGZF_TEXT_BLOCK;
+		blk.cdata.resize(BGZF_BLOCK_SIZE);
+		blk.csize = BGZF_BLOCK_SIZE;
+		if (bgzf_compress(&blk.cdata[0], &blk.csize, src + beg, std::min((size_t)BGZF_TEXT_BLOCK, srcLen - beg),
+			Z_DEFAULT_COMPRESSION) != 0)
+			blk.csize = -1;
+	}
+}
+
+unsigned long long bgzfWriter::voffset(size_t p, size_t len) const
+{
+	// the end of the text is the start of the next block
+	if (p == len)
+		return coffset << 16;
+
+	return (blocks[p/BGZF_TEXT_BLOCK].coffset << 16) | (p % BGZF_TEXT_BLOCK);
+}
+
+void bgzfWriter::indexLines(const char *s, size_t len)
+{
+	int beg = 0;
+	int end = 0;
+	int nf = 0;
+	size_t p = 0;
+	size_t q = 0;
+	const char *c = nullptr;
+	const char *e = nullptr;
+	const char *f[5];
+	const char *fe[5];
+	const int ncol = (conf[0] == TBX_VCF) ? 4 : std::max(conf[3], 2);
+
+	for (p = 0; p < len; p = q)
+	{
+		e = (const char*)memchr(s + p, '\n', len - p);
+		q = e ? (e - s) + 1 : len;
+		if (!e)
+			e = s + len;
+
+		if ((e == s + p) || (s[p] == conf[4]))
+			continue;
+
+		// find the columns holding the sequence name and the coordinates
+		f[0] = s + p;
+		for (nf = 0, c = s + p; (c < e) && (nf < ncol); c++)
+		{
+			if (*c == '\t')
+			{
+				fe[nf++] = c;
+				if (nf < ncol)
+					f[nf] = c + 1;
+			}
+		}
+
+		// the last column may end the line
+		if (nf < ncol)
+			fe[nf++] = e;
+
+		if ((nf < ncol) || !readCoordinate(f[1], fe[1], &beg))
+		{
+			unindexed = true;
+			continue;
+		}
+
+		std::string name(f[0], fe[0] - f[0]);
+		if ((lastTid < 0) || (name != lastName))
+		{
+			lastName = name;
+			lastTid = bam_get_tid(header, name.c_str());
+		}
+
+		if (lastTid < 0)
+		{
+			unindexed = true;
+			continue;
+		}
+
+		--beg;
+		if (conf[0] == TBX_VCF)
+			end = beg + (fe[3] - f[3]);
+		else if ((conf[3] == 0) || !readCoordinate(f[conf[3]-1], fe[conf[3]-1], &end))
+			end = beg + 1;
+		end = std::max(end, beg + 1);
+
+		if (!bi)
+			bi = bam_index_builder_init(header->n_targets, voffset(p, len));
+
+		// the line stands in the index as an alignment spanning its coordinates
+		b->core.tid = lastTid;
+		b->core.pos = beg;
+		b->core.bin = bam_reg2bin(beg, end);
+		b->core.flag = 0;
+		b->core.l_qname = 4;
+		b->core.n_cigar = 1;
+		b->data_len = 8;
+		if (b->m_data < 8)
+		{
+			b->m_data = 8;
+			b->data = (uint8_t*)realloc(b->data, b->m_data);
+		}
+		memcpy(b->data, ".\0\0\0", 4);
+		bam1_cigar(b)[0] = (uint32_t)(end - beg) << BAM_CIGAR_SHIFT;
+
+		if (bam_index_builder_push(bi, b, voffset(q, len)) < 0)
+		{
+			header = nullptr;
+			std::cerr << "Results in " << filename << " are not in coordinate order, so they are not indexed" << std::endl;
+			return;
+		}
+	}
+}
+
+int bgzfWriter::close(void)
+{
+	int ret = 0;
+	int l = 64;
+	char eof[64];
+
+	if (!fp)
+		return 0;
+
+	// an empty block marks the end of the file, as bgzf_close writes it
+	if ((bgzf_compress(eof, &l, "", 0, Z_DEFAULT_COMPRESSION) != 0) || (fwrite(eof, 1, l, fp) != (size_t)l))
+		ret = -1;
+	if (fclose(fp) != 0)
+		ret = -1;
+	fp = nullptr;
+
+	if (header && (saveIndex() < 0))
+		ret = -1;
+
+	return ret;
+}
+
+int bgzfWriter::saveIndex(void)
+{
+	int ret = 0;
+	std::string names;
+	std::string idxfile = filename + ".tbi";
+	bam_index_t *idx = nullptr;
+	BGZF *fpidx = nullptr;
+
+	if (!bi)
+		bi = bam_index_builder_init(header->n_targets, coffset << 16);
+
+	idx = bam_index_builder_finish(bi, coffset << 16);
+	bi = nullptr;
+	if (!idx)
+		return -1;
+
+	if (unindexed)
+		std::cerr << "Some lines of " << filename << " name no reference sequence of the input and are left out of its index" << std::endl;
+
+	for (int i = 0; i < header->n_targets; i++)
+		names.append(header->target_name[i], strlen(header->target_name[i]) + 1);
+
+	if ((fpidx = bgzf_open(idxfile.c_str(), "w")) == 0)
+	{
+		bam_index_destroy(idx);
+		return -1;
+	}
+
+	ret = bam_index_save_tabix(idx, fpidx, conf, names.data(), names.size());
+	if (bgzf_close(fpidx) < 0)
+		ret = -1;
+	bam_index_destroy(idx);
+
+	return ret;
+}
+
+textWriter::textWriter(void)
+{
+	threaded = false;
+	os = nullptr;
+	bgzf = nullptr;
+	n[0] = 0;
+	n[1] = 0;
+	slot = 0;
+	failed = false;
+}
+
+textWriter::~textWriter(void)
+{
+	close();
+}
+
+void textWriter::open(std::ostream *s)
+{
+	close();
+	os = s;
+	n[0] = 0;
+	n[1] = 0;
+	slot = 0;
+	failed = false;
+}
+
+int textWriter::openBGZF(const std::string &fn, int nthreads, const bam_header_t *h, int format, int colEnd)
+{
+	// text gathered before, such as the header of a VCF file, is compressed with the rest
+	waitWrite();
+	bgzf = new bgzfWriter;
+	if (bgzf->open(fn, nthreads) < 0)
+	{
+		delete bgzf;
+		bgzf = nullptr;
+		return -1;
+	}
+
+	if (h)
+		bgzf->indexBy(h, format, colEnd);
+	os = nullptr;
+
+	return 0;
+}
+
+int textWriter::close(void)
+{
+	if (!os && !bgzf)
+		return 0;
+
+	waitWrite();
+	writeSlot(slot);
+
+	if (bgzf)
+	{
+		if (bgzf->close() < 0)
+			failed = true;
+		delete bgzf;
+		bgzf = nullptr;
+	}
+	else
+	{
+		os->flush();
+		if (!os->good())
+			failed = true;
+		os = nullptr;
+	}
+
+	return failed ? -1 : 0;
+}
+
+void textWriter::write(const char *s, size_t len)
+{
+	size_t k = 0;
+
+	while (len > 0)
+	{
+		// buffers are allocated on first use, so idle writers cost nothing
+		if (buf[slot].empty())
+			buf[slot].resize(WRITER_BUFFER);
+
+		k = std::min(len, buf[slot].size() - n[slot]);
+		memcpy(&buf[slot][n[slot]], s, k);
+		n[slot] += k;
+		s += k;
+		len -= k;
+
+		if (n[slot] == buf[slot].size())
+			handOff();
+	}
+}
+
+void textWriter::handOff(void)
+{
+	size_t cut = n[slot];
+	std::string rest;
+
+	// compressed text is handed off in whole lines, so that each can be indexed
+	if (bgzf)
+	{
+		while ((cut > 0) && (buf[slot][cut-1] != '\n'))
+			--cut;
+
+		if (cut == 0)
+		{
+			buf[slot].resize(2 * buf[slot].size());
+			return;
+		}
+
+		rest.assign(&buf[slot][cut], n[slot] - cut);
+		n[slot] = cut;
+	}
+
+	if (!threaded)
+		writeSlot(slot);
+	else
+	{
+		// the previous buffer must be out before its slot is filled again
+		waitWrite();
+		worker = std::thread(&textWriter::writeSlot, this, slot);
+		slot ^= 1;
+	}
+
+	if (!rest.empty())
+	{
+		if (buf[slot].size() < std::max(rest.size(), (size_t)WRITER_BUFFER))
+			buf[slot].resize(std::max(rest.size(), (size_t)WRITER_BUFFER));
+		memcpy(&buf[slot][0], rest.data(), rest.size());
+		n[slot] = rest.size();
+	}
+}
+
+void textWriter::waitWrite(void)
+{
+	if (worker.joinable())
+		worker.join();
+}
+
+void textWriter::writeSlot(int s)
+{
+	if (n[s] == 0)
+		return;
+
+	if (bgzf)
+	{
+		if (bgzf->write(&buf[s][0], n[s]) < 0)
+			failed = true;
+	}
+	else if (os)
+	{
+		os->write(&buf[s][0], n[s]);
+		if (!os->good())
+			failed = true;
+	}
+	n[s] = 0;
+}
+
+textWriter& textWriter::operator<<(const char *s)
+{
+	write(s, strlen(s));
+	return *this;
+}
+
+textWriter& textWriter::operator<<(const std::string &s)
+{
+	write(s.c_str(), s.size());
+	return *this;
+}
+
+void textWriter::putUnsigned(unsigned long long v)
+{
+	char tmp[20];
+	int i = 20;
+
+	do
+	{
+		tmp[--i] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+
+	write(tmp + i, 20 - i);
+}
+
+textWriter& textWriter::operator<<(int v)
+{
+	return *this << (long long)v;
+}
+
+textWriter& textWriter::operator<<(unsigned int v)
+{
+	putUnsigned(v);
+	return *this;
+}
+
+textWriter& textWriter::operator<<(long v)
+{
+	return *this << (long long)v;
+}
+
+textWriter& textWriter::operator<<(unsigned long v)
+{
+	putUnsigned(v);
+	return *this;
+}
+
+textWriter& textWriter::operator<<(long long v)
+{
+	if (v < 0)
+	{
+		*this << '-';
+		putUnsigned(-(unsigned long long)v);
+	}
+	else
+		putUnsigned(v);
+
+	return *this;
+}
+
+textWriter& textWriter::operator<<(unsigned long long v)
+{
+	putUnsigned(v);
+	return *this;
+}
+
+textWriter& textWriter::operator<<(const fixedValue_t &f)
+{
+	static const double scale[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+	static const unsigned long long iscale[] = {1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+		1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL};
+	char tmp[32];
+	double x = 0.0;
+	double frac = 0.0;
+	unsigned long long r = 0;
+	unsigned long long d = 0;
+	int i = 0;
+
+	// the value is scaled to an integer count of the last decimal; large
+	// values, infinities and values so close to halfway between two outputs
+	// that the scaling may have rounded them the other way go through printf
+	if ((f.prec >= 0) && (f.prec <= 9))
+	{
+		x = fabs(f.v) * scale[f.prec];
+		if (x < 1e12)
+		{
+			r = (unsigned long long)x;
+			frac = x - r;
+			if (fabs(frac - 0.5) > 1e-3)
+			{
+				if (frac > 0.5)
+					++r;
+				if (std::signbit(f.v))
+					*this << '-';
+				putUnsigned(r / iscale[f.prec]);
+				if (f.prec > 0)
+				{
+					d = r % iscale[f.prec];
+					for (i = f.prec; i > 0; --i, d /= 10)
+						tmp[i] = '0' + d % 10;
+					tmp[0] = '.';
+					write(tmp, f.prec + 1);
+				}
+				return *this;
+			}
+		}
+	}
+
+	i = snprintf(tmp, sizeof(tmp), "%.*f", f.prec, f.v);
+	if ((i > 0) && (i < (int)sizeof(tmp)))
+		write(tmp, i);
+	else
+	{
+		std::vector<char> big(i + 1);
+		snprintf(&big[0], big.size(), "%.*f", f.prec, f.v);
+		write(&big[0], i);
+	}
+
+	return *this;
+}
+
+textWriter& textWriter::operator<<(const sigValue_t &g)
+{
+	char tmp[64];
+	int i = snprintf(tmp, sizeof(tmp), "%.*g", g.prec, g.v);
+
+	if ((i > 0) && (i < (int)sizeof(tmp)))
+		write(tmp, i);
+
+	return *this;
+}
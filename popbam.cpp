@@ -71,6 +71,14 @@ int main(int argc, char *argv[])
 		return mainLD(argc, argv);
 	else if (userFunc.compare(std::string("sfs")) == 0)
 		return mainSFS(argc, argv);
+	else if (userFunc.compare(std::string("pool")) == 0)
+		return mainPool(argc, argv);
+	else if (userFunc.compare(std::string("call")) == 0)
+		return mainCall(argc, argv);
+	else if (userFunc.compare(std::string("multi")) == 0)
+		return mainMulti(argc, argv);
+	else if (userFunc.compare(std::string("index")) == 0)
+		return mainIndex(argc, argv);
 	else if (userFunc.compare(std::string("fasta")) == 0)
 		return 0;
 	else
@@ -83,11 +91,26 @@ int main(int argc, char *argv[])
 
 popbamData::popbamData(void)
 {
+	sm = nullptr;
+	reader = nullptr;
+	reference = &refseq;
+	ref_base = nullptr;
+	len = 0;
+	cached = nullptr;
+	em = nullptr;
+	os.open(&std::cout);
 	flag = 0x0;
 	num_sites = 0;
+	segsites = 0;
+	site_cap = 0;
+	seg_cap = 0;
 	tid = -1;
 	beg = 0;
 	end = 0x7fffffff;
+	reg_end = 0x7fffffff;
+	winSites = 0;
+	winSpan = 0x7fffffff;
+	imask = 0;
 	minRMSQ = 25;
 	minSNPQ = 25;
 	minDepth = 3;
@@ -97,6 +120,16 @@ popbamData::popbamData(void)
 	hetPrior = 0.0001;
 }
 
+popbamData::~popbamData(void)
+{
+	// derived destructors still need the sample counts, so the
+	// sample data is released last
+	delete reader;
+	errmod_destroy(em);
+	if (sm)
+		bam_smpl_destroy(sm);
+}
+
 int popbamData::assignPops(const popbamOptions *p)
 {
 	int si = -1;
@@ -104,13 +137,23 @@ int popbamData::assignPops(const popbamOptions *p)
 
 	memset(&buf, 0, sizeof(kstring_t));
 
+	// the population bit masks hold one bit per sample
+	if (sm->n > 64)
+		fatalError("popbam can analyze at most 64 samples");
+
 	for (int i = 0; i < sm->n; i++)
 	{
-		if (sm->smpl[i])
-			si = bam_smpl_sm2popid(sm, p->bamfile.c_str(), sm->smpl[i], &buf);
+		si = -1;
 
-		if (si < 0)
-			si = bam_smpl_sm2popid(sm, p->bamfile.c_str(), 0, &buf);
+		// a sample is defined in the header of the file holding its reads
+		for (size_t f = 0; (si < 0) && (f < p->bamfiles.size()); f++)
+		{
+			if (sm->smpl[i])
+				si = bam_smpl_sm2popid(sm, p->bamfiles[f].c_str(), sm->smpl[i], &buf);
+
+			if (si < 0)
+				si = bam_smpl_sm2popid(sm, p->bamfiles[f].c_str(), 0, &buf);
+		}
 
 		if (si < 0)
 		{
@@ -124,16 +167,455 @@ int popbamData::assignPops(const popbamOptions *p)
 		pop_nsmpl[si]++;
 	}
 
+	free(buf.s);
+
+	return 0;
+}
+
+int popbamData::fetchRegion(const popbamOptions *p, int ref, bam_plbuf_t *buf)
+{
+	int ret = 0;
+	int si = -1;
+	int fi = 0;
+	unsigned char *s = nullptr;
+	bam1_t *b = nullptr;
+	kstring_t str;
+	std::string msg;
+
+	memset(&str, 0, sizeof(kstring_t));
+
+	// no reads from a previous region are still in the pileup
+	active_ends.assign(sm->n, readEndHeap());
+
+	// calls made earlier are replayed through the pileup callback from the genotype cache
+	if (p->cache)
+	{
+		int pos = 0;
+
+		if (p->cache->nsmpl != sm->n)
+			fatalError("Samples in the genotype cache do not match the samples of its BAM headers");
+
+		if ((ret = p->cache->query(ref, beg, reg_end)) < 0)
+			return ret;
+		while ((ret = p->cache->next(&pos, &cached)) >= 0)
+			buf->func(ref, pos, 0, nullptr, buf->data);
+		cached = nullptr;
+
+		return (ret == -1) ? 0 : ret;
+	}
+
+	// genotypes of a VCF file are replayed the same way
+	if (p->vcf)
+	{
+		int pos = 0;
+
+		if (p->vcf->nsmpl != sm->n)
+			fatalError("Samples in the VCF file do not match the samples of its population map");
+
+		if ((ret = p->vcf->query(ref, beg, reg_end)) < 0)
+			return ret;
+		while ((ret = p->vcf->next(&pos, &cached)) >= 0)
+			buf->func(ref, pos, 0, nullptr, buf->data);
+		cached = nullptr;
+
+		return (ret == -1) ? 0 : ret;
+	}
+
+	if (!reader)
+		reader = new bamReader(p);
+
+	if ((ret = reader->query(ref, beg, reg_end, &reference->masked)) < 0)
+		return ret;
+
+	while ((ret = reader->next(&b, &fi)) >= 0)
+	{
+		// reads that could never contribute a base call do not count toward depth
+		if ((b->core.flag & BAM_DEF_MASK) || (b->core.qual < minMapQ))
+			continue;
+
+		// reads lying entirely within one masked interval never reach the pileup
+		if (!reference->masked.empty())
+		{
+			int rbeg = b->core.pos;
+			std::vector<bamRegion_t>::const_iterator m = std::upper_bound(reference->masked.begin(), reference->masked.end(), rbeg,
+				[](int pos, const bamRegion_t &r) { return pos < r.end; });
+			if ((m != reference->masked.end()) && (m->beg <= rbeg) && ((int)bam_calend(&b->core, bam1_cigar(b)) <= m->end))
+				continue;
+		}
+
+		s = bam_aux_get(b, "RG");
+
+		// skip reads with no read group tag
+		if (!s)
+			continue;
+
+		si = bam_smpl_rg2smid(sm, p->bamfiles[fi].c_str(), (char*)(s+1), &str);
+		if (si < 0)
+			si = bam_smpl_rg2smid(sm, p->bamfiles[fi].c_str(), 0, &str);
+
+		if (si < 0)
+		{
+			free(str.s);
+			std::string rogue_rg(bam_aux2Z(s));
+			msg = "Problem assigning read group " + rogue_rg + " to a sample.\nPlease check BAM header for correct SM and PO tags";
+			fatalError(msg);
+		}
+
+		// retire reads of this sample that end before the current read starts
+		readEndHeap &ends = active_ends[si];
+		while (!ends.empty() && (ends.top() <= (unsigned int)b->core.pos))
+			ends.pop();
+
+		// hard cap on the number of overlapping reads per sample
+		if ((int)ends.size() >= maxDepth)
+			continue;
+
+		ends.push(bam_calend(&b->core, bam1_cigar(b)));
+		bam_plbuf_push_aux(b, buf, si);
+	}
+
+	free(str.s);
+
+	return (ret == -1) ? 0 : ret;
+}
+
+int runWindows(const popbamOptions &p, const std::vector<popbamData*> &tasks, bam_pileup_f func, void *data)
+{
+	int ref = 0;
+	std::string msg;
+	bam_plbuf_t *buf = nullptr;
+
+	// with threads to spare, the results are written out by a thread of their own
+	for (size_t i = 0; i < tasks.size(); ++i)
+		tasks[i]->os.threaded = (p.nthreads > 1);
+
+	// iterate through all windows along specified genomic region or all target regions
+	for (size_t j = 0; j < p.regions.size(); ++j)
+	{
+		ref = p.regions[j].tid;
+
+		for (size_t i = 0; i < tasks.size(); ++i)
+		{
+			tasks[i]->setRegion(p.regions[j]);
+
+			// fetch reference sequence of each new scaffold once; the other
+			// analyses share the sequence and masked intervals of the first
+			if (i > 0)
+				tasks[i]->useReference(tasks[0]->reference);
+			else if ((j == 0) || (ref != tasks[0]->tid))
+				tasks[0]->fetchReference(&p, ref);
+
+			// open the first window of the region
+			tasks[i]->openWindow();
+		}
+
+		// initialize pileup
+		buf = bam_plbuf_init(func, data);
+
+		// fetch region from bam file
+		if (tasks[0]->fetchRegion(&p, ref, buf) < 0)
+		{
+			msg = "Failed to retrieve region " + p.region + " due to corrupted BAM index file";
+			fatalError(msg);
+		}
+
+		// finalize pileup
+		bam_plbuf_push(0, buf);
+
+		// close the last window of the region
+		for (size_t i = 0; i < tasks.size(); ++i)
+			tasks[i]->closeWindow();
+
+		// take out the garbage
+		bam_plbuf_destroy(buf);
+	}
+	// end of window iteration
+
+	return 0;
+}
+
+void openResults(const popbamOptions &p, const std::string &analysis, popbamData *t, const std::string &fn)
+{
+	const bam_header_t *h = p.h;
+	int format = TBX_GENERIC;
+	int colEnd = 3;
+	std::string msg;
+
+	// windows span the second and third columns as 1-based closed intervals
+	// that never overlap, so a query at a window edge finds one line; snp lines
+	// span a single site, and ms samples carry no coordinates, so they are compressed without an index
+	if (analysis == "snp")
+	{
+		colEnd = 0;
+		if (p.output == 2)
+			h = nullptr;
+		else if (p.output == 3)
+			format = TBX_VCF;
+	}
+
+	if (t->os.openBGZF(fn, p.nthreads, h, format, colEnd) < 0)
+	{
+		msg = "Failed to open output file " + fn;
+		fatalError(msg);
+	}
+}
+
+void closeResults(popbamData *t, const std::string &fn)
+{
+	std::string msg;
+
+	if (t->os.close() < 0)
+	{
+		msg = "Failed to write output file " + fn;
+		fatalError(msg);
+	}
+}
+
+void popbamData::setRegion(const bamRegion_t &r)
+{
+	beg = r.beg;
+	end = r.end;
+	reg_end = r.end;
+
+	// the first site-count window may not span more than the longest window
+	if ((winSites > 0) && ((unsigned int)(end - beg) > winSpan))
+		end = beg + winSpan;
+
+	// target regions may overlap, so the mask is searched again from the start of each
+	imask = std::upper_bound(reference->masked.begin(), reference->masked.end(), beg,
+		[](int pos, const bamRegion_t &m) { return pos < m.end; }) - reference->masked.begin();
+}
+
+int popbamData::fetchReference(const popbamOptions *p, int ref)
+{
+	refseq.fetch(p, ref, flag & BAM_SOFTMASK);
+	useReference(&refseq);
+
 	return 0;
 }
 
+void popbamData::useReference(const refSequence *r)
+{
+	reference = r;
+	tid = r->tid;
+	ref_base = r->seq;
+	len = r->len;
+
+	imask = std::upper_bound(reference->masked.begin(), reference->masked.end(), beg,
+		[](int pos, const bamRegion_t &m) { return pos < m.end; }) - reference->masked.begin();
+}
+
+refSequence::refSequence(void)
+{
+	seq = nullptr;
+	len = 0;
+	tid = -1;
+}
+
+refSequence::~refSequence(void)
+{
+	free(seq);
+}
+
+int refSequence::fetch(const popbamOptions *p, int ref, bool softmask)
+{
+	int i = 0;
+	bamRegion_t r;
+	std::vector<bamRegion_t> soft;
+	std::vector<bamRegion_t>::const_iterator m;
+	std::string msg;
+
+	tid = ref;
+	free(seq);
+	seq = faidx_fetch_seq(p->fai_file, p->h->target_name[ref], 0, 0x7fffffff, &len);
+	if (!seq)
+	{
+		msg = "Failed to retrieve reference sequence " + std::string(p->h->target_name[ref]);
+		fatalError(msg);
+	}
+
+	// masked intervals of the BED file on this reference sequence
+	masked.clear();
+	r.tid = ref;
+	m = std::lower_bound(p->mask.begin(), p->mask.end(), ref, [](const bamRegion_t &a, int t) { return a.tid < t; });
+	for (; (m != p->mask.end()) && (m->tid == ref); ++m)
+		masked.push_back(*m);
+
+	// runs of lowercase bases in the reference are merged in
+	if (softmask)
+	{
+		for (i = 0; i < len; i++)
+		{
+			if (!islower(seq[i]))
+				continue;
+			r.beg = i;
+			while ((i < len) && islower(seq[i]))
+				i++;
+			r.end = i;
+			soft.push_back(r);
+		}
+
+		std::vector<bamRegion_t> bed;
+		bed.swap(masked);
+		std::merge(bed.begin(), bed.end(), soft.begin(), soft.end(), std::back_inserter(masked),
+			[](const bamRegion_t &a, const bamRegion_t &b) { return a.beg < b.beg; });
+
+		size_t k = 0;
+		for (size_t j = 1; j < masked.size(); j++)
+		{
+			if (masked[j].beg <= masked[k].end)
+				masked[k].end = std::max(masked[k].end, masked[j].end);
+			else
+				masked[++k] = masked[j];
+		}
+		if (!masked.empty())
+			masked.resize(k + 1);
+	}
+
+	return 0;
+}
+
+void popbamData::allocHap(hData_t *h)
+{
+	h->geno = arena.alloc<unsigned long long>(seg_cap);
+	h->call = arena.alloc<hCall_t>((size_t)seg_cap * sm->n);
+	h->seq = nullptr;
+	h->pos = arena.alloc<unsigned int>(seg_cap);
+	h->idx = arena.alloc<unsigned int>(seg_cap);
+	h->ref = arena.alloc<unsigned char>(seg_cap);
+}
+
+void popbamData::extendHap(hData_t *h, int cap)
+{
+	h->geno = arena.extend(h->geno, seg_cap, cap);
+	h->call = arena.extend(h->call, (size_t)seg_cap * sm->n, (size_t)cap * sm->n);
+	h->pos = arena.extend(h->pos, seg_cap, cap);
+	h->idx = arena.extend(h->idx, seg_cap, cap);
+	h->ref = arena.extend(h->ref, seg_cap, cap);
+}
+
+void popbamData::sampleMajor(hData_t *h)
+{
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	unsigned long long block[64];
+
+	// sites are stored one record after the other; analyses comparing
+	// individuals want one bit string per individual
+	h->seq = arena.alloc<unsigned long long*>(sm->n);
+	for (i = 0; i < sm->n; i++)
+		h->seq[i] = arena.alloc<unsigned long long>(SEG_IDX(segsites) + 1);
+
+	// each block of 64 sites turns into one word per individual
+	for (j = 0, k = 0; j < segsites; j += 64, k++)
+	{
+		for (i = 0; i < 64; i++)
+			block[i] = j + i < segsites ? h->geno[j+i] : 0;
+		transpose64(block);
+		for (i = 0; i < sm->n; i++)
+			h->seq[i][k] = block[i];
+	}
+}
+
+int popbamData::unmaskedLength(void) const
+{
+	const std::vector<bamRegion_t> &masked = reference->masked;
+	int n = end - beg;
+
+	for (size_t i = 0; i < masked.size(); i++)
+		if ((masked[i].end > beg) && (masked[i].beg < end))
+			n -= std::min(masked[i].end, end) - std::max(masked[i].beg, beg);
+
+	return n;
+}
+
+int popbamData::lastBase(void) const
+{
+	// BED targets and site-count windows stop before the column at end, so end
+	// is already their last base in 1-based coordinates; fixed windows print end + 1
+	return (flag & (BAM_BEDIN | BAM_SNPWINDOW | BAM_SITEWINDOW)) ? end : end + 1;
+}
+
+void popbamData::checkWindow(unsigned int pos)
+{
+	bool full = false;
+
+	// the pileup has left the region; its last window is closed by the caller
+	while ((int)pos < reg_end)
+	{
+		full = (int)((flag & BAM_SNPWINDOW) ? segsites : num_sites) >= (int)winSites;
+
+		if (!full && ((int)pos < end))
+			break;
+
+		// a full window ends at the first column after its last counted site
+		if (full && ((int)pos < end))
+			end = pos;
+
+		closeWindow();
+
+		beg = end;
+		end = ((unsigned int)(reg_end - beg) > winSpan) ? beg + winSpan : reg_end;
+		openWindow();
+	}
+}
+
+windowArena::windowArena(void)
+{
+	cur = 0;
+	used = 0;
+	total = 0;
+	high = 0;
+}
+
+windowArena::~windowArena(void)
+{
+	for (size_t i = 0; i < blocks.size(); i++)
+		free(blocks[i].first);
+}
+
+void windowArena::reset(void)
+{
+	if (total > high)
+		high = total;
+
+	// a window that outgrew the first block leaves one block large enough for every window so far
+	if (blocks.size() > 1)
+	{
+		for (size_t i = 0; i < blocks.size(); i++)
+			free(blocks[i].first);
+		blocks.clear();
+		grow(high);
+	}
+
+	cur = 0;
+	used = 0;
+	total = 0;
+}
+
+void windowArena::grow(size_t bytes)
+{
+	size_t size = blocks.empty() ? ARENA_BLOCK : 2 * blocks.back().second;
+	char *block = nullptr;
+
+	if (size < bytes)
+		size = bytes;
+	if ((block = (char*)malloc(size)) == nullptr)
+		throw std::bad_alloc();
+
+	blocks.push_back(std::make_pair(block, size));
+	cur = blocks.size() - 1;
+	used = 0;
+}
+
 int popbam_usage(void)
 {
 	std::cerr << std::endl;
 	std::cerr << "Program: popbam " << std::endl;
 	std::cerr << "(Tools to perform evolutionary analysis from BAM files)" << std::endl;
 	std::cerr << "Version: " << POPBAM_RELEASE << std::endl;
-	std::cerr << "Usage: popbam <command> [options] <in.bam> [region]"  << std::endl << std::endl;
+	std::cerr << "Usage: popbam <command> [options] <in1.bam> [in2.bam ...] [region]"  << std::endl << std::endl;
 	std::cerr << "Commands:  snp       output consensus base calls" << std::endl;
 	std::cerr << "           fasta     output alignment as multi-fasta file" << std::endl;
 	std::cerr << "           haplo     output haplotype-based analyses" << std::endl;
@@ -142,6 +624,10 @@ int popbam_usage(void)
 	std::cerr << "           nucdiv    output nucleotide diversity statistics" << std::endl;
 	std::cerr << "           ld        output linkage disequilibrium analysis" << std::endl;
 	std::cerr << "           sfs       output site frequency spectrum analysis" << std::endl;
+	std::cerr << "           pool      output diversity statistics of pooled samples" << std::endl;
+	std::cerr << "           call      write consensus calls to a genotype cache read by the other commands" << std::endl;
+	std::cerr << "           multi     run several analyses over one pass through the reads" << std::endl;
+	std::cerr << "           index     build index of BAM files" << std::endl;
 	std::cerr << std::endl;
 	return 1;
 }
@@ -28,10 +28,17 @@
 #include <new>
 #include <iomanip>
 #include <algorithm>
+#include <iterator>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <atomic>
 #include <cstdlib>
 #include <cstring>
+#include <cctype>
 #include <cstddef>
 #include <climits>
 #include <cassert>
@@ -96,6 +103,96 @@
  */
 #define BAM_NOSINGLETONS 0x100
 
+/*! \def BAM_SAMIN
+ *  \brief Flag for the -S command line switch-- input files are in SAM format
+ */
+#define BAM_SAMIN 0x200
+
+/*! \def BAM_INDEXOUT
+ *  \brief Flag for the -I command line switch-- index unindexed BAM files while streaming them
+ */
+#define BAM_INDEXOUT 0x400
+
+/*! \def BAM_BEDIN
+ *  \brief Flag for the -r command line switch-- analyze the target regions of a BED file
+ */
+#define BAM_BEDIN 0x800
+
+/*! \def BAM_SNPWINDOW
+ *  \brief Flag for the -g command line switch-- close windows after a number of segregating sites
+ */
+#define BAM_SNPWINDOW 0x1000
+
+/*! \def BAM_SITEWINDOW
+ *  \brief Flag for the -c command line switch-- close windows after a number of callable sites
+ */
+#define BAM_SITEWINDOW 0x2000
+
+/*! \def BAM_MASKIN
+ *  \brief Flag for the -M command line switch-- skip the regions of a BED file
+ */
+#define BAM_MASKIN 0x4000
+
+/*! \def BAM_SOFTMASK
+ *  \brief Flag for the -L command line switch-- skip lowercase bases of the reference
+ */
+#define BAM_SOFTMASK 0x8000
+
+/*! \def BAM_HAPLOID
+ *  \brief Flag for the -H command line switch-- individuals are haploid or inbred
+ */
+#define BAM_HAPLOID 0x10000
+
+/*! \def BAM_DIPLOID
+ *  \brief Flag for the -D command line switch-- count alleles over both chromosomes of each individual
+ */
+#define BAM_DIPLOID 0x20000
+
+/*! \def BAM_BGZFOUT
+ *  \brief Flag for the -Z command line switch-- write the results of multi as BGZF with a tabix index
+ */
+#define BAM_BGZFOUT 0x40000
+
+/*! \def ARENA_ALIGN
+ *  \brief Alignment in bytes of the arrays handed out by a windowArena
+ */
+#define ARENA_ALIGN 16
+
+/*! \def ARENA_BLOCK
+ *  \brief Smallest block of memory reserved by a windowArena
+ */
+#define ARENA_BLOCK 0x10000
+
+/*! \def SITE_CHUNK
+ *  \brief Number of sites the arrays of a window hold before they first grow
+ */
+#define SITE_CHUNK 0x1000
+
+/*! \def CACHE_CHUNK
+ *  \brief Number of sites stored together in one block of a genotype cache
+ */
+#define CACHE_CHUNK 0x1000
+
+/*! \def WRITER_BUFFER
+ *  \brief Number of bytes of results gathered before they are written out
+ */
+#define WRITER_BUFFER 0x100000
+
+/*! \def BGZF_TEXT_BLOCK
+ *  \brief Number of bytes of text compressed into each BGZF block of the results
+ */
+#define BGZF_TEXT_BLOCK 0xff00
+
+/*! \def TBX_GENERIC
+ *  \brief Tabix format code of tab-delimited text with 1-based coordinates
+ */
+#define TBX_GENERIC 0
+
+/*! \def TBX_VCF
+ *  \brief Tabix format code of VCF text
+ */
+#define TBX_VCF 2
+
 /*! \def POPBAM_RELEASE
  *  \brief Version number of popbam program
  */
@@ -145,22 +242,50 @@
 // Define data structures
 //
 
+/*!
+ * struct hCall_t
+ * \brief A structure to represent the consensus call of one individual at a segregating site
+ */
+typedef struct
+{
+	unsigned short rms;               //!< root mean square mapping score
+	unsigned short snpq;              //!< SNP quality score
+	unsigned short num_reads;         //!< number of reads
+	unsigned char base;               //!< consensus base
+} hCall_t;
+
 /*!
  * struct hData_t
  * \brief A structure to represent a haplotype data set
  */
 typedef struct
 {
-	unsigned long long **seq;         //!< binary encoding of haplotype data
+	unsigned long long *geno;         //!< individuals carrying the non-reference allele at each position
+	hCall_t *call;                    //!< consensus calls of all individuals at each position, one record per position
+	unsigned long long **seq;         //!< binary encoding of haplotype data per individual; built by sampleMajor()
 	unsigned int *pos;                //!< reference coordinate for each position
 	unsigned int *idx;                //!< position index of each segregating site
 	unsigned char *ref;               //!< reference allele at each position
-	unsigned char **base;             //!< consensus base at each position in each individual
-	unsigned short **rms;             //!< root mean square mapping score at each position
-	unsigned short **snpq;            //!< SNP quality score at each position
-	unsigned short **num_reads;       //!< number of reads at each position in each individual
 } hData_t;
 
+/*!
+ * \struct bitKernels_t
+ * \brief Population count kernels chosen for the running processor
+ */
+typedef struct
+{
+	unsigned int (*count)(unsigned long long x);                           //!< bits set in one word
+	unsigned int (*countAnd)(unsigned long long x, unsigned long long y);   //!< bits set in both words
+	unsigned int (*countXor)(unsigned long long x, unsigned long long y);   //!< bits differing between two words
+	unsigned long long (*countArray)(const unsigned long long *a, int n);                                 //!< bits set in n words
+	unsigned long long (*countAndArray)(const unsigned long long *a, const unsigned long long *b, int n);  //!< bits set in both of n words
+	unsigned long long (*countXorArray)(const unsigned long long *a, const unsigned long long *b, int n);  //!< bits differing between n words
+	const char *name;                                                       //!< instruction set the kernels use
+} bitKernels_t;
+
+// Population count kernels selected at startup
+extern bitKernels_t kernels;
+
 /*!
  * \struct bam_sample_t
  * \brief A structure to represent a sample in the BAM file
@@ -211,6 +336,68 @@ typedef struct __call_aux_t
 	unsigned int c[16];               //!< Array of
 } call_aux_t;
 
+/*!
+ * \struct bamRegion_t
+ * \brief An interval of a reference sequence: a window, target region or masked region
+ */
+typedef struct
+{
+	int tid;                          //!< Reference sequence identifier
+	int beg;                          //!< Beginning coordinate, 0-based
+	int end;                          //!< End coordinate, exclusive
+} bamRegion_t;
+
+/*!
+ * \struct filterSet_t
+ * \brief Thresholds of the site filters applied to the consensus calls
+ */
+typedef struct
+{
+	int minSNPQ;                      //!< Minimum SNP quality score
+	int minDepth;                     //!< Minimum read depth
+	int minRMSQ;                      //!< Minimum rms mapping quality
+} filterSet_t;
+
+/*!
+ * \struct fixedValue_t
+ * \brief A number to be written with a fixed number of decimals, as printf("%.*f")
+ */
+typedef struct
+{
+	double v;                         //!< Value to write
+	int prec;                         //!< Number of decimals
+} fixedValue_t;
+
+/*!
+ * \struct sigValue_t
+ * \brief A number to be written with a number of significant digits, as printf("%.*g")
+ */
+typedef struct
+{
+	double v;                         //!< Value to write
+	int prec;                         //!< Number of significant digits
+} sigValue_t;
+
+/*!
+ * \fn inline fixedValue_t fixedValue(double v, int prec)
+ * \brief Formats a number with prec decimals when it is written to a textWriter
+ */
+inline fixedValue_t fixedValue(double v, int prec)
+{
+	fixedValue_t f = {v, prec};
+	return f;
+}
+
+/*!
+ * \fn inline sigValue_t sigValue(double v, int prec)
+ * \brief Formats a number with prec significant digits when it is written to a textWriter
+ */
+inline sigValue_t sigValue(double v, int prec)
+{
+	sigValue_t g = {v, prec};
+	return g;
+}
+
 //
 // Define some global variables
 //
@@ -218,12 +405,17 @@ typedef struct __call_aux_t
 /*! \def popbam_func_t
  *  \brief A enum data type that holds the popbam function identifier
  */
-enum popbam_func_t {SNP, FASTA, DIVERGE, HAPLO, TREE, NUCDIV, LD, SFS};
+enum popbam_func_t {SNP, FASTA, DIVERGE, HAPLO, TREE, NUCDIV, LD, SFS, POOL, CALL, MULTI};
 
 ///
 /// Define classes
 ///
 
+class genoCache;
+class vcfReader;
+class textWriter;
+class bgzfWriter;
+
 class popbamOptions
 {
 public:
@@ -234,33 +426,495 @@ public:
 	~popbamOptions() {}
 
 	// member variables
-	samfile_t *bam_in;                      //!< BAM input file stream
+	std::vector<samfile_t*> bam_in;         //!< BAM input file streams
 	faidx_t *fai_file;                      //!< Fasta reference file index
-	bam_index_t *idx;                       //!< Pointer to the BAM input file index
-	bam_header_t *h;                        //!< Pointer to the header text for the input BAM file
-	unsigned short flag;                    //!< Bit flag to hold user options
+	std::vector<bam_index_t*> idx;          //!< Pointers to the BAM input file indices
+	std::vector<bam_index_builder_t*> idx_build; //!< Indices built while streaming the input files; 0 if not built
+	bam_header_t *h;                        //!< Pointer to the header of the first input BAM file
+	genoCache *cache;                       //!< Genotype cache read instead of the input BAM files; 0 if none
+	vcfReader *vcf;                         //!< VCF file of called genotypes read instead of the input BAM files; 0 if none
+	unsigned int flag;                      //!< Bit flag to hold user options
 	int output;                             //!< Analysis output option
 	int errorCount;                         //!< Flag to indicate error in reading user options
 	int minDepth;                           //!< User-specified minimumm read depth
 	int maxDepth;                           //!< User-specified maximum read depth
 	int minRMSQ;                            //!< User-specified minimum rms mapping quality
 	int minSNPQ;                            //!< User-specified minimum SNP quality score
+	int nthreads;                           //!< User-specified number of threads for decoding input files
 	unsigned int winSize;                   //!< User-specified window size in kilobases
+	unsigned int winSites;                  //!< User-specified number of segregating or callable sites closing a window
 	unsigned char minMapQ;                  //!< User-specified minimum individual read mapping quality
 	unsigned char minBaseQ;                 //!< User-specified minimum inidividual base quality
 	double minSites;                        //!< User-specified minimum number of aligned sites to perform analysis
 	double minPop;                          //!< Minimum proportion of samples present
 	double hetPrior;                        //!< Prior probability for calling heterozygous genotypes
+	int poolSize;                           //!< User-specified number of chromosomes in each pool
+	int minCount;                           //!< User-specified minimum count of the minor allele in pooled data
 	std::string dist;                       //!< Pointer to the name of the desired distance metric	(-d switch)
-	std::string bamfile;                    //!< File name for the input BAM file
+	std::vector<std::string> bamfiles;      //!< File names for the input BAM files
+	std::string listfile;                   //!< File name for the optional list of input BAM files
 	std::string reffile;                    //!< File name for the input reference Fasta file
 	std::string headfile;                   //!< File name for optional BAM header input file
+	std::string bedfile;                    //!< File name for the optional BED file of target regions
+	std::string maskfile;                   //!< File name for the optional BED file of masked regions
+	std::string popfile;                    //!< File name for the sample to population map of VCF input
+	std::string outfile;                    //!< File name for the genotype cache written by the call function; prefix of the multi outputs
 	std::string region;                     //!< Region on which to perform the analysis
+	std::vector<bamRegion_t> regions;       //!< Windows or target regions to analyze, in coordinate order
+	std::vector<bamRegion_t> mask;          //!< Merged masked intervals, in coordinate order
 	std::string errorMsg;                   //!< String to hold any error messages
 	std::string popFunc;                    //!< The popbam function being invoked
+	std::vector<std::string> analyses;      //!< Analyses run over the pileup; several for the multi function
+	std::vector<filterSet_t> sweep;         //!< Filter thresholds of each result set of the multi function (-T)
 
 	// member functions
 	int checkBAM(void);
+	int closeBAM(void);
+
+private:
+	int openCache(const std::string &headtext);
+	int openVCF(void);
+	void replaceHeader(bam_header_t *hdr, const std::string &headtext);
+	int layoutRegions(void);
+	int readBED(const std::string &fn, std::vector<bamRegion_t> &bed, bool strict);
+	int makeWindows(void);
+};
+
+/*!
+ * \class windowArena
+ * \brief Hands out zeroed arrays that live until the next window is opened
+ */
+class windowArena
+{
+	public:
+		// constructor
+		windowArena(void);
+
+		// destructor
+		~windowArena(void);
+
+		// member functions
+		void reset(void);
+
+		/*!
+		 * \fn T *alloc(size_t n)
+		 * \brief Returns a zeroed array of n elements of type T
+		 */
+		template<typename T> T *alloc(size_t n)
+		{
+			size_t bytes = (n * sizeof(T) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+			T *a = nullptr;
+
+			if (blocks.empty() || (used + bytes > blocks[cur].second))
+				grow(bytes);
+			a = (T*)(blocks[cur].first + used);
+			memset(a, 0, n * sizeof(T));
+			used += bytes;
+			total += bytes;
+
+			return a;
+		}
+
+		/*!
+		 * \fn T *extend(const T *a, size_t n, size_t m)
+		 * \brief Returns a zeroed array of m elements of type T starting with the n elements of a
+		 */
+		template<typename T> T *extend(const T *a, size_t n, size_t m)
+		{
+			T *b = alloc<T>(m);
+
+			memcpy(b, a, n * sizeof(T));
+
+			return b;
+		}
+
+	private:
+		// member functions
+		void grow(size_t bytes);
+
+		// member variables
+		std::vector<std::pair<char*, size_t> > blocks;  //!< Memory blocks and their sizes in bytes
+		size_t cur;                             //!< Block arrays are currently taken from
+		size_t used;                            //!< Bytes taken from the current block
+		size_t total;                           //!< Bytes handed out since the last reset
+		size_t high;                            //!< Most bytes handed out between two resets
+};
+
+/*!
+ * \class bamReader
+ * \brief Merges the alignments of one region from all input BAM files into coordinate order
+ */
+class bamReader
+{
+	public:
+		// constructor
+		bamReader(const popbamOptions *p);
+
+		// destructor
+		~bamReader(void);
+
+		// member functions
+		int query(int tid, int beg, int end, const std::vector<bamRegion_t> *m);
+		int next(bam1_t **b, int *fileid);
+
+	private:
+		/*!
+		 * \struct bamStream_t
+		 * \brief Decoding state of one input file
+		 */
+		typedef struct
+		{
+			samfile_t *in;                      //!< The input file
+			bamFile fp;                         //!< BGZF stream of the input file
+			const bam_index_t *idx;             //!< Index of the input file; 0 if the file is streamed
+			bam_index_builder_t *bi;            //!< Index built from the streamed alignments; 0 if none
+			bam_iter_t iter;                    //!< Iterator over the current region
+			int itid;                           //!< Reference sequence of an iterator over all planned regions; -1 if none
+			bam1_t *pending;                    //!< First alignment beyond the last chunk
+			bool has_pending;                   //!< Whether pending holds an alignment
+			bam1_t *spill;                      //!< First streamed alignment beyond the current region
+			bool held;                          //!< Whether spill holds an alignment
+			bool at_eof;                        //!< Whether the streamed input or the planned iterator is exhausted
+			std::vector<bam1_t*> carry[2];      //!< Streamed alignments reaching into the next region: replayed and collected
+			int ncarry[2];                      //!< Number of alignments in each carry buffer
+			int icarry;                         //!< Next carried alignment to replay
+			int status;                         //!< 0 while reading; -1 at end of region; < -1 on error
+			std::vector<bam1_t*> batch[2];      //!< Decoded alignments of the current and next chunk
+			int n[2];                           //!< Number of alignments in each batch
+			int cur;                            //!< Index of the next alignment in the current batch
+		} bamStream_t;
+
+		typedef std::pair<int, int> heapEntry;  //!< Alignment position and file index
+		typedef std::priority_queue<heapEntry, std::vector<heapEntry>, std::greater<heapEntry> > mergeHeap;
+
+		// member functions
+		int readRegion(bamStream_t &s, bam1_t *&b);
+		void carryOver(bamStream_t &s, const bam1_t *b);
+		void unmasked(int tid, int beg, int end, std::vector<int> &begs, std::vector<int> &ends);
+		void fillChunk(int slot, int limit);
+		void startFill(int slot, int limit);
+		void waitFill(void);
+		int swapChunk(void);
+
+		// member variables
+		std::vector<bamStream_t> streams;       //!< Decoding state for each input file
+		std::vector<std::thread> workers;       //!< Threads decoding the next chunk
+		std::atomic<int> next_file;             //!< Next file to be claimed by a decoding thread
+		mergeHeap heap;                         //!< Heads of the current batches in coordinate order
+		int nthreads;                           //!< Number of decoding threads
+		bool streamed;                          //!< Whether any input file is read sequentially
+		const std::vector<bamRegion_t> *plan;   //!< Regions that will be queried, in order
+		const std::vector<bamRegion_t> *mask;   //!< Masked intervals of the reference sequence of the current query
+		size_t iplan;                           //!< Next planned region
+		int qtid;                               //!< Reference sequence of the current region
+		int qbeg;                               //!< Beginning of the current region
+		int qend;                               //!< End of the current region
+		int cfrom;                              //!< Alignments ending beyond this coordinate are kept for the next region
+		int slot;                               //!< Batch currently being merged
+		int limit;                              //!< Coordinate up to which the next chunk is decoded
+		int step;                               //!< Span of reference covered by one chunk
+};
+
+/*!
+ * \class genoCache
+ * \brief Consensus calls of every sample at every called site, stored by popbam call in blocks of sites
+ * Within a block the calls are kept sample by sample and byte by byte, so that the slowly varying
+ * quality and depth fields compress well; an index of the blocks gives random access by region
+ */
+class genoCache
+{
+	public:
+		// constructor
+		genoCache(void);
+
+		// destructor
+		~genoCache(void);
+
+		// member functions
+		static bool isCache(const std::string &fn);
+		int create(const std::string &fn, const popbamOptions *p, int n);
+		int push(int tid, int pos, const unsigned long long *cb);
+		int open(const std::string &fn);
+		int query(int tid, int beg, int end);
+		int next(int *pos, const unsigned long long **cb);
+		int close(void);
+
+		// member variables
+		unsigned int flag;                      //!< Base-calling option flags the calls were made with
+		int nsmpl;                              //!< Number of samples
+		std::vector<std::string> files;         //!< Names of the BAM files the calls were made from
+		std::vector<bam_header_t*> headers;     //!< Headers of the BAM files the calls were made from
+
+	private:
+		/*!
+		 * \struct cacheBlock_t
+		 * \brief Index entry of one block of sites
+		 */
+		typedef struct
+		{
+			int tid;                            //!< Reference sequence of the sites
+			int beg;                            //!< Position of the first site
+			int end;                            //!< One past the position of the last site
+			unsigned long long offset;          //!< Virtual file offset of the block
+		} cacheBlock_t;
+
+		// member functions
+		int writeBlock(void);
+		int readBlock(size_t b);
+
+		// member variables
+		std::string cachefile;                  //!< File name of the genotype cache
+		BGZF *fp;                               //!< Compressed stream of the genotype cache
+		bool writing;                           //!< Whether the cache is being written
+		std::vector<cacheBlock_t> index;        //!< Index entries of all blocks, in coordinate order
+		std::vector<unsigned char> packed;      //!< A block as stored in the file
+		std::vector<int> pos;                   //!< Positions of the sites of the current block
+		std::vector<unsigned long long> calls;  //!< Consensus calls of the current block, nsmpl words per site
+		int tid;                                //!< Reference sequence of the current block
+		int last;                               //!< Position of the last site written
+		size_t iblock;                          //!< Block held in memory; index.size() if none
+		size_t isite;                           //!< Next site of the block held in memory
+		bool done;                              //!< Whether the current query is exhausted
+		int qtid;                               //!< Reference sequence of the current query
+		int qend;                               //!< End of the current query
+};
+
+/*!
+ * \class vcfWriter
+ * \brief Streams consensus calls as VCF text or as BGZF-compressed BCF records, one site at a time
+ */
+class vcfWriter
+{
+	public:
+		// constructor
+		vcfWriter(void);
+
+		// destructor
+		~vcfWriter(void);
+
+		// member public functions
+		int open(const std::string &fn, bool bcf, textWriter *out);
+		int writeHeader(const popbamOptions *p, const bam_sample_t *sm);
+		int writeSite(int tid, int pos, char ref, const unsigned long long *cb);
+		int close(void);
+
+	private:
+		// member private functions
+		int emit(const void *data, size_t len);
+		void packTyped(int type, int count);
+
+		// member private variables
+		BGZF *fp;                               //!< Compressed output; 0 if VCF text is written to the stream
+		textWriter *os;                         //!< Writer receiving uncompressed VCF text
+		bool binary;                            //!< Whether records are written as BCF
+		int nsmpl;                              //!< Number of samples in each record
+		int ploidy;                             //!< Number of alleles in each genotype
+		const bam_header_t *h;                  //!< Header naming the reference sequences
+		std::string line;                       //!< VCF text of the current record
+		std::vector<unsigned char> shared;      //!< Site fields of the current BCF record
+		std::vector<unsigned char> indiv;       //!< Sample fields of the current BCF record
+};
+
+/*!
+ * \class vcfReader
+ * \brief Reads called genotypes from a BGZF-compressed VCF file as the consensus calls of each site
+ * Each SNV or invariant record becomes one call per sample, so the analyses read the file the
+ * way they replay a genotype cache, without a pileup or genotype likelihoods
+ */
+class vcfReader
+{
+	public:
+		// constructor
+		vcfReader(void);
+
+		// destructor
+		~vcfReader(void);
+
+		// member public functions
+		static bool isVCF(const std::string &fn);
+		int open(const std::string &fn, const std::string &popfile, int depth);
+		int query(int t, int beg, int end);
+		int next(int *p, const unsigned long long **cb);
+
+		// member public variables
+		int nsmpl;                              //!< Number of samples in the file
+		bam_header_t *header;                   //!< Reference sequences of the file and its samples as read groups with populations
+
+	private:
+		// member private functions
+		int readLine(void);
+		int loadIndex(const std::string &fn);
+		int buildIndex(void);
+		int parseRecord(int *t, int *p);
+
+		// member private variables
+		BGZF *fp;                               //!< Compressed VCF file
+		std::string line;                       //!< Current line of the file
+		long long offset;                       //!< Virtual file offset of the current line
+		std::vector<std::vector<unsigned long long> > linear; //!< Offset of the first record in each 16 kb bin of each reference sequence
+		std::vector<unsigned long long> calls;  //!< Consensus calls of the current record, one per sample
+		int defaultDepth;                       //!< Read depth given to genotypes without a DP field
+		int qtid;                               //!< Reference sequence of the current query
+		int qbeg;                               //!< Beginning of the current query
+		int qend;                               //!< End of the current query
+		int last;                               //!< Position of the last record returned
+		bool done;                              //!< Whether the current query has no more records
+};
+
+/*!
+ * \class bgzfWriter
+ * \brief Compresses text into BGZF blocks on several threads and builds a tabix index of its lines
+ * Each line is indexed by its reference sequence in the first column and its coordinates in the
+ * second and, optionally, a later column, the way tabix would index the finished file
+ */
+class bgzfWriter
+{
+	public:
+		// constructor
+		bgzfWriter(void);
+
+		// destructor
+		~bgzfWriter(void);
+
+		// member public functions
+		int open(const std::string &fn, int nthreads);
+		void indexBy(const bam_header_t *h, int format, int colEnd);
+		int write(const char *s, size_t len);
+		int close(void);
+
+	private:
+		/*!
+		 * \struct textBlock_t
+		 * \brief One block of text and its compressed form
+		 */
+		typedef struct
+		{
+			unsigned long long coffset;         //!< File offset of the compressed block
+			int csize;                          //!< Size of the compressed block; -1 if compression failed
+			std::vector<char> cdata;            //!< The compressed block
+		} textBlock_t;
+
+		// member private functions
+		void deflateBlocks(void);
+		void startDeflate(void);
+		void waitDeflate(void);
+		void indexLines(const char *s, size_t len);
+		unsigned long long voffset(size_t p, size_t len) const;
+		int saveIndex(void);
+
+		// member private variables
+		std::string filename;                   //!< Name of the compressed file
+		FILE *fp;                               //!< Raw stream of the compressed file
+		unsigned long long coffset;             //!< File offset of the next block
+		int nthreads;                           //!< Number of compressing threads
+		const char *src;                        //!< Text being compressed
+		size_t srcLen;                          //!< Length of the text being compressed
+		std::vector<textBlock_t> blocks;        //!< Blocks of the text being compressed
+		int nblocks;                            //!< Number of blocks of the text being compressed
+		std::vector<std::thread> workers;       //!< Threads compressing the blocks
+		std::atomic<int> next_block;            //!< Next block to be claimed by a compressing thread
+		const bam_header_t *header;             //!< Reference sequences of the indexed lines; 0 if not indexed
+		int conf[6];                            //!< Tabix format, sequence, begin and end columns, meta character and skipped lines
+		bam_index_builder_t *bi;                //!< Index under construction; 0 before the first indexed line
+		bam1_t *b;                              //!< Record standing for the current line in the index
+		int lastTid;                            //!< Reference sequence of the previous line
+		std::string lastName;                   //!< Name of the reference sequence of the previous line
+		bool unindexed;                         //!< Whether a line could not be indexed
+};
+
+/*!
+ * \class textWriter
+ * \brief Gathers the text of the results in a large buffer and writes it out only when the buffer fills
+ * Numbers are formatted by hand rather than through iostream; with threaded set, a full buffer is
+ * written by its own thread while the next one is filled. Opened with openBGZF, the text is handed
+ * off in whole lines to a bgzfWriter instead of a stream
+ */
+class textWriter
+{
+	public:
+		// constructor
+		textWriter(void);
+
+		// destructor
+		~textWriter(void);
+
+		// member public functions
+		void open(std::ostream *s);
+		int openBGZF(const std::string &fn, int nthreads, const bam_header_t *h, int format, int colEnd);
+		int close(void);
+		void write(const char *s, size_t n);
+		textWriter& operator<<(char c);
+		textWriter& operator<<(const char *s);
+		textWriter& operator<<(const std::string &s);
+		textWriter& operator<<(int v);
+		textWriter& operator<<(unsigned int v);
+		textWriter& operator<<(long v);
+		textWriter& operator<<(unsigned long v);
+		textWriter& operator<<(long long v);
+		textWriter& operator<<(unsigned long long v);
+		textWriter& operator<<(const fixedValue_t &f);
+		textWriter& operator<<(const sigValue_t &g);
+
+		// member public variables
+		bool threaded;                          //!< Whether full buffers are written by a separate thread
+
+	private:
+		// member private functions
+		void putUnsigned(unsigned long long v);
+		void handOff(void);
+		void waitWrite(void);
+		void writeSlot(int slot);
+
+		// member private variables
+		std::ostream *os;                       //!< Stream receiving the text; 0 if closed or compressed
+		bgzfWriter *bgzf;                       //!< Compressed file receiving the text; 0 if written to os
+		std::vector<char> buf[2];               //!< Buffer being filled and buffer being written
+		size_t n[2];                            //!< Number of bytes in each buffer
+		int slot;                               //!< Buffer currently being filled
+		std::thread worker;                     //!< Thread writing the other buffer
+		bool failed;                            //!< Whether a write to the stream has failed
+};
+
+/*!
+ * \fn inline textWriter& textWriter::operator<<(char c)
+ * \brief Appends one character; the separators between fields are written this way, so it is kept inline
+ */
+inline textWriter& textWriter::operator<<(char c)
+{
+	if (n[slot] < buf[slot].size())
+		buf[slot][n[slot]++] = c;
+	else
+		write(&c, 1);
+
+	return *this;
+}
+
+/*!
+ * \class refSequence
+ * \brief A reference sequence and its merged masked intervals
+ * The analyses fed by one pileup read the same reference, so it is fetched once and shared
+ */
+class refSequence
+{
+	public:
+		// constructor
+		refSequence(void);
+
+		// destructor
+		~refSequence(void);
+
+		// member functions
+		int fetch(const popbamOptions *p, int ref, bool softmask);
+
+		// member variables
+		char *seq;                              //!< Reference sequence string; 0 before the first fetch
+		int len;                                //!< Length of the reference sequence
+		int tid;                                //!< Reference sequence identifier; -1 before the first fetch
+		std::vector<bamRegion_t> masked;        //!< Merged masked intervals of the reference sequence
+
+	private:
+		refSequence(const refSequence&);
+		refSequence& operator=(const refSequence&);
 };
 
 /*!
@@ -274,24 +928,70 @@ class popbamData
 		popbamData();
 
 		// destructor
-		~popbamData() {}
+		virtual ~popbamData();
 
 		// member functions
 		int assignPops(const popbamOptions *p);
+		int fetchRegion(const popbamOptions *p, int ref, bam_plbuf_t *buf);
+		void setRegion(const bamRegion_t &r);
+		void checkWindow(unsigned int pos);
+		int fetchReference(const popbamOptions *p, int ref);
+		void useReference(const refSequence *r);
+		void allocHap(hData_t *h);
+		void extendHap(hData_t *h, int cap);
+		void sampleMajor(hData_t *h);
+		int unmaskedLength(void) const;
+		int lastBase(void) const;
+
+		/*!
+		 * \fn bool isMasked(int pos)
+		 * \brief Checks whether a reference position is masked; positions must not decrease within a region
+		 */
+		bool isMasked(int pos)
+		{
+			const std::vector<bamRegion_t> &masked = reference->masked;
+
+			while ((imask < masked.size()) && (masked[imask].end <= pos))
+				++imask;
+			return (imask < masked.size()) && (masked[imask].beg <= pos);
+		}
+
+		/*!
+		 * \fn unsigned int derivedCount(int site, unsigned long long mask) const
+		 * \brief Counts the derived alleles of the masked individuals at a segregating site
+		 * Under -D a homozygote carries two copies, so the count is over chromosomes
+		 */
+		unsigned int derivedCount(int site, unsigned long long mask) const
+		{
+			unsigned int c = kernels.count(types[site] & mask);
+			if (flag & BAM_DIPLOID)
+				c += kernels.count(homs[site] & mask);
+			return c;
+		}
 
 		// member variables
-		std::string bamfile;                    //!< Name of bamfile used for indexing purposes
-		bam_sample_t *sm;                       //!< Pointer to the sample information for the input BAM file
-		char *ref_base;                         //!< Reference sequence string for specified region
+		bam_sample_t *sm;                       //!< Pointer to the sample information for the input BAM file (owned)
+		const refSequence *reference;           //!< Reference sequence in use; fetched by this analysis or shared with another
+		char *ref_base;                         //!< Reference sequence string for specified region (owned by reference)
 		int tid;                                //!< Reference chromosome/scaffold identifier
 		int beg;                                //!< Reference coordinate of the beginning of the current region
 		int end;                                //!< Reference coordinate of the end of current region
+		int reg_end;                            //!< Reference coordinate of the end of the region read through the pileup
+		unsigned int winSites;                  //!< Number of sites closing a window; 0 for windows of fixed length
+		unsigned int winSpan;                   //!< Longest span of reference covered by a site-count window
+		std::function<void(void)> openWindow;   //!< Allocates and initializes the data of a new window
+		std::function<void(void)> closeWindow;  //!< Calculates and prints the statistics of a finished window
+		windowArena arena;                      //!< Storage of the arrays that live for one window
 		int len;                                //!< Length of the reference sequence for current region
-		unsigned short flag;                    //!< Bit flag to hold user options
+		unsigned int flag;                      //!< Bit flag to hold user options
 		int num_sites;                          //!< Total number of aligned sites
 		int segsites;                           //!< Total number of segregating sites in entire sample
+		int site_cap;                           //!< Number of aligned sites the arrays of the window can hold
+		int seg_cap;                            //!< Number of segregating sites the arrays of the window can hold
 		unsigned char *pop_nsmpl;               //!< Sample size per population
 		unsigned long long *types;              //!< The site type for each aligned site
+		unsigned long long *homs;               //!< Individuals homozygous for the variant at each segregating site (-D)
+		const unsigned long long *cached;       //!< Consensus calls of the site replayed from a genotype cache; 0 if none
 		unsigned long long *pop_mask;           //!< Bit mask for which individuals are in which population
 		int minDepth;                           //!< User-specified minimumm read depth
 		int maxDepth;                           //!< User-specified maximum read depth
@@ -301,7 +1001,15 @@ class popbamData
 		unsigned char minBaseQ;                 //!< User-specified minimum inidividual base quality
 		double hetPrior;                        //!< Prior probability of heterozygous genotype
 		errmod_t *em;                           //!< Error model data structure
+		textWriter os;                          //!< Writer of the results of each window
 		popbam_func_t derived_type;             //!< Type of the derived class
+
+	private:
+		typedef std::priority_queue<unsigned int, std::vector<unsigned int>, std::greater<unsigned int> > readEndHeap;
+		std::vector<readEndHeap> active_ends;   //!< End coordinates of reads admitted to the pileup for each sample
+		refSequence refseq;                     //!< Reference sequence fetched by this analysis
+		size_t imask;                           //!< First masked interval not ending before the last position checked
+		bamReader *reader;                      //!< Merged reader over all input BAM files
 };
 
 ///
@@ -317,6 +1025,19 @@ extern int mainTree(int, char**);
 extern int mainNucdiv(int, char**);
 extern int mainLD(int, char**);
 extern int mainSFS(int, char**);
+extern int mainPool(int, char**);
+extern int mainCall(int, char**);
+extern int mainMulti(int, char**);
+extern int mainIndex(int, char**);
+
+// analyses that can share one pass through the pileup
+extern popbamData *initSNP(const popbamOptions&, bam_pileup_f*);
+extern popbamData *initDiverge(const popbamOptions&, bam_pileup_f*);
+extern popbamData *initHaplo(const popbamOptions&, bam_pileup_f*);
+extern popbamData *initTree(const popbamOptions&, bam_pileup_f*);
+extern popbamData *initNucdiv(const popbamOptions&, bam_pileup_f*);
+extern popbamData *initLD(const popbamOptions&, bam_pileup_f*);
+extern popbamData *initSFS(const popbamOptions&, bam_pileup_f*);
 
 /*!
  * \fn inline unsigned int log2int(const unsigned int val)
@@ -338,53 +1059,34 @@ static inline unsigned int log2int(const unsigned int va)
 #else
 extern __inline unsigned int log2int(const unsigned int va)
 {
-	unsigned int re;
-
-	asm ( "\tbsr  %1, %0\n"
-		 : "=r" (re)
-		 : "r"  (va)
-		 );
-
-	return re;
+	return 31 - __builtin_clz(va);
 }
 #endif
 
 /*!
- * \fn inline unsigned int bitcount64(unsigned long long x)
- * \brief Function count the number of bits set in a 64-bit integer
- * \param x the 64-bit integer
- * \return unsigned integer
- * Returns the number of bits set
- */
-inline unsigned short bitcount64(unsigned long long x)
-{
-	x = (x & 0x5555555555555555ULL) + ((x >> 1) & 0x5555555555555555ULL);
-	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
-	x = (x & 0x0F0F0F0F0F0F0F0FULL) + ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
-	return (x * 0x0101010101010101ULL) >> 56;
-}
-
-/*!
- * \fn inline unsigned int hamming_distance(unsigned long long x, unsigned long long y)
- * \brief Function to compute the hamming distance between two 64-bit integers
- * \param x the first 64-bit integer
- * \param y the second 64-bit integer
- * \return unsigned int of hamming distance
- * Returns the number of bits set
+ * \fn inline void transpose64(unsigned long long *a)
+ * \brief Function to transpose a 64 x 64 bit matrix in place
+ * \param a array of 64 rows of 64 bits
+ * Afterwards bit j of a[i] holds what was bit i of a[j]
  */
-inline unsigned int hamming_distance(unsigned long long x, unsigned long long y)
+inline void transpose64(unsigned long long *a)
 {
-	unsigned int dist = 0;
-	unsigned long long val = x^y;
-
-	// count the number of set bits
-	while (val)
-	{
-		++dist;
-		val &= val-1;
-	}
-
-	return dist;
+	int j = 0;
+	int k = 0;
+	int r = 0;
+	unsigned long long m = 0x00000000FFFFFFFFULL;
+	unsigned long long t = 0;
+
+	// swap ever smaller off-diagonal blocks; the rows of a block are
+	// independent, so the inner loop runs over contiguous words
+	for (j = 32; j; j >>= 1, m ^= m << j)
+		for (k = 0; k < 64; k += 2 * j)
+			for (r = k; r < k + j; r++)
+			{
+				t = ((a[r] >> j) ^ a[r+j]) & m;
+				a[r] ^= t << j;
+				a[r+j] ^= t;
+			}
 }
 
 inline unsigned long long calculateSiteType(int n, unsigned long long *cb)
@@ -396,6 +1098,21 @@ inline unsigned long long calculateSiteType(int n, unsigned long long *cb)
 	return site_type;
 }
 
+/*!
+ * \fn inline unsigned long long calculateHomType(int n, unsigned long long *cb)
+ * \brief Function to mark the individuals homozygous for the variant at a site
+ * \param n The number of samples
+ * \param cb The consensus base call information, as classified by segGenotype()
+ */
+inline unsigned long long calculateHomType(int n, unsigned long long *cb)
+{
+	unsigned long long hom_type = 0;
+	for (int i=0; i < n; i++)
+		if ((cb[i] & 0x7ULL) == 0x7ULL)
+			hom_type |= 0x1ULL << i;
+	return hom_type;
+}
+
 /*!
  * \fn int popbam_usage(void)
  * \brief Prints general command usage options to stdout
@@ -415,11 +1132,10 @@ extern bool is_file_exist(const char *fileName);
 extern bam_sample_t *bam_smpl_init(void);
 
 /*!
- * \fn int bam_smpl_add(bam_sample_t *sm, const popbamOptions *p)
- * \brief Add a sample data structure
+ * \fn int bam_smpl_add(bam_sample_t *sm, const popbamOptions *op)
+ * \brief Add the samples of every input BAM file to the sample data structure
  * \param sm Pointer to sample data structure
- * \param abs Pointer to name of input BAM file
- * \param txt Pointer to unformatted BAM header txt
+ * \param op Pointer to the options holding the input file names and headers
  */
 extern int bam_smpl_add(bam_sample_t *sm, const popbamOptions *op);
 
@@ -464,6 +1180,34 @@ extern char *get_refid(char *htext);
  */
 extern int fetch_func(const bam1_t *b, void *data);
 
+/*!
+ * \fn int runWindows(const popbamOptions &p, const std::vector<popbamData*> &tasks, bam_pileup_f func, void *data)
+ * \brief Passes once through the pileup of every region, opening and closing the windows of each analysis
+ * \param p The user command line options
+ * \param tasks The analyses fed by the pileup; the first one reads the input
+ * \param func The pileup callback
+ * \param data User defined data structure passed to the callback
+ */
+extern int runWindows(const popbamOptions &p, const std::vector<popbamData*> &tasks, bam_pileup_f func, void *data);
+
+/*!
+ * \fn void openResults(const popbamOptions &p, const std::string &analysis, popbamData *t, const std::string &fn)
+ * \brief Sends the results of an analysis to a BGZF file, indexed for tabix when its lines have coordinates
+ * \param p The user command line options
+ * \param analysis The name of the analysis writing the results
+ * \param t The analysis
+ * \param fn Name of the compressed file; its index is written next to it
+ */
+extern void openResults(const popbamOptions &p, const std::string &analysis, popbamData *t, const std::string &fn);
+
+/*!
+ * \fn void closeResults(popbamData *t, const std::string &fn)
+ * \brief Writes out the last results of an analysis and the index of their file
+ * \param t The analysis
+ * \param fn Name of the file of the results, for the error message
+ */
+extern void closeResults(popbamData *t, const std::string &fn);
+
 /*!
  * \fn unsigned long long qualFilter(int num_samples, unsigned long long *cb, int min_rmsQ, int min_depth, int max_depth)
  * \brief Filters data based on quality threshholds
@@ -485,6 +1229,18 @@ extern unsigned long long qualFilter(int num_samples, unsigned long long *cb, in
  */
 extern int segBase(int num_samples, unsigned long long *cb, char ref, int min_snpq);
 
+/*!
+ * \fn int segGenotype(int num_samples, unsigned long long *cb, char ref, int min_snpq)
+ * \brief Determines whether a base position is segregating, keeping heterozygous genotypes
+ * \param num_samples  The number of samples in the pileup
+ * \param cb  The consensus base call information for the individual
+ * \param ref  The reference base
+ * \param min_snpq  The minimum acceptable SNP score to consider a site a variant
+ * \return  The number of derived chromosomes, or -1 if more than one derived allele is present
+ * Individuals carrying the variant get bit 0x2 of cb, and homozygotes also get bit 0x4
+ */
+extern int segGenotype(int num_samples, unsigned long long *cb, char ref, int min_snpq);
+
 /*!
  * \fn void cleanHeterozygotes(int num_samples, unsigned long long *cb, int ref, int min_snpq)
  * \brief Reconfigures heterozygous base calls
@@ -498,10 +1254,11 @@ extern void cleanHeterozygotes(int num_samples, unsigned long long *cb, int ref,
 /*!
  * \fn unsigned long long gl2cns(float q[16], unsigned short k)
  * \brief Calculates a consensus base call from genotype likelihoods
+ * \tparam ploidy  1 to consider only the homozygous genotypes, 2 for all ten
  * \param q  Probabilites associated with each base
  * \param k  Number of reads mapping to a position in an individual
  */
-extern unsigned long long gl2cns(float q[16], unsigned short k);
+template <int ploidy> unsigned long long gl2cns(float q[16], unsigned short k);
 
 /*!
  * \fn errmod_t *errmod_init(float depcorr)
@@ -520,13 +1277,14 @@ extern void errmod_destroy(errmod_t *em);
 /*!
  * \fn int errmod_cal(const errmod_t *em, unsigned short n, int m, unsigned short *bases, float *q)
  * \brief Calculates probability for error model
+ * \tparam ploidy 1 to fill in only the homozygous likelihoods, 2 for all genotypes
  * \param em Pointer to the error model data structure
  * \param n The number of bases
  * \param m The maximum base
  * \param bases[i] qual:6, strand:1, base:4
  * \param q[i*m+j] Phred-scaled likelihood of (i,j)
  */
-extern int errmod_cal(const errmod_t *em, unsigned short n, int m, unsigned short *bases, float *q);
+template <int ploidy> int errmod_cal(const errmod_t *em, unsigned short n, int m, unsigned short *bases, float *q);
 
 /*!
  * \fn void fatalError(const char *msg, char* file, int line, void(*err_func)(void))
@@ -20,6 +20,7 @@ bam_header_t *bam_header_dup(const bam_header_t *h0)
     h = bam_header_init();
     *h = *h0;
     h->hash = h->dict = h->rg2lib = 0;
+    h->n_hashed = 0;
     h->text = (char*)calloc(h->l_text + 1, 1);
     memcpy(h->text, h0->text, h->l_text);
     h->target_len = (unsigned int*)calloc(h->n_targets, 4);
@@ -215,3 +216,14 @@ void samclose(samfile_t *fp)
 
     free(fp);
 }
+
+int samread(samfile_t *fp, bam1_t *b)
+{
+    if ((fp == 0) || !(fp->type & TYPE_READ))
+        return -1;
+
+    if (fp->type & TYPE_BAM)
+        return bam_read1(fp->x.bam, b);
+    else
+        return sam_read1(fp->x.tamr, fp->header, b);
+}
@@ -56,6 +56,14 @@ extern "C" {
 	 */
 	void samclose(samfile_t *fp);
 
+	/*!
+	  @abstract     Read one alignment
+	  @param  fp    file handler
+	  @param  b     alignment
+	  @return       bytes read; -1 at end of file; < -1 on error
+	 */
+	int samread(samfile_t *fp, bam1_t *b);
+
 #ifdef __cplusplus
 }
 #endif